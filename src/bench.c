@@ -26,10 +26,14 @@
 #include "shadow.h"
 #include "util.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -172,6 +176,29 @@ static int64_t timespec_sub(struct timespec a, struct timespec b)
 
 #define NSAMPLES 5
 
+/** Create a file shadow of the given size, as if received from the other
+ * side */
+static struct shadow_fd *create_bench_shadow(struct fd_translation_map *map,
+		struct thread_pool *pool, size_t size)
+{
+	struct wmsg_open_file file_msg;
+	file_msg.remote_id = 0;
+	file_msg.file_size = (uint32_t)size;
+	file_msg.size_and_type = transfer_header(
+			sizeof(struct wmsg_open_file), WMSG_OPEN_FILE);
+
+	struct render_data render;
+	memset(&render, 0, sizeof(render));
+	render.disabled = true;
+	render.drm_fd = 1;
+	render.av_disabled = true;
+
+	struct bytebuf msg = {.size = sizeof(struct wmsg_open_file),
+			.data = (char *)&file_msg};
+	(void)apply_update(map, pool, &render, WMSG_OPEN_FILE, 0, &msg);
+	return get_shadow_for_rid(map, 0);
+}
+
 static struct bench_result run_sub_bench(bool first,
 		const struct compression_range *rng, int level,
 		float bandwidth_mBps, int n_worker_threads, unsigned int seed,
@@ -192,22 +219,7 @@ static struct bench_result run_sub_bench(bool first,
 	struct fd_translation_map map;
 	setup_translation_map(&map, false);
 
-	struct wmsg_open_file file_msg;
-	file_msg.remote_id = 0;
-	file_msg.file_size = (uint32_t)test_size;
-	file_msg.size_and_type = transfer_header(
-			sizeof(struct wmsg_open_file), WMSG_OPEN_FILE);
-
-	struct render_data render;
-	memset(&render, 0, sizeof(render));
-	render.disabled = true;
-	render.drm_fd = 1;
-	render.av_disabled = true;
-
-	struct bytebuf msg = {.size = sizeof(struct wmsg_open_file),
-			.data = (char *)&file_msg};
-	(void)apply_update(&map, &pool, &render, WMSG_OPEN_FILE, 0, &msg);
-	struct shadow_fd *sfd = get_shadow_for_rid(&map, 0);
+	struct shadow_fd *sfd = create_bench_shadow(&map, &pool, test_size);
 
 	int iter = 0;
 	float samples[NSAMPLES];
@@ -224,7 +236,6 @@ static struct bench_result run_sub_bench(bool first,
 		/* Create transfer queue */
 		struct transfer_queue transfer_data;
 		memset(&transfer_data, 0, sizeof(struct transfer_queue));
-		pthread_mutex_init(&transfer_data.async_recv_queue.lock, NULL);
 
 		struct timespec t0, t1;
 		clock_gettime(CLOCK_REALTIME, &t0);
@@ -238,8 +249,7 @@ static struct bench_result run_sub_bench(bool first,
 		size_t total_wire_size = 0;
 		size_t net_diff_size = 0;
 		while (1) {
-			uint8_t flush[64];
-			(void)read(pool.selfpipe_r, flush, sizeof(flush));
+			clear_event_counter(pool.completion_r);
 
 			/* Run tasks on main thread, just like the main loop */
 			bool done = false;
@@ -247,10 +257,6 @@ static struct bench_result run_sub_bench(bool first,
 			bool has_task = request_work_task(&pool, &task, &done);
 			if (has_task) {
 				run_task(&task, &pool.threads[0]);
-
-				pthread_mutex_lock(&pool.work_mutex);
-				pool.tasks_in_progress--;
-				pthread_mutex_unlock(&pool.work_mutex);
 			}
 
 			struct timespec cur_time;
@@ -279,10 +285,8 @@ static struct bench_result run_sub_bench(bool first,
 				}
 			} else {
 				/* Very short delay, for poll loop */
-				bool tasks_remaining = false;
-				pthread_mutex_lock(&pool.work_mutex);
-				tasks_remaining = pool.stack_count > 0;
-				pthread_mutex_unlock(&pool.work_mutex);
+				int pending = atomic_load(&pool.tasks_pending);
+				bool tasks_remaining = pending > 0;
 
 				struct timespec delay_time;
 				delay_time.tv_sec = 0;
@@ -440,3 +444,438 @@ int run_bench(float bandwidth_mBps, uint32_t test_size, int n_worker_threads)
 	free(text_image);
 	return EXIT_SUCCESS;
 }
+
+int run_lookup_bench(void)
+{
+	/* Every shadow needs a distinct local fd, so the largest map size
+	 * is bounded by the file descriptor limit */
+	struct rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+		lim.rlim_cur = lim.rlim_max;
+		(void)setrlimit(RLIMIT_NOFILE, &lim);
+		(void)getrlimit(RLIMIT_NOFILE, &lim);
+	} else {
+		lim.rlim_cur = 1024;
+	}
+	int pipedes[2];
+	if (pipe(pipedes) == -1) {
+		wp_error("Failed to create pipe: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct render_data render;
+	memset(&render, 0, sizeof(render));
+	render.disabled = true;
+	render.drm_fd = -1;
+	render.av_disabled = true;
+
+	const int nlookups = 1 << 22;
+	const int counts[] = {10, 100, 1000, 10000, 100000};
+	printf("Timing %d shadow structure lookups by RID and by local fd\n",
+			nlookups);
+	for (size_t c = 0; !shutdown_flag &&
+				c < sizeof(counts) / sizeof(counts[0]);
+			c++) {
+		int n = counts[c];
+		if ((rlim_t)n + 64 > lim.rlim_cur) {
+			printf("%6d shadows: skipped, fd limit is %lu\n", n,
+					(unsigned long)lim.rlim_cur);
+			continue;
+		}
+		int *rids = calloc((size_t)n, sizeof(int));
+		int *fds = calloc((size_t)n, sizeof(int));
+		if (!rids || !fds) {
+			free(rids);
+			free(fds);
+			wp_error("Failed to allocate key arrays");
+			break;
+		}
+
+		struct fd_translation_map map;
+		setup_translation_map(&map, false);
+		int nmade = 0;
+		for (; nmade < n; nmade++) {
+			int fd = dup(pipedes[0]);
+			if (fd == -1) {
+				wp_error("Failed to duplicate fd: %s",
+						strerror(errno));
+				break;
+			}
+			struct shadow_fd *sfd = translate_fd(&map, &render,
+					NULL, fd, FDC_PIPE, 0, NULL, false);
+			if (!sfd) {
+				checked_close(fd);
+				break;
+			}
+			rids[nmade] = sfd->remote_id;
+			fds[nmade] = fd;
+		}
+
+		float rid_ns = 0.f, fd_ns = 0.f;
+		if (nmade == n) {
+			/* Visit keys in pseudo-random order, so that the
+			 * results do not depend on insertion order */
+			volatile uintptr_t sink = 0;
+			struct timespec t0, t1, t2;
+			uint32_t x = 1;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			for (int i = 0; i < nlookups; i++) {
+				x = x * 1103515245u + 12345u;
+				int key = rids[(x >> 8) % (uint32_t)n];
+				sink ^= (uintptr_t)get_shadow_for_rid(
+						&map, key);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			for (int i = 0; i < nlookups; i++) {
+				x = x * 1103515245u + 12345u;
+				int key = fds[(x >> 8) % (uint32_t)n];
+				sink ^= (uintptr_t)get_shadow_for_local_fd(
+						&map, key);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t2);
+			rid_ns = (float)timespec_sub(t1, t0) / (float)nlookups;
+			fd_ns = (float)timespec_sub(t2, t1) / (float)nlookups;
+			printf("%6d shadows: %6.2f ns per RID lookup, %6.2f ns per fd lookup\n",
+					n, rid_ns, fd_ns);
+		} else {
+			printf("%6d shadows: failed, only %d could be created\n",
+					n, nmade);
+		}
+		cleanup_translation_map(&map);
+		free(rids);
+		free(fds);
+	}
+
+	checked_close(pipedes[0]);
+	checked_close(pipedes[1]);
+	return EXIT_SUCCESS;
+}
+
+int run_thread_scaling_bench(uint32_t test_size, int max_threads)
+{
+	if (max_threads <= 0) {
+		max_threads = get_hardware_thread_count();
+	}
+	void *image = create_video_like_image(test_size);
+	if (!image) {
+		wp_error("Failed to allocate test image");
+		return EXIT_FAILURE;
+	}
+	printf("Timing diff tasks for a %u byte buffer, with 1 to %d threads\n",
+			test_size, max_threads);
+
+	float base_time = 0.f;
+	for (int nt = 1; !shutdown_flag && nt <= max_threads; nt++) {
+		srand(1);
+		struct thread_pool pool;
+		setup_thread_pool(&pool, COMP_NONE, 0, nt);
+		struct fd_translation_map map;
+		setup_translation_map(&map, false);
+		struct shadow_fd *sfd =
+				create_bench_shadow(&map, &pool, test_size);
+		if (!sfd || !sfd->mem_local) {
+			wp_error("Failed to create test shadow");
+			cleanup_translation_map(&map);
+			cleanup_thread_pool(&pool);
+			break;
+		}
+
+		int ntasks = 0;
+		float samples[NSAMPLES];
+		for (int iter = 0; iter < NSAMPLES; iter++) {
+			memcpy(sfd->mem_local, image, test_size);
+			memcpy(sfd->mem_mirror, image, test_size);
+			perturb(sfd->mem_local, test_size);
+			damage_everything(&sfd->damage);
+
+			struct transfer_queue transfer_data;
+			memset(&transfer_data, 0, sizeof(struct transfer_queue));
+
+			struct timespec t0, t1;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			sfd->is_dirty = true;
+			collect_update(&pool, sfd, &transfer_data, false);
+			ntasks = start_parallel_work(
+					&pool, &transfer_data.async_recv_queue);
+			/* Like the main loop, run tasks on the main thread
+			 * until all are done */
+			while (1) {
+				bool done = false;
+				struct task_data task;
+				if (request_work_task(&pool, &task, &done)) {
+					run_task(&task, &pool.threads[0]);
+				} else if (done) {
+					break;
+				} else {
+					struct pollfd pfd = {
+							.fd = pool.completion_r,
+							.events = POLLIN};
+					(void)poll(&pfd, 1, 10);
+					clear_event_counter(pool.completion_r);
+				}
+			}
+			transfer_load_async(&transfer_data);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+
+			finish_update(sfd);
+			cleanup_transfer_queue(&transfer_data);
+			samples[iter] = (float)timespec_sub(t1, t0) * 1e-6f;
+		}
+		cleanup_translation_map(&map);
+		cleanup_thread_pool(&pool);
+
+		qsort(samples, NSAMPLES, sizeof(float), float_compare);
+		float median = samples[NSAMPLES / 2];
+		if (nt == 1) {
+			base_time = median;
+		}
+		printf("%3d threads: %8.3f ms per update (%d tasks), speedup %.2f\n",
+				nt, median, ntasks, base_time / median);
+	}
+	free(image);
+	return EXIT_SUCCESS;
+}
+
+/** Time one diff of `local` against `mirror`, after restoring the mirror
+ * (and, if `hashes` is not NULL, its tile hashes) to the original image */
+static float time_diff(interval_diff_fn_t diff_fn, int alignment_bits,
+		tile_accum_fn_t accum_fn, size_t size, const char *orig,
+		const char *local, char *mirror, char *diff, uint64_t *hashes,
+		const uint64_t *orig_hashes)
+{
+	struct interval all = {.start = 0, .end = (int32_t)size};
+	size_t ntiles = size / DIFF_TILE_SIZE;
+	memcpy(mirror, orig, size);
+	if (hashes) {
+		memcpy(hashes, orig_hashes, ntiles * sizeof(uint64_t));
+	}
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (hashes) {
+		construct_diff_tiled(diff_fn, alignment_bits,
+				DEFAULT_DIFF_WINDOW, &all, 1, mirror, local,
+				diff, accum_fn, hashes);
+	} else {
+		construct_diff_core(diff_fn, alignment_bits,
+				DEFAULT_DIFF_WINDOW, &all, 1, mirror, local,
+				diff);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (float)timespec_sub(t1, t0);
+}
+
+int run_diff_bench(uint32_t test_size)
+{
+	static const struct {
+		enum diff_type type;
+		const char *name;
+	} kernels[] = {
+			{DIFF_AVX512BW, "avx512bw"},
+			{DIFF_AVX512F, "avx512f"},
+			{DIFF_AVX2, "avx2"},
+			{DIFF_SSE3, "sse3"},
+			{DIFF_NEON, "neon"},
+			{DIFF_C, "c"},
+	};
+	static const char *const changes[] = {"none", "sparse", "full"};
+
+	int ret = EXIT_FAILURE;
+	size_t size = test_size - test_size % 64;
+	size_t ntiles = size / DIFF_TILE_SIZE;
+	void *mirror_handle = NULL, *local_handle = NULL;
+	char *orig = create_video_like_image(size);
+	char *mirror = zeroed_aligned_alloc(size, 64, &mirror_handle);
+	char *local = zeroed_aligned_alloc(size, 64, &local_handle);
+	char *diff = malloc(size + 8 * (ntiles + 2));
+	uint64_t *hashes = calloc(ntiles + 1, sizeof(uint64_t));
+	uint64_t *orig_hashes = calloc(ntiles + 1, sizeof(uint64_t));
+	if (!orig || !mirror || !local || !diff || !hashes || !orig_hashes) {
+		wp_error("Failed to allocate test buffers");
+		goto end;
+	}
+
+	printf("Diffing a %zu byte buffer; GB/s of damage, with and without tile hashes\n",
+			size);
+	printf("%-8s %-7s %8s %8s\n", "kernel", "change", "plain", "tiled");
+	for (size_t k = 0; !shutdown_flag &&
+				k < sizeof(kernels) / sizeof(kernels[0]);
+			k++) {
+		int bits = 0;
+		interval_diff_fn_t diff_fn =
+				get_diff_function(kernels[k].type, &bits);
+		if (!diff_fn) {
+			continue;
+		}
+		/* Kernels without a tile accumulation function are only
+		 * timed without tile hashes */
+		tile_accum_fn_t accum_fn =
+				get_tile_accum_function(kernels[k].type);
+		if (accum_fn) {
+			/* Tile hashes of the original image, as if it had
+			 * been static */
+			struct interval all = {.start = 0, .end = (int32_t)size};
+			memcpy(mirror, orig, size);
+			memcpy(local, orig, size);
+			memset(orig_hashes, 0, ntiles * sizeof(uint64_t));
+			construct_diff_tiled(diff_fn, bits,
+					DEFAULT_DIFF_WINDOW, &all, 1, mirror,
+					local, diff, accum_fn, orig_hashes);
+		}
+
+		for (size_t c = 0; c < sizeof(changes) / sizeof(changes[0]);
+				c++) {
+			memcpy(local, orig, size);
+			for (size_t i = 0; c > 0 && i < size;
+					i += (c == 1 ? 65536 : 1)) {
+				local[i] = (char)~local[i];
+			}
+
+			float plain[NSAMPLES], tiled[NSAMPLES];
+			for (int iter = 0; iter < NSAMPLES; iter++) {
+				plain[iter] = time_diff(diff_fn, bits,
+						accum_fn, size, orig, local,
+						mirror, diff, NULL, NULL);
+				tiled[iter] = time_diff(diff_fn, bits,
+						accum_fn, size, orig, local,
+						mirror, diff,
+						accum_fn ? hashes : NULL,
+						orig_hashes);
+			}
+			qsort(plain, NSAMPLES, sizeof(float), float_compare);
+			qsort(tiled, NSAMPLES, sizeof(float), float_compare);
+			/* bytes per nanosecond are GB/s */
+			float plain_rate = (float)size / plain[NSAMPLES / 2];
+			float tiled_rate = (float)size / tiled[NSAMPLES / 2];
+			printf("%-8s %-7s %8.2f ", kernels[k].name, changes[c],
+					plain_rate);
+			if (accum_fn) {
+				printf("%8.2f\n", tiled_rate);
+			} else {
+				printf("%8s\n", "-");
+			}
+		}
+	}
+	ret = EXIT_SUCCESS;
+end:
+	free(orig_hashes);
+	free(hashes);
+	free(diff);
+	zeroed_aligned_free(local, &local_handle);
+	zeroed_aligned_free(mirror, &mirror_handle);
+	free(orig);
+	return ret;
+}
+
+/** Diff `local` against `mirror` after restoring the mirror to `orig`. If
+ * `stage` is not NULL, `local` is first copied into it, a tile at a time,
+ * by `readback` (or memcpy, if that is NULL), as is done for DMABUFs */
+static float time_staged_diff(interval_diff_fn_t diff_fn, int alignment_bits,
+		readback_fn_t readback, size_t size, const char *orig,
+		const char *local, char *mirror, char *stage, char *diff)
+{
+	const size_t tile = 1u << 16;
+	memcpy(mirror, orig, size);
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	size_t diffsize = 0;
+	for (size_t start = 0; start < size; start += tile) {
+		size_t end = minu(start + tile, size);
+		struct interval part = {.start = (int32_t)start,
+				.end = (int32_t)end};
+		const char *src = local;
+		if (stage && readback) {
+			(*readback)(stage, local + start, end - start);
+		} else if (stage) {
+			memcpy(stage, local + start, end - start);
+		}
+		if (stage) {
+			src = (const char *)((uintptr_t)stage - start);
+		}
+		diffsize += construct_diff_core(diff_fn, alignment_bits,
+				DEFAULT_DIFF_WINDOW, &part, 1, mirror, src,
+				diff + diffsize);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (float)timespec_sub(t1, t0);
+}
+
+int run_readback_bench(uint32_t test_size)
+{
+	static const char *const changes[] = {"none", "full"};
+	static const char *const methods[] = {"direct", "memcpy", "stream"};
+
+	int ret = EXIT_FAILURE;
+	size_t size = test_size - test_size % 64;
+	int bits = 0;
+	interval_diff_fn_t diff_fn = get_diff_function(DIFF_FASTEST, &bits);
+	readback_fn_t readback = get_readback_function();
+	void *mirror_handle = NULL, *stage_handle = NULL;
+	char *orig = create_video_like_image(size);
+	char *mirror = zeroed_aligned_alloc(size, 64, &mirror_handle);
+	char *stage = zeroed_aligned_alloc(1u << 16, 64, &stage_handle);
+	char *diff = malloc(size + 8 * (size / (1u << 16) + 2));
+	char *local = MAP_FAILED;
+	int fd = create_anon_file();
+	if (!orig || !mirror || !stage || !diff || fd == -1) {
+		wp_error("Failed to allocate test buffers");
+		goto end;
+	}
+	/* A shared memory mapping stands in for a DMABUF mapping; unlike
+	 * many of those, it is cached, so this mostly measures the cost
+	 * of the extra copy */
+	if (ftruncate(fd, (off_t)size) == -1) {
+		wp_error("Failed to resize test file: %s", strerror(errno));
+		goto end;
+	}
+	local = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (local == MAP_FAILED) {
+		wp_error("Failed to map test file: %s", strerror(errno));
+		goto end;
+	}
+
+	printf("Diffing a %zu byte shared memory mapping; GB/s of damage, when read\n",
+			size);
+	printf("directly, or first copied into a tile with memcpy or streaming loads\n");
+	printf("%-7s %8s %8s %8s\n", "change", methods[0], methods[1],
+			methods[2]);
+	for (size_t c = 0; !shutdown_flag &&
+				c < sizeof(changes) / sizeof(changes[0]);
+			c++) {
+		memcpy(local, orig, size);
+		for (size_t i = 0; c > 0 && i < size; i++) {
+			local[i] = (char)~local[i];
+		}
+		printf("%-7s", changes[c]);
+		for (int m = 0; m < 3; m++) {
+			if (m == 2 && !readback) {
+				printf(" %8s", "-");
+				continue;
+			}
+			float t[NSAMPLES];
+			for (int iter = 0; iter < NSAMPLES; iter++) {
+				t[iter] = time_staged_diff(diff_fn, bits,
+						m == 2 ? readback : NULL, size,
+						orig, local, mirror,
+						m > 0 ? stage : NULL, diff);
+			}
+			qsort(t, NSAMPLES, sizeof(float), float_compare);
+			printf(" %8.2f", (float)size / t[NSAMPLES / 2]);
+		}
+		printf("\n");
+	}
+	ret = EXIT_SUCCESS;
+end:
+	if (local != MAP_FAILED) {
+		munmap(local, size);
+	}
+	if (fd != -1) {
+		checked_close(fd);
+	}
+	free(diff);
+	zeroed_aligned_free(stage, &stage_handle);
+	zeroed_aligned_free(mirror, &mirror_handle);
+	free(orig);
+	return ret;
+}
@@ -159,6 +159,11 @@ static void apply_conn_header(uint32_t header, struct main_config *config)
 			config->no_gpu = true;
 		}
 	}
+	/* Diff history streams are only used if the server asked for them,
+	 * as it may not be able to decode them otherwise */
+	if (config) {
+		config->zstd_history = (header & CONN_ZSTD_HISTORY) != 0;
+	}
 	// todo: consider allowing to disable video encoding
 }
 
@@ -97,5 +97,8 @@ int get_shm_bytes_per_pixel(uint32_t format);
 #ifndef DRM_FORMAT_MOD_INVALID
 #define DRM_FORMAT_MOD_INVALID 0x00ffffffffffffffULL
 #endif
+#ifndef DRM_FORMAT_MOD_LINEAR
+#define DRM_FORMAT_MOD_LINEAR 0ULL
+#endif
 
 #endif // WAYPIPE_DMABUF_H
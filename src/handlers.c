@@ -68,6 +68,12 @@ struct obj_wl_buffer {
 	uint64_t dmabuf_modifiers[MAX_DMABUF_PLANES];
 
 	uint64_t unique_id;
+	/* Union of the damage committed to the surface with unique id
+	 * 'damage_surface_uid' since this buffer was last committed to it,
+	 * in the coordinates of the backing shadow_fd. If the uid is zero,
+	 * the damage is unknown. */
+	uint64_t damage_surface_uid;
+	struct damage pending_damage;
 };
 
 struct damage_record {
@@ -81,15 +87,23 @@ struct damage_list {
 	int size;
 };
 
-#define SURFACE_DAMAGE_BACKLOG 7
+struct surface_buffer_ref {
+	uint32_t obj_id;
+	uint64_t unique_id;
+};
+
 struct obj_wl_surface {
 	struct wp_object base;
 
-	/* The zeroth list is the "current" one, 1st was damage provided at last
-	 * commit, etc. */
-	struct damage_list damage_lists[SURFACE_DAMAGE_BACKLOG];
-	/* Unique buffer identifiers to which the above damage lists apply */
-	uint64_t attached_buffer_uids[SURFACE_DAMAGE_BACKLOG];
+	/* Damage provided since the last commit */
+	struct damage_list damage;
+	/* Buffers committed to this surface which accumulate its damage;
+	 * entries for destroyed or reassigned buffers are pruned lazily */
+	struct surface_buffer_ref *buffer_refs;
+	int buffer_refs_len;
+	int buffer_refs_size;
+	/* Assigned on first commit; zero until then */
+	uint64_t unique_id;
 
 	uint32_t attached_buffer_id; /* protocol object id */
 	int32_t scale;
@@ -249,11 +263,11 @@ void destroy_wp_object(struct wp_object *object)
 		if (r->shm_buffer) {
 			shadow_decref_protocol(r->shm_buffer);
 		}
+		reset_damage(&r->pending_damage);
 	} else if (object->type == &intf_wl_surface) {
 		struct obj_wl_surface *r = (struct obj_wl_surface *)object;
-		for (int i = 0; i < SURFACE_DAMAGE_BACKLOG; i++) {
-			free(r->damage_lists[i].list);
-		}
+		free(r->damage.list);
+		free(r->buffer_refs);
 	} else if (object->type == &intf_zwlr_screencopy_frame_v1) {
 		struct obj_wlr_screencopy_frame *r =
 				(struct obj_wlr_screencopy_frame *)object;
@@ -718,17 +732,136 @@ void do_wl_surface_req_attach(struct context *ctx, struct wp_object *buffer,
 	struct obj_wl_surface *surface = (struct obj_wl_surface *)ctx->obj;
 	surface->attached_buffer_id = bufobj->obj_id;
 }
-static void rotate_damage_lists(struct obj_wl_surface *surface)
+/** The linear, single plane image of a wl_buffer inside a shadow_fd */
+struct buffer_image {
+	struct shadow_fd *sfd;
+	int32_t offset;
+	int32_t width;
+	int32_t height;
+	int32_t stride;
+	int bpp;
+};
+/** Returns true if the image in 'sfd' can be diffed using surface damage,
+ * i.e., is a linear single-plane RGBA-type DMABUF */
+static bool dmabuf_has_linear_layout(
+		const struct obj_wl_buffer *buf, const struct shadow_fd *sfd)
+{
+	return buf->dmabuf_nplanes == 1 && sfd->type == FDC_DMABUF &&
+	       sfd->dmabuf_info.num_planes == 1 &&
+	       sfd->dmabuf_info.modifier == DRM_FORMAT_MOD_LINEAR &&
+	       get_shm_bytes_per_pixel(sfd->dmabuf_info.format) != -1;
+}
+/** Returns false if damage for the buffer cannot be tracked precisely */
+static bool get_buffer_image(
+		const struct obj_wl_buffer *buf, struct buffer_image *img)
+{
+	if (buf->type == BUF_SHM) {
+		if (!buf->shm_buffer || buf->shm_buffer->type != FDC_FILE) {
+			return false;
+		}
+		img->sfd = buf->shm_buffer;
+		img->offset = buf->shm_offset;
+		img->width = buf->shm_width;
+		img->height = buf->shm_height;
+		img->stride = buf->shm_stride;
+		img->bpp = get_shm_bytes_per_pixel(buf->shm_format);
+		return img->bpp != -1;
+	}
+	struct shadow_fd *sfd = buf->dmabuf_buffers[0];
+	if (buf->type != BUF_DMA || !sfd ||
+			!dmabuf_has_linear_layout(buf, sfd)) {
+		return false;
+	}
+	/* The image is transferred starting at the plane offset, with the
+	 * stride of the first plane */
+	img->sfd = sfd;
+	img->offset = 0;
+	img->width = (int32_t)sfd->dmabuf_info.width;
+	img->height = (int32_t)sfd->dmabuf_info.height;
+	img->stride = (int32_t)sfd->dmabuf_info.strides[0];
+	img->bpp = get_shm_bytes_per_pixel(sfd->dmabuf_info.format);
+	return true;
+}
+/** Add the damage provided to the surface since its last commit to 'dst',
+ * in the coordinates of the image 'img'. */
+static void add_surface_damage(struct context *ctx,
+		const struct obj_wl_surface *surface, struct damage *dst,
+		const struct buffer_image *img)
+{
+	const struct damage_list *frame_damage = &surface->damage;
+	if (frame_damage->len == 0) {
+		return;
+	}
+	struct ext_interval *damage_array = malloc(
+			sizeof(struct ext_interval) * (size_t)frame_damage->len);
+	if (!damage_array) {
+		wp_error("Failed to allocate damage array");
+		damage_everything(dst);
+		return;
+	}
+
+	for (int j = 0; j < frame_damage->len; j++) {
+		int xlow, xhigh, ylow, yhigh;
+		compute_damage_coordinates(&xlow, &xhigh, &ylow, &yhigh,
+				&frame_damage->list[j], img->width,
+				img->height, surface->transform,
+				surface->scale);
+
+		/* Clip the damage rectangle to the containing buffer. */
+		xlow = clamp(xlow, 0, img->width);
+		xhigh = clamp(xhigh, 0, img->width);
+		ylow = clamp(ylow, 0, img->height);
+		yhigh = clamp(yhigh, 0, img->height);
+
+		damage_array[j].start = img->offset + img->stride * ylow +
+					img->bpp * xlow;
+		damage_array[j].rep = yhigh - ylow;
+		damage_array[j].stride = img->stride;
+		damage_array[j].width = img->bpp * (xhigh - xlow);
+	}
+	merge_damage_records(dst, frame_damage->len, damage_array,
+			ctx->g->threads.diff_alignment_bits);
+	free(damage_array);
+}
+/** Add the current surface damage to the pending damage of all other buffers
+ * committed to the surface, and drop the ones that no longer exist, were
+ * committed elsewhere, or (if 'valid' is false) can no longer be tracked.
+ * Returns true if 'current' was found in the list. */
+static bool accumulate_surface_damage(struct context *ctx,
+		struct obj_wl_surface *surface,
+		const struct obj_wl_buffer *current, bool valid)
 {
-	free(surface->damage_lists[SURFACE_DAMAGE_BACKLOG - 1].list);
-	memmove(surface->damage_lists + 1, surface->damage_lists,
-			(SURFACE_DAMAGE_BACKLOG - 1) *
-					sizeof(struct damage_list));
-	memset(surface->damage_lists, 0, sizeof(struct damage_list));
-	memmove(surface->attached_buffer_uids + 1,
-			surface->attached_buffer_uids,
-			(SURFACE_DAMAGE_BACKLOG - 1) * sizeof(uint64_t));
-	surface->attached_buffer_uids[0] = 0;
+	bool found = false;
+	int n = 0;
+	for (int i = 0; i < surface->buffer_refs_len; i++) {
+		struct surface_buffer_ref ref = surface->buffer_refs[i];
+		struct wp_object *obj = tracker_get(ctx->tracker, ref.obj_id);
+		if (!obj || obj->type != &intf_wl_buffer) {
+			continue;
+		}
+		struct obj_wl_buffer *buf = (struct obj_wl_buffer *)obj;
+		if (buf->unique_id != ref.unique_id) {
+			continue;
+		}
+		if (buf == current) {
+			found = true;
+			surface->buffer_refs[n++] = ref;
+			continue;
+		}
+		if (buf->damage_surface_uid != surface->unique_id) {
+			continue;
+		}
+		struct buffer_image img;
+		if (!valid || !get_buffer_image(buf, &img)) {
+			buf->damage_surface_uid = 0;
+			reset_damage(&buf->pending_damage);
+			continue;
+		}
+		add_surface_damage(ctx, surface, &buf->pending_damage, &img);
+		surface->buffer_refs[n++] = ref;
+	}
+	surface->buffer_refs_len = n;
+	return found;
 }
 void do_wl_surface_req_commit(struct context *ctx)
 {
@@ -758,10 +891,35 @@ void do_wl_surface_req_commit(struct context *ctx)
 		return;
 	}
 	struct obj_wl_buffer *buf = (struct obj_wl_buffer *)obj;
-	surface->attached_buffer_uids[0] = buf->unique_id;
-	if (buf->type == BUF_DMA) {
-		rotate_damage_lists(surface);
+	if (!surface->unique_id) {
+		surface->unique_id = ++ctx->g->tracker.buffer_seqno;
+	}
+
+	bool valid_transform = true;
+	if (surface->scale <= 0) {
+		wp_error("Invalid buffer scale during commit (%d), assuming everything damaged",
+				surface->scale);
+		valid_transform = false;
+	}
+	if (surface->transform < 0 || surface->transform >= 8) {
+		wp_error("Invalid buffer transform during commit (%d), assuming everything damaged",
+				surface->transform);
+		valid_transform = false;
+	}
 
+	/* The damage specified as of wl_surface commit indicates which region
+	 * of the surface has changed between the last commit and the current
+	 * one. However, the last time the attached buffer was used may have
+	 * been several commits ago, so every buffer previously committed to
+	 * the surface accumulates the damage until it is committed again. */
+	bool listed = accumulate_surface_damage(
+			ctx, surface, buf, valid_transform);
+	bool known = valid_transform && listed &&
+		     buf->damage_surface_uid == surface->unique_id;
+
+	struct buffer_image img;
+	bool trackable = get_buffer_image(buf, &img);
+	if (buf->type == BUF_DMA) {
 		for (int i = 0; i < buf->dmabuf_nplanes; i++) {
 			struct shadow_fd *sfd = buf->dmabuf_buffers[i];
 			if (!sfd) {
@@ -776,123 +934,82 @@ void do_wl_surface_req_commit(struct context *ctx)
 				continue;
 			}
 
-			// detailed damage tracking is not yet supported
-			sfd->is_dirty = true;
-			damage_everything(&sfd->damage);
+			mark_shadow_dirty(sfd);
+			if (!(trackable && known)) {
+				damage_everything(&sfd->damage);
+			}
 		}
-		return;
 	} else if (buf->type != BUF_SHM) {
 		wp_error("wp_buffer is backed neither by DMA nor SHM, not yet supported");
-		return;
-	}
-
-	struct shadow_fd *sfd = buf->shm_buffer;
-	if (!sfd) {
+		goto end;
+	} else if (!buf->shm_buffer) {
 		wp_error("wp_buffer to be committed has no fd");
-		return;
-	}
-	if (sfd->type != FDC_FILE) {
+		goto end;
+	} else if (buf->shm_buffer->type != FDC_FILE) {
 		wp_error("fd associated with surface is not file-like");
-		return;
-	}
-	sfd->is_dirty = true;
-	int bpp = get_shm_bytes_per_pixel(buf->shm_format);
-	if (bpp == -1) {
-		wp_error("Encountered unknown/planar/subsampled wl_shm format %x; marking entire buffer",
-				buf->shm_format);
-		goto backup;
-	}
-	if (surface->scale <= 0) {
-		wp_error("Invalid buffer scale during commit (%d), assuming everything damaged",
-				surface->scale);
-		goto backup;
-	}
-	if (surface->transform < 0 || surface->transform >= 8) {
-		wp_error("Invalid buffer transform during commit (%d), assuming everything damaged",
-				surface->transform);
-		goto backup;
-	}
-
-	/* The damage specified as of wl_surface commit indicates which region
-	 * of the surface has changed between the last commit and the current
-	 * one. However, the last time the attached buffer was used may have
-	 * been several commits ago, so we need to replay all the damage up
-	 * to the current point. */
-	int age = -1;
-	int n_damaged_rects = surface->damage_lists[0].len;
-	for (int j = 1; j < SURFACE_DAMAGE_BACKLOG; j++) {
-		if (surface->attached_buffer_uids[0] ==
-				surface->attached_buffer_uids[j]) {
-			age = j;
-			break;
+		goto end;
+	} else {
+		mark_shadow_dirty(buf->shm_buffer);
+		buf->shm_buffer->pixel_bytes = trackable ? img.bpp : 0;
+		if (!trackable) {
+			wp_error("Encountered unknown/planar/subsampled wl_shm format %x; marking entire buffer",
+					buf->shm_format);
+		} else {
+			buf->shm_buffer->scroll_image = (struct image_rows){
+					.start = (uint32_t)img.offset,
+					.stride = (uint32_t)img.stride,
+					.row_length = (uint32_t)(img.bpp *
+								 img.width),
+					.nrows = (uint32_t)img.height,
+			};
+		}
+		if (!(trackable && known)) {
+			/* damage the entire buffer (but no other part of the
+			 * shm_pool) */
+			struct ext_interval full_surface_damage;
+			full_surface_damage.start = buf->shm_offset;
+			full_surface_damage.rep = 1;
+			full_surface_damage.stride = 0;
+			full_surface_damage.width =
+					buf->shm_stride * buf->shm_height;
+			merge_damage_records(&buf->shm_buffer->damage, 1,
+					&full_surface_damage,
+					ctx->g->threads.diff_alignment_bits);
 		}
-		n_damaged_rects += surface->damage_lists[j].len;
 	}
-	if (age == -1) {
-		/* cannot find last time buffer+surface combo was used */
-		goto backup;
+	if (trackable && known) {
+		add_surface_damage(ctx, surface, &img.sfd->damage, &img);
+		merge_damage(&img.sfd->damage, &buf->pending_damage,
+				ctx->g->threads.diff_alignment_bits);
 	}
 
-	struct ext_interval *damage_array = malloc(
-			sizeof(struct ext_interval) * (size_t)n_damaged_rects);
-	if (!damage_array) {
-		wp_error("Failed to allocate damage array");
-		goto backup;
-	}
-	int i = 0;
-
-	// Translate damage stack into damage records for the fd buffer
-	for (int k = 0; k < age; k++) {
-		const struct damage_list *frame_damage =
-				&surface->damage_lists[k];
-		for (int j = 0; j < frame_damage->len; j++) {
-			int xlow, xhigh, ylow, yhigh;
-			compute_damage_coordinates(&xlow, &xhigh, &ylow, &yhigh,
-					&frame_damage->list[j], buf->shm_width,
-					buf->shm_height, surface->transform,
-					surface->scale);
-
-			/* Clip the damage rectangle to the containing
-			 * buffer. */
-			xlow = clamp(xlow, 0, buf->shm_width);
-			xhigh = clamp(xhigh, 0, buf->shm_width);
-			ylow = clamp(ylow, 0, buf->shm_height);
-			yhigh = clamp(yhigh, 0, buf->shm_height);
-
-			damage_array[i].start = buf->shm_offset +
-						buf->shm_stride * ylow +
-						bpp * xlow;
-			damage_array[i].rep = yhigh - ylow;
-			damage_array[i].stride = buf->shm_stride;
-			damage_array[i].width = bpp * (xhigh - xlow);
-			i++;
-		}
+	/* Start accumulating damage for the next time this buffer is used */
+	reset_damage(&buf->pending_damage);
+	buf->damage_surface_uid = 0;
+	if (!trackable || !valid_transform) {
+		goto end;
 	}
-
-	merge_damage_records(&sfd->damage, i, damage_array,
-			ctx->g->threads.diff_alignment_bits);
-	free(damage_array);
-	rotate_damage_lists(surface);
-backup:
-	if (1) {
-		/* damage the entire buffer (but no other part of the shm_pool)
-		 */
-		struct ext_interval full_surface_damage;
-		full_surface_damage.start = buf->shm_offset;
-		full_surface_damage.rep = 1;
-		full_surface_damage.stride = 0;
-		full_surface_damage.width = buf->shm_stride * buf->shm_height;
-		merge_damage_records(&sfd->damage, 1, &full_surface_damage,
-				ctx->g->threads.diff_alignment_bits);
+	if (!listed) {
+		if (buf_ensure_size(surface->buffer_refs_len + 1,
+				    sizeof(struct surface_buffer_ref),
+				    &surface->buffer_refs_size,
+				    (void **)&surface->buffer_refs) == -1) {
+			wp_error("Failed to allocate buffer reference, buffer will be fully damaged on next use");
+			goto end;
+		}
+		int k = surface->buffer_refs_len++;
+		surface->buffer_refs[k].obj_id = buf->base.obj_id;
+		surface->buffer_refs[k].unique_id = buf->unique_id;
 	}
-	rotate_damage_lists(surface);
-	return;
+	buf->damage_surface_uid = surface->unique_id;
+end:
+	surface->damage.len = 0;
 }
 static void append_damage_record(struct obj_wl_surface *surface, int32_t x,
 		int32_t y, int32_t width, int32_t height,
 		bool in_buffer_coordinates)
 {
-	struct damage_list *current = &surface->damage_lists[0];
+	struct damage_list *current = &surface->damage;
 	if (buf_ensure_size(current->len + 1, sizeof(struct damage_record),
 			    &current->size, (void **)&current->list) == -1) {
 		wp_error("Failed to allocate space for damage list, dropping damage record");
@@ -1094,7 +1211,7 @@ void do_zwlr_screencopy_frame_v1_evt_ready(struct context *ctx,
 		// The display side performs the update
 		return;
 	}
-	sfd->is_dirty = true;
+	mark_shadow_dirty(sfd);
 	/* The protocol guarantees that the buffer attributes match
 	 * those of the written frame */
 	const struct ext_interval interval = {.start = buffer->shm_offset,
@@ -1886,7 +2003,7 @@ void do_zwlr_export_dmabuf_frame_v1_evt_ready(struct context *ctx,
 	for (uint32_t i = 0; i < frame->nobjects; i++) {
 		struct shadow_fd *sfd = frame->objects[i].buffer;
 		if (sfd) {
-			sfd->is_dirty = true;
+			mark_shadow_dirty(sfd);
 			damage_everything(&sfd->damage);
 		}
 	}
@@ -266,6 +266,33 @@ void merge_damage_records(struct damage *base, int nintervals,
 			alignment_bits);
 }
 
+void merge_damage(struct damage *base, const struct damage *other,
+		int alignment_bits)
+{
+	if (other->damage == DAMAGE_EVERYTHING) {
+		damage_everything(base);
+		return;
+	}
+	if (base->damage == DAMAGE_EVERYTHING || other->ndamage_intvs <= 0) {
+		return;
+	}
+	struct ext_interval *list = malloc(sizeof(struct ext_interval) *
+					   (size_t)other->ndamage_intvs);
+	if (!list) {
+		wp_error("Failed to allocate damage merge list, damaging everything");
+		damage_everything(base);
+		return;
+	}
+	for (int i = 0; i < other->ndamage_intvs; i++) {
+		list[i].start = other->damage[i].start;
+		list[i].width = other->damage[i].end - other->damage[i].start;
+		list[i].rep = 1;
+		list[i].stride = 0;
+	}
+	merge_damage_records(base, other->ndamage_intvs, list, alignment_bits);
+	free(list);
+}
+
 void reset_damage(struct damage *base)
 {
 	if (base->damage != DAMAGE_EVERYTHING) {
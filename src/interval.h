@@ -74,6 +74,9 @@ struct damage {
  * `1 << alignment_bits`. */
 void merge_damage_records(struct damage *base, int nintervals,
 		const struct ext_interval *const new_list, int alignment_bits);
+/** Update the base damage structure to also contain all of 'other' */
+void merge_damage(struct damage *base, const struct damage *other,
+		int alignment_bits);
 /** Set damage to empty  */
 void reset_damage(struct damage *base);
 /** Expand damage to cover everything */
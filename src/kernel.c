@@ -98,6 +98,17 @@ static size_t run_interval_diff_C(const int diff_window_size,
 	return dc * 2;
 }
 
+#ifdef HAVE_AVX512BW
+static bool avx512bw_available(void)
+{
+	return __builtin_cpu_supports("avx512f") &&
+	       __builtin_cpu_supports("avx512bw");
+}
+size_t run_interval_diff_avx512bw(const int diff_window_size,
+		const void *__restrict__ imod, void *__restrict__ ibase,
+		uint32_t *__restrict__ idiff, size_t i, const size_t i_end);
+#endif
+
 #ifdef HAVE_AVX512F
 static bool avx512f_available(void)
 {
@@ -106,6 +117,8 @@ static bool avx512f_available(void)
 size_t run_interval_diff_avx512f(const int diff_window_size,
 		const void *__restrict__ imod, void *__restrict__ ibase,
 		uint32_t *__restrict__ idiff, size_t i, const size_t i_end);
+void accumulate_tile_avx512f(
+		const void *__restrict__ tile, uint64_t *__restrict__ acc);
 #endif
 
 #ifdef HAVE_AVX2
@@ -113,6 +126,12 @@ static bool avx2_available(void) { return __builtin_cpu_supports("avx2"); }
 size_t run_interval_diff_avx2(const int diff_window_size,
 		const void *__restrict__ imod, void *__restrict__ ibase,
 		uint32_t *__restrict__ idiff, size_t i, const size_t i_end);
+void accumulate_tile_avx2(
+		const void *__restrict__ tile, uint64_t *__restrict__ acc);
+void split_planes_avx2(void *__restrict__ dst, const void *__restrict__ src,
+		size_t size);
+void join_planes_avx2(void *__restrict__ dst, const void *__restrict__ src,
+		size_t size);
 #endif
 
 #ifdef HAVE_NEON
@@ -129,8 +148,45 @@ size_t run_interval_diff_sse3(const int diff_window_size,
 		uint32_t *__restrict__ idiff, size_t i, const size_t i_end);
 #endif
 
+#ifdef HAVE_SSE41
+static bool sse41_available(void)
+{
+	return __builtin_cpu_supports("sse4.1");
+}
+void readback_stream_sse41(void *__restrict__ dst,
+		const void *__restrict__ src, size_t size);
+#endif
+
+const char *diff_type_to_str(enum diff_type type)
+{
+	switch (type) {
+	case DIFF_FASTEST:
+		return "auto";
+	case DIFF_AVX512BW:
+		return "avx512bw";
+	case DIFF_AVX512F:
+		return "avx512f";
+	case DIFF_AVX2:
+		return "avx2";
+	case DIFF_SSE3:
+		return "sse3";
+	case DIFF_NEON:
+		return "neon";
+	case DIFF_C:
+		return "c";
+	}
+	return "<invalid>";
+}
+
 interval_diff_fn_t get_diff_function(enum diff_type type, int *alignment_bits)
 {
+#ifdef HAVE_AVX512BW
+	if ((type == DIFF_FASTEST || type == DIFF_AVX512BW) &&
+			avx512bw_available()) {
+		*alignment_bits = 6;
+		return run_interval_diff_avx512bw;
+	}
+#endif
 #ifdef HAVE_AVX512F
 	if ((type == DIFF_FASTEST || type == DIFF_AVX512F) &&
 			avx512f_available()) {
@@ -164,11 +220,64 @@ interval_diff_fn_t get_diff_function(enum diff_type type, int *alignment_bits)
 	return NULL;
 }
 
+readback_fn_t get_readback_function(void)
+{
+#ifdef HAVE_SSE41
+	if (sse41_available()) {
+		return readback_stream_sse41;
+	}
+#endif
+	return NULL;
+}
+
+static void split_planes_C(void *__restrict__ dst,
+		const void *__restrict__ src, size_t size)
+{
+	uint8_t *__restrict__ out = dst;
+	const uint8_t *__restrict__ in = src;
+	size_t npixels = size / 4;
+	for (size_t k = 0; k < 4; k++) {
+		for (size_t i = 0; i < npixels; i++) {
+			out[k * npixels + i] = in[4 * i + k];
+		}
+	}
+	memcpy(out + 4 * npixels, in + 4 * npixels, size % 4);
+}
+static void join_planes_C(void *__restrict__ dst, const void *__restrict__ src,
+		size_t size)
+{
+	uint8_t *__restrict__ out = dst;
+	const uint8_t *__restrict__ in = src;
+	size_t npixels = size / 4;
+	for (size_t k = 0; k < 4; k++) {
+		for (size_t i = 0; i < npixels; i++) {
+			out[4 * i + k] = in[k * npixels + i];
+		}
+	}
+	memcpy(out + 4 * npixels, in + 4 * npixels, size % 4);
+}
+void get_planes_functions(
+		enum diff_type type, planes_fn_t *split, planes_fn_t *join)
+{
+#ifdef HAVE_AVX2
+	if (type != DIFF_C && avx2_available()) {
+		*split = split_planes_avx2;
+		*join = join_planes_avx2;
+		return;
+	}
+#else
+	(void)type;
+#endif
+	*split = split_planes_C;
+	*join = join_planes_C;
+}
+
 /** Construct the main portion of a diff. The provided arguments should
  * be validated beforehand. All intervals, as well as the base/changed data
  * pointers, should be aligned to the alignment size associated with the
  * interval diff function */
 size_t construct_diff_core(interval_diff_fn_t idiff_fn, int alignment_bits,
+		int diff_window,
 		const struct interval *__restrict__ damaged_intervals,
 		int n_intervals, void *__restrict__ base,
 		const void *__restrict__ changed, void *__restrict__ diff)
@@ -179,8 +288,162 @@ size_t construct_diff_core(interval_diff_fn_t idiff_fn, int alignment_bits,
 		struct interval e = damaged_intervals[i];
 		size_t bend = (size_t)e.end >> alignment_bits;
 		size_t bstart = (size_t)e.start >> alignment_bits;
-		cursor += (*idiff_fn)(24, changed, base, diff_blocks + cursor,
-				bstart, bend);
+		cursor += (*idiff_fn)(diff_window, changed, base,
+				diff_blocks + cursor, bstart, bend);
+	}
+	return cursor * sizeof(uint32_t);
+}
+
+size_t construct_diff_strided(interval_diff_fn_t idiff_fn, int alignment_bits,
+		int diff_window,
+		const struct interval *__restrict__ damaged_intervals,
+		int n_intervals, void *__restrict__ base,
+		const void *__restrict__ changed, size_t base_stride,
+		size_t changed_stride, size_t row_length,
+		void *__restrict__ diff)
+{
+	uint32_t *diff_blocks = (uint32_t *)diff;
+	size_t cursor = 0;
+	for (int i = 0; i < n_intervals; i++) {
+		size_t start = (size_t)damaged_intervals[i].start;
+		size_t end = (size_t)damaged_intervals[i].end;
+		for (size_t row = start / base_stride; row * base_stride < end;
+				row++) {
+			size_t row_start = row * base_stride;
+			size_t seg_start = start > row_start ? start : row_start;
+			size_t seg_end = row_start + row_length;
+			seg_end = end < seg_end ? end : seg_end;
+			if (seg_start >= seg_end) {
+				continue;
+			}
+			/* The kernels index both buffers with the same offset,
+			 * so shift `changed` to put this row where it is in
+			 * base; only the row itself is read */
+			uintptr_t shifted = (uintptr_t)changed +
+					    row * changed_stride - row_start;
+			cursor += (*idiff_fn)(diff_window,
+					(const void *)shifted, base,
+					diff_blocks + cursor,
+					seg_start >> alignment_bits,
+					seg_end >> alignment_bits);
+		}
+	}
+	return cursor * sizeof(uint32_t);
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+/** Portable implementation of a tile_accum_fn_t; the vectorized versions
+ * compute the same values */
+static void accumulate_tile_C(
+		const void *__restrict__ tile, uint64_t *__restrict__ acc)
+{
+	const uint64_t *__restrict__ words = tile;
+	uint64_t key[8];
+	for (int j = 0; j < 8; j++) {
+		acc[j] = 0;
+		key[j] = TILE_HASH_KEY * (uint64_t)(2 * j + 1);
+	}
+	for (size_t s = 0; s < DIFF_TILE_SIZE / 64; s++) {
+		for (int j = 0; j < 8; j++) {
+			uint64_t d = words[8 * s + (size_t)j] ^ key[j];
+			acc[j] += (d & 0xffffffffu) * (d >> 32) +
+				  words[8 * s + (size_t)(j ^ 1)];
+			key[j] += TILE_HASH_KEY;
+		}
+	}
+}
+tile_accum_fn_t get_tile_accum_function(enum diff_type type)
+{
+#ifdef HAVE_AVX512F
+	if ((type == DIFF_FASTEST || type == DIFF_AVX512BW ||
+			    type == DIFF_AVX512F) &&
+			avx512f_available()) {
+		return accumulate_tile_avx512f;
+	}
+#endif
+#ifdef HAVE_AVX2
+	if ((type == DIFF_FASTEST || type == DIFF_AVX2) && avx2_available()) {
+		return accumulate_tile_avx2;
+	}
+#endif
+	/* Without wide vectors, hashing a tile is not much faster than
+	 * comparing it with the mirror; the portable version is only used
+	 * when explicitly requested */
+	if (type == DIFF_C) {
+		return accumulate_tile_C;
+	}
+	return NULL;
+}
+uint64_t hash_tile(tile_accum_fn_t accum_fn, const void *tile)
+{
+	uint64_t acc[8];
+	(*accum_fn)(tile, acc);
+	uint64_t r = TILE_HASH_KEY;
+	for (int j = 0; j < 8; j++) {
+		r = rotl64(r ^ (acc[j] * TILE_HASH_KEY), 27) * TILE_HASH_KEY;
+	}
+	r = (r ^ (r >> 29)) * TILE_HASH_KEY;
+	r ^= r >> 32;
+	return r ? r : 1;
+}
+/** Diff the byte range [start, end), returning the number of diff words */
+static size_t diff_range(interval_diff_fn_t idiff_fn, int alignment_bits,
+		int diff_window, const void *__restrict__ changed,
+		void *__restrict__ base, uint32_t *__restrict__ diff,
+		size_t start, size_t end)
+{
+	if (start >= end) {
+		return 0;
+	}
+	return (*idiff_fn)(diff_window, changed, base, diff,
+			start >> alignment_bits, end >> alignment_bits);
+}
+size_t construct_diff_tiled(interval_diff_fn_t idiff_fn, int alignment_bits,
+		int diff_window,
+		const struct interval *__restrict__ damaged_intervals,
+		int n_intervals, void *__restrict__ base,
+		const void *__restrict__ changed, void *__restrict__ diff,
+		tile_accum_fn_t accum_fn, uint64_t *__restrict__ tile_hashes)
+{
+	const char *changed_bytes = changed;
+	const char *base_bytes = base;
+	uint32_t *diff_blocks = (uint32_t *)diff;
+	size_t cursor = 0;
+	for (int i = 0; i < n_intervals; i++) {
+		size_t start = (size_t)damaged_intervals[i].start;
+		size_t end = (size_t)damaged_intervals[i].end;
+		size_t tstart = alignz(start, DIFF_TILE_SIZE);
+		size_t tend = end - end % DIFF_TILE_SIZE;
+		if (tstart >= tend) {
+			cursor += diff_range(idiff_fn, alignment_bits,
+					diff_window, changed, base,
+					diff_blocks + cursor, start, end);
+			continue;
+		}
+		cursor += diff_range(idiff_fn, alignment_bits, diff_window,
+				changed, base, diff_blocks + cursor, start,
+				tstart);
+		for (size_t t = tstart; t < tend; t += DIFF_TILE_SIZE) {
+			uint64_t *hash = &tile_hashes[t / DIFF_TILE_SIZE];
+			/* Tiles that were recently changed have no hash, and
+			 * are diffed without hashing them; a tile is only
+			 * hashed again once its diff is empty */
+			if (*hash && *hash == hash_tile(accum_fn,
+						 changed_bytes + t)) {
+				continue;
+			}
+			size_t n = diff_range(idiff_fn, alignment_bits,
+					diff_window, changed, base,
+					diff_blocks + cursor, t,
+					t + DIFF_TILE_SIZE);
+			cursor += n;
+			*hash = n ? 0 : hash_tile(accum_fn, base_bytes + t);
+		}
+		cursor += diff_range(idiff_fn, alignment_bits, diff_window,
+				changed, base, diff_blocks + cursor, tend, end);
 	}
 	return cursor * sizeof(uint32_t);
 }
@@ -35,22 +35,71 @@ typedef size_t (*interval_diff_fn_t)(const int diff_window_size,
 
 enum diff_type {
 	DIFF_FASTEST,
+	DIFF_AVX512BW,
 	DIFF_AVX512F,
 	DIFF_AVX2,
 	DIFF_SSE3,
 	DIFF_NEON,
 	DIFF_C,
 };
+/** Number of unchanged words after which diff kernels end a run, unless a
+ * different window was configured */
+#define DEFAULT_DIFF_WINDOW 24
+/** Smallest supported diff window; the vector kernels only end a run after a
+ * fully unchanged block of up to 16 words */
+#define MIN_DIFF_WINDOW 16
+
+/** Returns a short lower case name for a diff kernel type */
+const char *diff_type_to_str(enum diff_type type);
 
 /** Returns a function pointer to a diff construction kernel, and indicates
  * the alignment of the data which is to be passed in */
 interval_diff_fn_t get_diff_function(enum diff_type type, int *alignment_bits);
 /** Given intervals aligned to 1<<alignment_bits, create a diff of changed
- * over base, and update base to match changed. */
+ * over base, and update base to match changed. Runs of changed words are
+ * merged across gaps of up to about diff_window unchanged words. */
 size_t construct_diff_core(interval_diff_fn_t idiff_fn, int alignment_bits,
+		int diff_window,
 		const struct interval *__restrict__ damaged_intervals,
 		int n_intervals, void *__restrict__ base,
 		const void *__restrict__ changed, void *__restrict__ diff);
+/** Like construct_diff_core, but rows of `changed` are `changed_stride`
+ * bytes apart instead of `base_stride` bytes; only the first `row_length`
+ * bytes of each row are compared. Both strides and the row length should be
+ * multiples of 1<<alignment_bits. */
+size_t construct_diff_strided(interval_diff_fn_t idiff_fn, int alignment_bits,
+		int diff_window,
+		const struct interval *__restrict__ damaged_intervals,
+		int n_intervals, void *__restrict__ base,
+		const void *__restrict__ changed, size_t base_stride,
+		size_t changed_stride, size_t row_length,
+		void *__restrict__ diff);
+/** Size of the tiles whose mirror contents construct_diff_tiled tracks by
+ * hash; a multiple of every diff function alignment */
+#define DIFF_TILE_SIZE 4096
+/** Initial key and per 64-byte stripe key increment of the tile hash */
+#define TILE_HASH_KEY 0x9e3779b97f4a7c15uLL
+/** Accumulate the DIFF_TILE_SIZE bytes of a 64-byte aligned tile into eight
+ * lanes: for each 64-bit word w with partner word w' (index xor 1) and key k
+ * (which differs per lane and per stripe), add lo32(w^k) * hi32(w^k) + w' */
+typedef void (*tile_accum_fn_t)(
+		const void *__restrict__ tile, uint64_t *__restrict__ acc);
+
+/** Returns the tile accumulation function matching a diff kernel type, or
+ * NULL if tile hashes would not make diffs with that kernel faster */
+tile_accum_fn_t get_tile_accum_function(enum diff_type type);
+/** Hash a tile using the given accumulation function; never returns zero */
+uint64_t hash_tile(tile_accum_fn_t accum_fn, const void *tile);
+/** Like construct_diff_core, but for each tile of DIFF_TILE_SIZE bytes fully
+ * inside an interval, `tile_hashes` holds either zero or a hash of the
+ * tile's contents in base. Tiles of changed whose hash matches are skipped
+ * without reading base; the hashes of the other tiles are updated. */
+size_t construct_diff_tiled(interval_diff_fn_t idiff_fn, int alignment_bits,
+		int diff_window,
+		const struct interval *__restrict__ damaged_intervals,
+		int n_intervals, void *__restrict__ base,
+		const void *__restrict__ changed, void *__restrict__ diff,
+		tile_accum_fn_t accum_fn, uint64_t *__restrict__ tile_hashes);
 /** If the bytes after the last multiple of 1<<alignment_bits differ, copy
  * them over base and append the to the diff */
 size_t construct_diff_trailing(size_t size, int alignment_bits,
@@ -60,6 +109,23 @@ size_t construct_diff_trailing(size_t size, int alignment_bits,
 void apply_diff(size_t size, char *__restrict__ target1,
 		char *__restrict__ target2, size_t diffsize, size_t ntrailing,
 		const char *__restrict__ diff);
+typedef void (*readback_fn_t)(void *__restrict__ dst,
+		const void *__restrict__ src, size_t size);
+/** Returns a function which copies memory using streaming loads, for reading
+ * from uncached or write-combined mappings (like those of DMABUFs) faster
+ * than with ordinary loads; or NULL if the processor has none */
+readback_fn_t get_readback_function(void);
+/** Reorders `size` bytes of 4-byte pixels; a split puts the first byte of
+ * every pixel first, then the second bytes, and so on, so that compressors
+ * see the slowly varying channels of an image as long similar runs. A join
+ * undoes a split. The size % 4 bytes after the last pixel are copied as is. */
+typedef void (*planes_fn_t)(void *__restrict__ dst,
+		const void *__restrict__ src, size_t size);
+/** Sets the byte plane split and join functions matching a diff kernel
+ * type; the results of all implementations are the same */
+void get_planes_functions(
+		enum diff_type type, planes_fn_t *split, planes_fn_t *join);
+
 /**
  * src, dest are buffers whose meaningful content consists of a series
  * of rows; the start coordinates of each row are multiples of 'src_stride' and
@@ -23,9 +23,12 @@
  * SOFTWARE.
  */
 
+#include "kernel.h"
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <x86intrin.h>
 
@@ -164,3 +167,101 @@ size_t run_interval_diff_avx2(const int diff_window_size,
 
 	return dc;
 }
+
+void accumulate_tile_avx2(
+		const void *__restrict__ tile, uint64_t *__restrict__ acc)
+{
+	const __m256i *__restrict__ data = tile;
+	const uint64_t k = TILE_HASH_KEY;
+	uint64_t keys[8];
+	for (int j = 0; j < 8; j++) {
+		keys[j] = k * (uint64_t)(2 * j + 1);
+	}
+	const __m256i step = _mm256_set1_epi64x((long long)k);
+	__m256i key0 = _mm256_loadu_si256((const __m256i *)&keys[0]);
+	__m256i key1 = _mm256_loadu_si256((const __m256i *)&keys[4]);
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	for (size_t s = 0; s < DIFF_TILE_SIZE / 64; s++) {
+		__m256i w0 = _mm256_load_si256(&data[2 * s]);
+		__m256i w1 = _mm256_load_si256(&data[2 * s + 1]);
+		__m256i d0 = _mm256_xor_si256(w0, key0);
+		__m256i d1 = _mm256_xor_si256(w1, key1);
+		__m256i p0 = _mm256_mul_epu32(d0, _mm256_srli_epi64(d0, 32));
+		__m256i p1 = _mm256_mul_epu32(d1, _mm256_srli_epi64(d1, 32));
+		/* Swap adjacent 64-bit words */
+		__m256i s0 = _mm256_shuffle_epi32(w0, _MM_SHUFFLE(1, 0, 3, 2));
+		__m256i s1 = _mm256_shuffle_epi32(w1, _MM_SHUFFLE(1, 0, 3, 2));
+		acc0 = _mm256_add_epi64(acc0, _mm256_add_epi64(p0, s0));
+		acc1 = _mm256_add_epi64(acc1, _mm256_add_epi64(p1, s1));
+		key0 = _mm256_add_epi64(key0, step);
+		key1 = _mm256_add_epi64(key1, step);
+	}
+	_mm256_storeu_si256((__m256i *)&acc[0], acc0);
+	_mm256_storeu_si256((__m256i *)&acc[4], acc1);
+}
+
+/* Shuffle which transposes each 4x4 block of bytes in a 128-bit lane; it is
+ * its own inverse */
+static __m256i planes_transpose_mask(void)
+{
+	return _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7,
+			11, 15, 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7,
+			11, 15);
+}
+
+void split_planes_avx2(void *__restrict__ dst, const void *__restrict__ src,
+		size_t size)
+{
+	uint8_t *__restrict__ out = dst;
+	const uint8_t *__restrict__ in = src;
+	size_t npixels = size / 4;
+	const __m256i mask = planes_transpose_mask();
+	/* After the transpose, 32-bit word k of each lane holds byte k of
+	 * the lane's four pixels; gather the two words for each plane */
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	size_t i = 0;
+	for (; i + 8 <= npixels; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&in[4 * i]);
+		v = _mm256_shuffle_epi8(v, mask);
+		v = _mm256_permutevar8x32_epi32(v, order);
+		uint64_t planes[4];
+		_mm256_storeu_si256((__m256i *)planes, v);
+		for (size_t k = 0; k < 4; k++) {
+			memcpy(&out[k * npixels + i], &planes[k], 8);
+		}
+	}
+	for (; i < npixels; i++) {
+		for (size_t k = 0; k < 4; k++) {
+			out[k * npixels + i] = in[4 * i + k];
+		}
+	}
+	memcpy(out + 4 * npixels, in + 4 * npixels, size % 4);
+}
+
+void join_planes_avx2(void *__restrict__ dst, const void *__restrict__ src,
+		size_t size)
+{
+	uint8_t *__restrict__ out = dst;
+	const uint8_t *__restrict__ in = src;
+	size_t npixels = size / 4;
+	const __m256i mask = planes_transpose_mask();
+	const __m256i order = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	size_t i = 0;
+	for (; i + 8 <= npixels; i += 8) {
+		uint64_t planes[4];
+		for (size_t k = 0; k < 4; k++) {
+			memcpy(&planes[k], &in[k * npixels + i], 8);
+		}
+		__m256i v = _mm256_loadu_si256((const __m256i *)planes);
+		v = _mm256_permutevar8x32_epi32(v, order);
+		v = _mm256_shuffle_epi8(v, mask);
+		_mm256_storeu_si256((__m256i *)&out[4 * i], v);
+	}
+	for (; i < npixels; i++) {
+		for (size_t k = 0; k < 4; k++) {
+			out[4 * i + k] = in[k * npixels + i];
+		}
+	}
+	memcpy(out + 4 * npixels, in + 4 * npixels, size % 4);
+}
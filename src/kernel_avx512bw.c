@@ -0,0 +1,150 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <x86intrin.h>
+
+/** The diff run currently being written */
+struct diff_run {
+	uint32_t *ctrl; /* NULL if no run is open */
+	size_t end;     /* index after the last word of the run */
+};
+
+/** Copy n 32-bit words, using a masked store for the last partial vector */
+static inline void copy_words(uint32_t *__restrict__ dst,
+		const uint32_t *__restrict__ src, size_t n)
+{
+	for (; n >= 16; n -= 16, dst += 16, src += 16) {
+		_mm512_storeu_si512(dst, _mm512_loadu_si512(src));
+	}
+	if (n > 0) {
+		__mmask16 k = _cvtu32_mask16((1u << n) - 1);
+		_mm512_mask_storeu_epi32(
+				dst, k, _mm512_maskz_loadu_epi32(k, src));
+	}
+}
+
+/** Add the changed words indicated by `mask`, whose bit 0 is the word at
+ * index `pos`, to the diff. Words which are unchanged are included when
+ * they lie between changed words at most `window` apart; their values are
+ * read from the (already updated) base. */
+static inline size_t add_changes(uint32_t *__restrict__ diff, size_t dc,
+		struct diff_run *run, const uint32_t *base, size_t window,
+		uint64_t mask, size_t pos)
+{
+	while (mask) {
+		size_t e = (size_t)_tzcnt_u64(mask);
+		size_t first = pos + e;
+		size_t start = first;
+		if (run->ctrl && first - run->end <= window) {
+			start = run->end;
+		} else {
+			if (run->ctrl) {
+				run->ctrl[1] = (uint32_t)run->end;
+			}
+			run->ctrl = &diff[dc];
+			run->ctrl[0] = (uint32_t)first;
+			dc += 2;
+		}
+		/* Extend over changed words, and short gaps of unchanged
+		 * words, up to the end of the mask */
+		while (1) {
+			e += (size_t)_tzcnt_u64(~(mask >> e));
+			if (e >= 64 || !(mask >> e)) {
+				break;
+			}
+			size_t gap = (size_t)_tzcnt_u64(mask >> e);
+			if (gap > window) {
+				break;
+			}
+			e += gap;
+		}
+		copy_words(&diff[dc], &base[start], pos + e - start);
+		dc += pos + e - start;
+		run->end = pos + e;
+		mask = e >= 64 ? 0 : mask & (~0uLL << e);
+	}
+	return dc;
+}
+
+size_t run_interval_diff_avx512bw(const int diff_window_size,
+		const void *__restrict__ imod, void *__restrict__ ibase,
+		uint32_t *__restrict__ diff, size_t i, const size_t i_end)
+{
+	const __m512i *mod = imod;
+	__m512i *base = ibase;
+	const uint32_t *base_words = ibase;
+	const size_t window = (size_t)diff_window_size;
+
+	struct diff_run run = {.ctrl = NULL, .end = 0};
+	size_t dc = 0;
+	/* Compare four vectors at a time, joining their masks into one */
+	for (; i + 4 <= i_end; i += 4) {
+		__m512i m0 = _mm512_load_si512(&mod[i]);
+		__m512i m1 = _mm512_load_si512(&mod[i + 1]);
+		__m512i m2 = _mm512_load_si512(&mod[i + 2]);
+		__m512i m3 = _mm512_load_si512(&mod[i + 3]);
+		__mmask16 c0 = _mm512_cmpneq_epi32_mask(
+				m0, _mm512_load_si512(&base[i]));
+		__mmask16 c1 = _mm512_cmpneq_epi32_mask(
+				m1, _mm512_load_si512(&base[i + 1]));
+		__mmask16 c2 = _mm512_cmpneq_epi32_mask(
+				m2, _mm512_load_si512(&base[i + 2]));
+		__mmask16 c3 = _mm512_cmpneq_epi32_mask(
+				m3, _mm512_load_si512(&base[i + 3]));
+		__mmask64 changed = _mm512_kunpackd(_mm512_kunpackw(c3, c2),
+				_mm512_kunpackw(c1, c0));
+		if (_kortestz_mask64_u8(changed, changed)) {
+			continue;
+		}
+		/* The diff is copied from base, so that it is certain to
+		 * match what base holds even if mod changes concurrently */
+		_mm512_store_si512(&base[i], m0);
+		_mm512_store_si512(&base[i + 1], m1);
+		_mm512_store_si512(&base[i + 2], m2);
+		_mm512_store_si512(&base[i + 3], m3);
+		dc = add_changes(diff, dc, &run, base_words, window,
+				_cvtmask64_u64(changed), 16 * i);
+	}
+	for (; i < i_end; i++) {
+		__m512i m = _mm512_load_si512(&mod[i]);
+		__mmask16 c = _mm512_cmpneq_epi32_mask(
+				m, _mm512_load_si512(&base[i]));
+		if (_cvtmask16_u32(c) == 0) {
+			continue;
+		}
+		_mm512_store_si512(&base[i], m);
+		dc = add_changes(diff, dc, &run, base_words, window,
+				_cvtmask16_u32(c), 16 * i);
+	}
+	if (run.ctrl) {
+		run.ctrl[1] = (uint32_t)run.end;
+	}
+	return dc;
+}
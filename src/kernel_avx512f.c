@@ -23,6 +23,8 @@
  * SOFTWARE.
  */
 
+#include "kernel.h"
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -117,3 +119,27 @@ size_t run_interval_diff_avx512f(const int diff_window_size,
 
 	return dc;
 }
+
+void accumulate_tile_avx512f(
+		const void *__restrict__ tile, uint64_t *__restrict__ acc)
+{
+	const __m512i *__restrict__ data = tile;
+	const uint64_t k = TILE_HASH_KEY;
+	uint64_t keys[8];
+	for (int j = 0; j < 8; j++) {
+		keys[j] = k * (uint64_t)(2 * j + 1);
+	}
+	const __m512i step = _mm512_set1_epi64((long long)k);
+	__m512i key = _mm512_loadu_si512((const void *)keys);
+	__m512i sum = _mm512_setzero_si512();
+	for (size_t s = 0; s < DIFF_TILE_SIZE / 64; s++) {
+		__m512i w = _mm512_load_si512(&data[s]);
+		__m512i d = _mm512_xor_si512(w, key);
+		__m512i p = _mm512_mul_epu32(d, _mm512_srli_epi64(d, 32));
+		/* Swap adjacent 64-bit words */
+		__m512i sw = _mm512_shuffle_epi32(w, _MM_PERM_BADC);
+		sum = _mm512_add_epi64(sum, _mm512_add_epi64(p, sw));
+		key = _mm512_add_epi64(key, step);
+	}
+	_mm512_storeu_si512((void *)acc, sum);
+}
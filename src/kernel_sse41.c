@@ -0,0 +1,64 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "kernel.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <smmintrin.h> // sse4.1
+
+void readback_stream_sse41(void *__restrict__ dst,
+		const void *__restrict__ src, size_t size)
+{
+	char *d = dst;
+	const char *s = src;
+	/* MOVNTDQA requires 16-byte aligned addresses */
+	size_t head = (16 - (uintptr_t)s % 16) % 16;
+	head = head < size ? head : size;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	/* Read a full 64-byte line at a time, since the streaming load
+	 * buffer for write-combined memory is filled by line */
+	for (; size >= 64; size -= 64, s += 64, d += 64) {
+		__m128i *line = (__m128i *)(uintptr_t)s;
+		__m128i a = _mm_stream_load_si128(&line[0]);
+		__m128i b = _mm_stream_load_si128(&line[1]);
+		__m128i c = _mm_stream_load_si128(&line[2]);
+		__m128i e = _mm_stream_load_si128(&line[3]);
+		_mm_storeu_si128((__m128i *)d, a);
+		_mm_storeu_si128((__m128i *)(d + 16), b);
+		_mm_storeu_si128((__m128i *)(d + 32), c);
+		_mm_storeu_si128((__m128i *)(d + 48), e);
+	}
+	for (; size >= 16; size -= 16, s += 16, d += 16) {
+		__m128i a = _mm_stream_load_si128((__m128i *)(uintptr_t)s);
+		_mm_storeu_si128((__m128i *)d, a);
+	}
+	memcpy(d, s, size);
+}
@@ -29,11 +29,47 @@
 #include "shadow.h"
 #include "util.h"
 
+/** Upper bound for main_config::max_frames_in_flight */
+#define MAX_FRAMES_IN_FLIGHT 16
+
 struct main_config {
 	const char *drm_node;
 	int n_worker_threads;
+	/* How many frames may be queued on the channel while the next one is
+	 * processed; values below 1 act as 1 */
+	int max_frames_in_flight;
+	/* Use io_uring for channel reads and writes, if available */
+	bool chan_io_uring;
+	/* Send scrolled buffer rows as WMSG_BUFFER_COPY_ROWS; the remote
+	 * side must support that message */
+	bool scroll_copy;
+	/* Send buffer blocks already present on the remote side as
+	 * WMSG_BUFFER_COPY_BLOCK; the remote side must support that message */
+	bool block_dedup;
+	/* Keep a Zstd stream open per buffer region between updates, and
+	 * send diffs as WMSG_BUFFER_DIFF_STREAM; set by the connection header
+	 * on the client side */
+	bool zstd_history;
+	/* Train a dictionary from the first small diffs, send it with
+	 * WMSG_COMPRESSION_DICT, and then compress with it; the remote side
+	 * must support that message */
+	bool train_dict;
+	/* Also compress protocol blocks and pipe transfers; the remote side
+	 * must support WMSG_PROTOCOL_COMPRESSED and
+	 * WMSG_PIPE_TRANSFER_COMPRESSED */
+	bool compress_streams;
+	/* Split 4-byte pixels into byte planes before compression, where this
+	 * helps; the remote side must support WMSG_BUFFER_FILL_PLANES and
+	 * WMSG_BUFFER_DIFF_PLANES */
+	bool split_planes;
+	/* Diff kernel to use; DIFF_FASTEST to time the available kernels */
+	enum diff_type diff_kernel;
+	/* Diff window; zero to adapt the window for each buffer */
+	int diff_window;
 	enum compression_mode compression;
 	int compression_level;
+	/* Adapt the compression level each frame, starting from the above */
+	bool compression_adapt;
 	bool no_gpu;
 	bool only_linear_dmabuf;
 	bool video_if_possible;
@@ -74,5 +110,15 @@ int run_client(int cwd_fd, const char *sock_folder_name, int sock_folder_fd,
 		int channelsock);
 /** Run benchmarking tool; n_worker_threads defined as with \ref main_config */
 int run_bench(float bandwidth_mBps, uint32_t test_size, int n_worker_threads);
+/** Measure the cost of shadow structure lookups as the map grows */
+int run_lookup_bench(void);
+/** Measure how buffer update time scales from 1 to max_threads threads */
+int run_thread_scaling_bench(uint32_t test_size, int max_threads);
+/** Measure the throughput of each available diff kernel, with and without
+ * tile hashes */
+int run_diff_bench(uint32_t test_size);
+/** Measure how fast buffers are diffed when first copied out of their
+ * mapping with streaming loads, as is done for DMABUFs */
+int run_readback_bench(uint32_t test_size);
 
 #endif // WAYPIPE_MAIN_H
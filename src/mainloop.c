@@ -178,6 +178,16 @@ static void untranslate_ids(struct fd_translation_map *map, int nids,
 enum wm_state { WM_WAITING_FOR_PROGRAM, WM_WAITING_FOR_CHANNEL, WM_TERMINAL };
 /** This state corresponds to the in-progress transfer from the program
  * (compositor or application) and its pipes/buffers to the channel. */
+/** Smoothed count of bytes written and nanoseconds taken while the channel
+ * was backlogged; the channel drains at bytes/ns */
+struct drain_meter {
+	struct timespec last_write;
+	bool backlogged;
+	/* Was a rate sample taken during the current frame */
+	bool sampled;
+	double bytes, ns;
+};
+
 struct way_msg_state {
 	enum wm_state state;
 
@@ -205,6 +215,19 @@ struct way_msg_state {
 	/** Statically allocated message acknowledgement messages; due
 	 * to the way they are updated out of order, at most two are needed */
 	struct wmsg_ack ack_msgs[2];
+
+	/** Frames whose transfers are queued but not yet fully written; the
+	 * next frame may be read and processed while there are fewer than
+	 * `max_frames` of these. Each is identified by the message number of
+	 * its last transfer, oldest first. */
+	uint32_t frame_last_msgno[MAX_FRAMES_IN_FLIGHT];
+	int nframes, max_frames;
+	/** Has the current frame already been added to frame_last_msgno */
+	bool frame_queued;
+
+	/** Estimates the rate at which the channel accepts data while
+	 * transfers are waiting to be written, for the compression tuner */
+	struct drain_meter drain;
 };
 
 enum cm_state { CM_WAITING_FOR_PROGRAM, CM_WAITING_FOR_CHANNEL, CM_TERMINAL };
@@ -215,6 +238,8 @@ struct chan_msg_state {
 
 	/** Edited protocol data which is being written to the program */
 	struct char_window proto_write;
+	/** Protocol data of the last WMSG_PROTOCOL_COMPRESSED message */
+	struct char_window proto_uncompressed;
 
 	/**< FDs that should immediately be transferred to the program */
 	struct int_window transf_fds;
@@ -222,11 +247,20 @@ struct chan_msg_state {
 	struct int_window proto_fds;
 
 #define RECV_GOAL_READ_SIZE 131072
-	char *recv_buffer; // ring-like buffer for message data
+#define RECV_INITIAL_SIZE (8 * RECV_GOAL_READ_SIZE)
+	/* Ring buffer for message data, mapped twice in a row so that any
+	 * `recv_size` long range starting in the first copy is contiguous */
+	char *recv_buffer;
 	size_t recv_size;
 	size_t recv_start; // (recv_buffer+rev_start) should be a message header
 	size_t recv_end;   // last byte read from channel, always >=recv_start
 	int recv_unhandled_messages; // number of messages to parse
+	/* If set, buffer updates from `recv_retain_start` on may still be
+	 * read by thread tasks, so the space may not be reused */
+	bool recv_retaining;
+	size_t recv_retain_start;
+	/* Target of the current channel read */
+	struct iovec recv_vec;
 };
 
 /** State used by both forward and reverse messages */
@@ -243,8 +277,53 @@ struct cross_state {
 	/* Which was the last message number sent to the other application which
 	 * was acknowledged by that side? */
 	uint32_t last_confirmed_msgno;
+	/* If not NULL, channel reads and writes are made through this */
+	struct io_ring *chan_ring;
 };
 
+/** Parse and forward a block of protocol messages from the channel */
+static int interpret_protocol(struct chan_msg_state *cmsg, struct globals *g,
+		bool display_side, char *data, int protosize)
+{
+	/* While by construction, the provided message buffer should be
+	 * aligned with individual message boundaries, it is not guaranteed
+	 * that all file descriptors provided will be used by the messages.
+	 * This makes fd handling more complicated. */
+	wp_debug("Received WMSG_PROTOCOL with %d bytes of messages", protosize);
+	// TODO: have message editing routines ensure size, so
+	// that this limit can be tighter
+	if (buf_ensure_size(protosize + 1024, 1, &cmsg->proto_write.size,
+			    (void **)&cmsg->proto_write.data) == -1) {
+		wp_error("Allocation failure for message workspace");
+		return ERR_NOMEM;
+	}
+	cmsg->proto_write.zone_end = 0;
+	cmsg->proto_write.zone_start = 0;
+
+	struct char_window src;
+	src.data = data;
+	src.zone_start = 0;
+	src.zone_end = protosize;
+	src.size = protosize;
+	parse_and_prune_messages(g, display_side, display_side, &src,
+			&cmsg->proto_write, &cmsg->proto_fds);
+	if (src.zone_start != src.zone_end) {
+		wp_error("did not expect partial messages over channel, only parsed %d/%d bytes",
+				src.zone_start, src.zone_end);
+		return ERR_FATAL;
+	}
+	/* Update file descriptor queue */
+	if (cmsg->proto_fds.zone_end > cmsg->proto_fds.zone_start) {
+		memmove(cmsg->proto_fds.data,
+				cmsg->proto_fds.data +
+						cmsg->proto_fds.zone_start,
+				sizeof(int) * (size_t)(cmsg->proto_fds.zone_end >
+							      cmsg->proto_fds.zone_start));
+		cmsg->proto_fds.zone_end -= cmsg->proto_fds.zone_start;
+	}
+	return 0;
+}
+
 static int interpret_chanmsg(struct chan_msg_state *cmsg,
 		struct cross_state *cxs, struct globals *g, bool display_side,
 		char *packet)
@@ -299,6 +378,18 @@ static int interpret_chanmsg(struct chan_msg_state *cmsg,
 		cxs->newest_received_msgno = cxs->last_received_msgno;
 	}
 
+	if (!is_async_buffer_update(type)) {
+		/* Protocol messages and other updates may depend on buffer
+		 * contents, so wait until all received fills and diffs are
+		 * applied. The sender ends each batch of buffer updates with
+		 * a protocol message, so updates within one batch never
+		 * overlap. */
+		int fence_ret = fence_buffer_updates(&g->map, &g->threads);
+		if (fence_ret < 0) {
+			return fence_ret;
+		}
+	}
+
 	if (type == WMSG_INJECT_RIDS) {
 		const int32_t *fds = &((const int32_t *)packet)[1];
 		int nfds = (int)((unpadded_size - sizeof(uint32_t)) /
@@ -331,46 +422,18 @@ static int interpret_chanmsg(struct chan_msg_state *cmsg,
 		}
 		return 0;
 	} else if (type == WMSG_PROTOCOL) {
-		/* While by construction, the provided message buffer should be
-		 * aligned with individual message boundaries, it is not
-		 * guaranteed that all file descriptors provided will be used by
-		 * the messages. This makes fd handling more complicated. */
-		int protosize = (int)(unpadded_size - sizeof(uint32_t));
-		wp_debug("Received WMSG_PROTOCOL with %d bytes of messages",
-				protosize);
-		// TODO: have message editing routines ensure size, so
-		// that this limit can be tighter
-		if (buf_ensure_size(protosize + 1024, 1,
-				    &cmsg->proto_write.size,
-				    (void **)&cmsg->proto_write.data) == -1) {
-			wp_error("Allocation failure for message workspace");
-			return ERR_NOMEM;
-		}
-		cmsg->proto_write.zone_end = 0;
-		cmsg->proto_write.zone_start = 0;
-
-		struct char_window src;
-		src.data = packet + sizeof(uint32_t);
-		src.zone_start = 0;
-		src.zone_end = protosize;
-		src.size = protosize;
-		parse_and_prune_messages(g, display_side, display_side, &src,
-				&cmsg->proto_write, &cmsg->proto_fds);
-		if (src.zone_start != src.zone_end) {
-			wp_error("did not expect partial messages over channel, only parsed %d/%d bytes",
-					src.zone_start, src.zone_end);
+		return interpret_protocol(cmsg, g, display_side,
+				packet + sizeof(uint32_t),
+				(int)(unpadded_size - sizeof(uint32_t)));
+	} else if (type == WMSG_PROTOCOL_COMPRESSED) {
+		struct bytebuf msg = {.data = packet, .size = unpadded_size};
+		if (uncompress_protocol_block(&g->threads, &msg,
+				    &cmsg->proto_uncompressed) == -1) {
 			return ERR_FATAL;
 		}
-		/* Update file descriptor queue */
-		if (cmsg->proto_fds.zone_end > cmsg->proto_fds.zone_start) {
-			memmove(cmsg->proto_fds.data,
-					cmsg->proto_fds.data +
-							cmsg->proto_fds.zone_start,
-					sizeof(int) * (size_t)(cmsg->proto_fds.zone_end >
-								      cmsg->proto_fds.zone_start));
-			cmsg->proto_fds.zone_end -= cmsg->proto_fds.zone_start;
-		}
-		return 0;
+		return interpret_protocol(cmsg, g, display_side,
+				cmsg->proto_uncompressed.data,
+				cmsg->proto_uncompressed.zone_end);
 	} else {
 		if (unpadded_size < sizeof(struct wmsg_basic)) {
 			wp_error("Message is too small to contain header+RID, %d bytes",
@@ -386,80 +449,172 @@ static int interpret_chanmsg(struct chan_msg_state *cmsg,
 		wp_debug("Received %s for RID=%d (len %d)",
 				wmsg_type_to_str(type), op_header->remote_id,
 				unpadded_size);
+		if (is_async_buffer_update(type) ||
+				type == WMSG_BUFFER_COPY_ROWS ||
+				type == WMSG_BUFFER_COPY_BLOCK) {
+			return queue_buffer_update(&g->map, &g->threads,
+					&g->render, type, op_header->remote_id,
+					&msg);
+		}
 		return apply_update(&g->map, &g->threads, &g->render, type,
 				op_header->remote_id, &msg);
 	}
 }
 
+/** Stop keeping received buffer updates once no thread task uses them */
+static void release_recv_retained(struct chan_msg_state *cmsg,
+		struct thread_pool *threads)
+{
+	if (cmsg->recv_retaining &&
+			atomic_load_explicit(&threads->apply_pending,
+					memory_order_acquire) == 0) {
+		cmsg->recv_retaining = false;
+	}
+}
+
+/** Replace the receive buffer with a larger one, keeping unread data */
+static int grow_recv_buffer(struct chan_msg_state *cmsg, size_t min_size)
+{
+	size_t new_size = cmsg->recv_size;
+	while (new_size < min_size) {
+		if (new_size >= ((size_t)1 << 30)) {
+			wp_error("Message of size %zu is too large to receive",
+					min_size);
+			return ERR_FATAL;
+		}
+		new_size *= 2;
+	}
+	char *new_buffer = create_mirrored_buffer(new_size);
+	if (!new_buffer) {
+		wp_error("Allocation failure, resizing receive buffer failed");
+		return ERR_NOMEM;
+	}
+	size_t len = cmsg->recv_end - cmsg->recv_start;
+	memcpy(new_buffer, cmsg->recv_buffer + cmsg->recv_start, len);
+	destroy_mirrored_buffer(cmsg->recv_buffer, cmsg->recv_size);
+	cmsg->recv_buffer = new_buffer;
+	cmsg->recv_size = new_size;
+	cmsg->recv_start = 0;
+	cmsg->recv_end = len;
+	return 0;
+}
+
+/** Choose where the next channel read will place data, making space
+ * available in the receive buffer */
+static int setup_chanread(struct chan_msg_state *cmsg, struct globals *g)
+{
+	release_recv_retained(cmsg, &g->threads);
+
+	/* Space to keep for the message being received */
+	size_t msg_size = RECV_GOAL_READ_SIZE;
+	if (cmsg->recv_end >= cmsg->recv_start + sizeof(uint32_t)) {
+		uint32_t *header = (uint32_t *)&cmsg->recv_buffer
+						   [cmsg->recv_start];
+		msg_size = maxu(alignz(transfer_size(*header), 4), msg_size);
+	}
+	size_t tail = cmsg->recv_retaining ? cmsg->recv_retain_start
+					   : cmsg->recv_start;
+	if (cmsg->recv_retaining &&
+			cmsg->recv_size < msg_size + cmsg->recv_start - tail) {
+		/* Finish the updates that use the space */
+		int ret = fence_buffer_updates(&g->map, &g->threads);
+		if (ret < 0) {
+			return ret;
+		}
+		cmsg->recv_retaining = false;
+		tail = cmsg->recv_start;
+	}
+	if (cmsg->recv_size < msg_size) {
+		int ret = grow_recv_buffer(cmsg, msg_size);
+		if (ret < 0) {
+			return ret;
+		}
+		tail = cmsg->recv_start;
+	}
+	if (tail >= cmsg->recv_size) {
+		/* The same data is visible one buffer size earlier */
+		cmsg->recv_start -= cmsg->recv_size;
+		cmsg->recv_end -= cmsg->recv_size;
+		cmsg->recv_retain_start -= cmsg->recv_retaining
+							   ? cmsg->recv_size
+							   : 0;
+		tail -= cmsg->recv_size;
+	}
+
+	cmsg->recv_vec.iov_base = cmsg->recv_buffer + cmsg->recv_end;
+	cmsg->recv_vec.iov_len = cmsg->recv_size - (cmsg->recv_end - tail);
+	return 0;
+}
+
+/** If the channel operation made through the ring has completed, set
+ * `result` and errno as the corresponding readv/writev call would */
+static bool take_chan_ring_result(
+		struct cross_state *cxs, enum io_ring_op op, ssize_t *result)
+{
+	if (!take_io_ring_result(cxs->chan_ring, op, result)) {
+		return false;
+	}
+	if (*result < 0) {
+		errno = (int)-*result;
+		*result = -1;
+	}
+	return true;
+}
+
+/** Close the channel, once no operations on it are in flight */
+static void close_chanfd(struct cross_state *cxs, int chanfd)
+{
+	if (cxs->chan_ring) {
+		cancel_io_ring_ops(cxs->chan_ring);
+	}
+	checked_close(chanfd);
+}
+
+/** Keep a read in flight on the channel, when waiting for it */
+static int queue_chanread(struct chan_msg_state *cmsg, struct cross_state *cxs,
+		struct globals *g, int chanfd)
+{
+	if (cmsg->state != CM_WAITING_FOR_CHANNEL ||
+			cmsg->recv_unhandled_messages > 0 || chanfd == -1 ||
+			is_io_ring_op_busy(cxs->chan_ring, IO_RING_READ)) {
+		return 0;
+	}
+	int ret = setup_chanread(cmsg, g);
+	if (ret < 0) {
+		return ret;
+	}
+	if (register_io_ring_buffer(cxs->chan_ring, cmsg->recv_buffer,
+			    2 * cmsg->recv_size) == -1) {
+		wp_debug("Failed to register receive buffer, will not use fixed reads: %s",
+				strerror(errno));
+	}
+	if (queue_io_ring_op(cxs->chan_ring, IO_RING_READ, chanfd,
+			    &cmsg->recv_vec, 1) == -1) {
+		wp_error("Failed to queue channel read");
+		return ERR_FATAL;
+	}
+	return 0;
+}
+
 static int advance_chanmsg_chanread(struct chan_msg_state *cmsg,
 		struct cross_state *cxs, int chanfd, bool display_side,
 		struct globals *g)
 {
-	/* Setup read operation to be able to read a minimum number of bytes,
-	 * wrapping around as early as overlap conditions permit */
 	if (cmsg->recv_unhandled_messages == 0) {
-		struct iovec vec[2];
-		memset(vec, 0, sizeof(vec));
-		int nvec;
-		if (cmsg->recv_start == cmsg->recv_end) {
-			/* A fresh packet */
-			cmsg->recv_start = 0;
-			cmsg->recv_end = 0;
-			nvec = 1;
-			vec[0].iov_base = cmsg->recv_buffer;
-			vec[0].iov_len = (size_t)(cmsg->recv_size / 2);
-		} else if (cmsg->recv_end <
-				cmsg->recv_start + sizeof(uint32_t)) {
-			/* Didn't quite finish reading the header */
-			int recvsz = (int)cmsg->recv_size;
-			if (buf_ensure_size((int)cmsg->recv_end +
-							    RECV_GOAL_READ_SIZE,
-					    1, &recvsz,
-					    (void **)&cmsg->recv_buffer) ==
-					-1) {
-				wp_error("Allocation failure, resizing receive buffer failed");
-				return ERR_NOMEM;
+		ssize_t r;
+		if (cxs->chan_ring) {
+			/* The read was set up by queue_chanread() */
+			if (!take_chan_ring_result(cxs, IO_RING_READ, &r)) {
+				return 0;
 			}
-			cmsg->recv_size = (size_t)recvsz;
-
-			nvec = 1;
-			vec[0].iov_base = cmsg->recv_buffer + cmsg->recv_end;
-			vec[0].iov_len = RECV_GOAL_READ_SIZE;
 		} else {
-			/* Continuing an old packet; space made available last
-			 * time */
-			uint32_t *header = (uint32_t *)&cmsg->recv_buffer
-							   [cmsg->recv_start];
-			size_t sz = alignz(transfer_size(*header), 4);
-
-			size_t read_end = cmsg->recv_start + sz;
-			bool wraparound =
-					cmsg->recv_start >= RECV_GOAL_READ_SIZE;
-			if (!wraparound) {
-				read_end = maxu(read_end,
-						cmsg->recv_end +
-								RECV_GOAL_READ_SIZE);
-			}
-			int recvsz = (int)cmsg->recv_size;
-			if (buf_ensure_size((int)read_end, 1, &recvsz,
-					    (void **)&cmsg->recv_buffer) ==
-					-1) {
-				wp_error("Allocation failure, resizing receive buffer failed");
-				return ERR_NOMEM;
-			}
-			cmsg->recv_size = (size_t)recvsz;
-
-			nvec = 1;
-			vec[0].iov_base = cmsg->recv_buffer + cmsg->recv_end;
-			vec[0].iov_len = read_end - cmsg->recv_end;
-			if (wraparound) {
-				nvec = 2;
-				vec[1].iov_base = cmsg->recv_buffer;
-				vec[1].iov_len = cmsg->recv_start;
+			int ret = setup_chanread(cmsg, g);
+			if (ret < 0) {
+				return ret;
 			}
+			r = read(chanfd, cmsg->recv_vec.iov_base,
+					cmsg->recv_vec.iov_len);
 		}
-
-		ssize_t r = readv(chanfd, vec, nvec);
 		if (r == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
 			wp_debug("Read would block");
 			return 0;
@@ -470,26 +625,7 @@ static int advance_chanmsg_chanread(struct chan_msg_state *cmsg,
 			wp_error("chanfd read failure: %s", strerror(errno));
 			return ERR_FATAL;
 		} else {
-			if (nvec == 2 && (size_t)r >= vec[0].iov_len) {
-				/* Complete parsing this message */
-				int cm_ret = interpret_chanmsg(cmsg, cxs, g,
-						display_side,
-						cmsg->recv_buffer +
-								cmsg->recv_start);
-				if (cm_ret < 0) {
-					return cm_ret;
-				}
-
-				cmsg->recv_start = 0;
-				cmsg->recv_end = (size_t)r - vec[0].iov_len;
-
-				if (cmsg->proto_write.zone_start <
-						cmsg->proto_write.zone_end) {
-					goto next_stage;
-				}
-			} else {
-				cmsg->recv_end += (size_t)r;
-			}
+			cmsg->recv_end += (size_t)r;
 		}
 	}
 
@@ -514,6 +650,12 @@ static int advance_chanmsg_chanread(struct chan_msg_state *cmsg,
 		char *packet_start = &cmsg->recv_buffer[cmsg->recv_start];
 		uint32_t *header = (uint32_t *)packet_start;
 		size_t sz = transfer_size(*header);
+		enum wmsg_type type = transfer_type(*header);
+		if (is_async_buffer_update(type) && !cmsg->recv_retaining) {
+			/* The update may be applied straight from the buffer */
+			cmsg->recv_retaining = true;
+			cmsg->recv_retain_start = cmsg->recv_start;
+		}
 		int cm_ret = interpret_chanmsg(
 				cmsg, cxs, g, display_side, packet_start);
 		if (cm_ret < 0) {
@@ -639,9 +781,50 @@ static void clear_old_transfers(
 	}
 }
 
-/* Returns 0 sucessful -1 if fatal error, -2 if closed */
-static int partial_write_transfer(int chanfd, struct transfer_queue *td,
-		int *total_written, int max_iov)
+/** Advance the transfer queue past the `wr` bytes written by the last
+ * writev of it */
+static int finish_transfer_write(
+		struct transfer_queue *td, ssize_t wr, int *total_written)
+{
+	if (wr == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+		return 0;
+	} else if (wr == -1 && (errno == ECONNRESET || errno == EPIPE)) {
+		wp_debug("Channel connection closed");
+		return ERR_DISCONN;
+	} else if (wr == -1) {
+		wp_error("chanfd write failure: %s", strerror(errno));
+		return ERR_FATAL;
+	}
+
+	size_t uwr = (size_t)wr;
+	*total_written += (int)wr;
+	while (uwr > 0 && td->start < td->end) {
+		/* Skip past zero-length blocks */
+		if (td->vecs[td->start].iov_len == 0) {
+			td->start++;
+			continue;
+		}
+		size_t left = td->vecs[td->start].iov_len -
+			      td->partial_write_amt;
+		if (left > uwr) {
+			/* Block partially completed */
+			td->partial_write_amt += uwr;
+			uwr = 0;
+		} else {
+			/* Block completed */
+			td->partial_write_amt = 0;
+			uwr -= left;
+			td->start++;
+		}
+	}
+	return 0;
+}
+
+/* Returns 0 sucessful -1 if fatal error, -2 if closed. With a ring, the
+ * write is only queued, and finish_transfer_write is called once it has
+ * completed */
+static int partial_write_transfer(struct io_ring *ring, int chanfd,
+		struct transfer_queue *td, int *total_written, int max_iov)
 {
 	// Waiting for channel write to complete
 	if (td->start < td->end) {
@@ -652,42 +835,24 @@ static int partial_write_transfer(int chanfd, struct transfer_queue *td,
 				orig_base + td->partial_write_amt;
 		td->vecs[td->start].iov_len = orig_len - td->partial_write_amt;
 		int count = min(max_iov, td->end - td->start);
-		ssize_t wr = writev(chanfd, &td->vecs[td->start], count);
+		ssize_t wr;
+		if (ring) {
+			wr = queue_io_ring_op(ring, IO_RING_WRITE, chanfd,
+					&td->vecs[td->start], count);
+		} else {
+			wr = writev(chanfd, &td->vecs[td->start], count);
+		}
 		td->vecs[td->start].iov_base = orig_base;
 		td->vecs[td->start].iov_len = orig_len;
 
-		if (wr == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-			return 0;
-		} else if (wr == -1 &&
-				(errno == ECONNRESET || errno == EPIPE)) {
-			wp_debug("Channel connection closed");
-			return ERR_DISCONN;
-		} else if (wr == -1) {
-			wp_error("chanfd write failure: %s", strerror(errno));
-			return ERR_FATAL;
-		}
-
-		size_t uwr = (size_t)wr;
-		*total_written += (int)wr;
-		while (uwr > 0 && td->start < td->end) {
-			/* Skip past zero-length blocks */
-			if (td->vecs[td->start].iov_len == 0) {
-				td->start++;
-				continue;
-			}
-			size_t left = td->vecs[td->start].iov_len -
-				      td->partial_write_amt;
-			if (left > uwr) {
-				/* Block partially completed */
-				td->partial_write_amt += uwr;
-				uwr = 0;
-			} else {
-				/* Block completed */
-				td->partial_write_amt = 0;
-				uwr -= left;
-				td->start++;
+		if (ring) {
+			if (wr == -1) {
+				wp_error("Failed to queue channel write");
+				return ERR_FATAL;
 			}
+			return 0;
 		}
+		return finish_transfer_write(td, wr, total_written);
 	}
 	return 0;
 }
@@ -766,14 +931,64 @@ static int inject_acknowledge(
 	return 0;
 }
 
-static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
-		struct cross_state *cxs, struct globals *g, int chanfd,
-		bool display_side)
+static bool has_unwritten_transfers(const struct way_msg_state *wmsg)
 {
-	const char *progdesc = display_side ? "compositor" : "application";
+	return wmsg->transfers.start < wmsg->transfers.end;
+}
+/** Record that `written` bytes were just written to the channel; if
+ * transfers were already waiting before this write, the time since the
+ * last write gives a sample of the rate at which the channel drains */
+static void meter_channel_write(
+		struct drain_meter *m, size_t written, bool backlogged)
+{
+	if (written == 0 && m->backlogged) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (m->backlogged) {
+		double ns = (double)(now.tv_sec - m->last_write.tv_sec) * 1e9 +
+			    (double)(now.tv_nsec - m->last_write.tv_nsec);
+		m->bytes = 0.875 * m->bytes + (double)written;
+		m->ns = 0.875 * m->ns + ns;
+		m->sampled = true;
+	}
+	m->last_write = now;
+	m->backlogged = backlogged;
+}
 
-	/* Copy the data in the transfer queue to the write queue. */
-	(void)transfer_load_async(&wmsg->transfers);
+/** Return the estimated drain rate in bytes/ns, or zero if the channel has
+ * not been a bottleneck, and start a new frame */
+static double next_frame_drain_rate(struct drain_meter *m)
+{
+	if (!m->sampled) {
+		/* The channel kept up with the last frame, so it may be
+		 * faster than estimated */
+		m->ns *= 0.8;
+	}
+	m->sampled = false;
+	if (m->bytes <= 0 || m->ns < 1.0) {
+		return 0.0;
+	}
+	return m->bytes / m->ns;
+}
+
+static int write_transfer_queue(
+		struct way_msg_state *wmsg, struct cross_state *cxs, int chanfd)
+{
+	if (cxs->chan_ring) {
+		ssize_t wr;
+		if (take_chan_ring_result(cxs, IO_RING_WRITE, &wr)) {
+			int ret = finish_transfer_write(&wmsg->transfers, wr,
+					&wmsg->total_written);
+			if (ret < 0) {
+				return ret;
+			}
+		} else if (is_io_ring_op_busy(cxs->chan_ring, IO_RING_WRITE)) {
+			/* Messages being written may not be changed */
+			return 0;
+		}
+	}
 
 	// First, clear out any transfers that are no longer needed
 	clear_old_transfers(&wmsg->transfers, cxs->last_confirmed_msgno);
@@ -783,8 +998,54 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 		(void)inject_acknowledge(wmsg, cxs);
 	}
 
-	int ret = partial_write_transfer(chanfd, &wmsg->transfers,
-			&wmsg->total_written, wmsg->max_iov);
+	return partial_write_transfer(cxs->chan_ring, chanfd,
+			&wmsg->transfers, &wmsg->total_written, wmsg->max_iov);
+}
+
+/** Write as much of the transfer queue to the channel as possible */
+static int write_transfers(
+		struct way_msg_state *wmsg, struct cross_state *cxs, int chanfd)
+{
+	int written_before = wmsg->total_written;
+	int ret = write_transfer_queue(wmsg, cxs, chanfd);
+	meter_channel_write(&wmsg->drain,
+			(size_t)(wmsg->total_written - written_before),
+			has_unwritten_transfers(wmsg));
+	return ret;
+}
+
+/** Forget the frames whose transfers have all been written */
+static void drop_written_frames(struct way_msg_state *wmsg)
+{
+	const struct transfer_queue *td = &wmsg->transfers;
+	int k = 0;
+	for (; k < wmsg->nframes; k++) {
+		/* Frame k is written iff the first unwritten transfer comes
+		 * after its last one */
+		uint32_t next_msgno = wmsg->frame_last_msgno[k] + 1;
+		if (td->start < td->end &&
+				!msgno_gt(td->meta[td->start].msgno,
+						next_msgno)) {
+			break;
+		}
+	}
+	if (k > 0) {
+		memmove(wmsg->frame_last_msgno, wmsg->frame_last_msgno + k,
+				sizeof(uint32_t) * (size_t)(wmsg->nframes - k));
+		wmsg->nframes -= k;
+	}
+}
+
+static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
+		struct cross_state *cxs, struct globals *g, int chanfd,
+		bool display_side)
+{
+	const char *progdesc = display_side ? "compositor" : "application";
+
+	/* Copy the data in the transfer queue to the write queue. */
+	(void)transfer_load_async(&wmsg->transfers);
+
+	int ret = write_transfers(wmsg, cxs, chanfd);
 	if (ret < 0) {
 		return ret;
 	}
@@ -793,18 +1054,10 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 	struct task_data task;
 	bool has_task = request_work_task(&g->threads, &task, &is_done);
 
-	/* Run a task ourselves, making use of the main thread */
+	/* Run a task ourselves, making use of the main thread. This also
+	 * signals the completion counter, to skip the next poll */
 	if (has_task) {
 		run_task(&task, &g->threads.threads[0]);
-
-		pthread_mutex_lock(&g->threads.work_mutex);
-		g->threads.tasks_in_progress--;
-		pthread_mutex_unlock(&g->threads.work_mutex);
-		/* To skip the next poll */
-		uint8_t triv = 0;
-		if (write(g->threads.selfpipe_w, &triv, 1) == -1) {
-			wp_error("Failed to write to self-pipe");
-		}
 	}
 
 	if (is_done) {
@@ -825,40 +1078,39 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 		memset(wmsg->trailing, 0, sizeof(wmsg->trailing));
 	}
 
-	if (wmsg->transfers.start == wmsg->transfers.end && is_done) {
-		for (struct shadow_fd_link *lcur = g->map.link.l_next,
-					   *lnxt = lcur->l_next;
-				lcur != &g->map.link;
-				lcur = lnxt, lnxt = lcur->l_next) {
-			/* Note: finish_update() may delete `cur` */
-			struct shadow_fd *cur = (struct shadow_fd *)lcur;
-			finish_update(cur);
-			destroy_shadow_if_unreferenced(cur);
-		}
+	if (is_done && !wmsg->frame_queued) {
+		/* All messages for the frame are now in the transfer queue,
+		 * and the thread pool is free for the next frame */
+		finish_dirty_updates(&g->map);
+		tune_compression(&g->threads,
+				next_frame_drain_rate(&wmsg->drain));
+		update_compression_dict(&g->threads, &wmsg->transfers);
 
-		/* Reset work queue */
-		pthread_mutex_lock(&g->threads.work_mutex);
-		if (g->threads.stack_count > 0 ||
-				g->threads.tasks_in_progress > 0) {
+		if (atomic_load(&g->threads.tasks_pending) != 0) {
 			wp_error("Multithreading state failure");
 		}
-		g->threads.do_work = false;
-		g->threads.stack_count = 0;
-		g->threads.tasks_in_progress = 0;
-		pthread_mutex_unlock(&g->threads.work_mutex);
+		wmsg->frame_last_msgno[wmsg->nframes++] =
+				wmsg->transfers.last_msgno - 1;
+		wmsg->frame_queued = true;
+	}
+	drop_written_frames(wmsg);
 
+	if (wmsg->frame_queued && wmsg->nframes < wmsg->max_frames) {
 		DTRACE_PROBE(waypipe, channel_write_end);
 		size_t unacked_bytes = 0;
 		for (int i = 0; i < wmsg->transfers.end; i++) {
 			unacked_bytes += wmsg->transfers.vecs[i].iov_len;
 		}
 
-		wp_debug("Sent %d-byte message from %s to channel; %zu-bytes in flight",
-				wmsg->total_written, progdesc, unacked_bytes);
+		wp_debug("Sent %d-byte message from %s to channel; %zu-bytes in flight, %d frames queued",
+				wmsg->total_written, progdesc, unacked_bytes,
+				wmsg->nframes);
 
 		/* do not delete the used transfers yet; we need a remote
-		 * acknowledgement */
+		 * acknowledgement. Any queued frames continue to be written
+		 * while the next frame is read and processed. */
 		wmsg->total_written = 0;
+		wmsg->frame_queued = false;
 		wmsg->state = WM_WAITING_FOR_PROGRAM;
 	}
 	return 0;
@@ -871,6 +1123,8 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 	// We have data to read from programs/pipes
 	bool new_proto_data = false;
 	int old_fbuffer_end = wmsg->fds.zone_end;
+	/* Earlier frames may still be being written */
+	int old_transfers_end = wmsg->transfers.end;
 	if (progsock_readable) {
 		// Read /once/
 		ssize_t rc = iovec_read(progfd,
@@ -932,18 +1186,8 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 
 	read_readable_pipes(&g->map);
 
-	for (struct shadow_fd_link *lcur = g->map.link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &g->map.link;
-			lcur = lnxt, lnxt = lcur->l_next) {
-		/* Note: finish_update() may delete `cur` */
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		collect_update(&g->threads, cur, &wmsg->transfers,
-				g->config->old_video_mode);
-		/* collecting updates can reset `pipe.remote_can_X` state, so
-		 * garbage collect the sfd immediately after */
-		destroy_shadow_if_unreferenced(cur);
-	}
+	collect_dirty_updates(&g->map, &g->threads, &wmsg->transfers,
+			g->config->old_video_mode);
 
 	int num_mt_tasks = start_parallel_work(
 			&g->threads, &wmsg->transfers.async_recv_queue);
@@ -987,9 +1231,21 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 			wmsg->trailing[wmsg->ntrailing].iov_base = msg;
 			wmsg->ntrailing++;
 		}
+		size_t comp_size = 0;
+		void *comp_proto = NULL;
 		if (wmsg->proto_write.zone_end > 0) {
 			wp_debug("We are transferring a data buffer with %d bytes",
 					wmsg->proto_write.zone_end);
+			comp_proto = compress_protocol_block(&g->threads,
+					wmsg->proto_write.data,
+					(size_t)wmsg->proto_write.zone_end,
+					&comp_size);
+		}
+		if (comp_proto) {
+			wmsg->trailing[wmsg->ntrailing].iov_len = comp_size;
+			wmsg->trailing[wmsg->ntrailing].iov_base = comp_proto;
+			wmsg->ntrailing++;
+		} else if (wmsg->proto_write.zone_end > 0) {
 			size_t act_size = (size_t)wmsg->proto_write.zone_end +
 					  sizeof(uint32_t);
 			uint32_t protoh = transfer_header(
@@ -1016,9 +1272,9 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 		}
 	}
 
-	int n_transfers = wmsg->transfers.end - wmsg->transfers.start;
+	int n_transfers = wmsg->transfers.end - old_transfers_end;
 	size_t net_bytes = 0;
-	for (int i = wmsg->transfers.start; i < wmsg->transfers.end; i++) {
+	for (int i = old_transfers_end; i < wmsg->transfers.end; i++) {
 		net_bytes += wmsg->transfers.vecs[i].iov_len;
 	}
 
@@ -1031,6 +1287,16 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 	}
 	return 0;
 }
+/** After the program has closed, finish writing any queued frames before
+ * shutting down the program->channel transfers */
+static void stop_waymsg_reads(struct way_msg_state *wmsg)
+{
+	if (wmsg->state == WM_WAITING_FOR_PROGRAM) {
+		wmsg->state = has_unwritten_transfers(wmsg)
+					      ? WM_WAITING_FOR_CHANNEL
+					      : WM_TERMINAL;
+	}
+}
 static int advance_waymsg_transfer(struct globals *g,
 		struct way_msg_state *wmsg, struct cross_state *cxs,
 		bool display_side, int chanfd, int progfd,
@@ -1040,6 +1306,14 @@ static int advance_waymsg_transfer(struct globals *g,
 		return advance_waymsg_chanwrite(
 				wmsg, cxs, g, chanfd, display_side);
 	} else if (wmsg->state == WM_WAITING_FOR_PROGRAM) {
+		if (has_unwritten_transfers(wmsg) && chanfd != -1) {
+			/* Keep writing earlier frames */
+			int ret = write_transfers(wmsg, cxs, chanfd);
+			if (ret < 0) {
+				return ret;
+			}
+			drop_written_frames(wmsg);
+		}
 		return advance_waymsg_progread(wmsg, g, progfd, display_side,
 				progsock_readable);
 	}
@@ -1108,9 +1382,9 @@ static void reset_connection(struct cross_state *cxs,
 		int chanfd)
 {
 	/* Discard partial read transfer, throwing away complete but unread
-	 * messages, and trailing remnants */
-	cmsg->recv_end = 0;
-	cmsg->recv_start = 0;
+	 * messages, and trailing remnants. Earlier data may still be in use
+	 * by buffer update tasks. */
+	cmsg->recv_start = cmsg->recv_end;
 	cmsg->recv_unhandled_messages = 0;
 
 	clear_old_transfers(&wmsg->transfers, cxs->last_confirmed_msgno);
@@ -1189,6 +1463,8 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 	memset(&g, 0, sizeof(g));
 
 	way_msg.state = WM_WAITING_FOR_PROGRAM;
+	way_msg.max_frames = max(1,
+			min(config->max_frames_in_flight, MAX_FRAMES_IN_FLIGHT));
 	/* AFAIK, there is no documented upper bound for the size of a
 	 * Wayland protocol message, but libwayland (in wl_buffer_put)
 	 * effectively limits message sizes to 4096 bytes. We must
@@ -1201,16 +1477,10 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 	way_msg.proto_write.size = 2 * max_read_size;
 	way_msg.proto_write.data = malloc((size_t)way_msg.proto_write.size);
 	way_msg.max_iov = get_iov_max();
-	int mut_ret = pthread_mutex_init(
-			&way_msg.transfers.async_recv_queue.lock, NULL);
-	if (mut_ret) {
-		wp_error("Mutex creation failed: %s", strerror(mut_ret));
-		goto init_failure_cleanup;
-	}
 
 	chan_msg.state = CM_WAITING_FOR_CHANNEL;
-	chan_msg.recv_size = 2 * RECV_GOAL_READ_SIZE;
-	chan_msg.recv_buffer = malloc((size_t)chan_msg.recv_size);
+	chan_msg.recv_size = RECV_INITIAL_SIZE;
+	chan_msg.recv_buffer = create_mirrored_buffer(chan_msg.recv_size);
 	chan_msg.proto_write.size = max_read_size * 2;
 	chan_msg.proto_write.data = malloc((size_t)chan_msg.proto_write.size);
 	if (!chan_msg.proto_write.data || !chan_msg.recv_buffer ||
@@ -1243,7 +1513,48 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			    config->n_worker_threads) == -1) {
 		goto init_failure_cleanup;
 	}
+	if (configure_diff_kernel(&g.threads, config->diff_kernel,
+			    config->diff_window) == -1) {
+		wp_error("Diff kernel %s is not available, choosing one automatically",
+				diff_type_to_str(config->diff_kernel));
+		(void)configure_diff_kernel(&g.threads, DIFF_FASTEST,
+				config->diff_window);
+	}
+	if (config->compression_adapt &&
+			enable_compression_tuner(&g.threads) == -1) {
+		wp_error("Failed to set up compression tuner, using a fixed compression level");
+	}
+	if (config->train_dict && enable_dict_training(&g.threads) == -1) {
+		wp_error("Cannot train a compression dictionary with compression=%s, not using one",
+				compression_mode_to_str(config->compression));
+	}
 	setup_translation_map(&g.map, display_side);
+	g.map.scroll_copy = config->scroll_copy;
+	g.map.diff_history = config->zstd_history;
+	if (config->zstd_history && config->compression != COMP_ZSTD) {
+		wp_debug("Diff history streams need Zstd compression, not using them");
+	}
+	if (config->compress_streams &&
+			enable_stream_compression(&g.threads) == -1) {
+		wp_debug("Protocol and pipe data are not compressed with compression=%s",
+				compression_mode_to_str(config->compression));
+	}
+	if (config->split_planes &&
+			enable_plane_split(&g.threads) == -1) {
+		wp_debug("Byte planes are not split with compression=%s",
+				compression_mode_to_str(config->compression));
+	}
+	if (config->block_dedup && enable_block_dedup(&g.map) == -1) {
+		wp_error("Failed to allocate block index, not deduplicating buffer blocks");
+	}
+	int pipe_watch_fd = setup_pipe_watch(&g.map);
+	if (config->chan_io_uring) {
+		cross_data.chan_ring = create_io_ring();
+		if (!cross_data.chan_ring) {
+			wp_error("Failed to set up io_uring, using readv/writev instead: %s",
+					strerror(errno));
+		}
+	}
 	if (init_message_tracker(&g.tracker) == -1) {
 		goto init_failure_cleanup;
 	}
@@ -1262,7 +1573,7 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 	while (!shutdown_flag && exit_code == 0 &&
 			!(way_msg.state == WM_TERMINAL &&
 					chan_msg.state == CM_TERMINAL)) {
-		int psize = 4 + count_npipes(&g.map);
+		int psize = 5 + count_npipes(&g.map);
 		if (buf_ensure_size(psize, sizeof(struct pollfd), &pfds_size,
 				    (void **)&pfds) == -1) {
 			wp_error("Allocation failure, not enough space for pollfds");
@@ -1272,23 +1583,54 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 		pfds[0].fd = chanfd;
 		pfds[1].fd = progfd;
 		pfds[2].fd = linkfd;
-		pfds[3].fd = g.threads.selfpipe_r;
+		pfds[3].fd = g.threads.completion_r;
+		pfds[4].fd = pipe_watch_fd;
 		pfds[0].events = 0;
 		pfds[1].events = 0;
 		pfds[2].events = POLLIN;
 		pfds[3].events = POLLIN;
+		pfds[4].events = POLLIN;
 		if (way_msg.state == WM_WAITING_FOR_CHANNEL) {
 			pfds[0].events |= POLLOUT;
 		} else if (way_msg.state == WM_WAITING_FOR_PROGRAM) {
 			pfds[1].events |= POLLIN;
+			if (has_unwritten_transfers(&way_msg)) {
+				pfds[0].events |= POLLOUT;
+			}
 		}
 		if (chan_msg.state == CM_WAITING_FOR_CHANNEL) {
 			pfds[0].events |= POLLIN;
 		} else if (chan_msg.state == CM_WAITING_FOR_PROGRAM) {
 			pfds[1].events |= POLLOUT;
 		}
+		bool chan_ring_ready = false;
+		if (cross_data.chan_ring) {
+			/* Completions are reported through the ring fd; and
+			 * a new write can be started right away if needed */
+			chan_ring_ready = (pfds[0].events & POLLOUT) &&
+					  !is_io_ring_op_busy(
+							  cross_data.chan_ring,
+							  IO_RING_WRITE);
+			pfds[0].fd = get_io_ring_fd(cross_data.chan_ring);
+			pfds[0].events = POLLIN;
+			int ret = queue_chanread(
+					&chan_msg, &cross_data, &g, chanfd);
+			if (ret < 0) {
+				exit_code = ret;
+				break;
+			}
+			ret = submit_io_ring(cross_data.chan_ring);
+			if (ret == -1) {
+				wp_error("Failed to submit io_uring operations: %s",
+						strerror(errno));
+				exit_code = ERR_FATAL;
+				break;
+			}
+			chan_ring_ready = chan_ring_ready || ret == 1;
+		}
 		bool check_read = way_msg.state == WM_WAITING_FOR_PROGRAM;
-		int npoll = 4 + fill_with_pipes(&g.map, pfds + 4, check_read);
+		set_pipe_read_interest(&g.map, check_read);
+		int npoll = 5 + fill_with_pipes(&g.map, pfds + 5, check_read);
 
 		bool own_msg_pending =
 				(cross_data.last_acked_msgno !=
@@ -1299,7 +1641,7 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 				chan_msg.recv_unhandled_messages > 0;
 
 		int poll_delay;
-		if (unread_chan_msgs) {
+		if (unread_chan_msgs || chan_ring_ready) {
 			/* There is work to do, so continue */
 			poll_delay = 0;
 		} else if (own_msg_pending) {
@@ -1323,13 +1665,15 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			}
 		}
 		if (pfds[3].revents & POLLIN) {
-			/* After the self pipe has been used to wake up the
-			 * connection, drain it */
-			char tmp[64];
-			(void)read(g.threads.selfpipe_r, tmp, sizeof(tmp));
+			/* After the completion counter has been used to wake
+			 * up the connection, reset it */
+			clear_event_counter(g.threads.completion_r);
 		}
 
-		mark_pipe_object_statuses(&g.map, npoll - 4, pfds + 4);
+		if (pfds[4].revents & POLLIN) {
+			collect_pipe_events(&g.map);
+		}
+		mark_pipe_object_statuses(&g.map, npoll - 5, pfds + 5);
 		/* POLLHUP sometimes implies POLLIN, but not on all systems.
 		 * Checking POLLHUP|POLLIN means that we can detect EOF when
 		 * we actually do try to read from the sockets, but also, if
@@ -1338,14 +1682,14 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 		bool progsock_readable = pfds[1].revents & (POLLIN | POLLHUP);
 		bool chanmsg_active = (pfds[0].revents & (POLLIN | POLLHUP)) ||
 				      (pfds[1].revents & POLLOUT) ||
-				      unread_chan_msgs;
+				      unread_chan_msgs || chan_ring_ready;
 
 		bool maybe_new_channel = (pfds[2].revents & (POLLIN | POLLHUP));
 		if (maybe_new_channel) {
 			int new_fd = read_new_chanfd(linkfd, &recon_fds);
 			if (new_fd >= 0) {
 				if (chanfd != -1) {
-					checked_close(chanfd);
+					close_chanfd(&cross_data, chanfd);
 				}
 				chanfd = new_fd;
 				reset_connection(&cross_data, &chan_msg,
@@ -1368,7 +1712,7 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 				/* Actually handle the reconnection/reset state
 				 */
 				if (chanfd != -1) {
-					checked_close(chanfd);
+					close_chanfd(&cross_data, chanfd);
 				}
 				chanfd = new_fd;
 				reset_connection(&cross_data, &chan_msg,
@@ -1402,7 +1746,7 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 				/* Channel connection has at least
 				 * partially been shut down, so close it
 				 * fully. */
-				checked_close(chanfd);
+				close_chanfd(&cross_data, chanfd);
 				chanfd = -1;
 				if (linkfd == -1) {
 					wp_error("Channel hang up detected, no reconnection link, fatal");
@@ -1421,10 +1765,7 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 					/* Stop returned while reading */
 					checked_close(progfd);
 					progfd = -1;
-					if (way_msg.state ==
-							WM_WAITING_FOR_PROGRAM) {
-						way_msg.state = WM_TERMINAL;
-					}
+					stop_waymsg_reads(&way_msg);
 					if (chan_msg.state == CM_WAITING_FOR_PROGRAM ||
 							chan_msg.recv_start ==
 									chan_msg.recv_end) {
@@ -1445,9 +1786,7 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			 * a cause for permanent closure, thanks to
 			 * reconnection support */
 			if (progfd == -1) {
-				if (way_msg.state == WM_WAITING_FOR_PROGRAM) {
-					way_msg.state = WM_TERMINAL;
-				}
+				stop_waymsg_reads(&way_msg);
 				if (chan_msg.state == CM_WAITING_FOR_PROGRAM ||
 						chan_msg.recv_start ==
 								chan_msg.recv_end) {
@@ -1494,6 +1833,10 @@ init_failure_cleanup:
 		}
 	}
 
+	/* Stop channel operations before writing to it directly, and before
+	 * the buffers they use are freed */
+	destroy_io_ring(cross_data.chan_ring);
+
 	/* Attempt to notify remote end that the application has closed,
 	 * waiting at most for a very short amount of time */
 	if (way_msg.transfers.start != way_msg.transfers.end) {
@@ -1537,8 +1880,9 @@ init_failure_cleanup:
 	}
 	free(chan_msg.transf_fds.data);
 	free(chan_msg.proto_fds.data);
-	free(chan_msg.recv_buffer);
+	destroy_mirrored_buffer(chan_msg.recv_buffer, chan_msg.recv_size);
 	free(chan_msg.proto_write.data);
+	free(chan_msg.proto_uncompressed.data);
 
 	if (chanfd != -1) {
 		checked_close(chanfd);
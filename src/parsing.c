@@ -577,7 +577,11 @@ void parse_and_prune_messages(struct globals *g, bool on_display_side,
 				lcur = lnxt, lnxt = lcur->l_next) {
 			struct shadow_fd *cur = (struct shadow_fd *)lcur;
 			if (!cur->has_owner) {
-				cur->is_dirty = true;
+				mark_shadow_dirty(cur);
+				if (cur->type == FDC_DMABUF) {
+					/* no surface damage to replay */
+					damage_everything(&cur->damage);
+				}
 			}
 		}
 	}
@@ -27,9 +27,11 @@
 #define _GNU_SOURCE
 #endif
 
-#include "config-waypipe.h"
+#include "util.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -56,6 +58,16 @@
 
 #if defined(__linux__)
 #define HAS_O_PATH 1
+#define HAS_EVENTFD 1
+#define HAS_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#ifdef HAS_IO_URING
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
 #endif
 
 int create_anon_file(void)
@@ -88,6 +100,137 @@ int get_hardware_thread_count(void)
 
 int get_iov_max(void) { return (int)sysconf(_SC_IOV_MAX); }
 
+int create_event_counter(int *read_fd, int *write_fd)
+{
+#ifdef HAS_EVENTFD
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	*read_fd = fd;
+	*write_fd = fd;
+	return fd == -1 ? -1 : 0;
+#else
+	int fds[2];
+	if (pipe(fds) == -1) {
+		*read_fd = -1;
+		*write_fd = -1;
+		return -1;
+	}
+	for (int i = 0; i < 2; i++) {
+		int flags = fcntl(fds[i], F_GETFL, 0);
+		(void)fcntl(fds[i], F_SETFL, flags | O_NONBLOCK);
+		(void)fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	*read_fd = fds[0];
+	*write_fd = fds[1];
+	return 0;
+#endif
+}
+void signal_event_counter(int write_fd)
+{
+#ifdef HAS_EVENTFD
+	uint64_t one = 1;
+	(void)write(write_fd, &one, sizeof(one));
+#else
+	/* if the pipe is full, the reader has not yet woken up anyway */
+	uint8_t triv = 0;
+	(void)write(write_fd, &triv, 1);
+#endif
+}
+void clear_event_counter(int read_fd)
+{
+#ifdef HAS_EVENTFD
+	uint64_t count;
+	(void)read(read_fd, &count, sizeof(count));
+#else
+	uint8_t flush[64];
+	while (read(read_fd, flush, sizeof(flush)) == (ssize_t)sizeof(flush)) {
+	}
+#endif
+}
+
+int create_fd_watch_set(void)
+{
+#ifdef HAS_EPOLL
+	return epoll_create1(EPOLL_CLOEXEC);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+#ifdef HAS_EPOLL
+static int update_epoll(int set, int op, int fd, short events, void *data)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	/* EPOLLHUP and EPOLLERR are always reported, as with poll */
+	ev.events = ((events & POLLIN) ? EPOLLIN : 0) |
+		    ((events & POLLOUT) ? EPOLLOUT : 0);
+	ev.data.ptr = data;
+	return epoll_ctl(set, op, fd, &ev);
+}
+#endif
+int add_to_fd_watch_set(int set, int fd, short events, void *data)
+{
+#ifdef HAS_EPOLL
+	return update_epoll(set, EPOLL_CTL_ADD, fd, events, data);
+#else
+	(void)set;
+	(void)fd;
+	(void)events;
+	(void)data;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+int modify_fd_watch_set(int set, int fd, short events, void *data)
+{
+#ifdef HAS_EPOLL
+	return update_epoll(set, EPOLL_CTL_MOD, fd, events, data);
+#else
+	(void)set;
+	(void)fd;
+	(void)events;
+	(void)data;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+void remove_from_fd_watch_set(int set, int fd)
+{
+#ifdef HAS_EPOLL
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	(void)epoll_ctl(set, EPOLL_CTL_DEL, fd, &ev);
+#else
+	(void)set;
+	(void)fd;
+#endif
+}
+int wait_fd_watch_set(int set, struct fd_watch_event *events, int max)
+{
+#ifdef HAS_EPOLL
+	struct epoll_event evs[64];
+	if (max > 64) {
+		max = 64;
+	}
+	int n = epoll_wait(set, evs, max, 0);
+	for (int i = 0; i < n; i++) {
+		events[i].data = evs[i].data.ptr;
+		events[i].revents = (short)(
+				((evs[i].events & EPOLLIN) ? POLLIN : 0) |
+				((evs[i].events & EPOLLOUT) ? POLLOUT : 0) |
+				((evs[i].events & EPOLLHUP) ? POLLHUP : 0) |
+				((evs[i].events & EPOLLERR) ? POLLERR : 0));
+	}
+	return n;
+#else
+	(void)set;
+	(void)events;
+	(void)max;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 #ifdef HAVE_NEON
 bool neon_available(void)
 {
@@ -177,3 +320,446 @@ int open_folder(const char *name)
 	return open(path, O_RDONLY | O_DIRECTORY);
 #endif
 }
+
+void *create_mirrored_buffer(size_t size)
+{
+	int fd = create_anon_file();
+	if (fd == -1) {
+		return NULL;
+	}
+	if (ftruncate(fd, (off_t)size) == -1) {
+		checked_close(fd);
+		return NULL;
+	}
+	/* Reserve space for both copies, then map the file over it */
+	char *base = mmap(NULL, 2 * size, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		checked_close(fd);
+		return NULL;
+	}
+	for (int i = 0; i < 2; i++) {
+		if (mmap(base + (size_t)i * size, size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_FIXED, fd,
+				    0) == MAP_FAILED) {
+			munmap(base, 2 * size);
+			checked_close(fd);
+			return NULL;
+		}
+	}
+	/* The mappings keep the file alive */
+	checked_close(fd);
+	return base;
+}
+void destroy_mirrored_buffer(void *buf, size_t size)
+{
+	if (buf) {
+		munmap(buf, 2 * size);
+	}
+}
+
+#ifdef HAS_IO_URING
+enum io_ring_op_state { OP_IDLE, OP_QUEUED, OP_IN_FLIGHT, OP_DONE };
+/* user_data values other than the io_ring_op; their results are ignored */
+#define IO_RING_CANCEL_TAG 2
+#define IO_RING_POLL_TAG(op) (3 + (op))
+
+struct io_ring {
+	int fd;
+	void *sq_map, *cq_map;
+	size_t sq_map_size, cq_map_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int sq_entries;
+	/* sqes up to here are filled in, and have been handed to the kernel
+	 * up to `sq_submitted` */
+	unsigned int sq_local_tail, sq_submitted;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Set if the kernel fails with EAGAIN instead of waiting for
+	 * nonblocking fds; then each operation is linked after a poll */
+	bool poll_first;
+	bool poll_32bits;
+	enum io_ring_op_state state[2];
+	int result[2];
+	struct iovec read_vecs[2];
+	struct iovec *write_vecs;
+	int write_vecs_size;
+	char *fixed_buf;
+	size_t fixed_size;
+	/* The last buffer which could not be registered; it is not tried
+	 * again, as the cause (like RLIMIT_MEMLOCK) will not have changed */
+	char *unregistrable_buf;
+	size_t unregistrable_size;
+};
+
+static unsigned int load_acquire(const unsigned int *p)
+{
+	return atomic_load_explicit(
+			(const _Atomic(unsigned int) *)p, memory_order_acquire);
+}
+static void store_release(unsigned int *p, unsigned int v)
+{
+	atomic_store_explicit((_Atomic(unsigned int) *)p, v,
+			memory_order_release);
+}
+
+struct io_ring *create_io_ring(void)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = (int)syscall(__NR_io_uring_setup, 8, &params);
+	if (fd == -1) {
+		return NULL;
+	}
+	/* iovecs must be read at submission time */
+	uint32_t needed = IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_RW_CUR_POS;
+	if ((params.features & needed) != needed) {
+		checked_close(fd);
+		errno = ENOSYS;
+		return NULL;
+	}
+	struct io_ring *ring = calloc(1, sizeof(struct io_ring));
+	if (!ring) {
+		checked_close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	ring->fd = fd;
+	ring->poll_32bits = params.features & IORING_FEAT_POLL_32BITS;
+	ring->sq_map_size = params.sq_off.array +
+			    params.sq_entries * sizeof(unsigned int);
+	ring->cq_map_size = params.cq_off.cqes +
+			    params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_map_size > ring->sq_map_size) {
+			ring->sq_map_size = ring->cq_map_size;
+		}
+		ring->cq_map_size = 0;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	ring->cq_map = ring->cq_map_size == 0
+				       ? ring->sq_map
+				       : mmap(NULL, ring->cq_map_size,
+						       PROT_READ | PROT_WRITE,
+						       MAP_SHARED | MAP_POPULATE,
+						       fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED ||
+			ring->sqes == MAP_FAILED) {
+		int err = errno;
+		destroy_io_ring(ring);
+		errno = err;
+		return NULL;
+	}
+	char *sq = ring->sq_map, *cq = ring->cq_map;
+	ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->sq_submitted = ring->sq_local_tail;
+	ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return ring;
+}
+
+static int enter_io_ring(struct io_ring *ring, bool wait)
+{
+	unsigned int count = ring->sq_local_tail - ring->sq_submitted;
+	if (count == 0 && !wait) {
+		return 0;
+	}
+	store_release(ring->sq_tail, ring->sq_local_tail);
+	int r = (int)syscall(__NR_io_uring_enter, ring->fd, count,
+			wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+			NULL, 0);
+	if (r == -1) {
+		return errno == EINTR || errno == EAGAIN || errno == EBUSY
+				       ? 0
+				       : -1;
+	}
+	ring->sq_submitted += (unsigned int)r;
+	for (int i = 0; i < 2; i++) {
+		if (ring->state[i] == OP_QUEUED &&
+				ring->sq_submitted == ring->sq_local_tail) {
+			ring->state[i] = OP_IN_FLIGHT;
+		}
+	}
+	return 0;
+}
+
+static void reap_io_ring(struct io_ring *ring)
+{
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = load_acquire(ring->cq_tail);
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe =
+				&ring->cqes[head & *ring->cq_mask];
+		if (cqe->user_data < 2) {
+			ring->state[cqe->user_data] = OP_DONE;
+			ring->result[cqe->user_data] = cqe->res;
+			if (cqe->res == -EAGAIN) {
+				ring->poll_first = true;
+			}
+		}
+	}
+	store_release(ring->cq_head, head);
+}
+
+static struct io_uring_sqe *get_io_ring_sqe(struct io_ring *ring)
+{
+	unsigned int tail = ring->sq_local_tail;
+	if (tail - load_acquire(ring->sq_head) >= ring->sq_entries) {
+		return NULL;
+	}
+	unsigned int idx = tail & *ring->sq_mask;
+	ring->sq_array[idx] = idx;
+	ring->sq_local_tail = tail + 1;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+void destroy_io_ring(struct io_ring *ring)
+{
+	if (!ring) {
+		return;
+	}
+	if (ring->sq_map && ring->sq_map != MAP_FAILED &&
+			ring->cq_map != MAP_FAILED &&
+			ring->sqes != MAP_FAILED) {
+		cancel_io_ring_ops(ring);
+	}
+	if (ring->sqes && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_map_size && ring->cq_map && ring->cq_map != MAP_FAILED) {
+		munmap(ring->cq_map, ring->cq_map_size);
+	}
+	if (ring->sq_map && ring->sq_map != MAP_FAILED) {
+		munmap(ring->sq_map, ring->sq_map_size);
+	}
+	/* closing the ring also unregisters the buffer */
+	checked_close(ring->fd);
+	free(ring->write_vecs);
+	free(ring);
+}
+
+int get_io_ring_fd(const struct io_ring *ring) { return ring->fd; }
+
+int register_io_ring_buffer(struct io_ring *ring, void *buf, size_t size)
+{
+	if (buf == ring->fixed_buf && size == ring->fixed_size) {
+		return 0;
+	}
+	if (ring->fixed_buf) {
+		(void)syscall(__NR_io_uring_register, ring->fd,
+				IORING_UNREGISTER_BUFFERS, NULL, 0);
+		ring->fixed_buf = NULL;
+		ring->fixed_size = 0;
+	}
+	if (buf == ring->unregistrable_buf &&
+			size == ring->unregistrable_size) {
+		return 0;
+	}
+	struct iovec vec = {.iov_base = buf, .iov_len = size};
+	if (syscall(__NR_io_uring_register, ring->fd,
+			    IORING_REGISTER_BUFFERS, &vec, 1) == -1) {
+		ring->unregistrable_buf = buf;
+		ring->unregistrable_size = size;
+		return -1;
+	}
+	ring->fixed_buf = buf;
+	ring->fixed_size = size;
+	return 0;
+}
+
+int queue_io_ring_op(struct io_ring *ring, enum io_ring_op op, int fd,
+		const struct iovec *vecs, int nvecs)
+{
+	if (ring->state[op] != OP_IDLE) {
+		return -1;
+	}
+	struct iovec *copy = ring->read_vecs;
+	if (op == IO_RING_WRITE) {
+		if (buf_ensure_size(nvecs, sizeof(struct iovec),
+				    &ring->write_vecs_size,
+				    (void **)&ring->write_vecs) == -1) {
+			return -1;
+		}
+		copy = ring->write_vecs;
+	} else if (nvecs > 2) {
+		return -1;
+	}
+	unsigned int nsqes = ring->poll_first ? 2 : 1;
+	if (ring->sq_local_tail + nsqes - load_acquire(ring->sq_head) >
+			ring->sq_entries) {
+		return -1;
+	}
+	if (ring->poll_first) {
+		struct io_uring_sqe *poll_sqe = get_io_ring_sqe(ring);
+		poll_sqe->opcode = IORING_OP_POLL_ADD;
+		poll_sqe->fd = fd;
+		poll_sqe->flags = IOSQE_IO_LINK;
+		short events = op == IO_RING_READ ? POLLIN : POLLOUT;
+		if (ring->poll_32bits) {
+			poll_sqe->poll32_events = (uint32_t)events;
+		} else {
+			poll_sqe->poll_events = (uint16_t)events;
+		}
+		poll_sqe->user_data = IO_RING_POLL_TAG(op);
+	}
+	struct io_uring_sqe *sqe = get_io_ring_sqe(ring);
+	memcpy(copy, vecs, sizeof(struct iovec) * (size_t)nvecs);
+	sqe->fd = fd;
+	sqe->off = (uint64_t)-1;
+	sqe->user_data = (uint64_t)op;
+	const char *base = vecs[0].iov_base;
+	if (op == IO_RING_READ && nvecs == 1 && ring->fixed_buf &&
+			base >= ring->fixed_buf &&
+			base + vecs[0].iov_len <=
+					ring->fixed_buf + ring->fixed_size) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->addr = (uint64_t)(uintptr_t)base;
+		sqe->len = (uint32_t)vecs[0].iov_len;
+		sqe->buf_index = 0;
+	} else {
+		sqe->opcode = op == IO_RING_READ ? IORING_OP_READV
+						 : IORING_OP_WRITEV;
+		sqe->addr = (uint64_t)(uintptr_t)copy;
+		sqe->len = (uint32_t)nvecs;
+	}
+	ring->state[op] = OP_QUEUED;
+	return 0;
+}
+
+int submit_io_ring(struct io_ring *ring)
+{
+	if (enter_io_ring(ring, false) == -1) {
+		return -1;
+	}
+	/* Keep the completion queue empty, so that the ring fd only polls
+	 * readable for completions made after this point */
+	reap_io_ring(ring);
+	return ring->state[IO_RING_READ] == OP_DONE ||
+	       ring->state[IO_RING_WRITE] == OP_DONE;
+}
+
+bool is_io_ring_op_busy(const struct io_ring *ring, enum io_ring_op op)
+{
+	return ring->state[op] != OP_IDLE;
+}
+
+bool take_io_ring_result(
+		struct io_ring *ring, enum io_ring_op op, ssize_t *result)
+{
+	reap_io_ring(ring);
+	if (ring->state[op] != OP_DONE) {
+		return false;
+	}
+	*result = ring->result[op];
+	ring->state[op] = OP_IDLE;
+	return true;
+}
+
+void cancel_io_ring_ops(struct io_ring *ring)
+{
+	bool cancelled[2] = {false, false};
+	while (ring->state[IO_RING_READ] == OP_IN_FLIGHT ||
+			ring->state[IO_RING_WRITE] == OP_IN_FLIGHT ||
+			ring->state[IO_RING_READ] == OP_QUEUED ||
+			ring->state[IO_RING_WRITE] == OP_QUEUED) {
+		bool in_flight = false;
+		for (int i = 0; i < 2; i++) {
+			if (ring->state[i] != OP_IN_FLIGHT) {
+				continue;
+			}
+			in_flight = true;
+			if (cancelled[i]) {
+				continue;
+			}
+			cancelled[i] = true;
+			/* The operation may be waiting on a linked poll */
+			for (int k = 0; k < (ring->poll_first ? 2 : 1); k++) {
+				struct io_uring_sqe *sqe =
+						get_io_ring_sqe(ring);
+				if (!sqe) {
+					break;
+				}
+				sqe->opcode = IORING_OP_ASYNC_CANCEL;
+				sqe->fd = -1;
+				sqe->addr = k == 0 ? (uint64_t)i
+						   : (uint64_t)IO_RING_POLL_TAG(
+								     i);
+				sqe->user_data = IO_RING_CANCEL_TAG;
+			}
+		}
+		if (enter_io_ring(ring, in_flight) == -1) {
+			wp_error("Failed to cancel io_uring operations: %s",
+					strerror(errno));
+			break;
+		}
+		reap_io_ring(ring);
+	}
+	ring->state[IO_RING_READ] = OP_IDLE;
+	ring->state[IO_RING_WRITE] = OP_IDLE;
+}
+#else
+struct io_ring *create_io_ring(void)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+void destroy_io_ring(struct io_ring *ring) { (void)ring; }
+int get_io_ring_fd(const struct io_ring *ring)
+{
+	(void)ring;
+	return -1;
+}
+int register_io_ring_buffer(struct io_ring *ring, void *buf, size_t size)
+{
+	(void)ring;
+	(void)buf;
+	(void)size;
+	return -1;
+}
+int queue_io_ring_op(struct io_ring *ring, enum io_ring_op op, int fd,
+		const struct iovec *vecs, int nvecs)
+{
+	(void)ring;
+	(void)op;
+	(void)fd;
+	(void)vecs;
+	(void)nvecs;
+	return -1;
+}
+int submit_io_ring(struct io_ring *ring)
+{
+	(void)ring;
+	return -1;
+}
+bool is_io_ring_op_busy(const struct io_ring *ring, enum io_ring_op op)
+{
+	(void)ring;
+	(void)op;
+	return false;
+}
+bool take_io_ring_result(
+		struct io_ring *ring, enum io_ring_op op, ssize_t *result)
+{
+	(void)ring;
+	(void)op;
+	(void)result;
+	return false;
+}
+void cancel_io_ring_ops(struct io_ring *ring) { (void)ring; }
+#endif
@@ -57,6 +57,9 @@ static inline uint32_t conntoken_header(const struct main_config *config,
 	if (config->compression == COMP_NONE) {
 		header |= CONN_NO_COMPRESSION;
 	}
+	if (config->compression == COMP_ZSTD && config->zstd_history) {
+		header |= CONN_ZSTD_HISTORY;
+	}
 	if (config->video_if_possible) {
 		header |= (config->video_fmt == VIDEO_H264 ? CONN_H264_VIDEO
 							   : 0);
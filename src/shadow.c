@@ -35,6 +35,7 @@
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef HAS_LZ4
@@ -42,33 +43,246 @@
 #include <lz4hc.h>
 #endif
 #ifdef HAS_ZSTD
+#include <zdict.h>
 #include <zstd.h>
 #endif
 
+static inline uint32_t shadow_index_hash(int key)
+{
+	/* Fibonacci hashing; fds and RIDs are small and sequential */
+	uint32_t h = (uint32_t)key * 2654435769u;
+	return h ^ (h >> 16);
+}
+static struct shadow_fd *shadow_index_lookup(
+		const struct shadow_index *idx, int key)
+{
+	if (idx->size == 0) {
+		return NULL;
+	}
+	uint32_t mask = (uint32_t)idx->size - 1;
+	for (uint32_t i = shadow_index_hash(key) & mask;; i = (i + 1) & mask) {
+		const struct shadow_index_entry *e = &idx->slots[i];
+		if (!e->sfd) {
+			return NULL;
+		}
+		if (e->key == key) {
+			return e->sfd;
+		}
+	}
+}
+static void shadow_index_place(struct shadow_index_entry *slots, int size,
+		int key, struct shadow_fd *sfd)
+{
+	uint32_t mask = (uint32_t)size - 1;
+	uint32_t i = shadow_index_hash(key) & mask;
+	while (slots[i].sfd) {
+		i = (i + 1) & mask;
+	}
+	slots[i].key = key;
+	slots[i].sfd = sfd;
+}
+/** Returns -1 on allocation failure. Keys must be unique. */
+static int shadow_index_insert(
+		struct shadow_index *idx, int key, struct shadow_fd *sfd)
+{
+	/* Keep the load factor at most 1/2, so probe sequences stay short */
+	if (2 * (idx->count + 1) > idx->size) {
+		int new_size = idx->size ? 2 * idx->size : 16;
+		struct shadow_index_entry *new_slots = calloc(
+				(size_t)new_size, sizeof(*new_slots));
+		if (!new_slots) {
+			wp_error("Failed to resize shadow index to %d slots",
+					new_size);
+			return -1;
+		}
+		for (int i = 0; i < idx->size; i++) {
+			if (idx->slots[i].sfd) {
+				shadow_index_place(new_slots, new_size,
+						idx->slots[i].key,
+						idx->slots[i].sfd);
+			}
+		}
+		free(idx->slots);
+		idx->slots = new_slots;
+		idx->size = new_size;
+	}
+	shadow_index_place(idx->slots, idx->size, key, sfd);
+	idx->count++;
+	return 0;
+}
+static void shadow_index_remove(
+		struct shadow_index *idx, int key, const struct shadow_fd *sfd)
+{
+	if (idx->size == 0) {
+		return;
+	}
+	uint32_t mask = (uint32_t)idx->size - 1;
+	uint32_t i = shadow_index_hash(key) & mask;
+	while (idx->slots[i].sfd) {
+		if (idx->slots[i].key == key && idx->slots[i].sfd == sfd) {
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+	if (!idx->slots[i].sfd) {
+		return;
+	}
+	/* Backward shift deletion: move later entries of the probe run into
+	 * the hole, unless that would place them before their home slot */
+	for (uint32_t j = (i + 1) & mask; idx->slots[j].sfd;
+			j = (j + 1) & mask) {
+		uint32_t home = shadow_index_hash(idx->slots[j].key) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			idx->slots[i] = idx->slots[j];
+			i = j;
+		}
+	}
+	idx->slots[i].sfd = NULL;
+	idx->count--;
+}
+static void shadow_index_clear(struct shadow_index *idx)
+{
+	free(idx->slots);
+	idx->slots = NULL;
+	idx->size = 0;
+	idx->count = 0;
+}
+/** Change the local fd of a shadow structure, updating the map's index. A
+ * value of -1 is not indexed. */
+static void set_local_fd(struct shadow_fd *sfd, int fd)
+{
+	struct shadow_index *idx = &sfd->map->fd_index;
+	if (sfd->fd_local != -1) {
+		shadow_index_remove(idx, sfd->fd_local, sfd);
+	}
+	sfd->fd_local = fd;
+	if (fd != -1 && shadow_index_insert(idx, fd, sfd) == -1) {
+		wp_error("Failed to index RID=%d by local fd %d",
+				sfd->remote_id, fd);
+	}
+}
+
+/* Get the shadow_fd containing a given list link field */
+#define SFD_FROM_LINK(ptr, field)                                              \
+	((struct shadow_fd *)((char *)(ptr) - offsetof(struct shadow_fd, field)))
+static void sfd_list_append(
+		struct shadow_fd_link *head, struct shadow_fd_link *link)
+{
+	if (link->l_next) {
+		return;
+	}
+	link->l_next = head;
+	link->l_prev = head->l_prev;
+	link->l_prev->l_next = link;
+	head->l_prev = link;
+}
+static void sfd_list_remove(struct shadow_fd_link *link)
+{
+	if (!link->l_next) {
+		return;
+	}
+	link->l_prev->l_next = link->l_next;
+	link->l_next->l_prev = link->l_prev;
+	link->l_next = NULL;
+	link->l_prev = NULL;
+}
+static void sfd_list_init(struct shadow_fd_link *head)
+{
+	head->l_next = head;
+	head->l_prev = head;
+}
+
 struct shadow_fd *get_shadow_for_local_fd(
 		struct fd_translation_map *map, int lfd)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		if (cur->fd_local == lfd) {
-			return cur;
-		}
+	if (lfd == -1) {
+		return NULL;
 	}
-	return NULL;
+	return shadow_index_lookup(&map->fd_index, lfd);
 }
 struct shadow_fd *get_shadow_for_rid(struct fd_translation_map *map, int rid)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		if (cur->remote_id == rid) {
-			return cur;
+	return shadow_index_lookup(&map->rid_index, rid);
+}
+static short pipe_poll_events(const struct shadow_fd *sfd, bool check_read)
+{
+	short events = 0;
+	if (check_read && sfd->pipe.readable) {
+		events |= POLLIN;
+	}
+	if (sfd->pipe.send.used > 0) {
+		events |= POLLOUT;
+	}
+	return events;
+}
+/** Register the pipe in the map's watch set, or update the events it is
+ * watched for, if these have changed */
+static void update_pipe_watch(struct shadow_fd *sfd)
+{
+	struct fd_translation_map *map = sfd->map;
+	if (map->pipe_watch_fd == -1 || sfd->pipe.fd == -1 ||
+			sfd->pipe.unwatchable) {
+		return;
+	}
+	short events = pipe_poll_events(sfd, map->pipe_check_read);
+	if (!sfd->pipe.watched) {
+		if (add_to_fd_watch_set(map->pipe_watch_fd, sfd->pipe.fd,
+				    events, sfd) == -1) {
+			/* e.g., regular files are not supported by epoll */
+			wp_debug("Polling pipe RID=%d directly, could not watch it: %s",
+					sfd->remote_id, strerror(errno));
+			sfd->pipe.unwatchable = true;
+			map->npipes_unwatched++;
+			return;
+		}
+		sfd->pipe.watched = true;
+	} else if (events != sfd->pipe.watch_events) {
+		if (modify_fd_watch_set(map->pipe_watch_fd, sfd->pipe.fd,
+				    events, sfd) == -1) {
+			wp_error("Failed to update watch for pipe RID=%d: %s",
+					sfd->remote_id, strerror(errno));
+			return;
 		}
 	}
-	return NULL;
+	sfd->pipe.watch_events = events;
+}
+/** Remove the pipe from the watch set; must be done before pipe.fd is
+ * closed, since the program may still hold the other copy of it */
+static void remove_pipe_watch(struct shadow_fd *sfd)
+{
+	if (sfd->pipe.watched) {
+		remove_from_fd_watch_set(sfd->map->pipe_watch_fd, sfd->pipe.fd);
+		sfd->pipe.watched = false;
+	} else if (sfd->pipe.unwatchable) {
+		sfd->map->npipes_unwatched--;
+		sfd->pipe.unwatchable = false;
+	}
+}
+/** Get the buffer's diff history, creating it if needed; NULL on failure.
+ * This must be called by the main thread, before any task uses it. */
+static struct diff_history *get_diff_history(struct shadow_fd *sfd)
+{
+	if (!sfd->diff_history) {
+		sfd->diff_history = calloc(1, sizeof(struct diff_history));
+		if (!sfd->diff_history) {
+			wp_error("Failed to allocate diff history for RID=%d",
+					sfd->remote_id);
+		}
+	}
+	return sfd->diff_history;
+}
+static void destroy_diff_history(struct diff_history *history)
+{
+	if (!history) {
+		return;
+	}
+#ifdef HAS_ZSTD
+	for (int i = 0; i < DIFF_STREAM_COUNT; i++) {
+		ZSTD_freeCCtx(history->cctx[i]);
+		ZSTD_freeDCtx(history->dctx[i]);
+	}
+#endif
+	free(history);
 }
 static void destroy_unlinked_sfd(struct shadow_fd *sfd)
 {
@@ -80,6 +294,10 @@ static void destroy_unlinked_sfd(struct shadow_fd *sfd)
 	/* free all accumulated damage records */
 	reset_damage(&sfd->damage);
 	free(sfd->damage_task_interval_store);
+	free(sfd->tile_hashes);
+	free(sfd->diff_tuner);
+	free(sfd->planes_tuner);
+	destroy_diff_history(sfd->diff_history);
 
 	if (sfd->type == FDC_FILE) {
 		munmap(sfd->mem_local, sfd->buffer_size);
@@ -96,6 +314,7 @@ static void destroy_unlinked_sfd(struct shadow_fd *sfd)
 					&sfd->dmabuf_warped_handle);
 		}
 	} else if (sfd->type == FDC_PIPE) {
+		remove_pipe_watch(sfd);
 		if (sfd->pipe.fd != sfd->fd_local && sfd->pipe.fd != -1) {
 			checked_close(sfd->pipe.fd);
 		}
@@ -115,8 +334,11 @@ static void cleanup_thread_local(struct thread_data *data)
 #endif
 #ifdef HAS_LZ4
 	free(data->comp_ctx.lz4_extstate);
+	free(data->comp_ctx.lz4_dict_state);
 #endif
 	free(data->tmp_buf);
+	free(data->planes_buf);
+	zeroed_aligned_free(data->stage_buf, &data->stage_handle);
 }
 
 static void setup_thread_local(struct thread_data *data,
@@ -126,6 +348,8 @@ static void setup_thread_local(struct thread_data *data,
 	ctx->zstd_ccontext = NULL;
 	ctx->zstd_dcontext = NULL;
 	ctx->lz4_extstate = NULL;
+	ctx->lz4_extstate_hc = false;
+	ctx->lz4_dict_state = NULL;
 #ifdef HAS_LZ4
 	if (mode == COMP_LZ4) {
 		/* Like LZ4Frame, integer codes indicate compression level.
@@ -136,6 +360,7 @@ static void setup_thread_local(struct thread_data *data,
 		} else {
 			ctx->lz4_extstate = malloc((size_t)LZ4_sizeofStateHC());
 		}
+		ctx->lz4_extstate_hc = compression_level > 0;
 	}
 #endif
 #ifdef HAS_ZSTD
@@ -149,6 +374,10 @@ static void setup_thread_local(struct thread_data *data,
 
 	data->tmp_buf = NULL;
 	data->tmp_size = 0;
+	data->planes_buf = NULL;
+	data->planes_size = 0;
+	data->stage_buf = NULL;
+	data->stage_handle = NULL;
 }
 void cleanup_translation_map(struct fd_translation_map *map)
 {
@@ -158,8 +387,20 @@ void cleanup_translation_map(struct fd_translation_map *map)
 		struct shadow_fd *cur = (struct shadow_fd *)lcur;
 		destroy_unlinked_sfd(cur);
 	}
-	map->link.l_next = &map->link;
-	map->link.l_prev = &map->link;
+	sfd_list_init(&map->link);
+	sfd_list_init(&map->dirty);
+	sfd_list_init(&map->pipes);
+	sfd_list_init(&map->maybe_unref);
+	sfd_list_init(&map->applying);
+	shadow_index_clear(&map->rid_index);
+	shadow_index_clear(&map->fd_index);
+	if (map->pipe_watch_fd != -1) {
+		checked_close(map->pipe_watch_fd);
+		map->pipe_watch_fd = -1;
+	}
+	map->npipes_unwatched = 0;
+	free(map->block_index);
+	map->block_index = NULL;
 }
 bool destroy_shadow_if_unreferenced(struct shadow_fd *sfd)
 {
@@ -170,12 +411,19 @@ bool destroy_shadow_if_unreferenced(struct shadow_fd *sfd)
 		autodelete = true;
 	}
 	if (sfd->refcount.protocol == 0 && sfd->refcount.transfer == 0 &&
-			sfd->refcount.compute == false && autodelete) {
-		/* remove shadowfd from list */
-		sfd->link.l_prev->l_next = sfd->link.l_next;
-		sfd->link.l_next->l_prev = sfd->link.l_prev;
-		sfd->link.l_next = NULL;
-		sfd->link.l_prev = NULL;
+			sfd->refcount.compute == false &&
+			sfd->refcount.apply == false && autodelete) {
+		/* remove shadowfd from list and indices */
+		shadow_index_remove(&sfd->map->rid_index, sfd->remote_id, sfd);
+		if (sfd->fd_local != -1) {
+			shadow_index_remove(&sfd->map->fd_index, sfd->fd_local,
+					sfd);
+		}
+		sfd_list_remove(&sfd->link);
+		sfd_list_remove(&sfd->dirty_link);
+		sfd_list_remove(&sfd->pipe_link);
+		sfd_list_remove(&sfd->maybe_unref_link);
+		sfd_list_remove(&sfd->apply_link);
 
 		destroy_unlinked_sfd(sfd);
 		return true;
@@ -188,27 +436,201 @@ bool destroy_shadow_if_unreferenced(struct shadow_fd *sfd)
 }
 
 static void *worker_thread_main(void *arg);
+int enable_block_dedup(struct fd_translation_map *map)
+{
+	map->block_index = calloc(
+			BLOCK_INDEX_SIZE, sizeof(struct block_index_entry));
+	if (!map->block_index) {
+		wp_error("Failed to allocate block deduplication index");
+		return -1;
+	}
+	return 0;
+}
 void setup_translation_map(struct fd_translation_map *map, bool display_side)
 {
 	map->local_sign = display_side ? -1 : 1;
-	map->link.l_next = &map->link;
-	map->link.l_prev = &map->link;
+	sfd_list_init(&map->link);
+	sfd_list_init(&map->dirty);
+	sfd_list_init(&map->pipes);
+	sfd_list_init(&map->maybe_unref);
+	sfd_list_init(&map->applying);
+	map->pipe_watch_fd = -1;
+	map->npipes_unwatched = 0;
+	map->pipe_check_read = false;
+	map->scroll_copy = false;
+	map->diff_history = false;
+	map->block_index = NULL;
 	map->max_local_id = 1;
+	memset(&map->rid_index, 0, sizeof(map->rid_index));
+	memset(&map->fd_index, 0, sizeof(map->fd_index));
+}
+
+static struct task_ring *create_task_ring(
+		uint32_t capacity, struct task_ring *retired)
+{
+	struct task_ring *ring = calloc(1, sizeof(struct task_ring));
+	if (!ring) {
+		return NULL;
+	}
+	ring->tasks = calloc(capacity, sizeof(struct task_data));
+	if (!ring->tasks) {
+		free(ring);
+		return NULL;
+	}
+	ring->mask = capacity - 1;
+	ring->retired = retired;
+	return ring;
+}
+static void cleanup_task_deque(struct task_deque *q)
+{
+	struct task_ring *ring = atomic_load(&q->ring);
+	while (ring) {
+		struct task_ring *next = ring->retired;
+		free(ring->tasks);
+		free(ring);
+		ring = next;
+	}
+	atomic_store(&q->ring, NULL);
+}
+/** Append a task to the queue, without publishing it. Main thread only. */
+static int task_deque_push(struct task_deque *q, const struct task_data *task)
+{
+	struct task_ring *ring =
+			atomic_load_explicit(&q->ring, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	if (!ring || q->pending_tail - head > ring->mask) {
+		/* Grow the ring. Consumers may concurrently read from the old
+		 * ring, but will only take entries that are also present at
+		 * the same index in the new one. */
+		uint32_t capacity = ring ? 2 * (ring->mask + 1) : 64;
+		struct task_ring *next = create_task_ring(capacity, ring);
+		if (!next) {
+			return -1;
+		}
+		for (uint32_t i = head; i != q->pending_tail; i++) {
+			next->tasks[i & next->mask] =
+					ring->tasks[i & ring->mask];
+		}
+		atomic_store_explicit(&q->ring, next, memory_order_release);
+		ring = next;
+	}
+	ring->tasks[q->pending_tail & ring->mask] = *task;
+	q->pending_tail++;
+	return 0;
+}
+static bool task_deque_take(struct task_deque *q, struct task_data *task)
+{
+	uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	while (1) {
+		uint32_t tail = atomic_load_explicit(
+				&q->tail, memory_order_acquire);
+		if (head == tail) {
+			return false;
+		}
+		struct task_ring *ring = atomic_load_explicit(
+				&q->ring, memory_order_acquire);
+		/* If another thread took this entry first, the slot may be
+		 * overwritten while copying, but then the swap fails */
+		memcpy(task, &ring->tasks[head & ring->mask], sizeof(*task));
+		if (atomic_compare_exchange_weak_explicit(&q->head, &head,
+				    head + 1, memory_order_acq_rel,
+				    memory_order_acquire)) {
+			return true;
+		}
+	}
+}
+/** Take a task from the queue (or if `apply`, the apply_queue) of thread
+ * `self`, or else steal one from another thread's queue */
+static bool take_task(struct thread_pool *pool, int self, bool apply,
+		struct task_data *task)
+{
+	for (int k = 0; k < pool->nthreads; k++) {
+		struct thread_data *data =
+				&pool->threads[(self + k) % pool->nthreads];
+		if (task_deque_take(apply ? &data->apply_queue : &data->queue,
+				    task)) {
+			return true;
+		}
+	}
+	return false;
+}
+static bool has_visible_task(struct thread_pool *pool)
+{
+	for (int i = 0; i < pool->nthreads; i++) {
+		struct task_deque *q = &pool->threads[i].queue;
+		struct task_deque *aq = &pool->threads[i].apply_queue;
+		if (atomic_load(&q->head) != atomic_load(&q->tail) ||
+				atomic_load(&aq->head) !=
+						atomic_load(&aq->tail)) {
+			return true;
+		}
+	}
+	struct task_deque *bq = &pool->background_queue;
+	return atomic_load(&bq->head) != atomic_load(&bq->tail);
+}
+/** Wake up to `count` sleeping workers, after new tasks were published */
+static void wake_workers(struct thread_pool *pool, int count)
+{
+	/* Workers increment `nsleeping` before their final check for tasks,
+	 * and both sides use sequentially consistent operations, so either
+	 * the worker sees the tasks or this sees the worker. */
+	int nwake = min(count, atomic_load(&pool->nsleeping));
+	if (nwake > 0) {
+		pthread_mutex_lock(&pool->sleep_mutex);
+		if (nwake >= atomic_load(&pool->nsleeping)) {
+			pthread_cond_broadcast(&pool->sleep_cond);
+		} else {
+			for (int i = 0; i < nwake; i++) {
+				pthread_cond_signal(&pool->sleep_cond);
+			}
+		}
+		pthread_mutex_unlock(&pool->sleep_mutex);
+	}
+}
+/** Add a task to the pool; it will only be run once start_parallel_work
+ * has been called. Main thread only. */
+static int queue_task(struct thread_pool *pool, const struct task_data *task)
+{
+	/* Slots are numbered in queue order; start_parallel_work will
+	 * provide one for every task */
+	struct task_data slotted = *task;
+	slotted.msg_slot = pool->tasks_unpublished;
+	/* Distribute tasks round robin, so that each worker starts with
+	 * its own share and only steals once that is exhausted */
+	for (int k = 0; k < pool->nthreads; k++) {
+		int i = pool->next_queue;
+		pool->next_queue = (pool->next_queue + 1) % pool->nthreads;
+		if (task_deque_push(&pool->threads[i].queue, &slotted) == 0) {
+			pool->tasks_unpublished++;
+			atomic_fetch_add_explicit(&pool->tasks_pending, 1,
+					memory_order_relaxed);
+			return 0;
+		}
+	}
+	return -1;
+}
+#ifdef HAS_ZSTD
+/** Add a task to the background queue, and publish it right away. Main
+ * thread only; for now, only dictionary training needs this. */
+static int queue_background_task(
+		struct thread_pool *pool, const struct task_data *task)
+{
+	struct task_deque *q = &pool->background_queue;
+	if (task_deque_push(q, task) == -1) {
+		return -1;
+	}
+	atomic_store(&q->tail, q->pending_tail);
+	wake_workers(pool, 1);
+	return 0;
 }
+#endif
 
 static void shutdown_threads(struct thread_pool *pool)
 {
-	pthread_mutex_lock(&pool->work_mutex);
-	free(pool->stack);
-	struct task_data task;
-	memset(&task, 0, sizeof(task));
-	task.type = TASK_STOP;
-	pool->stack = &task;
-	pool->stack_count = 1;
-	pool->stack_size = 1;
-	pool->do_work = true;
-	pthread_cond_broadcast(&pool->work_cond);
-	pthread_mutex_unlock(&pool->work_mutex);
+	atomic_store(&pool->stop, true);
+	pthread_mutex_lock(&pool->sleep_mutex);
+	pthread_cond_broadcast(&pool->sleep_cond);
+	pthread_mutex_unlock(&pool->sleep_mutex);
 
 	if (pool->threads) {
 		for (int i = 1; i < pool->nthreads; i++) {
@@ -217,7 +639,6 @@ static void shutdown_threads(struct thread_pool *pool)
 			}
 		}
 	}
-	pool->stack = NULL;
 }
 
 int setup_thread_pool(struct thread_pool *pool,
@@ -228,6 +649,12 @@ int setup_thread_pool(struct thread_pool *pool,
 
 	pool->diff_func = get_diff_function(
 			DIFF_FASTEST, &pool->diff_alignment_bits);
+	pool->tile_accum_func = get_tile_accum_function(DIFF_FASTEST);
+	get_planes_functions(DIFF_FASTEST, &pool->planes_split_func,
+			&pool->planes_join_func);
+	pool->readback_func = get_readback_function();
+	pool->diff_window = DEFAULT_DIFF_WINDOW;
+	pool->diff_window_adapt = false;
 
 	pool->compression = compression;
 	pool->compression_level = comp_level;
@@ -238,11 +665,21 @@ int setup_thread_pool(struct thread_pool *pool,
 	} else {
 		pool->nthreads = n_threads;
 	}
-	pool->stack_size = 0;
-	pool->stack_count = 0;
-	pool->stack = NULL;
-	pool->tasks_in_progress = 0;
-	pool->do_work = true;
+	atomic_init(&pool->tasks_pending, 0);
+	atomic_init(&pool->apply_pending, 0);
+	atomic_init(&pool->apply_failed, false);
+	atomic_init(&pool->nsleeping, 0);
+	atomic_init(&pool->stop, false);
+	pool->tasks_unpublished = 0;
+	pool->next_queue = 0;
+
+	if (create_event_counter(&pool->completion_r, &pool->completion_w) ==
+			-1) {
+		wp_error("Failed to create task completion counter: %s",
+				strerror(errno));
+		pool->completion_r = -1;
+		pool->completion_w = -1;
+	}
 
 	/* Thread #0 is the 'main' thread */
 	pool->threads = calloc(
@@ -251,50 +688,538 @@ int setup_thread_pool(struct thread_pool *pool,
 		wp_error("Failed to allocate list of thread data");
 		return -1;
 	}
+	for (int i = 0; i < pool->nthreads; i++) {
+		pool->threads[i].pool = pool;
+		pool->threads[i].index = i;
+		atomic_init(&pool->threads[i].queue.head, 0);
+		atomic_init(&pool->threads[i].queue.tail, 0);
+		atomic_init(&pool->threads[i].queue.ring, NULL);
+		atomic_init(&pool->threads[i].apply_queue.head, 0);
+		atomic_init(&pool->threads[i].apply_queue.tail, 0);
+		atomic_init(&pool->threads[i].apply_queue.ring, NULL);
+	}
+	atomic_init(&pool->background_queue.head, 0);
+	atomic_init(&pool->background_queue.tail, 0);
+	atomic_init(&pool->background_queue.ring, NULL);
 
 	int ret;
-	ret = pthread_mutex_init(&pool->work_mutex, NULL);
+	ret = pthread_mutex_init(&pool->sleep_mutex, NULL);
 	if (ret) {
 		wp_error("Mutex creation failed: %s", strerror(ret));
 		return -1;
 	}
-	ret = pthread_cond_init(&pool->work_cond, NULL);
-	if (ret) {
-		wp_error("Condition variable creation failed: %s",
-				strerror(ret));
-		return -1;
+	ret = pthread_cond_init(&pool->sleep_cond, NULL);
+	if (ret) {
+		wp_error("Condition variable creation failed: %s",
+				strerror(ret));
+		return -1;
+	}
+
+	/* Setup thread local data from the main thread, to avoid requiring
+	 * the worker threads to allocate pools, for a few fixed buffers */
+	for (int i = 0; i < pool->nthreads; i++) {
+		setup_thread_local(&pool->threads[i], compression, comp_level);
+	}
+
+	pool->threads[0].thread = pthread_self();
+	for (int i = 1; i < pool->nthreads; i++) {
+		ret = pthread_create(&pool->threads[i].thread, NULL,
+				worker_thread_main, &pool->threads[i]);
+		if (ret) {
+			wp_error("Thread creation failed: %s", strerror(ret));
+			// Stop making new threads, but keep what is there
+			for (int j = i; j < pool->nthreads; j++) {
+				cleanup_thread_local(&pool->threads[j]);
+			}
+			pool->nthreads = i;
+			break;
+		}
+	}
+	return 0;
+}
+static int64_t timespec_diff_ns(struct timespec a, struct timespec b)
+{
+	return (a.tv_sec - b.tv_sec) * 1000000000LL + (a.tv_nsec - b.tv_nsec);
+}
+
+/** Size of the buffer used to time diff kernels */
+#define DIFF_CALIBRATION_SIZE (3u << 16)
+
+/** Return the shortest of several times to diff `local` against a copy of
+ * `orig`, in nanoseconds */
+static int64_t time_diff_kernel(interval_diff_fn_t diff_fn, int alignment_bits,
+		const char *orig, const char *local, char *mirror, char *diff)
+{
+	struct interval all = {.start = 0, .end = DIFF_CALIBRATION_SIZE};
+	int64_t best = INT64_MAX;
+	/* The first run only warms up caches */
+	for (int k = 0; k < 4; k++) {
+		memcpy(mirror, orig, DIFF_CALIBRATION_SIZE);
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		construct_diff_core(diff_fn, alignment_bits,
+				DEFAULT_DIFF_WINDOW, &all, 1, mirror, local,
+				diff);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if (k > 0) {
+			int64_t t = timespec_diff_ns(t1, t0);
+			best = t < best ? t : best;
+		}
+	}
+	return best;
+}
+
+/** Time each available diff kernel on a buffer whose first third is
+ * unchanged, whose middle third has sparse changes, and whose last third is
+ * entirely changed; return the type of the fastest kernel, or DIFF_FASTEST
+ * if timing was not possible */
+static enum diff_type calibrate_diff_kernel(void)
+{
+	static const enum diff_type types[] = {DIFF_AVX512BW, DIFF_AVX512F,
+			DIFF_AVX2, DIFF_NEON, DIFF_SSE3, DIFF_C};
+	const size_t size = DIFF_CALIBRATION_SIZE;
+	void *orig_handle = NULL, *local_handle = NULL, *mirror_handle = NULL;
+	char *orig = zeroed_aligned_alloc(size, 64, &orig_handle);
+	char *local = zeroed_aligned_alloc(size, 64, &local_handle);
+	char *mirror = zeroed_aligned_alloc(size, 64, &mirror_handle);
+	char *diff = malloc(size + 8);
+	enum diff_type fastest = DIFF_FASTEST;
+	if (!orig || !local || !mirror || !diff) {
+		wp_error("Failed to allocate diff kernel calibration buffers");
+		goto end;
+	}
+
+	uint32_t x = 0x12345678;
+	for (size_t i = 0; i < size; i += 4) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		memcpy(orig + i, &x, 4);
+	}
+	memcpy(local, orig, size);
+	for (size_t i = size / 3; i < 2 * size / 3; i += 1024) {
+		local[i] = (char)~local[i];
+	}
+	for (size_t i = 2 * size / 3; i < size; i++) {
+		local[i] = (char)~local[i];
+	}
+
+	int64_t fastest_time = INT64_MAX;
+	for (size_t k = 0; k < sizeof(types) / sizeof(types[0]); k++) {
+		int bits = 0;
+		interval_diff_fn_t diff_fn = get_diff_function(types[k], &bits);
+		if (!diff_fn) {
+			continue;
+		}
+		int64_t t = time_diff_kernel(
+				diff_fn, bits, orig, local, mirror, diff);
+		wp_debug("Diff kernel %s: %.2f GB/s", diff_type_to_str(types[k]),
+				(double)size / (double)t);
+		if (t < fastest_time) {
+			fastest_time = t;
+			fastest = types[k];
+		}
+	}
+end:
+	free(diff);
+	zeroed_aligned_free(mirror, &mirror_handle);
+	zeroed_aligned_free(local, &local_handle);
+	zeroed_aligned_free(orig, &orig_handle);
+	return fastest;
+}
+
+int configure_diff_kernel(
+		struct thread_pool *pool, enum diff_type type, int window)
+{
+	bool forced = type != DIFF_FASTEST;
+	if (!forced) {
+		type = calibrate_diff_kernel();
+	}
+	int bits = 0;
+	interval_diff_fn_t diff_fn = get_diff_function(type, &bits);
+	if (!diff_fn) {
+		return -1;
+	}
+	pool->diff_func = diff_fn;
+	pool->diff_alignment_bits = bits;
+	/* Tile hashes do not depend on the kernel; the portable hash is only
+	 * used if the C kernel was explicitly requested */
+	pool->tile_accum_func = get_tile_accum_function(
+			forced ? type : DIFF_FASTEST);
+	get_planes_functions(forced ? type : DIFF_FASTEST,
+			&pool->planes_split_func, &pool->planes_join_func);
+	pool->diff_window = window > 0 ? max(window, MIN_DIFF_WINDOW)
+				       : DEFAULT_DIFF_WINDOW;
+	pool->diff_window_adapt = window <= 0;
+	if (pool->diff_window_adapt) {
+		wp_debug("Using diff kernel %s, adapting the diff window per buffer",
+				diff_type_to_str(type));
+	} else {
+		wp_debug("Using diff kernel %s, with a diff window of %d words",
+				diff_type_to_str(type), pool->diff_window);
+	}
+	return 0;
+}
+
+/** Compression levels the tuner chooses from; for LZ4, levels <= 0 give
+ * the acceleration of the fast routines, and levels > 0 use LZ4 HC */
+#ifdef HAS_LZ4
+static const int lz4_level_choices[COMPRESSION_CHOICES] = {
+		-64, -16, -4, -1, 3, 6, 9, 12};
+#endif
+#ifdef HAS_ZSTD
+static const int zstd_level_choices[COMPRESSION_CHOICES] = {
+		-7, -3, -1, 1, 3, 5, 9, 15};
+#endif
+/** Frames with less compressed input than this do not update the tuner */
+#define COMPRESSION_TUNE_MIN_INPUT (1u << 16)
+/** Every this many frames, the tuner tries a level next to the best */
+#define COMPRESSION_TUNE_TRIAL_INTERVAL 16
+
+int enable_compression_tuner(struct thread_pool *pool)
+{
+	const int *levels = NULL;
+#ifdef HAS_LZ4
+	if (pool->compression == COMP_LZ4) {
+		levels = lz4_level_choices;
+	}
+#endif
+#ifdef HAS_ZSTD
+	if (pool->compression == COMP_ZSTD) {
+		levels = zstd_level_choices;
+	}
+#endif
+	if (!levels) {
+		return -1;
+	}
+	struct compression_tuner *tuner =
+			calloc(1, sizeof(struct compression_tuner));
+	if (!tuner) {
+		return -1;
+	}
+	tuner->levels = levels;
+	tuner->nlevels = COMPRESSION_CHOICES;
+	/* Start from the choice closest to the configured level */
+	for (int k = 0; k < tuner->nlevels; k++) {
+		tuner->ns_per_byte[k] = -1.f;
+		tuner->ratio[k] = -1.f;
+		if (abs(levels[k] - pool->compression_level) <
+				abs(levels[tuner->choice] -
+						pool->compression_level)) {
+			tuner->choice = k;
+		}
+	}
+	atomic_init(&tuner->input, 0);
+	atomic_init(&tuner->output, 0);
+	atomic_init(&tuner->time_ns, 0);
+	pool->compression_level = levels[tuner->choice];
+	pool->comp_tuner = tuner;
+	return 0;
+}
+
+static void record_compression(struct compression_tuner *tuner, size_t input,
+		size_t output, int64_t time_ns)
+{
+	atomic_fetch_add(&tuner->input, input);
+	atomic_fetch_add(&tuner->output, output);
+	atomic_fetch_add(&tuner->time_ns, time_ns > 0 ? (uint64_t)time_ns : 0);
+}
+
+/** Estimated nanoseconds per input byte to compress and send with level k */
+static float compression_cost(const struct compression_tuner *tuner, int k,
+		int nthreads, double drain_rate)
+{
+	float cost = tuner->ns_per_byte[k] / (float)nthreads;
+	if (drain_rate > 0) {
+		cost += tuner->ratio[k] / (float)drain_rate;
+	}
+	return cost;
+}
+
+void tune_compression(struct thread_pool *pool, double drain_rate)
+{
+	struct compression_tuner *tuner = pool->comp_tuner;
+	if (!tuner) {
+		return;
+	}
+	uint64_t input = atomic_exchange(&tuner->input, 0);
+	uint64_t output = atomic_exchange(&tuner->output, 0);
+	uint64_t time_ns = atomic_exchange(&tuner->time_ns, 0);
+	if (input < COMPRESSION_TUNE_MIN_INPUT) {
+		return;
+	}
+	int k = tuner->choice;
+	float ns_per_byte = (float)time_ns / (float)input;
+	float ratio = (float)output / (float)input;
+	if (tuner->ns_per_byte[k] < 0) {
+		tuner->ns_per_byte[k] = ns_per_byte;
+		tuner->ratio[k] = ratio;
+	} else {
+		tuner->ns_per_byte[k] = 0.75f * tuner->ns_per_byte[k] +
+					0.25f * ns_per_byte;
+		tuner->ratio[k] = 0.75f * tuner->ratio[k] + 0.25f * ratio;
+	}
+
+	/* Costs are recomputed each frame, since the drain rate changes */
+	int best = k;
+	for (int j = 0; j < tuner->nlevels; j++) {
+		if (tuner->ns_per_byte[j] >= 0 &&
+				compression_cost(tuner, j, pool->nthreads,
+						drain_rate) <
+						compression_cost(tuner, best,
+								pool->nthreads,
+								drain_rate)) {
+			best = j;
+		}
+	}
+	int next = best;
+	tuner->nframes++;
+	if (tuner->nframes % COMPRESSION_TUNE_TRIAL_INTERVAL == 0) {
+		/* Alternately try the levels above and below the best */
+		int step = (tuner->nframes / COMPRESSION_TUNE_TRIAL_INTERVAL) %
+						   2
+					   ? 1
+					   : -1;
+		if (best + step < 0 || best + step >= tuner->nlevels) {
+			step = -step;
+		}
+		next = best + step;
+	}
+	if (tuner->levels[next] != pool->compression_level) {
+		wp_debug("Changing compression level from %d to %d, channel drains %.1f MB/s",
+				pool->compression_level, tuner->levels[next],
+				drain_rate * 1e3);
+	}
+	tuner->choice = next;
+	pool->compression_level = tuner->levels[next];
+}
+
+int enable_dict_training(struct thread_pool *pool)
+{
+#ifdef HAS_ZSTD
+	if (pool->compression == COMP_NONE) {
+		return -1;
+	}
+	struct dict_trainer *trainer = calloc(1, sizeof(struct dict_trainer));
+	if (!trainer) {
+		return -1;
+	}
+	trainer->samples = malloc(COMPRESSION_DICT_TRAIN_BYTES);
+	if (!trainer->samples) {
+		free(trainer);
+		return -1;
+	}
+	pthread_mutex_init(&trainer->lock, NULL);
+	atomic_init(&trainer->trained, false);
+	pool->dict_trainer = trainer;
+	return 0;
+#else
+	/* Dictionaries are trained using the Zstd library */
+	(void)pool;
+	return -1;
+#endif
+}
+static void destroy_dict_trainer(struct dict_trainer *trainer)
+{
+	if (!trainer) {
+		return;
+	}
+	pthread_mutex_destroy(&trainer->lock);
+	free(trainer->samples);
+	free(trainer->data);
+	free(trainer);
+}
+static void destroy_compression_dict(struct compression_dict *dict)
+{
+	if (!dict) {
+		return;
+	}
+#ifdef HAS_ZSTD
+	ZSTD_freeCDict(dict->cdict);
+	ZSTD_freeDDict(dict->ddict);
+#endif
+	free(dict->data);
+	free(dict);
+}
+/** Keep a copy of a small diff, until a dictionary has been trained */
+static void add_dict_sample(
+		struct thread_pool *pool, const char *data, size_t size)
+{
+	struct dict_trainer *trainer = pool->dict_trainer;
+	if (!trainer || size == 0 || size > COMPRESSION_DICT_SAMPLE_MAX) {
+		return;
+	}
+	pthread_mutex_lock(&trainer->lock);
+	if (!trainer->training && trainer->count < COMPRESSION_DICT_SAMPLES &&
+			trainer->used + size <= COMPRESSION_DICT_TRAIN_BYTES) {
+		memcpy(trainer->samples + trainer->used, data, size);
+		trainer->sizes[trainer->count++] = size;
+		trainer->used += size;
+	}
+	pthread_mutex_unlock(&trainer->lock);
+}
+#ifdef HAS_ZSTD
+/** Train a dictionary from the collected samples; this may take a while,
+ * and runs as a TASK_TRAIN_DICT task */
+static void train_dict_samples(struct dict_trainer *trainer)
+{
+	char *data = malloc(COMPRESSION_DICT_SIZE);
+	if (!data) {
+		wp_error("Failed to allocate compression dictionary");
+	} else {
+		size_t size = ZDICT_trainFromBuffer(data,
+				COMPRESSION_DICT_SIZE, trainer->samples,
+				trainer->sizes, (unsigned int)trainer->count);
+		if (ZDICT_isError(size)) {
+			wp_debug("Could not train a compression dictionary from %d samples: %s",
+					trainer->count,
+					ZDICT_getErrorName(size));
+			free(data);
+			data = NULL;
+		} else {
+			trainer->size = size;
+		}
+	}
+	trainer->data = data;
+	atomic_store_explicit(&trainer->trained, true, memory_order_release);
+}
+/** Send the dictionary made by train_dict_samples, and use it for the
+ * following messages */
+static void install_compression_dict(struct dict_trainer *trainer,
+		struct thread_pool *pool, struct transfer_queue *transfers)
+{
+	size_t msg_size = sizeof(struct wmsg_basic) + trainer->size;
+	char *msg = calloc(1, alignz(msg_size, 4));
+	struct compression_dict *dict =
+			calloc(1, sizeof(struct compression_dict));
+	if (!msg || !dict) {
+		wp_error("Failed to allocate compression dictionary");
+		goto fail;
 	}
 
-	pool->threads[0].pool = pool;
-	pool->threads[0].thread = pthread_self();
-	for (int i = 1; i < pool->nthreads; i++) {
-		pool->threads[i].pool = pool;
-		ret = pthread_create(&pool->threads[i].thread, NULL,
-				worker_thread_main, &pool->threads[i]);
-		if (ret) {
-			wp_error("Thread creation failed: %s", strerror(ret));
-			// Stop making new threads, but keep what is there
-			pool->nthreads = i;
-			break;
+	struct wmsg_basic header;
+	header.size_and_type = transfer_header(msg_size, WMSG_COMPRESSION_DICT);
+	header.remote_id = 0;
+	memcpy(msg, &header, sizeof(header));
+	memcpy(msg + sizeof(header), trainer->data, trainer->size);
+	if (transfer_add(transfers, alignz(msg_size, 4), msg) == -1) {
+		wp_error("Failed to queue compression dictionary");
+		goto fail;
+	}
+	wp_debug("Trained a %zu byte compression dictionary from %d samples (%zu bytes)",
+			trainer->size, trainer->count, trainer->used);
+	dict->data = trainer->data;
+	dict->size = trainer->size;
+	trainer->data = NULL;
+	pool->tx_dict = dict;
+#ifdef HAS_LZ4
+	if (pool->compression == COMP_LZ4) {
+		/* Loaded once for each thread, not for each message */
+		for (int i = 0; i < pool->nthreads; i++) {
+			struct comp_ctx *ctx = &pool->threads[i].comp_ctx;
+			ctx->lz4_dict_state = malloc(sizeof(LZ4_stream_t));
+			if (ctx->lz4_dict_state) {
+				LZ4_loadDict(ctx->lz4_dict_state, dict->data,
+						(int)dict->size);
+			}
 		}
 	}
+#endif
+	return;
+fail:
+	free(msg);
+	free(dict);
+}
+#endif
+void update_compression_dict(
+		struct thread_pool *pool, struct transfer_queue *transfers)
+{
+#ifdef HAS_ZSTD
+	struct dict_trainer *trainer = pool->dict_trainer;
+	/* Train once no further sample can be guaranteed to fit */
+	const size_t fill_limit = COMPRESSION_DICT_TRAIN_BYTES -
+				  COMPRESSION_DICT_SAMPLE_MAX;
+	if (trainer && !trainer->training &&
+			(trainer->count == COMPRESSION_DICT_SAMPLES ||
+					trainer->used > fill_limit)) {
+		pthread_mutex_lock(&trainer->lock);
+		trainer->training = true;
+		pthread_mutex_unlock(&trainer->lock);
 
-	/* Setup thread local data from the main thread, to avoid requiring
-	 * the worker threads to allocate pools, for a few fixed buffers */
-	for (int i = 0; i < pool->nthreads; i++) {
-		setup_thread_local(&pool->threads[i], compression, comp_level);
+		struct task_data task;
+		memset(&task, 0, sizeof(task));
+		task.type = TASK_TRAIN_DICT;
+		task.trainer = trainer;
+		if (pool->nthreads == 1 ||
+				queue_background_task(pool, &task) == -1) {
+			/* Without worker threads, train right away */
+			train_dict_samples(trainer);
+		}
+	}
+	/* The dictionary is installed between frames, so that all the
+	 * updates of a frame use the same dictionary */
+	if (trainer && trainer->training &&
+			atomic_load_explicit(&trainer->trained,
+					memory_order_acquire)) {
+		if (trainer->data) {
+			install_compression_dict(trainer, pool, transfers);
+		}
+		pool->dict_trainer = NULL;
+		destroy_dict_trainer(trainer);
 	}
 
-	int fds[2];
-	if (pipe(fds) == -1) {
-		wp_error("Failed to create pipe: %s", strerror(errno));
+	struct compression_dict *dict = pool->tx_dict;
+	int level = pool->compression_level;
+	if (dict && pool->compression == COMP_ZSTD &&
+			(!dict->cdict || dict->cdict_level != level)) {
+		/* A CDict has a fixed level, so it is remade when the
+		 * compression tuner changes the level. Without it, messages are
+		 * compressed without the dictionary, which is still valid. */
+		ZSTD_freeCDict(dict->cdict);
+		dict->cdict = ZSTD_createCDict(dict->data, dict->size, level);
+		dict->cdict_level = level;
 	}
-	pool->selfpipe_r = fds[0];
-	pool->selfpipe_w = fds[1];
-	if (set_nonblocking(pool->selfpipe_r) == -1) {
-		wp_error("Failed to make read end of pipe nonblocking: %s",
-				strerror(errno));
+#else
+	(void)pool;
+	(void)transfers;
+#endif
+}
+/** Use the dictionary of a WMSG_COMPRESSION_DICT message for the fills and
+ * diffs that are received after it */
+static int receive_compression_dict(
+		struct thread_pool *pool, const struct bytebuf *msg)
+{
+	size_t size = msg->size - sizeof(struct wmsg_basic);
+	if (size > COMPRESSION_DICT_SIZE) {
+		wp_error("Received compression dictionary is too large, %zu > %u bytes",
+				size, COMPRESSION_DICT_SIZE);
+		return ERR_FATAL;
+	}
+	struct compression_dict *dict =
+			calloc(1, sizeof(struct compression_dict));
+	if (!dict) {
+		return ERR_NOMEM;
+	}
+	dict->data = malloc(size);
+	if (!dict->data) {
+		free(dict);
+		return ERR_NOMEM;
 	}
+	memcpy(dict->data, msg->data + sizeof(struct wmsg_basic), size);
+	dict->size = size;
+#ifdef HAS_ZSTD
+	if (pool->compression == COMP_ZSTD) {
+		dict->ddict = ZSTD_createDDict(dict->data, dict->size);
+		if (!dict->ddict) {
+			wp_error("Failed to load received compression dictionary");
+			destroy_compression_dict(dict);
+			return ERR_NOMEM;
+		}
+	}
+#endif
+	wp_debug("Received a %zu byte compression dictionary", size);
+	destroy_compression_dict(pool->rx_dict);
+	pool->rx_dict = dict;
 	return 0;
 }
 void cleanup_thread_pool(struct thread_pool *pool)
@@ -303,16 +1228,27 @@ void cleanup_thread_pool(struct thread_pool *pool)
 	if (pool->threads) {
 		for (int i = 0; i < pool->nthreads; i++) {
 			cleanup_thread_local(&pool->threads[i]);
+			cleanup_task_deque(&pool->threads[i].queue);
+			cleanup_task_deque(&pool->threads[i].apply_queue);
 		}
 	}
+	cleanup_task_deque(&pool->background_queue);
 
-	pthread_mutex_destroy(&pool->work_mutex);
-	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->sleep_mutex);
+	pthread_cond_destroy(&pool->sleep_cond);
 	free(pool->threads);
-	free(pool->stack);
+	free(pool->comp_tuner);
+	destroy_dict_trainer(pool->dict_trainer);
+	destroy_compression_dict(pool->tx_dict);
+	destroy_compression_dict(pool->rx_dict);
 
-	checked_close(pool->selfpipe_r);
-	checked_close(pool->selfpipe_w);
+	if (pool->completion_r != -1) {
+		checked_close(pool->completion_r);
+	}
+	if (pool->completion_w != -1 &&
+			pool->completion_w != pool->completion_r) {
+		checked_close(pool->completion_w);
+	}
 }
 
 const char *fdcat_to_str(enum fdcat cat)
@@ -430,6 +1366,10 @@ static void compress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 	}
 
 	DTRACE_PROBE1(waypipe, compress_buffer_enter, isize);
+	struct timespec t_start;
+	if (pool->comp_tuner) {
+		clock_gettime(CLOCK_MONOTONIC, &t_start);
+	}
 	switch (pool->compression) {
 	default:
 	case COMP_NONE:
@@ -441,7 +1381,25 @@ static void compress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 #ifdef HAS_LZ4
 	case COMP_LZ4: {
 		int ws;
-		if (pool->compression_level <= 0) {
+		if (pool->compression_level > 0 && !ctx->lz4_extstate_hc) {
+			/* The level was raised by the compression tuner */
+			free(ctx->lz4_extstate);
+			ctx->lz4_extstate = malloc((size_t)LZ4_sizeofStateHC());
+			ctx->lz4_extstate_hc = true;
+		}
+		if (!ctx->lz4_extstate) {
+			ws = 0;
+		} else if (pool->compression_level <= 0 &&
+				ctx->lz4_dict_state) {
+			/* Copying the loaded dictionary is much faster than
+			 * loading it again. The HC state is too large to copy
+			 * for each message, so only the fast levels use it. */
+			LZ4_stream_t *stream = (LZ4_stream_t *)ctx->lz4_extstate;
+			memcpy(stream, ctx->lz4_dict_state, sizeof(LZ4_stream_t));
+			ws = LZ4_compress_fast_continue(stream, ibuf, mbuf,
+					(int)isize, (int)msize,
+					-pool->compression_level);
+		} else if (pool->compression_level <= 0) {
 			ws = LZ4_compress_fast_extState(ctx->lz4_extstate, ibuf,
 					mbuf, (int)isize, (int)msize,
 					-pool->compression_level);
@@ -461,8 +1419,15 @@ static void compress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 #endif
 #ifdef HAS_ZSTD
 	case COMP_ZSTD: {
-		size_t ws = ZSTD_compressCCtx(ctx->zstd_ccontext, mbuf, msize,
-				ibuf, isize, pool->compression_level);
+		size_t ws;
+		if (pool->tx_dict && pool->tx_dict->cdict) {
+			ws = ZSTD_compress_usingCDict(ctx->zstd_ccontext, mbuf,
+					msize, ibuf, isize,
+					pool->tx_dict->cdict);
+		} else {
+			ws = ZSTD_compressCCtx(ctx->zstd_ccontext, mbuf, msize,
+					ibuf, isize, pool->compression_level);
+		}
 		if (ZSTD_isError(ws)) {
 			wp_error("Zstd compression failed for %d bytes in %d of space: %s",
 					(int)isize, (int)msize,
@@ -474,6 +1439,12 @@ static void compress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 	}
 #endif
 	}
+	if (pool->comp_tuner) {
+		struct timespec t_end;
+		clock_gettime(CLOCK_MONOTONIC, &t_end);
+		record_compression(pool->comp_tuner, isize, dst->size,
+				timespec_diff_ns(t_end, t_start));
+	}
 	DTRACE_PROBE1(waypipe, compress_buffer_exit, dst->size);
 }
 /* With the selected compression method, uncompress the buffer {isize,ibuf},
@@ -502,8 +1473,16 @@ static void uncompress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 		break;
 #ifdef HAS_LZ4
 	case COMP_LZ4: {
-		int ws = LZ4_decompress_safe(
-				ibuf, mbuf, (int)isize, (int)msize);
+		int ws;
+		if (pool->rx_dict) {
+			ws = LZ4_decompress_safe_usingDict(ibuf, mbuf,
+					(int)isize, (int)msize,
+					pool->rx_dict->data,
+					(int)pool->rx_dict->size);
+		} else {
+			ws = LZ4_decompress_safe(
+					ibuf, mbuf, (int)isize, (int)msize);
+		}
 		if (ws < 0 || (size_t)ws != msize) {
 			wp_error("Lz4 decompression failed for %d bytes to %d of space, used %d",
 					(int)isize, (int)msize, ws);
@@ -515,8 +1494,15 @@ static void uncompress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 #endif
 #ifdef HAS_ZSTD
 	case COMP_ZSTD: {
-		size_t ws = ZSTD_decompressDCtx(
-				ctx->zstd_dcontext, mbuf, msize, ibuf, isize);
+		size_t ws;
+		if (pool->rx_dict && pool->rx_dict->ddict) {
+			ws = ZSTD_decompress_usingDDict(ctx->zstd_dcontext,
+					mbuf, msize, ibuf, isize,
+					pool->rx_dict->ddict);
+		} else {
+			ws = ZSTD_decompressDCtx(ctx->zstd_dcontext, mbuf,
+					msize, ibuf, isize);
+		}
 		if (ZSTD_isError(ws) || (size_t)ws != msize) {
 			wp_error("Zstd decompression failed for %d bytes to %d of space: %s",
 					(int)isize, (int)msize,
@@ -554,20 +1540,33 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
 		wp_error("Failed to allocate shadow_fd structure");
 		return NULL;
 	}
+	sfd->fd_local = fd;
+	sfd->remote_id = (map->max_local_id++) * map->local_sign;
+	if (shadow_index_insert(&map->rid_index, sfd->remote_id, sfd) == -1) {
+		free(sfd);
+		return NULL;
+	}
+	if (shadow_index_insert(&map->fd_index, fd, sfd) == -1) {
+		shadow_index_remove(&map->rid_index, sfd->remote_id, sfd);
+		free(sfd);
+		return NULL;
+	}
+	sfd->map = map;
 	sfd->link.l_prev = &map->link;
 	sfd->link.l_next = map->link.l_next;
 	sfd->link.l_prev->l_next = &sfd->link;
 	sfd->link.l_next->l_prev = &sfd->link;
 
-	sfd->fd_local = fd;
 	sfd->mem_local = NULL;
 	sfd->mem_mirror = NULL;
 	sfd->mem_mirror_handle = NULL;
 	sfd->buffer_size = 0;
-	sfd->remote_id = (map->max_local_id++) * map->local_sign;
 	sfd->type = type;
 	// File changes must be propagated
-	sfd->is_dirty = true;
+	mark_shadow_dirty(sfd);
+	if (type == FDC_PIPE) {
+		sfd_list_append(&map->pipes, &sfd->pipe_link);
+	}
 	/* files/dmabufs are damaged by default; shm_pools are explicitly
 	 * undamaged in handlers.c */
 	damage_everything(&sfd->damage);
@@ -645,6 +1644,7 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
 				sfd->pipe.can_write = true;
 			}
 		}
+		update_pipe_watch(sfd);
 	} break;
 	case FDC_DMAVID_IR: {
 		sfd->video_fmt = render->av_video_fmt;
@@ -711,6 +1711,545 @@ static void *shrink_buffer(void *buf, size_t sz)
 	}
 }
 
+/** Compress `size` bytes from `data` into a new message, leaving space for
+ * a header of `header_size` bytes, and set `*msg_size` to its unpadded size.
+ * Returns NULL if the data did not compress to 7/8 of its size or less, in
+ * which case it is better sent raw. */
+static char *compress_stream_data(struct thread_pool *pool,
+		struct comp_ctx *ctx, const char *data, size_t size,
+		size_t header_size, size_t *msg_size)
+{
+	size_t comp_size = compress_bufsize(pool, size);
+	char *msg = malloc(alignz(header_size + comp_size, 4));
+	if (!msg) {
+		return NULL;
+	}
+	struct bytebuf dst;
+	compress_buffer(pool, ctx, size, data, comp_size, msg + header_size,
+			&dst);
+	if (dst.size == 0 || dst.size > size - size / 8) {
+		free(msg);
+		return NULL;
+	}
+	*msg_size = header_size + dst.size;
+	msg = shrink_buffer(msg, alignz(*msg_size, 4));
+	memset(msg + *msg_size, 0, alignz(*msg_size, 4) - *msg_size);
+	return msg;
+}
+
+int enable_stream_compression(struct thread_pool *pool)
+{
+	if (pool->compression == COMP_NONE) {
+		return -1;
+	}
+	pool->compress_streams = true;
+	return 0;
+}
+
+int enable_plane_split(struct thread_pool *pool)
+{
+	if (pool->compression == COMP_NONE) {
+		return -1;
+	}
+	pool->split_planes = true;
+	return 0;
+}
+
+void *compress_protocol_block(struct thread_pool *pool, const char *data,
+		size_t size, size_t *msg_size)
+{
+	if (!pool->compress_streams || size < STREAM_COMPRESS_MIN) {
+		return NULL;
+	}
+	size_t sz = 0;
+	char *msg = compress_stream_data(pool, &pool->threads[0].comp_ctx, data,
+			size, sizeof(struct wmsg_protocol_compressed), &sz);
+	if (!msg) {
+		return NULL;
+	}
+	struct wmsg_protocol_compressed header;
+	header.size_and_type = transfer_header(sz, WMSG_PROTOCOL_COMPRESSED);
+	header.raw_size = (uint32_t)size;
+	memcpy(msg, &header, sizeof(header));
+	*msg_size = alignz(sz, 4);
+	return msg;
+}
+
+int uncompress_protocol_block(struct thread_pool *pool,
+		const struct bytebuf *msg, struct char_window *dst)
+{
+	const size_t header_size = sizeof(struct wmsg_protocol_compressed);
+	if (msg->size < header_size) {
+		wp_error("WMSG_PROTOCOL_COMPRESSED message is too short, %zu bytes",
+				msg->size);
+		return -1;
+	}
+	if (pool->compression == COMP_NONE) {
+		wp_error("Received WMSG_PROTOCOL_COMPRESSED, but compression is disabled");
+		return -1;
+	}
+	const struct wmsg_protocol_compressed *header =
+			(const struct wmsg_protocol_compressed *)msg->data;
+	if (header->raw_size >= (1u << 30) ||
+			buf_ensure_size((int)header->raw_size, 1, &dst->size,
+					(void **)&dst->data) == -1) {
+		wp_error("Failed to allocate %u bytes for protocol data",
+				header->raw_size);
+		return -1;
+	}
+	size_t act_size = 0;
+	const char *act_buffer = NULL;
+	uncompress_buffer(pool, &pool->threads[0].comp_ctx,
+			msg->size - header_size, msg->data + header_size,
+			header->raw_size, dst->data, &act_size, &act_buffer);
+	if (act_size != header->raw_size) {
+		return -1;
+	}
+	dst->zone_start = 0;
+	dst->zone_end = (int)act_size;
+	return 0;
+}
+
+/** Replace the WMSG_PIPE_TRANSFER message `msg` with a compressed version,
+ * if the data compresses well; otherwise keep it, and send the next few
+ * transfers of the pipe raw. */
+static void compress_pipe_transfer(struct thread_pool *pool,
+		struct comp_ctx *ctx, struct shadow_fd *sfd,
+		struct bytebuf *msg)
+{
+	const struct wmsg_basic *raw = (const struct wmsg_basic *)msg->data;
+	size_t raw_size = transfer_size(raw->size_and_type) -
+			  sizeof(struct wmsg_basic);
+	size_t sz = 0;
+	char *comp = compress_stream_data(pool, ctx,
+			msg->data + sizeof(struct wmsg_basic), raw_size,
+			sizeof(struct wmsg_pipe_transfer_compressed), &sz);
+	if (!comp) {
+		sfd->pipe.compress_skip = STREAM_COMPRESS_SKIP;
+		return;
+	}
+	struct wmsg_pipe_transfer_compressed header;
+	header.size_and_type =
+			transfer_header(sz, WMSG_PIPE_TRANSFER_COMPRESSED);
+	header.remote_id = sfd->remote_id;
+	header.raw_size = (uint32_t)raw_size;
+	memcpy(comp, &header, sizeof(header));
+	free(msg->data);
+	msg->data = comp;
+	msg->size = alignz(sz, 4);
+}
+
+/** Add the WMSG_PIPE_TRANSFER message `msg`, holding `data_size` bytes of
+ * pipe data, to `transfers`; if enabled, it is first compressed on the thread
+ * pool. If `in_order`, further messages for the pipe follow in this batch,
+ * so the message is compressed right away to stay ahead of them. */
+static void queue_pipe_transfer(struct thread_pool *threads,
+		struct shadow_fd *sfd, struct transfer_queue *transfers,
+		struct bytebuf msg, size_t data_size, bool in_order)
+{
+	if (!threads || !threads->compress_streams ||
+			data_size < STREAM_COMPRESS_MIN) {
+		transfer_add(transfers, msg.size, msg.data);
+		return;
+	}
+	if (sfd->pipe.compress_skip > 0) {
+		sfd->pipe.compress_skip--;
+		transfer_add(transfers, msg.size, msg.data);
+		return;
+	}
+	if (!in_order) {
+		struct task_data task;
+		memset(&task, 0, sizeof(task));
+		task.type = TASK_COMPRESS_PIPE;
+		task.sfd = sfd;
+		task.msg_queue = &transfers->async_recv_queue;
+		task.pipe_msg = msg;
+		if (queue_task(threads, &task) == 0) {
+			/* Keep sfd alive until the task is done */
+			sfd->refcount.compute = true;
+			sfd_list_append(&sfd->map->maybe_unref,
+					&sfd->maybe_unref_link);
+			return;
+		}
+	}
+	compress_pipe_transfer(threads, &threads->threads[0].comp_ctx, sfd,
+			&msg);
+	transfer_add(transfers, msg.size, msg.data);
+}
+
+/** Streamed diffs are made from at most this many bytes of damage at a
+ * time; parts start at multiples of this size, which is a multiple of
+ * DIFF_TILE_SIZE, so that tiles are never split between parts */
+#define DIFF_STREAM_CHUNK (1u << 16)
+
+/** Size of the cacheable tile into which DMABUF contents are read back */
+#define DIFF_STAGE_SIZE (1u << 16)
+
+/** How a worker reads the current contents of a buffer to diff them */
+enum diff_source {
+	/* From mem_local, or dmabuf_warped if the DMABUF stride differs */
+	DIFF_SOURCE_DIRECT,
+	/* Row by row from a DMABUF mapping with a different stride */
+	DIFF_SOURCE_STRIDED,
+	/* Copied out of a DMABUF mapping, a tile at a time */
+	DIFF_SOURCE_STAGED,
+};
+
+/** Returns true if a DMABUF whose mapping has a different stride than the
+ * data sent for it can be diffed directly from the mapping */
+static bool can_diff_strided(
+		const struct thread_pool *pool, const struct shadow_fd *sfd)
+{
+	size_t alignment = 1u << pool->diff_alignment_bits;
+	return sfd->dmabuf_info.strides[0] % alignment == 0 &&
+	       sfd->dmabuf_map_stride % alignment == 0 &&
+	       sfd->buffer_size % alignment == 0 &&
+	       (uintptr_t)sfd->mem_local % alignment == 0;
+}
+
+static enum diff_source get_diff_source(
+		const struct thread_pool *pool, const struct shadow_fd *sfd)
+{
+	if (sfd->type != FDC_DMABUF) {
+		return DIFF_SOURCE_DIRECT;
+	}
+	/* Mappings of DMABUFs are often uncached or write-combined, so
+	 * that the diff kernels would read them slowly */
+	if (pool->readback_func) {
+		return DIFF_SOURCE_STAGED;
+	}
+	if (sfd->dmabuf_map_stride != sfd->dmabuf_info.strides[0] &&
+			can_diff_strided(pool, sfd)) {
+		return DIFF_SOURCE_STRIDED;
+	}
+	return DIFF_SOURCE_DIRECT;
+}
+
+/** Copy bytes [start, end) of a DMABUF, laid out with the stride of the data
+ * sent, from its mapping to `dst`. Bytes which the mapping does not have are
+ * taken from the mirror. If `readback` is NULL, memcpy is used. */
+static void readback_dmabuf(readback_fn_t readback,
+		const struct shadow_fd *sfd, char *dst, size_t start,
+		size_t end)
+{
+	size_t tx_stride = sfd->dmabuf_info.strides[0];
+	size_t map_stride = sfd->dmabuf_map_stride;
+	size_t row_length = minu(tx_stride, map_stride);
+	for (size_t pos = start; pos < end;) {
+		size_t row = pos / tx_stride, col = pos % tx_stride;
+		size_t stop = minu(end, (row + 1) * tx_stride);
+		if (map_stride == tx_stride) {
+			stop = end;
+		} else if (col >= row_length) {
+			/* A no-op when reading back into the mirror itself */
+			if (dst + (pos - start) != sfd->mem_mirror + pos) {
+				memcpy(dst + (pos - start),
+						sfd->mem_mirror + pos,
+						stop - pos);
+			}
+			pos = stop;
+			continue;
+		} else {
+			stop = minu(stop, row * tx_stride + row_length);
+		}
+		const char *src = sfd->mem_local + row * map_stride + col;
+		if (readback) {
+			(*readback)(dst + (pos - start), src, stop - pos);
+		} else {
+			memcpy(dst + (pos - start), src, stop - pos);
+		}
+		pos = stop;
+	}
+}
+
+/** Upper bound on the size of the diff of `range` damaged bytes */
+static size_t diff_space(const struct shadow_fd *sfd, enum diff_source mode,
+		size_t range)
+{
+	size_t space = range + 8;
+	if (sfd->tile_hashes) {
+		/* Each tile may be diffed separately */
+		space += 8 * (range / DIFF_TILE_SIZE + 1);
+	}
+	if (mode == DIFF_SOURCE_STRIDED) {
+		/* And each row, when diffing from a DMABUF mapping */
+		space += 8 * (range / sfd->dmabuf_info.strides[0] + 2);
+	} else if (mode == DIFF_SOURCE_STAGED) {
+		space += 8 * (range / DIFF_STAGE_SIZE + 1);
+	}
+	return space;
+}
+
+/** Diff intervals of `source` against the mirror, returning the diff size */
+static size_t diff_intervals(struct thread_data *local, struct shadow_fd *sfd,
+		int diff_window, const char *source, enum diff_source mode,
+		const struct interval *intervals, int n_intervals, char *diff)
+{
+	struct thread_pool *pool = local->pool;
+	if (mode == DIFF_SOURCE_STAGED) {
+		size_t diffsize = 0;
+		for (int i = 0; i < n_intervals; i++) {
+			size_t start = (size_t)intervals[i].start;
+			size_t end = (size_t)intervals[i].end;
+			while (start < end) {
+				size_t stop = minu(end,
+						start + DIFF_STAGE_SIZE);
+				readback_dmabuf(pool->readback_func, sfd,
+						local->stage_buf, start, stop);
+				/* Offset the tile to line up with the mirror */
+				uintptr_t shifted = (uintptr_t)local->stage_buf -
+						    start;
+				struct interval part = {.start = (int32_t)start,
+						.end = (int32_t)stop};
+				diffsize += construct_diff_core(pool->diff_func,
+						pool->diff_alignment_bits,
+						diff_window, &part, 1,
+						sfd->mem_mirror,
+						(const void *)shifted,
+						diff + diffsize);
+				start = stop;
+			}
+		}
+		return diffsize;
+	} else if (mode == DIFF_SOURCE_STRIDED) {
+		size_t tx_stride = sfd->dmabuf_info.strides[0];
+		return construct_diff_strided(pool->diff_func,
+				pool->diff_alignment_bits, diff_window,
+				intervals, n_intervals, sfd->mem_mirror, source,
+				tx_stride, sfd->dmabuf_map_stride,
+				minu(tx_stride, sfd->dmabuf_map_stride), diff);
+	} else if (sfd->tile_hashes) {
+		return construct_diff_tiled(pool->diff_func,
+				pool->diff_alignment_bits, diff_window,
+				intervals, n_intervals, sfd->mem_mirror, source,
+				diff, pool->tile_accum_func, sfd->tile_hashes);
+	} else {
+		return construct_diff_core(pool->diff_func,
+				pool->diff_alignment_bits, diff_window,
+				intervals, n_intervals, sfd->mem_mirror, source,
+				diff);
+	}
+}
+
+/** Diff the bytes after the last aligned position in the buffer */
+static size_t diff_trailing(struct thread_data *local, struct shadow_fd *sfd,
+		const char *source, enum diff_source mode, char *diff)
+{
+	struct thread_pool *pool = local->pool;
+	if (mode == DIFF_SOURCE_STAGED) {
+		size_t alignment = 1u << pool->diff_alignment_bits;
+		size_t start = sfd->buffer_size - sfd->buffer_size % alignment;
+		readback_dmabuf(pool->readback_func, sfd, local->stage_buf,
+				start, sfd->buffer_size);
+		source = (const char *)((uintptr_t)local->stage_buf - start);
+	}
+	return construct_diff_trailing(sfd->buffer_size,
+			pool->diff_alignment_bits, sfd->mem_mirror, source,
+			diff);
+}
+
+#ifdef HAS_ZSTD
+/** Feed `size` bytes to the Zstd stream; returns -1 if `out` is too small */
+static int stream_feed(ZSTD_CCtx *cctx, ZSTD_outBuffer *out, const char *data,
+		size_t size, ZSTD_EndDirective mode,
+		struct compression_tuner *tuner)
+{
+	ZSTD_inBuffer in = {.src = data, .size = size, .pos = 0};
+	size_t out_start = out->pos;
+	struct timespec t_start;
+	if (tuner) {
+		clock_gettime(CLOCK_MONOTONIC, &t_start);
+	}
+	int ret = 0;
+	while (1) {
+		size_t r = ZSTD_compressStream2(cctx, out, &in, mode);
+		if (ZSTD_isError(r)) {
+			wp_error("Zstd stream compression failed: %s",
+					ZSTD_getErrorName(r));
+			ret = -1;
+			break;
+		}
+		bool done = mode == ZSTD_e_continue ? in.pos == in.size
+						    : r == 0;
+		if (done) {
+			break;
+		}
+		if (out->pos == out->size) {
+			wp_error("Zstd stream compression ran out of space");
+			ret = -1;
+			break;
+		}
+	}
+	if (tuner) {
+		struct timespec t_end;
+		clock_gettime(CLOCK_MONOTONIC, &t_end);
+		record_compression(tuner, size, out->pos - out_start,
+				timespec_diff_ns(t_end, t_start));
+	}
+	return ret;
+}
+
+/** Get the context for the task's diff history stream, preparing to restart
+ * the stream if the other side does not have its start yet, or if the
+ * compression level changed (which Zstd only applies to new frames).
+ * Returns NULL if no context could be made. */
+static ZSTD_CCtx *open_history_stream(struct diff_history *history,
+		int stream, int level, bool *restart)
+{
+	ZSTD_CCtx *cctx = history->cctx[stream];
+	*restart = !history->started[stream] ||
+		   history->level[stream] != level;
+	if (cctx && !*restart) {
+		return cctx;
+	}
+	if (!cctx) {
+		cctx = ZSTD_createCCtx();
+		if (!cctx) {
+			return NULL;
+		}
+		history->cctx[stream] = cctx;
+	}
+	ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog,
+			DIFF_HISTORY_WINDOW_LOG);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_hashLog, DIFF_HISTORY_TABLE_LOG);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_chainLog, DIFF_HISTORY_TABLE_LOG);
+	history->started[stream] = false;
+	history->level[stream] = level;
+	return cctx;
+}
+
+/** Construct the diff for a task in parts of at most DIFF_STREAM_CHUNK bytes
+ * of damage, passing each part to a Zstd stream as soon as it is made, so
+ * that the uncompressed diff is only ever held in a small buffer which stays
+ * in cache. The stream is ended, or for history streams flushed, with
+ * `last`. The compressed data is written to `dst`; returns its length, or 0
+ * if it did not fit. */
+static size_t stream_compress_diff(struct task_data *task,
+		struct thread_data *local, ZSTD_CCtx *cctx,
+		ZSTD_EndDirective last, const char *source,
+		enum diff_source mode, char *dst, size_t dst_size,
+		size_t *diffsize, size_t *ntrailing)
+{
+	struct shadow_fd *sfd = task->sfd;
+	struct thread_pool *pool = local->pool;
+	char *part = local->tmp_buf;
+	ZSTD_outBuffer out = {.dst = dst, .size = dst_size, .pos = 0};
+	bool failed = false;
+
+	*diffsize = 0;
+	*ntrailing = 0;
+	for (int i = 0; i < task->damage_len; i++) {
+		size_t start = (size_t)task->damage_intervals[i].start;
+		size_t end = (size_t)task->damage_intervals[i].end;
+		while (start < end) {
+			size_t next = start - start % DIFF_STREAM_CHUNK +
+				      DIFF_STREAM_CHUNK;
+			size_t stop = minu(end, next);
+			struct interval range = {.start = (int32_t)start,
+					.end = (int32_t)stop};
+			size_t n = diff_intervals(local, sfd,
+					task->diff_window, source, mode, &range,
+					1, part);
+			add_dict_sample(pool, part, n);
+			/* Keep the mirror in sync even if compression fails */
+			if (n > 0 && !failed) {
+				failed = stream_feed(cctx, &out, part, n,
+							 ZSTD_e_continue,
+							 pool->comp_tuner) == -1;
+			}
+			*diffsize += n;
+			start = stop;
+		}
+	}
+	if (task->damaged_end) {
+		*ntrailing = diff_trailing(local, sfd, source, mode, part);
+	}
+	if (*diffsize + *ntrailing == 0) {
+		return 0;
+	}
+	if (!failed) {
+		failed = stream_feed(cctx, &out, part, *ntrailing, last,
+					 pool->comp_tuner) == -1;
+	}
+	return failed ? 0 : out.pos;
+}
+#endif
+
+/** Compress `size` bytes of buffer data into `dst`, which has space for
+ * compress_bufsize(pool, size) bytes, first splitting them into byte planes
+ * if the task says to. Sets `split` to whether the output is of planes, and
+ * returns its size. */
+static size_t compress_pixels(struct task_data *task,
+		struct thread_data *local, const char *data, size_t size,
+		char *dst, size_t dst_space, bool *split)
+{
+	struct thread_pool *pool = local->pool;
+	struct bytebuf out;
+	*split = false;
+	if (task->planes == PLANES_OFF) {
+		compress_buffer(pool, &local->comp_ctx, size, data, dst_space,
+				dst, &out);
+		return out.size;
+	}
+	/* Trials need space for a second output, after the planes */
+	bool trial = task->planes == PLANES_TRIAL;
+	size_t planes_space = alignz(size, 64);
+	size_t space = planes_space + (trial ? dst_space : 0);
+	if (buf_ensure_size((int)space, 1, &local->planes_size,
+			    &local->planes_buf) == -1) {
+		wp_error("Failed to allocate byte plane buffer, not splitting planes");
+		compress_buffer(pool, &local->comp_ctx, size, data, dst_space,
+				dst, &out);
+		return out.size;
+	}
+	char *planes = local->planes_buf;
+	(*pool->planes_split_func)(planes, data, size);
+	if (!trial) {
+		compress_buffer(pool, &local->comp_ctx, size, planes,
+				dst_space, dst, &out);
+		*split = true;
+		return out.size;
+	}
+
+	struct bytebuf alt;
+	compress_buffer(pool, &local->comp_ctx, size, data, dst_space, dst,
+			&out);
+	compress_buffer(pool, &local->comp_ctx, size, planes, dst_space,
+			planes + planes_space, &alt);
+	*split = alt.size < out.size;
+	atomic_fetch_add(&task->sfd->planes_tuner->votes, *split ? 1 : -1);
+	if (*split) {
+		memcpy(dst, alt.data, alt.size);
+		return alt.size;
+	}
+	return out.size;
+}
+
+/** Write a diff which sets all of the task's intervals, and the last
+ * `ntrailing` bytes, to their contents in the mirror; returns the size of
+ * its non-trailing part. Used once the mirror has been updated by a diff
+ * which could not be sent. */
+static size_t diff_from_mirror(const struct task_data *task,
+		const struct shadow_fd *sfd, size_t ntrailing, char *diff)
+{
+	size_t diffsize = 0;
+	for (int i = 0; i < task->damage_len; i++) {
+		uint32_t span[2] = {
+				(uint32_t)task->damage_intervals[i].start / 4,
+				(uint32_t)task->damage_intervals[i].end / 4};
+		memcpy(diff + diffsize, span, sizeof(span));
+		memcpy(diff + diffsize + sizeof(span),
+				sfd->mem_mirror + 4 * span[0],
+				4 * (size_t)(span[1] - span[0]));
+		diffsize += sizeof(span) + 4 * (size_t)(span[1] - span[0]);
+	}
+	memcpy(diff + diffsize, sfd->mem_mirror + sfd->buffer_size - ntrailing,
+			ntrailing);
+	return diffsize;
+}
+
 /* Construct and optionally compress a diff between sfd->mem_mirror and
  * the actual memmap'd data, and synchronize sfd->mem_mirror */
 static void worker_run_compress_diff(
@@ -718,29 +2257,76 @@ static void worker_run_compress_diff(
 {
 	struct shadow_fd *sfd = task->sfd;
 	struct thread_pool *pool = local->pool;
+	struct timespec t_start;
+	if (sfd->diff_tuner) {
+		clock_gettime(CLOCK_MONOTONIC, &t_start);
+	}
 
-	size_t damage_space = 0;
+	enum diff_source mode = get_diff_source(pool, sfd);
+
+	size_t damage_space = 0, damage = 0;
+	size_t output = 0;
 	for (int i = 0; i < task->damage_len; i++) {
 		int range = task->damage_intervals[i].end -
 			    task->damage_intervals[i].start;
-		damage_space += (size_t)range + 8;
+		damage += (size_t)range;
+		damage_space += diff_space(sfd, mode, (size_t)range);
 	}
 	if (task->damaged_end) {
 		damage_space += 1u << pool->diff_alignment_bits;
 	}
+	if (mode == DIFF_SOURCE_STAGED && !local->stage_buf) {
+		local->stage_buf = zeroed_aligned_alloc(DIFF_STAGE_SIZE, 64,
+				&local->stage_handle);
+		if (!local->stage_buf) {
+			wp_error("Allocation failed, dropping diff transfer block");
+			goto end;
+		}
+	}
 
 	DTRACE_PROBE1(waypipe, worker_compdiff_enter, damage_space);
 
 	char *diff_buffer = NULL;
 	char *diff_target = NULL;
-	if (pool->compression == COMP_NONE) {
-		diff_buffer = malloc(
-				damage_space + sizeof(struct wmsg_buffer_diff));
+	/* Zstd can compress the diff as it is made, so that it need not be
+	 * stored in full */
+	bool stream = false;
+	/* If set, the diff is sent on this history stream */
+	ZSTD_CCtx *history_cctx = NULL;
+	bool restart = false;
+#ifdef HAS_ZSTD
+	/* Byte planes can only be split once the whole diff is known */
+	stream = pool->compression == COMP_ZSTD && task->planes == PLANES_OFF;
+	if (stream && task->stream >= 0) {
+		history_cctx = open_history_stream(sfd->diff_history,
+				task->stream, pool->compression_level,
+				&restart);
+	}
+#endif
+	size_t header_size = sizeof(struct wmsg_buffer_diff);
+	if (history_cctx) {
+		header_size = sizeof(struct wmsg_buffer_diff_stream);
+	}
+	if (stream) {
+		diff_buffer = malloc(alignz(compress_bufsize(pool, damage_space),
+						     4) +
+				     header_size);
+		size_t part_space = diff_space(sfd, mode, DIFF_STREAM_CHUNK);
+		if (!diff_buffer || buf_ensure_size((int)part_space, 1,
+							    &local->tmp_size,
+							    &local->tmp_buf) ==
+							    -1) {
+			wp_error("Allocation failed, dropping diff transfer block");
+			free(diff_buffer);
+			goto end;
+		}
+	} else if (pool->compression == COMP_NONE) {
+		diff_buffer = malloc(damage_space + header_size);
 		if (!diff_buffer) {
 			wp_error("Allocation failed, dropping diff transfer block");
 			goto end;
 		}
-		diff_target = diff_buffer + sizeof(struct wmsg_buffer_diff);
+		diff_target = diff_buffer + header_size;
 	} else {
 		if (buf_ensure_size((int)damage_space, 1, &local->tmp_size,
 				    &local->tmp_buf) == -1) {
@@ -752,7 +2338,7 @@ static void worker_run_compress_diff(
 
 	DTRACE_PROBE1(waypipe, construct_diff_enter, task->damage_len);
 	char *source = sfd->mem_local;
-	if (sfd->type == FDC_DMABUF &&
+	if (mode == DIFF_SOURCE_DIRECT && sfd->type == FDC_DMABUF &&
 			sfd->dmabuf_map_stride != sfd->dmabuf_info.strides[0]) {
 		size_t tx_stride = (size_t)sfd->dmabuf_info.strides[0];
 		size_t common = (size_t)minu(sfd->dmabuf_map_stride, tx_stride);
@@ -798,14 +2384,39 @@ static void worker_run_compress_diff(
 		source = sfd->dmabuf_warped;
 	}
 
-	size_t diffsize = construct_diff_core(pool->diff_func,
-			pool->diff_alignment_bits, task->damage_intervals,
-			task->damage_len, sfd->mem_mirror, source, diff_target);
-	size_t ntrailing = 0;
-	if (task->damaged_end) {
-		ntrailing = construct_diff_trailing(sfd->buffer_size,
-				pool->diff_alignment_bits, sfd->mem_mirror,
-				source, diff_target + diffsize);
+	size_t diffsize = 0, ntrailing = 0, stream_size = 0;
+	if (stream) {
+#ifdef HAS_ZSTD
+		ZSTD_CCtx *cctx = history_cctx;
+		ZSTD_EndDirective last = ZSTD_e_flush;
+		if (!cctx) {
+			cctx = local->comp_ctx.zstd_ccontext;
+			last = ZSTD_e_end;
+			ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+			ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+					pool->compression_level);
+			if (pool->tx_dict) {
+				ZSTD_CCtx_refCDict(cctx, pool->tx_dict->cdict);
+			}
+		}
+		size_t stream_space = compress_bufsize(pool, damage_space);
+		if (pool->diff_stream_space_limit) {
+			stream_space = minu(stream_space,
+					pool->diff_stream_space_limit);
+		}
+		stream_size = stream_compress_diff(task, local, cctx, last,
+				source, mode, diff_buffer + header_size,
+				stream_space, &diffsize, &ntrailing);
+#endif
+	} else {
+		diffsize = diff_intervals(local, sfd, task->diff_window, source,
+				mode, task->damage_intervals,
+				task->damage_len, diff_target);
+		if (task->damaged_end) {
+			ntrailing = diff_trailing(local, sfd, source, mode,
+					diff_target + diffsize);
+		}
+		add_dict_sample(pool, diff_target, diffsize + ntrailing);
 	}
 	DTRACE_PROBE1(waypipe, construct_diff_exit, diffsize);
 
@@ -813,15 +2424,38 @@ static void worker_run_compress_diff(
 		free(diff_buffer);
 		goto end;
 	}
+	if (stream && stream_size == 0) {
+		/* The stream failed after the mirror was updated, so the diff
+		 * can not be made again; instead send everything in the
+		 * damaged intervals, compressed as a whole */
+		free(diff_buffer);
+		diff_buffer = NULL;
+		stream = false;
+		if (history_cctx) {
+			/* The stream must restart with its next message */
+			sfd->diff_history->started[task->stream] = false;
+			history_cctx = NULL;
+		}
+		if (buf_ensure_size((int)damage_space, 1, &local->tmp_size,
+				    &local->tmp_buf) == -1) {
+			wp_error("Allocation failed, dropping diff transfer block");
+			goto end;
+		}
+		diff_target = local->tmp_buf;
+		diffsize = diff_from_mirror(task, sfd, ntrailing, diff_target);
+	}
 
 	uint8_t *msg;
 	size_t sz;
 	size_t net_diff_sz = diffsize + ntrailing;
-	if (pool->compression == COMP_NONE) {
-		sz = net_diff_sz + sizeof(struct wmsg_buffer_diff);
+	bool split = false;
+	if (stream) {
+		sz = stream_size + header_size;
+		msg = (uint8_t *)diff_buffer;
+	} else if (pool->compression == COMP_NONE) {
+		sz = net_diff_sz + header_size;
 		msg = (uint8_t *)diff_buffer;
 	} else {
-		struct bytebuf dst;
 		size_t comp_size = compress_bufsize(pool, net_diff_sz);
 		char *comp_buf = malloc(alignz(comp_size, 4) +
 					sizeof(struct wmsg_buffer_diff));
@@ -829,25 +2463,50 @@ static void worker_run_compress_diff(
 			wp_error("Allocation failed, dropping diff transfer block");
 			goto end;
 		}
-		compress_buffer(pool, &local->comp_ctx, net_diff_sz,
-				diff_target, comp_size,
-				comp_buf + sizeof(struct wmsg_buffer_diff),
-				&dst);
-		sz = dst.size + sizeof(struct wmsg_buffer_diff);
+		sz = compress_pixels(task, local, diff_target, net_diff_sz,
+				     comp_buf + sizeof(struct wmsg_buffer_diff),
+				     comp_size, &split) +
+		     sizeof(struct wmsg_buffer_diff);
 		msg = (uint8_t *)comp_buf;
 	}
 	msg = shrink_buffer(msg, alignz(sz, 4));
 	memset(msg + sz, 0, alignz(sz, 4) - sz);
-	struct wmsg_buffer_diff header;
-	header.size_and_type = transfer_header(sz, WMSG_BUFFER_DIFF);
-	header.remote_id = sfd->remote_id;
-	header.diff_size = (uint32_t)diffsize;
-	header.ntrailing = (uint32_t)ntrailing;
-	memcpy(msg, &header, sizeof(struct wmsg_buffer_diff));
+	if (history_cctx) {
+		struct wmsg_buffer_diff_stream header;
+		header.size_and_type = transfer_header(
+				sz, WMSG_BUFFER_DIFF_STREAM);
+		header.remote_id = sfd->remote_id;
+		header.diff_size = (uint32_t)diffsize;
+		header.ntrailing = (uint32_t)ntrailing;
+		header.stream = (uint32_t)task->stream |
+				(restart ? DIFF_STREAM_RESTART : 0);
+		memcpy(msg, &header, sizeof(header));
+		sfd->diff_history->started[task->stream] = true;
+	} else {
+		struct wmsg_buffer_diff header;
+		header.size_and_type = transfer_header(sz,
+				split ? WMSG_BUFFER_DIFF_PLANES
+				      : WMSG_BUFFER_DIFF);
+		header.remote_id = sfd->remote_id;
+		header.diff_size = (uint32_t)diffsize;
+		header.ntrailing = (uint32_t)ntrailing;
+		memcpy(msg, &header, sizeof(header));
+	}
 
-	transfer_async_add(task->msg_queue, msg, alignz(sz, 4));
+	transfer_async_add(task->msg_queue, task->msg_slot, msg,
+			alignz(sz, 4));
+	output = sz;
 
 end:
+	if (sfd->diff_tuner) {
+		struct timespec t_end;
+		clock_gettime(CLOCK_MONOTONIC, &t_end);
+		struct diff_tuner *tuner = sfd->diff_tuner;
+		atomic_fetch_add(&tuner->damage, damage);
+		atomic_fetch_add(&tuner->output, output);
+		atomic_fetch_add(&tuner->time_ns,
+				(uint64_t)timespec_diff_ns(t_end, t_start));
+	}
 	DTRACE_PROBE1(waypipe, worker_compdiff_exit, diffsize);
 }
 
@@ -868,22 +2527,10 @@ static void worker_run_compress_block(
 	DTRACE_PROBE1(waypipe, worker_comp_enter, source_end - source_start);
 
 	/* Update mirror to match local */
-	if (sfd->type == FDC_DMABUF &&
-			sfd->dmabuf_map_stride != sfd->dmabuf_info.strides[0]) {
-		uint32_t tx_stride = sfd->dmabuf_info.strides[0];
-		size_t common = (size_t)minu(sfd->dmabuf_map_stride,
-				sfd->dmabuf_info.strides[0]);
-		size_t loc_start = (source_start % tx_stride) +
-				   (source_start / tx_stride) *
-						   sfd->dmabuf_map_stride;
-		size_t loc_end = (source_end % tx_stride) +
-				 (source_end / tx_stride) *
-						 sfd->dmabuf_map_stride;
-
-		stride_shifted_copy(sfd->mem_mirror, sfd->mem_local, loc_start,
-				loc_end - loc_start, common,
-				sfd->dmabuf_map_stride,
-				sfd->dmabuf_info.strides[0]);
+	if (sfd->type == FDC_DMABUF) {
+		readback_dmabuf(pool->readback_func, sfd,
+				sfd->mem_mirror + source_start, source_start,
+				source_end);
 	} else {
 		memcpy(sfd->mem_mirror + source_start,
 				sfd->mem_local + source_start,
@@ -892,6 +2539,7 @@ static void worker_run_compress_block(
 
 	size_t sz = 0;
 	uint8_t *msg;
+	bool split = false;
 	if (pool->compression == COMP_NONE) {
 		sz = sizeof(struct wmsg_buffer_fill) +
 		     (source_end - source_start);
@@ -913,30 +2561,92 @@ static void worker_run_compress_block(
 			wp_error("Allocation failed, dropping fill transfer block");
 			goto end;
 		}
-		struct bytebuf dst;
-		compress_buffer(pool, &local->comp_ctx,
-				source_end - source_start,
-				&sfd->mem_mirror[source_start], comp_size,
-				(char *)msg + sizeof(struct wmsg_buffer_fill),
-				&dst);
-		sz = dst.size + sizeof(struct wmsg_buffer_fill);
+		char *body = (char *)msg + sizeof(struct wmsg_buffer_fill);
+		sz = compress_pixels(task, local,
+				     &sfd->mem_mirror[source_start],
+				     source_end - source_start, body,
+				     comp_size, &split) +
+		     sizeof(struct wmsg_buffer_fill);
 		msg = shrink_buffer(msg, alignz(sz, 4));
 	}
 	memset(msg + sz, 0, alignz(sz, 4) - sz);
 	struct wmsg_buffer_fill header;
-	header.size_and_type = transfer_header(sz, WMSG_BUFFER_FILL);
+	header.size_and_type = transfer_header(
+			sz, split ? WMSG_BUFFER_FILL_PLANES : WMSG_BUFFER_FILL);
 	header.remote_id = sfd->remote_id;
 	header.start = (uint32_t)source_start;
 	header.end = (uint32_t)source_end;
 	memcpy(msg, &header, sizeof(struct wmsg_buffer_fill));
 
-	transfer_async_add(task->msg_queue, msg, alignz(sz, 4));
+	transfer_async_add(task->msg_queue, task->msg_slot, msg,
+			alignz(sz, 4));
 
 end:
 	DTRACE_PROBE1(waypipe, worker_comp_exit,
 			sz - sizeof(struct wmsg_buffer_fill));
 }
 
+/** Mark the hashes of all tiles overlapping [start, end) as unknown; for use
+ * when the mirror is modified other than by construct_diff_tiled */
+static void forget_tile_hashes(struct shadow_fd *sfd, size_t start, size_t end)
+{
+	if (!sfd->tile_hashes || start >= end) {
+		return;
+	}
+	size_t ntiles = sfd->buffer_size / DIFF_TILE_SIZE;
+	size_t first = start / DIFF_TILE_SIZE;
+	size_t last = minu((end + DIFF_TILE_SIZE - 1) / DIFF_TILE_SIZE, ntiles);
+	for (size_t t = first; t < last; t++) {
+		sfd->tile_hashes[t] = 0;
+	}
+}
+
+/** Return whether the tasks for the next update of the buffer should split
+ * it into byte planes, creating its struct planes_tuner if necessary */
+static enum planes_mode choose_planes_mode(
+		struct thread_pool *threads, struct shadow_fd *sfd)
+{
+	if (!threads->split_planes) {
+		return PLANES_OFF;
+	}
+	int bpp = sfd->type == FDC_DMABUF ? get_shm_bytes_per_pixel(
+						    sfd->dmabuf_info.format)
+					  : sfd->pixel_bytes;
+	if (bpp != 4) {
+		return PLANES_OFF;
+	}
+	struct planes_tuner *tuner = sfd->planes_tuner;
+	if (!tuner) {
+		tuner = calloc(1, sizeof(struct planes_tuner));
+		if (!tuner) {
+			wp_error("Failed to allocate byte plane tuner, not splitting planes");
+			return PLANES_OFF;
+		}
+		atomic_init(&tuner->votes, 0);
+		sfd->planes_tuner = tuner;
+	}
+	tuner->trial = tuner->nupdates % PLANES_TRIAL_INTERVAL == 0;
+	tuner->nupdates++;
+	atomic_store(&tuner->votes, 0);
+	if (tuner->trial) {
+		return PLANES_TRIAL;
+	}
+	return tuner->split ? PLANES_ON : PLANES_OFF;
+}
+
+/** Once all tasks for a buffer are done, adopt whichever choice most trial
+ * tasks found to compress better */
+static void update_planes_tuner(struct shadow_fd *sfd)
+{
+	struct planes_tuner *tuner = sfd->planes_tuner;
+	int votes = atomic_exchange(&tuner->votes, 0);
+	if (tuner->trial && votes != 0 && tuner->split != (votes > 0)) {
+		wp_debug("Byte planes for RID=%d are now %s", sfd->remote_id,
+				votes > 0 ? "split" : "kept together");
+		tuner->split = votes > 0;
+	}
+}
+
 /* Optionally compress the data in mem_mirror, and set up the initial
  * transfer blocks */
 static void queue_fill_transfers(struct thread_pool *threads,
@@ -958,17 +2668,11 @@ static void queue_fill_transfers(struct thread_pool *threads,
 
 	/* Keep sfd alive at least until write to channel is done */
 	sfd->refcount.compute = true;
+	sfd_list_append(&sfd->map->maybe_unref, &sfd->maybe_unref_link);
+	forget_tile_hashes(sfd, (size_t)region_start, (size_t)region_end);
 
 	int nshards = ceildiv((region_end - region_start), chunksize);
-
-	pthread_mutex_lock(&threads->work_mutex);
-	if (buf_ensure_size(threads->stack_count + nshards,
-			    sizeof(struct task_data), &threads->stack_size,
-			    (void **)&threads->stack) == -1) {
-		wp_error("Allocation failed, dropping some fill tasks");
-		pthread_mutex_unlock(&threads->work_mutex);
-		return;
-	}
+	enum planes_mode planes = choose_planes_mode(threads, sfd);
 
 	for (int i = 0; i < nshards; i++) {
 		struct task_data task;
@@ -976,14 +2680,102 @@ static void queue_fill_transfers(struct thread_pool *threads,
 		task.type = TASK_COMPRESS_BLOCK;
 		task.sfd = sfd;
 		task.msg_queue = &transfers->async_recv_queue;
+		task.planes = planes;
 
 		task.zone_start = split_interval(
 				region_start, region_end, nshards, i);
 		task.zone_end = split_interval(
 				region_start, region_end, nshards, i + 1);
-		threads->stack[threads->stack_count++] = task;
+		if (queue_task(threads, &task) == -1) {
+			wp_error("Allocation failed, dropping some fill tasks");
+			return;
+		}
+	}
+}
+
+/** Window sizes, in words, among which a struct diff_tuner chooses */
+static const int diff_window_choices[DIFF_WINDOW_CHOICES] = {
+		MIN_DIFF_WINDOW, DEFAULT_DIFF_WINDOW, 32, 48, 64, 96};
+/** Nanoseconds of diff and compression work counted as costly as sending one
+ * byte; roughly the time to send a byte at 1 Gbps */
+#define DIFF_TUNE_NS_PER_BYTE 8
+/** One in this many diffs tries a window next to the best one */
+#define DIFF_TUNE_TRIAL_INTERVAL 8
+
+/** Return the diff window to use for the next diff of the buffer, creating
+ * its struct diff_tuner if necessary */
+static int choose_diff_window(
+		struct thread_pool *threads, struct shadow_fd *sfd)
+{
+	struct diff_tuner *tuner = sfd->diff_tuner;
+	if (!tuner) {
+		tuner = calloc(1, sizeof(struct diff_tuner));
+		if (!tuner) {
+			wp_error("Failed to allocate diff tuner, using a fixed diff window");
+			return threads->diff_window;
+		}
+		for (int i = 0; i < DIFF_WINDOW_CHOICES; i++) {
+			tuner->cost[i] = -1.f;
+			if (diff_window_choices[i] == DEFAULT_DIFF_WINDOW) {
+				tuner->best = i;
+			}
+		}
+		atomic_init(&tuner->damage, 0);
+		atomic_init(&tuner->output, 0);
+		atomic_init(&tuner->time_ns, 0);
+		sfd->diff_tuner = tuner;
+	}
+
+	tuner->ndiffs++;
+	tuner->choice = tuner->best;
+	if (tuner->ndiffs % DIFF_TUNE_TRIAL_INTERVAL == 0) {
+		/* Alternate between the next smaller and next larger window */
+		int step = (tuner->ndiffs / DIFF_TUNE_TRIAL_INTERVAL) % 2 ? 1
+									 : -1;
+		int trial = tuner->best + step;
+		if (trial < 0 || trial >= DIFF_WINDOW_CHOICES) {
+			trial = tuner->best - step;
+		}
+		tuner->choice = trial;
+	}
+	atomic_store(&tuner->damage, 0);
+	atomic_store(&tuner->output, 0);
+	atomic_store(&tuner->time_ns, 0);
+	return diff_window_choices[tuner->choice];
+}
+
+/** Once all diff tasks for a buffer are done, update the cost of the window
+ * they used, and pick the best window for later diffs */
+static void update_diff_tuner(struct shadow_fd *sfd)
+{
+	struct diff_tuner *tuner = sfd->diff_tuner;
+	uint64_t damage = atomic_exchange(&tuner->damage, 0);
+	uint64_t output = atomic_exchange(&tuner->output, 0);
+	uint64_t time_ns = atomic_exchange(&tuner->time_ns, 0);
+	if (damage == 0) {
+		return;
+	}
+	float cost = (float)(output + time_ns / DIFF_TUNE_NS_PER_BYTE) /
+		     (float)damage;
+	float *prev = &tuner->cost[tuner->choice];
+	*prev = *prev < 0.f ? cost : 0.75f * *prev + 0.25f * cost;
+
+	int best = tuner->best;
+	for (int i = 0; i < DIFF_WINDOW_CHOICES; i++) {
+		if (tuner->cost[i] >= 0.f &&
+				tuner->cost[i] < tuner->cost[best]) {
+			best = i;
+		}
+	}
+	if (best != tuner->best) {
+		wp_debug("Diff window for RID=%d changed from %d to %d words (cost per byte %.4f to %.4f)",
+				sfd->remote_id,
+				diff_window_choices[tuner->best],
+				diff_window_choices[best],
+				(double)tuner->cost[tuner->best],
+				(double)tuner->cost[best]);
+		tuner->best = best;
 	}
-	pthread_mutex_unlock(&threads->work_mutex);
 }
 
 static void queue_diff_transfers(struct thread_pool *threads,
@@ -996,6 +2788,21 @@ static void queue_diff_transfers(struct thread_pool *threads,
 
 	/* Keep sfd alive at least until write to channel is done */
 	sfd->refcount.compute = true;
+	sfd_list_append(&sfd->map->maybe_unref, &sfd->maybe_unref_link);
+
+	if (sfd->type == FDC_FILE && !sfd->tile_hashes &&
+			threads->tile_accum_func &&
+			sfd->buffer_size >= DIFF_TILE_SIZE) {
+		/* Allocated on first use, since files which are only written
+		 * by the remote side are never diffed */
+		sfd->tile_hashes = calloc(sfd->buffer_size / DIFF_TILE_SIZE,
+				sizeof(uint64_t));
+	}
+
+	int diff_window = threads->diff_window_adapt
+					  ? choose_diff_window(threads, sfd)
+					  : threads->diff_window;
+	enum planes_mode planes = choose_planes_mode(threads, sfd);
 
 	int bs = 1 << threads->diff_alignment_bits;
 	int align_end = bs * ((int)sfd->buffer_size / bs);
@@ -1078,17 +2885,28 @@ static void queue_diff_transfers(struct thread_pool *threads,
 
 		offsets[shard + 1] = iw;
 	}
+	/* Diff tasks only check and update the hashes of tiles inside one of
+	 * their intervals; as tiles split between intervals (and possibly
+	 * between tasks) will change, their hashes are dropped here */
+	for (int i = 0; i < iw; i++) {
+		if (intvs[i].start % DIFF_TILE_SIZE) {
+			forget_tile_hashes(sfd, (size_t)intvs[i].start,
+					(size_t)intvs[i].start + 1);
+		}
+		if (intvs[i].end % DIFF_TILE_SIZE) {
+			forget_tile_hashes(sfd, (size_t)intvs[i].end - 1,
+					(size_t)intvs[i].end);
+		}
+	}
 	/* Reset damage, once it has been applied */
 	reset_damage(&sfd->damage);
 
-	pthread_mutex_lock(&threads->work_mutex);
-	if (buf_ensure_size(threads->stack_count + nshards,
-			    sizeof(struct task_data), &threads->stack_size,
-			    (void **)&threads->stack) == -1) {
-		wp_error("Allocation failed, dropping some diff tasks");
-		pthread_mutex_unlock(&threads->work_mutex);
-		free(offsets);
-		return;
+	/* The first tasks each continue one of the buffer's history streams;
+	 * as updates are usually similar in size, the n-th task tends to
+	 * cover the same part of the buffer that it did in the last update */
+	bool use_history = false;
+	if (sfd->map->diff_history && threads->compression == COMP_ZSTD) {
+		use_history = get_diff_history(sfd) != NULL;
 	}
 
 	for (int i = 0; i < nshards; i++) {
@@ -1102,10 +2920,16 @@ static void queue_diff_transfers(struct thread_pool *threads,
 		task.damage_intervals =
 				&sfd->damage_task_interval_store[offsets[i]];
 		task.damaged_end = (i == nshards - 1) && check_tail;
+		task.diff_window = diff_window;
+		task.stream = (use_history && i < DIFF_STREAM_COUNT) ? i : -1;
+		/* Diffs sent on a history stream are never split */
+		task.planes = task.stream >= 0 ? PLANES_OFF : planes;
 
-		threads->stack[threads->stack_count++] = task;
+		if (queue_task(threads, &task) == -1) {
+			wp_error("Allocation failed, dropping some diff tasks");
+			break;
+		}
 	}
-	pthread_mutex_unlock(&threads->work_mutex);
 	free(offsets);
 }
 
@@ -1179,9 +3003,453 @@ void finish_update(struct shadow_fd *sfd)
 		free(sfd->damage_task_interval_store);
 		sfd->damage_task_interval_store = NULL;
 	}
+	if (sfd->diff_tuner) {
+		update_diff_tuner(sfd);
+	}
+	if (sfd->planes_tuner) {
+		update_planes_tuner(sfd);
+	}
 	sfd->refcount.compute = false;
 }
 
+void mark_shadow_dirty(struct shadow_fd *sfd)
+{
+	sfd->is_dirty = true;
+	/* pipes are always visited by collect_dirty_updates */
+	if (sfd->type != FDC_PIPE) {
+		sfd_list_append(&sfd->map->dirty, &sfd->dirty_link);
+	}
+}
+void collect_dirty_updates(struct fd_translation_map *map,
+		struct thread_pool *threads, struct transfer_queue *transfers,
+		bool use_old_dmavid_req)
+{
+	while (map->dirty.l_next != &map->dirty) {
+		struct shadow_fd_link *lcur = map->dirty.l_next;
+		sfd_list_remove(lcur);
+		collect_update(threads, SFD_FROM_LINK(lcur, dirty_link),
+				transfers, use_old_dmavid_req);
+	}
+	for (struct shadow_fd_link *lcur = map->pipes.l_next,
+				   *lnxt = lcur->l_next;
+			lcur != &map->pipes; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, pipe_link);
+		collect_update(threads, cur, transfers, use_old_dmavid_req);
+		/* collecting updates can reset `pipe.remote_can_X` state, so
+		 * garbage collect the sfd immediately after */
+		destroy_shadow_if_unreferenced(cur);
+	}
+}
+void finish_dirty_updates(struct fd_translation_map *map)
+{
+	while (map->maybe_unref.l_next != &map->maybe_unref) {
+		struct shadow_fd_link *lcur = map->maybe_unref.l_next;
+		sfd_list_remove(lcur);
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, maybe_unref_link);
+		finish_update(cur);
+		destroy_shadow_if_unreferenced(cur);
+	}
+}
+
+/** Returns true if both row ranges of a WMSG_BUFFER_COPY_ROWS message lie
+ * inside a buffer of the given size */
+static bool copy_rows_in_bounds(
+		const struct wmsg_buffer_copy_rows *m, size_t size)
+{
+	if (m->nrows == 0) {
+		return true;
+	}
+	if (m->row_length > m->stride) {
+		return false;
+	}
+	uint64_t span = (uint64_t)(m->nrows - 1) * m->stride + m->row_length;
+	return (uint64_t)m->src + span <= size &&
+	       (uint64_t)m->dst + span <= size;
+}
+/** Move the rows described by a WMSG_BUFFER_COPY_ROWS message */
+static void copy_image_rows(char *base, const struct wmsg_buffer_copy_rows *m)
+{
+	/* The source and destination may overlap, so copy rows in the
+	 * direction of the move */
+	for (uint32_t k = 0; k < m->nrows; k++) {
+		uint32_t i = m->dst > m->src ? m->nrows - 1 - k : k;
+		memmove(base + m->dst + (size_t)i * m->stride,
+				base + m->src + (size_t)i * m->stride,
+				m->row_length);
+	}
+}
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+/** Hash a range of bytes, using four independent lanes for speed */
+static uint64_t hash_bytes(const char *row, size_t len)
+{
+	const uint64_t k = 0x9e3779b97f4a7c15uLL;
+	uint64_t h[4] = {len, 1, 2, 3};
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		for (int j = 0; j < 4; j++) {
+			uint64_t w;
+			memcpy(&w, row + i + 8 * j, 8);
+			h[j] = rotl64((h[j] ^ w) * k, 31);
+		}
+	}
+	for (; i < len; i += 8) {
+		uint64_t w = 0;
+		memcpy(&w, row + i, len - i < 8 ? len - i : 8);
+		h[0] = rotl64((h[0] ^ w) * k, 31);
+	}
+	uint64_t r = h[0] ^ rotl64(h[1], 16) ^ rotl64(h[2], 32) ^
+		     rotl64(h[3], 48);
+	return (r ^ (r >> 29)) * k;
+}
+static int cmp_int(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+	return (x > y) - (x < y);
+}
+struct row_hash_slot {
+	uint64_t hash;
+	int row; /* -1 if empty, -2 if several rows have this hash */
+};
+/** Return the index of the only row with the given hash, or -1 if there is
+ * no such row or it is not unique */
+static int lookup_row_hash(const struct row_hash_slot *table, uint32_t mask,
+		uint64_t hash)
+{
+	for (uint32_t p = (uint32_t)hash & mask;; p = (p + 1) & mask) {
+		if (table[p].row == -1) {
+			return -1;
+		}
+		if (table[p].hash == hash) {
+			return table[p].row;
+		}
+	}
+}
+/* Minimum number of changed rows that a detected scroll must account for */
+#define SCROLL_MIN_ROWS 8
+
+/** If the damaged part of the image last committed from the file has been
+ * scrolled relative to the mirror, move the mirror's rows accordingly and
+ * queue a WMSG_BUFFER_COPY_ROWS message for the remote side, so that only
+ * the remaining changes need to be diffed. The row hashes only locate the
+ * candidate move; the diff of the moved rows ensures correctness. */
+static void queue_scroll_copy(struct thread_pool *threads,
+		struct shadow_fd *sfd, struct transfer_queue *transfers)
+{
+	struct image_rows img = sfd->scroll_image;
+	memset(&sfd->scroll_image, 0, sizeof(sfd->scroll_image));
+	if (!sfd->map->scroll_copy || !sfd->damage.damage ||
+			img.row_length == 0 ||
+			img.nrows < 2 * SCROLL_MIN_ROWS) {
+		return;
+	}
+	struct wmsg_buffer_copy_rows whole = {.src = img.start,
+			.dst = img.start,
+			.row_length = img.row_length,
+			.nrows = img.nrows,
+			.stride = img.stride};
+	if (!copy_rows_in_bounds(&whole, sfd->buffer_size)) {
+		return;
+	}
+
+	/* Only search the rows which were damaged */
+	uint32_t r0 = 0, r1 = img.nrows;
+	if (sfd->damage.damage != DAMAGE_EVERYTHING) {
+		int64_t lo = INT64_MAX, hi = 0;
+		for (int i = 0; i < sfd->damage.ndamage_intvs; i++) {
+			struct interval e = sfd->damage.damage[i];
+			if (e.start < lo) {
+				lo = e.start;
+			}
+			if (e.end > hi) {
+				hi = e.end;
+			}
+		}
+		lo -= img.start;
+		hi -= img.start;
+		if (hi <= 0) {
+			return;
+		}
+		r0 = lo <= 0 ? 0 : (uint32_t)(lo / img.stride);
+		r1 = (uint32_t)minu(img.nrows,
+				((uint64_t)hi + img.stride - 1) / img.stride);
+		if (r0 >= r1) {
+			return;
+		}
+	}
+	int n = (int)(r1 - r0);
+	if (n < 2 * SCROLL_MIN_ROWS) {
+		return;
+	}
+
+	uint32_t tsize = 1;
+	while (tsize < 2 * (uint32_t)n) {
+		tsize *= 2;
+	}
+	uint64_t *local_hashes = malloc(2 * (size_t)n * sizeof(uint64_t));
+	int *shifts = malloc((size_t)n * sizeof(int));
+	struct row_hash_slot *table =
+			malloc(tsize * sizeof(struct row_hash_slot));
+	if (!local_hashes || !shifts || !table) {
+		goto end;
+	}
+	uint64_t *mirror_hashes = local_hashes + n;
+	for (uint32_t p = 0; p < tsize; p++) {
+		table[p].row = -1;
+	}
+	for (int i = 0; i < n; i++) {
+		size_t offset = img.start + (size_t)(r0 + (uint32_t)i) *
+						    img.stride;
+		local_hashes[i] = hash_bytes(
+				sfd->mem_local + offset, img.row_length);
+		mirror_hashes[i] = hash_bytes(
+				sfd->mem_mirror + offset, img.row_length);
+
+		uint32_t mask = tsize - 1;
+		for (uint32_t p = (uint32_t)mirror_hashes[i] & mask;;
+				p = (p + 1) & mask) {
+			if (table[p].row == -1) {
+				table[p].hash = mirror_hashes[i];
+				table[p].row = i;
+				break;
+			}
+			if (table[p].hash == mirror_hashes[i]) {
+				table[p].row = -2;
+				break;
+			}
+		}
+	}
+
+	/* Each changed row which matches a distinct old row votes for its
+	 * shift; the most common shift is then checked */
+	int nshifts = 0;
+	for (int i = 0; i < n; i++) {
+		if (local_hashes[i] == mirror_hashes[i]) {
+			continue;
+		}
+		int j = lookup_row_hash(table, tsize - 1, local_hashes[i]);
+		if (j >= 0) {
+			shifts[nshifts++] = i - j;
+		}
+	}
+	if (nshifts < SCROLL_MIN_ROWS) {
+		goto end;
+	}
+	qsort(shifts, (size_t)nshifts, sizeof(int), cmp_int);
+	int shift = 0, shift_votes = 0;
+	for (int i = 0, run = 1; i < nshifts; i++, run++) {
+		if (i + 1 == nshifts || shifts[i + 1] != shifts[i]) {
+			if (run > shift_votes) {
+				shift = shifts[i];
+				shift_votes = run;
+			}
+			run = 0;
+		}
+	}
+	if (shift_votes < SCROLL_MIN_ROWS) {
+		goto end;
+	}
+
+	/* Pick the contiguous run of rows matching the shifted mirror which
+	 * would otherwise require the most rows to be diffed */
+	int best_start = 0, best_end = 0, best_gain = 0;
+	int lower = shift > 0 ? shift : 0, upper = shift > 0 ? n : n + shift;
+	for (int i = lower; i < upper;) {
+		if (local_hashes[i] != mirror_hashes[i - shift]) {
+			i++;
+			continue;
+		}
+		int start = i, gain = 0;
+		for (; i < upper && local_hashes[i] == mirror_hashes[i - shift];
+				i++) {
+			gain += local_hashes[i] != mirror_hashes[i];
+		}
+		if (gain > best_gain) {
+			best_start = start;
+			best_end = i;
+			best_gain = gain;
+		}
+	}
+	if (best_gain < SCROLL_MIN_ROWS) {
+		goto end;
+	}
+
+	struct wmsg_buffer_copy_rows *msg = calloc(1, sizeof(*msg));
+	if (!msg) {
+		goto end;
+	}
+	msg->size_and_type = transfer_header(
+			sizeof(struct wmsg_buffer_copy_rows),
+			WMSG_BUFFER_COPY_ROWS);
+	msg->remote_id = sfd->remote_id;
+	msg->src = img.start + (r0 + (uint32_t)(best_start - shift)) *
+					       img.stride;
+	msg->dst = img.start + (r0 + (uint32_t)best_start) * img.stride;
+	msg->row_length = img.row_length;
+	msg->nrows = (uint32_t)(best_end - best_start);
+	msg->stride = img.stride;
+	wp_debug("Moving %u rows of RID=%d by %d rows", msg->nrows,
+			sfd->remote_id, shift);
+
+	copy_image_rows(sfd->mem_mirror, msg);
+	forget_tile_hashes(sfd, msg->dst,
+			msg->dst + (msg->nrows - 1) * msg->stride +
+					msg->row_length);
+	transfer_add(transfers, sizeof(struct wmsg_buffer_copy_rows), msg);
+
+	/* The moved rows must still be diffed, in case a hash collided */
+	struct ext_interval moved = {.start = (int32_t)msg->dst,
+			.width = (int32_t)msg->row_length,
+			.rep = (int32_t)msg->nrows,
+			.stride = (int32_t)msg->stride};
+	merge_damage_records(&sfd->damage, 1, &moved,
+			threads->diff_alignment_bits);
+end:
+	free(local_hashes);
+	free(shifts);
+	free(table);
+}
+
+/** Return the shadow whose mirror holds the block described by `entry`, if
+ * the remote side is certain to have the same mirror contents */
+static struct shadow_fd *get_block_source(struct fd_translation_map *map,
+		const struct block_index_entry *entry, const char *contents)
+{
+	struct shadow_fd *src = get_shadow_for_rid(map, entry->remote_id);
+	/* Shadows without protocol references may already have been
+	 * destroyed on the remote side; and those with updates still being
+	 * applied by thread tasks cannot be read yet */
+	if (!src || src->type != FDC_FILE || src->only_here ||
+			!src->mem_mirror || src->refcount.protocol <= 0 ||
+			src->refcount.apply) {
+		return NULL;
+	}
+	if ((uint64_t)entry->offset + DEDUP_BLOCK_SIZE >
+			minu(src->buffer_size, src->remote_bufsize)) {
+		return NULL;
+	}
+	if (memcmp(src->mem_mirror + entry->offset, contents,
+			    DEDUP_BLOCK_SIZE) != 0) {
+		return NULL;
+	}
+	return src;
+}
+/** Returns true if the block copy `c` can be extended to also copy the next
+ * block from `src_start` to `dst_start`. Copies within a file are only
+ * extended while the source and destination ranges stay disjoint, so that
+ * copying the range at once matches copying block by block. */
+static bool extends_block_copy(const struct wmsg_buffer_copy_block *c,
+		int32_t src_rid, uint32_t src_start, uint32_t dst_start)
+{
+	if (!c || c->src_remote_id != src_rid ||
+			c->src_start + c->length != src_start ||
+			c->dst_start + c->length != dst_start) {
+		return false;
+	}
+	if (c->remote_id != src_rid) {
+		return true;
+	}
+	return src_start + DEDUP_BLOCK_SIZE <= c->dst_start ||
+	       dst_start + DEDUP_BLOCK_SIZE <= c->src_start;
+}
+/** Queue the pending block copy message, if there is one */
+static void flush_block_copy(struct transfer_queue *transfers,
+		struct wmsg_buffer_copy_block **pending)
+{
+	if (*pending) {
+		wp_debug("Copying %u bytes from RID=%d to RID=%d",
+				(*pending)->length, (*pending)->src_remote_id,
+				(*pending)->remote_id);
+		transfer_add(transfers, sizeof(struct wmsg_buffer_copy_block),
+				*pending);
+		*pending = NULL;
+	}
+}
+/** Record the block of the file at `offset` in the deduplication index. If
+ * it changed, and its new contents are already present in a mirror, copy
+ * them into this file's mirror, and add the copy to `pending`. */
+static void dedup_block(struct shadow_fd *sfd, uint32_t offset,
+		struct transfer_queue *transfers,
+		struct wmsg_buffer_copy_block **pending)
+{
+	struct fd_translation_map *map = sfd->map;
+	const char *contents = sfd->mem_local + offset;
+	uint64_t hash = hash_bytes(contents, DEDUP_BLOCK_SIZE);
+	struct block_index_entry *entry =
+			&map->block_index[hash % BLOCK_INDEX_SIZE];
+	struct block_index_entry old = *entry;
+	entry->hash = hash;
+	entry->remote_id = sfd->remote_id;
+	entry->offset = offset;
+
+	if (old.remote_id == 0 || old.hash != hash ||
+			(old.remote_id == sfd->remote_id &&
+					old.offset == offset)) {
+		return;
+	}
+	struct shadow_fd *src = get_block_source(map, &old, contents);
+	if (!src || memcmp(sfd->mem_mirror + offset, contents,
+				    DEDUP_BLOCK_SIZE) == 0) {
+		return;
+	}
+
+	if (extends_block_copy(*pending, src->remote_id, old.offset, offset)) {
+		(*pending)->length += DEDUP_BLOCK_SIZE;
+	} else {
+		flush_block_copy(transfers, pending);
+		struct wmsg_buffer_copy_block *msg = calloc(1, sizeof(*msg));
+		if (!msg) {
+			wp_error("Failed to allocate block copy message");
+			return;
+		}
+		msg->size_and_type = transfer_header(
+				sizeof(struct wmsg_buffer_copy_block),
+				WMSG_BUFFER_COPY_BLOCK);
+		msg->remote_id = sfd->remote_id;
+		msg->src_remote_id = src->remote_id;
+		msg->src_start = old.offset;
+		msg->dst_start = offset;
+		msg->length = DEDUP_BLOCK_SIZE;
+		*pending = msg;
+	}
+	memmove(sfd->mem_mirror + offset, src->mem_mirror + old.offset,
+			DEDUP_BLOCK_SIZE);
+	forget_tile_hashes(sfd, offset, offset + DEDUP_BLOCK_SIZE);
+}
+/** Look up all damaged blocks of the file in the deduplication index, and
+ * queue WMSG_BUFFER_COPY_BLOCK messages for those whose new contents are
+ * already present in a mirror, so that the diff finds them unchanged. */
+static void queue_block_copies(
+		struct shadow_fd *sfd, struct transfer_queue *transfers)
+{
+	if (!sfd->map->block_index || !sfd->damage.damage ||
+			sfd->refcount.apply) {
+		return;
+	}
+	struct interval everything = {
+			.start = 0, .end = (int32_t)sfd->buffer_size};
+	const struct interval *intvs = &everything;
+	int nintvs = 1;
+	if (sfd->damage.damage != DAMAGE_EVERYTHING) {
+		intvs = sfd->damage.damage;
+		nintvs = sfd->damage.ndamage_intvs;
+	}
+
+	struct wmsg_buffer_copy_block *pending = NULL;
+	for (int i = 0; i < nintvs; i++) {
+		uint64_t end = minu((uint64_t)intvs[i].end, sfd->buffer_size);
+		for (uint64_t offset = alignz((size_t)intvs[i].start,
+				     DEDUP_BLOCK_SIZE);
+				offset + DEDUP_BLOCK_SIZE <= end;
+				offset += DEDUP_BLOCK_SIZE) {
+			dedup_block(sfd, (uint32_t)offset, transfers, &pending);
+		}
+	}
+	flush_block_copy(transfers, &pending);
+}
+
 void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 		struct transfer_queue *transfers, bool use_old_dmavid_req)
 {
@@ -1231,6 +3499,8 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 			sfd->remote_bufsize = sfd->buffer_size;
 		}
 
+		queue_scroll_copy(threads, sfd, transfers);
+		queue_block_copies(sfd, transfers);
 		queue_diff_transfers(threads, sfd, transfers);
 	} break;
 	case FDC_DMABUF: {
@@ -1265,10 +3535,7 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 			sfd->mem_mirror = zeroed_aligned_alloc(
 					alignz(sfd->buffer_size, alignment),
 					alignment, &sfd->mem_mirror_handle);
-			sfd->dmabuf_warped = zeroed_aligned_alloc(
-					alignz(sfd->buffer_size, alignment),
-					alignment, &sfd->dmabuf_warped_handle);
-			if (!sfd->mem_mirror || !sfd->dmabuf_warped) {
+			if (!sfd->mem_mirror) {
 				wp_error("Failed to allocate mirror");
 				return;
 			}
@@ -1277,8 +3544,27 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 			queue_fill_transfers(threads, sfd, transfers);
 			sfd->remote_bufsize = sfd->buffer_size;
 		} else {
-			// TODO: detailed damage tracking
-			damage_everything(&sfd->damage);
+			/* Diffs are made from the mapping (or a copy of part of
+			 * it) unless its stride is misaligned; then it is first
+			 * copied into a buffer with the stride of the data
+			 * sent. */
+			uint32_t tx_stride = sfd->dmabuf_info.strides[0];
+			size_t align = 1u << threads->diff_alignment_bits;
+			if (sfd->dmabuf_map_stride != tx_stride &&
+					get_diff_source(threads, sfd) ==
+							DIFF_SOURCE_DIRECT &&
+					!sfd->dmabuf_warped) {
+				sfd->dmabuf_warped = zeroed_aligned_alloc(
+						alignz(sfd->buffer_size, align),
+						align,
+						&sfd->dmabuf_warped_handle);
+				if (!sfd->dmabuf_warped) {
+					wp_error("Failed to allocate warped buffer");
+					return;
+				}
+			}
+			/* Damage is recorded on surface commit, or by
+			 * any other handler that marks the buffer dirty */
 			queue_diff_transfers(threads, sfd, transfers);
 		}
 		/* Unmapping will be handled by finish_update() */
@@ -1360,7 +3646,16 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 					(size_t)sfd->pipe.recv.used);
 			memset(buf + msgsz, 0, alignz(msgsz, 4) - msgsz);
 
-			transfer_add(transfers, alignz(msgsz, 4), buf);
+			/* Shutdown messages must not overtake the data */
+			const struct pipe_state *p = &sfd->pipe;
+			bool shutdown_follows =
+					(!p->can_read && p->remote_can_write) ||
+					(!p->can_write && p->remote_can_read);
+			struct bytebuf msg = {
+					.data = buf, .size = alignz(msgsz, 4)};
+			queue_pipe_transfer(threads, sfd, transfers, msg,
+					(size_t)sfd->pipe.recv.used,
+					shutdown_follows);
 
 			sfd->pipe.recv.used = 0;
 		}
@@ -1406,6 +3701,9 @@ static void increase_buffer_sizes(struct shadow_fd *sfd,
 				sfd->remote_id, strerror(errno));
 		return;
 	}
+	/* Reallocated for the new size when next needed */
+	free(sfd->tile_hashes);
+	sfd->tile_hashes = NULL;
 	/* if resize happens before any transfers, mirror may still be zero */
 	if (sfd->mem_mirror) {
 		// todo: handle allocation failures
@@ -1430,9 +3728,10 @@ static void pipe_close_write(struct shadow_fd *sfd)
 		 */
 		shutdown(sfd->pipe.fd, SHUT_WR);
 	} else {
+		remove_pipe_watch(sfd);
 		checked_close(sfd->pipe.fd);
 		if (sfd->fd_local == sfd->pipe.fd) {
-			sfd->fd_local = -1;
+			set_local_fd(sfd, -1);
 		}
 		sfd->pipe.fd = -1;
 	}
@@ -1441,6 +3740,7 @@ static void pipe_close_write(struct shadow_fd *sfd)
 	/* Also free any accumulated data that was not delivered */
 	free(sfd->pipe.send.data);
 	memset(&sfd->pipe.send, 0, sizeof(sfd->pipe.send));
+	update_pipe_watch(sfd);
 }
 static void pipe_close_read(struct shadow_fd *sfd)
 {
@@ -1450,9 +3750,10 @@ static void pipe_close_read(struct shadow_fd *sfd)
 		// TODO: check return value, can legitimately fail with ENOBUFS
 		shutdown(sfd->pipe.fd, SHUT_RD);
 	} else {
+		remove_pipe_watch(sfd);
 		checked_close(sfd->pipe.fd);
 		if (sfd->fd_local == sfd->pipe.fd) {
-			sfd->fd_local = -1;
+			set_local_fd(sfd, -1);
 		}
 		sfd->pipe.fd = -1;
 	}
@@ -1475,6 +3776,11 @@ static int open_sfd(struct fd_translation_map *map, struct shadow_fd **sfd_ptr,
 				remote_id);
 		return ERR_FATAL;
 	}
+	if (shadow_index_insert(&map->rid_index, remote_id, sfd) == -1) {
+		free(sfd);
+		return ERR_NOMEM;
+	}
+	sfd->map = map;
 	sfd->link.l_prev = &map->link;
 	sfd->link.l_next = map->link.l_next;
 	sfd->link.l_prev->l_next = &sfd->link;
@@ -1506,27 +3812,205 @@ static int check_message_min_size(
 
 	return 0;
 }
-
-static int check_sfd_type_2(struct shadow_fd *sfd, int remote_id,
-		enum wmsg_type mtype, enum fdcat ftype1, enum fdcat ftype2)
+
+static int check_sfd_type_2(struct shadow_fd *sfd, int remote_id,
+		enum wmsg_type mtype, enum fdcat ftype1, enum fdcat ftype2)
+{
+	if (!sfd) {
+		wp_error("shadow structure for RID=%d was not available",
+				remote_id);
+		return ERR_FATAL;
+	}
+	if (sfd->type != ftype1 && sfd->type != ftype2) {
+		wp_error("Trying to apply %s to RID=%d which has incompatible type=%s",
+				wmsg_type_to_str(mtype), remote_id,
+				fdcat_to_str(sfd->type));
+		return ERR_FATAL;
+	}
+	return 0;
+}
+static int check_sfd_type(struct shadow_fd *sfd, int remote_id,
+		enum wmsg_type mtype, enum fdcat ftype)
+{
+	return check_sfd_type_2(sfd, remote_id, mtype, ftype, ftype);
+}
+
+#ifdef HAS_ZSTD
+/** Decompress the next part of one of the buffer's diff history streams, as
+ * given by `stream`. Returns the number of bytes written to `dst`. */
+static size_t uncompress_stream(struct diff_history *history, uint32_t stream,
+		const char *src, size_t src_size, char *dst, size_t dst_size)
+{
+	uint32_t index = stream & ~DIFF_STREAM_RESTART;
+	if (index >= DIFF_STREAM_COUNT) {
+		wp_error("Diff stream index %" PRIu32 " is out of range", index);
+		return 0;
+	}
+	ZSTD_DCtx *dctx = history->dctx[index];
+	if (stream & DIFF_STREAM_RESTART) {
+		if (!dctx) {
+			dctx = ZSTD_createDCtx();
+			history->dctx[index] = dctx;
+		}
+		if (dctx) {
+			ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+		}
+	}
+	if (!dctx) {
+		wp_error("Diff stream %" PRIu32 " was not started", index);
+		return 0;
+	}
+
+	ZSTD_inBuffer in = {.src = src, .size = src_size, .pos = 0};
+	ZSTD_outBuffer out = {.dst = dst, .size = dst_size, .pos = 0};
+	while (in.pos < in.size || out.pos < out.size) {
+		size_t in_prev = in.pos, out_prev = out.pos;
+		size_t r = ZSTD_decompressStream(dctx, &out, &in);
+		if (ZSTD_isError(r)) {
+			wp_error("Zstd stream decompression failed: %s",
+					ZSTD_getErrorName(r));
+			/* Later parts of the stream can not be decoded */
+			ZSTD_freeDCtx(dctx);
+			history->dctx[index] = NULL;
+			return 0;
+		}
+		if (in.pos == in_prev && out.pos == out_prev) {
+			break;
+		}
+	}
+	return out.pos;
+}
+#endif
+
+/* Decompress the body of a fill or diff message into the thread's temporary
+ * buffer. Returns 1 on success, 0 if the update should be dropped, and
+ * ERR_FATAL if the message is invalid. */
+static int uncompress_update(struct thread_data *local, struct shadow_fd *sfd,
+		enum wmsg_type type, const struct bytebuf *msg,
+		const char **act_buffer)
+{
+	size_t header_size, uncomp_size;
+	bool planes = type == WMSG_BUFFER_FILL_PLANES ||
+		      type == WMSG_BUFFER_DIFF_PLANES;
+	if (type == WMSG_BUFFER_FILL || type == WMSG_BUFFER_FILL_PLANES) {
+		const struct wmsg_buffer_fill *header =
+				(const struct wmsg_buffer_fill *)msg->data;
+		header_size = sizeof(struct wmsg_buffer_fill);
+		uncomp_size = header->end - header->start;
+	} else if (type == WMSG_BUFFER_DIFF_STREAM) {
+		const struct wmsg_buffer_diff_stream *header =
+				(const struct wmsg_buffer_diff_stream *)
+						msg->data;
+		header_size = sizeof(struct wmsg_buffer_diff_stream);
+		uncomp_size = (size_t)header->diff_size + header->ntrailing;
+	} else {
+		const struct wmsg_buffer_diff *header =
+				(const struct wmsg_buffer_diff *)msg->data;
+		header_size = sizeof(struct wmsg_buffer_diff);
+		uncomp_size = (size_t)header->diff_size + header->ntrailing;
+	}
+	if (buf_ensure_size((int)uncomp_size, 1, &local->tmp_size,
+			    &local->tmp_buf) == -1 ||
+			(planes && buf_ensure_size((int)uncomp_size, 1,
+						   &local->planes_size,
+						   &local->planes_buf) == -1)) {
+		wp_error("Failed to expand temporary decompression buffer, dropping update");
+		return 0;
+	}
+
+	size_t act_size = 0;
+	if (type == WMSG_BUFFER_DIFF_STREAM) {
+#ifdef HAS_ZSTD
+		const struct wmsg_buffer_diff_stream *header =
+				(const struct wmsg_buffer_diff_stream *)
+						msg->data;
+		act_size = uncompress_stream(sfd->diff_history, header->stream,
+				msg->data + header_size,
+				msg->size - header_size, local->tmp_buf,
+				uncomp_size);
+		*act_buffer = local->tmp_buf;
+#else
+		(void)sfd;
+		wp_error("Cannot decompress %s, as Zstd support is not built in",
+				wmsg_type_to_str(type));
+#endif
+	} else {
+		uncompress_buffer(local->pool, &local->comp_ctx,
+				msg->size - header_size,
+				msg->data + header_size, uncomp_size,
+				planes ? local->planes_buf : local->tmp_buf,
+				&act_size, act_buffer);
+	}
+	// `memsize+8*remote_nthreads` is the worst-case diff
+	// expansion
+	if (act_size != uncomp_size) {
+		wp_error("Transfer size mismatch %zu %zu", act_size,
+				uncomp_size);
+		return ERR_FATAL;
+	}
+	if (planes) {
+		(*local->pool->planes_join_func)(
+				local->tmp_buf, *act_buffer, uncomp_size);
+		*act_buffer = local->tmp_buf;
+	}
+	return 1;
+}
+/* Mark the hashes of the tiles which a fill or diff message, whose header has
+ * been checked, may change as unknown. This must run on the main thread,
+ * before the update is applied, as updates applied in parallel would all
+ * write to the hashes. */
+static void forget_updated_tiles(struct shadow_fd *sfd, enum wmsg_type type,
+		const struct bytebuf *msg)
+{
+	if (type == WMSG_BUFFER_FILL || type == WMSG_BUFFER_FILL_PLANES) {
+		const struct wmsg_buffer_fill *header =
+				(const struct wmsg_buffer_fill *)msg->data;
+		forget_tile_hashes(sfd, header->start, header->end);
+	} else {
+		/* Which intervals a diff touches is only known once it
+		 * has been decompressed */
+		forget_tile_hashes(sfd, 0, sfd->buffer_size);
+	}
+}
+/* Apply a fill or diff message, whose header has been checked, to a FDC_FILE
+ * shadow, after forget_updated_tiles. This only touches the thread's own data
+ * and the shadow's buffers, so it can run on any thread. */
+static int apply_file_update(struct thread_data *local, struct shadow_fd *sfd,
+		enum wmsg_type type, const struct bytebuf *msg)
 {
-	if (!sfd) {
-		wp_error("shadow structure for RID=%d was not available",
-				remote_id);
-		return ERR_FATAL;
+	const char *act_buffer = NULL;
+	int ret = uncompress_update(local, sfd, type, msg, &act_buffer);
+	if (ret != 1) {
+		return ret;
 	}
-	if (sfd->type != ftype1 && sfd->type != ftype2) {
-		wp_error("Trying to apply %s to RID=%d which has incompatible type=%s",
-				wmsg_type_to_str(mtype), remote_id,
-				fdcat_to_str(sfd->type));
-		return ERR_FATAL;
+
+	if (type == WMSG_BUFFER_FILL || type == WMSG_BUFFER_FILL_PLANES) {
+		const struct wmsg_buffer_fill *header =
+				(const struct wmsg_buffer_fill *)msg->data;
+		memcpy(sfd->mem_mirror + header->start, act_buffer,
+				header->end - header->start);
+		memcpy(sfd->mem_local + header->start, act_buffer,
+				header->end - header->start);
+	} else {
+		const struct wmsg_buffer_diff *header =
+				(const struct wmsg_buffer_diff *)msg->data;
+		DTRACE_PROBE2(waypipe, apply_diff_enter, sfd->buffer_size,
+				header->diff_size);
+		apply_diff(sfd->buffer_size, sfd->mem_mirror, sfd->mem_local,
+				header->diff_size, header->ntrailing,
+				act_buffer);
+		DTRACE_PROBE(waypipe, apply_diff_exit);
 	}
 	return 0;
 }
-static int check_sfd_type(struct shadow_fd *sfd, int remote_id,
-		enum wmsg_type mtype, enum fdcat ftype)
+static void worker_run_apply_update(
+		struct task_data *task, struct thread_data *local)
 {
-	return check_sfd_type_2(sfd, remote_id, mtype, ftype, ftype);
+	uint32_t header = ((const uint32_t *)task->update.data)[0];
+	if (apply_file_update(local, task->sfd, transfer_type(header),
+			    &task->update) < 0) {
+		atomic_store(&local->pool->apply_failed, true);
+	}
 }
 
 int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
@@ -1541,7 +4025,8 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 	case WMSG_CLOSE:
 	case WMSG_ACK_NBLOCKS:
 	case WMSG_INJECT_RIDS:
-	case WMSG_PROTOCOL: {
+	case WMSG_PROTOCOL:
+	case WMSG_PROTOCOL_COMPRESSED: {
 		if (wmsg_type_is_known(type)) {
 			wp_error("Unexpected update type: %s",
 					wmsg_type_to_str(type));
@@ -1581,7 +4066,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 			return 0;
 		}
 
-		sfd->fd_local = create_anon_file();
+		set_local_fd(sfd, create_anon_file());
 		if (sfd->fd_local == -1) {
 			wp_error("Failed to create anon file for object %d: %s",
 					sfd->remote_id, strerror(errno));
@@ -1632,10 +4117,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		sfd->mem_mirror = zeroed_aligned_alloc(
 				alignz(sfd->buffer_size, alignment), alignment,
 				&sfd->mem_mirror_handle);
-		sfd->dmabuf_warped = zeroed_aligned_alloc(
-				alignz(sfd->buffer_size, alignment), alignment,
-				&sfd->dmabuf_warped_handle);
-		if (!sfd->mem_mirror || !sfd->dmabuf_warped) {
+		if (!sfd->mem_mirror) {
 			wp_error("Failed to allocate mirror");
 			return 0;
 		}
@@ -1646,16 +4128,16 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		// The file can only actually be created when we know
 		// what type it is?
 		if (init_render_data(render) == -1) {
-			sfd->fd_local = -1;
+			set_local_fd(sfd, -1);
 			return 0;
 		}
 
 		sfd->dmabuf_bo = make_dmabuf(render, &sfd->dmabuf_info);
 		if (!sfd->dmabuf_bo) {
-			sfd->fd_local = -1;
+			set_local_fd(sfd, -1);
 			return 0;
 		}
-		sfd->fd_local = export_dmabuf(sfd->dmabuf_bo);
+		set_local_fd(sfd, export_dmabuf(sfd->dmabuf_bo));
 
 		return 0;
 	}
@@ -1710,7 +4192,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		}
 
 		if (init_render_data(render) == -1) {
-			sfd->fd_local = -1;
+			set_local_fd(sfd, -1);
 			return 0;
 		}
 		sfd->dmabuf_bo = make_dmabuf(render, &sfd->dmabuf_info);
@@ -1720,7 +4202,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 					sizeof(struct dmabuf_slice_data));
 			return 0;
 		}
-		sfd->fd_local = export_dmabuf(sfd->dmabuf_bo);
+		set_local_fd(sfd, export_dmabuf(sfd->dmabuf_bo));
 
 		if (setup_video_decode(sfd, render) == -1) {
 			wp_error("Video decoding setup failed for RID=%d",
@@ -1780,7 +4262,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		}
 
 		if (init_render_data(render) == -1) {
-			sfd->fd_local = -1;
+			set_local_fd(sfd, -1);
 			return 0;
 		}
 
@@ -1790,7 +4272,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 					sfd->remote_id);
 			return 0;
 		}
-		sfd->fd_local = export_dmabuf(sfd->dmabuf_bo);
+		set_local_fd(sfd, export_dmabuf(sfd->dmabuf_bo));
 
 		if (setup_video_encode(sfd, render, threads->nthreads) == -1) {
 			wp_error("Video encoding setup failed for RID=%d",
@@ -1805,6 +4287,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 			return ret;
 		}
 		sfd->type = FDC_PIPE;
+		sfd_list_append(&map->pipes, &sfd->pipe_link);
 
 		int pipedes[2];
 		if (type == WMSG_OPEN_RW_PIPE) {
@@ -1826,19 +4309,19 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		 * read and write from pipe_fd if it exists. */
 		if (type == WMSG_OPEN_IR_PIPE) {
 			// Read end is 0; the other process writes
-			sfd->fd_local = pipedes[1];
+			set_local_fd(sfd, pipedes[1]);
 			sfd->pipe.fd = pipedes[0];
 			sfd->pipe.can_read = true;
 			sfd->pipe.remote_can_write = true;
 		} else if (type == WMSG_OPEN_IW_PIPE) {
 			// Write end is 1; the other process reads
-			sfd->fd_local = pipedes[0];
+			set_local_fd(sfd, pipedes[0]);
 			sfd->pipe.fd = pipedes[1];
 			sfd->pipe.can_write = true;
 			sfd->pipe.remote_can_read = true;
 		} else { // FDC_PIPE_RW
 			// Here, it doesn't matter which end is which
-			sfd->fd_local = pipedes[0];
+			set_local_fd(sfd, pipedes[0]);
 			sfd->pipe.fd = pipedes[1];
 			sfd->pipe.can_read = true;
 			sfd->pipe.can_write = true;
@@ -1851,6 +4334,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 					strerror(errno));
 			return 0;
 		}
+		update_pipe_watch(sfd);
 		return 0;
 	}
 	/* SFD update messages */
@@ -1883,7 +4367,8 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		sfd->remote_bufsize = sfd->buffer_size;
 		return 0;
 	}
-	case WMSG_BUFFER_FILL: {
+	case WMSG_BUFFER_FILL:
+	case WMSG_BUFFER_FILL_PLANES: {
 		if ((ret = check_message_min_size(type, msg,
 				     sizeof(struct wmsg_buffer_fill))) < 0) {
 			return ret;
@@ -1901,22 +4386,6 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		const struct wmsg_buffer_fill *header =
 				(const struct wmsg_buffer_fill *)msg->data;
 
-		size_t uncomp_size = header->end - header->start;
-		struct thread_data *local = &threads->threads[0];
-		if (buf_ensure_size((int)uncomp_size, 1, &local->tmp_size,
-				    &local->tmp_buf) == -1) {
-			wp_error("Failed to expand temporary decompression buffer, dropping update");
-			return 0;
-		}
-
-		const char *act_buffer = NULL;
-		size_t act_size = 0;
-		uncompress_buffer(threads, &threads->threads[0].comp_ctx,
-				msg->size - sizeof(struct wmsg_buffer_fill),
-				msg->data + sizeof(struct wmsg_buffer_fill),
-				uncomp_size, local->tmp_buf, &act_size,
-				&act_buffer);
-
 		// `memsize+8*remote_nthreads` is the worst-case diff
 		// expansion
 		if (header->end > sfd->buffer_size) {
@@ -1924,10 +4393,16 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 					header->end, sfd->buffer_size);
 			return ERR_FATAL;
 		}
-		if (act_size != header->end - header->start) {
-			wp_error("Transfer size mismatch %zu %" PRIu32,
-					act_size, header->end - header->start);
-			return ERR_FATAL;
+		if (sfd->type == FDC_FILE) {
+			forget_updated_tiles(sfd, type, msg);
+			return apply_file_update(
+					&threads->threads[0], sfd, type, msg);
+		}
+
+		const char *act_buffer = NULL;
+		if ((ret = uncompress_update(&threads->threads[0], sfd, type,
+				     msg, &act_buffer)) != 1) {
+			return ret;
 		}
 
 		if (sfd->type == FDC_DMABUF) {
@@ -1976,54 +4451,136 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 			if (unmap_dmabuf(sfd->dmabuf_bo, handle) == -1) {
 				return 0;
 			}
-		} else {
-			memcpy(sfd->mem_mirror + header->start, act_buffer,
-					header->end - header->start);
-			memcpy(sfd->mem_local + header->start, act_buffer,
-					header->end - header->start);
 		}
 		return 0;
 	}
-	case WMSG_BUFFER_DIFF: {
+	case WMSG_BUFFER_COPY_ROWS: {
+		if ((ret = check_message_min_size(type, msg,
+				     sizeof(struct wmsg_buffer_copy_rows))) <
+				0) {
+			return ret;
+		}
+		if ((ret = check_sfd_type(sfd, remote_id, type, FDC_FILE)) <
+				0) {
+			return ret;
+		}
+		if (sfd->file_readonly) {
+			wp_debug("Ignoring a row copy to readonly file at RID=%d",
+					remote_id);
+			return 0;
+		}
+		const struct wmsg_buffer_copy_rows *header =
+				(const struct wmsg_buffer_copy_rows *)msg->data;
+		if (!copy_rows_in_bounds(header, sfd->buffer_size)) {
+			wp_error("Row copy [%" PRIu32 " -> %" PRIu32
+				 ", %" PRIu32 " rows] exceeds buffer size %zu",
+					header->src, header->dst, header->nrows,
+					sfd->buffer_size);
+			return ERR_FATAL;
+		}
+		copy_image_rows(sfd->mem_mirror, header);
+		forget_tile_hashes(sfd, header->dst,
+				header->dst + (header->nrows - 1) *
+								header->stride +
+						header->row_length);
+		copy_image_rows(sfd->mem_local, header);
+		return 0;
+	}
+	case WMSG_COMPRESSION_DICT: {
+		if ((ret = check_message_min_size(type, msg,
+				     sizeof(struct wmsg_basic))) < 0) {
+			return ret;
+		}
+		return receive_compression_dict(threads, msg);
+	}
+	case WMSG_BUFFER_COPY_BLOCK: {
 		if ((ret = check_message_min_size(type, msg,
-				     sizeof(struct wmsg_buffer_diff))) < 0) {
+				     sizeof(struct wmsg_buffer_copy_block))) <
+				0) {
+			return ret;
+		}
+		if ((ret = check_sfd_type(sfd, remote_id, type, FDC_FILE)) <
+				0) {
+			return ret;
+		}
+		const struct wmsg_buffer_copy_block *header =
+				(const struct wmsg_buffer_copy_block *)msg->data;
+		struct shadow_fd *src =
+				get_shadow_for_rid(map, header->src_remote_id);
+		if ((ret = check_sfd_type(src, header->src_remote_id, type,
+				     FDC_FILE)) < 0) {
+			return ret;
+		}
+		if ((uint64_t)header->src_start + header->length >
+						src->buffer_size ||
+				(uint64_t)header->dst_start + header->length >
+						sfd->buffer_size) {
+			wp_error("Block copy from RID=%d [%" PRIu32
+				 ", +%" PRIu32 ") to offset %" PRIu32
+				 " exceeds buffer sizes",
+					header->src_remote_id,
+					header->src_start, header->length,
+					header->dst_start);
+			return ERR_FATAL;
+		}
+		if (sfd->file_readonly) {
+			wp_debug("Ignoring a block copy to readonly file at RID=%d",
+					remote_id);
+			return 0;
+		}
+		memmove(sfd->mem_mirror + header->dst_start,
+				src->mem_mirror + header->src_start,
+				header->length);
+		forget_tile_hashes(sfd, header->dst_start,
+				(size_t)header->dst_start + header->length);
+		memcpy(sfd->mem_local + header->dst_start,
+				sfd->mem_mirror + header->dst_start,
+				header->length);
+		return 0;
+	}
+	case WMSG_BUFFER_DIFF:
+	case WMSG_BUFFER_DIFF_PLANES:
+	case WMSG_BUFFER_DIFF_STREAM: {
+		size_t header_size = sizeof(struct wmsg_buffer_diff);
+		if (type == WMSG_BUFFER_DIFF_STREAM) {
+			header_size = sizeof(struct wmsg_buffer_diff_stream);
+		}
+		if ((ret = check_message_min_size(type, msg, header_size)) <
+				0) {
 			return ret;
 		}
 		if ((ret = check_sfd_type_2(sfd, remote_id, type, FDC_FILE,
 				     FDC_DMABUF)) < 0) {
 			return ret;
 		}
+		if (type == WMSG_BUFFER_DIFF_STREAM &&
+				!get_diff_history(sfd)) {
+			return ERR_NOMEM;
+		}
 		if (sfd->type == FDC_FILE && sfd->file_readonly) {
 			wp_debug("Ignoring a diff update to readonly file at RID=%d",
 					remote_id);
+			if (type == WMSG_BUFFER_DIFF_STREAM) {
+				/* Later diffs on the stream may refer to it */
+				const char *act_buffer = NULL;
+				ret = uncompress_update(&threads->threads[0],
+						sfd, type, msg, &act_buffer);
+				return ret == 1 ? 0 : ret;
+			}
 			return 0;
 		}
 		const struct wmsg_buffer_diff *header =
 				(const struct wmsg_buffer_diff *)msg->data;
-
-		struct thread_data *local = &threads->threads[0];
-		if (buf_ensure_size((int)(header->diff_size +
-						    header->ntrailing),
-				    1, &local->tmp_size,
-				    &local->tmp_buf) == -1) {
-			wp_error("Failed to expand temporary decompression buffer, dropping update");
-			return 0;
+		if (sfd->type == FDC_FILE) {
+			forget_updated_tiles(sfd, type, msg);
+			return apply_file_update(
+					&threads->threads[0], sfd, type, msg);
 		}
 
 		const char *act_buffer = NULL;
-		size_t act_size = 0;
-		uncompress_buffer(threads, &threads->threads[0].comp_ctx,
-				msg->size - sizeof(struct wmsg_buffer_diff),
-				msg->data + sizeof(struct wmsg_buffer_diff),
-				header->diff_size + header->ntrailing,
-				local->tmp_buf, &act_size, &act_buffer);
-
-		// `memsize+8*remote_nthreads` is the worst-case diff
-		// expansion
-		if (act_size != header->diff_size + header->ntrailing) {
-			wp_error("Transfer size mismatch %zu %u", act_size,
-					header->diff_size + header->ntrailing);
-			return ERR_FATAL;
+		if ((ret = uncompress_update(&threads->threads[0], sfd, type,
+				     msg, &act_buffer)) != 1) {
+			return ret;
 		}
 
 		if (sfd->type == FDC_DMABUF) {
@@ -2098,13 +4655,6 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 			if (unmap_dmabuf(sfd->dmabuf_bo, handle) == -1) {
 				return 0;
 			}
-		} else {
-			DTRACE_PROBE2(waypipe, apply_diff_enter,
-					sfd->buffer_size, header->diff_size);
-			apply_diff(sfd->buffer_size, sfd->mem_mirror,
-					sfd->mem_local, header->diff_size,
-					header->ntrailing, act_buffer);
-			DTRACE_PROBE(waypipe, apply_diff_exit);
 		}
 
 		return 0;
@@ -2137,6 +4687,56 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		// The pipe itself will be flushed/or closed later by
 		// flush_writable_pipes
 		sfd->pipe.writable = true;
+		update_pipe_watch(sfd);
+		return 0;
+	}
+	case WMSG_PIPE_TRANSFER_COMPRESSED: {
+		const size_t header_size =
+				sizeof(struct wmsg_pipe_transfer_compressed);
+		if ((ret = check_message_min_size(type, msg, header_size)) <
+				0) {
+			return ret;
+		}
+		if ((ret = check_sfd_type(sfd, remote_id, type, FDC_PIPE)) <
+				0) {
+			return ret;
+		}
+		if (!sfd->pipe.can_write || sfd->pipe.pending_w_shutdown) {
+			wp_debug("Discarding transfer to pipe RID=%d, because pipe cannot be written to",
+					remote_id);
+			return 0;
+		}
+		const struct wmsg_pipe_transfer_compressed *header =
+				(const struct wmsg_pipe_transfer_compressed *)
+						msg->data;
+		if (header->raw_size >= (1u << 30)) {
+			wp_error("Pipe transfer of %u bytes is too large",
+					header->raw_size);
+			return ERR_FATAL;
+		}
+		int netsize = sfd->pipe.send.used + (int)header->raw_size;
+		if (buf_ensure_size(netsize, 1, &sfd->pipe.send.size,
+				    (void **)&sfd->pipe.send.data) == -1) {
+			wp_error("Failed to expand pipe transfer buffer, dropping data");
+			return 0;
+		}
+
+		char *dst = sfd->pipe.send.data + sfd->pipe.send.used;
+		size_t act_size = 0;
+		const char *act_buffer = NULL;
+		uncompress_buffer(threads, &threads->threads[0].comp_ctx,
+				msg->size - header_size,
+				msg->data + header_size, header->raw_size, dst,
+				&act_size, &act_buffer);
+		if (act_size != header->raw_size || act_buffer != dst) {
+			wp_error("Transfer size mismatch %zu %u", act_size,
+					header->raw_size);
+			return ERR_FATAL;
+		}
+		sfd->pipe.send.used = netsize;
+
+		sfd->pipe.writable = true;
+		update_pipe_watch(sfd);
 		return 0;
 	}
 	case WMSG_PIPE_SHUTDOWN_R: {
@@ -2194,6 +4794,139 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 	/* all returns should happen inside switch, so none here */
 }
 
+bool is_async_buffer_update(enum wmsg_type type)
+{
+	return type == WMSG_BUFFER_FILL || type == WMSG_BUFFER_DIFF ||
+	       type == WMSG_BUFFER_DIFF_STREAM ||
+	       type == WMSG_BUFFER_FILL_PLANES ||
+	       type == WMSG_BUFFER_DIFF_PLANES;
+}
+
+int queue_buffer_update(struct fd_translation_map *map,
+		struct thread_pool *threads, struct render_data *render,
+		enum wmsg_type type, int remote_id, const struct bytebuf *msg)
+{
+	struct shadow_fd *sfd = get_shadow_for_rid(map, remote_id);
+	/* Uncompressed updates are applied inline, as there is little to
+	 * gain. So are unusual messages, for which apply_update handles
+	 * errors, and DMABUFs, which must be mapped by the main thread. */
+	bool parallel = threads->nthreads > 1 &&
+			threads->compression != COMP_NONE && sfd &&
+			sfd->type == FDC_FILE && !sfd->file_readonly;
+	uint32_t stream_bit = 0;
+	if (parallel && (type == WMSG_BUFFER_FILL ||
+				 type == WMSG_BUFFER_FILL_PLANES)) {
+		const struct wmsg_buffer_fill *header =
+				(const struct wmsg_buffer_fill *)msg->data;
+		parallel = msg->size >= sizeof(struct wmsg_buffer_fill) &&
+			   header->start <= header->end &&
+			   header->end <= sfd->buffer_size;
+	} else if (parallel && type == WMSG_BUFFER_DIFF_STREAM) {
+		/* Each stream must be decoded in order, so only one update
+		 * per stream may be queued between fences */
+		parallel = msg->size >= sizeof(struct wmsg_buffer_diff_stream) &&
+			   get_diff_history(sfd);
+		if (parallel) {
+			const struct wmsg_buffer_diff_stream *header =
+					(const struct wmsg_buffer_diff_stream *)
+							msg->data;
+			stream_bit = 1u << (header->stream % DIFF_STREAM_COUNT);
+			parallel = !(sfd->diff_history->queued & stream_bit);
+		}
+	} else if (parallel) {
+		parallel = (type == WMSG_BUFFER_DIFF ||
+				   type == WMSG_BUFFER_DIFF_PLANES) &&
+			   msg->size >= sizeof(struct wmsg_buffer_diff);
+	}
+
+	if (parallel) {
+		forget_updated_tiles(sfd, type, msg);
+		struct task_data task;
+		memset(&task, 0, sizeof(task));
+		task.type = TASK_APPLY_UPDATE;
+		task.sfd = sfd;
+		task.update = *msg;
+		/* The main thread only runs these tasks while fencing, so
+		 * spread them over the worker threads */
+		int nworkers = threads->nthreads - 1;
+		for (int k = 0; k < nworkers; k++) {
+			int i = 1 + threads->apply_next_queue;
+			threads->apply_next_queue =
+					(threads->apply_next_queue + 1) %
+					nworkers;
+			struct task_deque *q = &threads->threads[i].apply_queue;
+			if (task_deque_push(q, &task) == -1) {
+				continue;
+			}
+			atomic_fetch_add(&threads->apply_pending, 1);
+			atomic_store(&q->tail, q->pending_tail);
+			if (stream_bit) {
+				sfd->diff_history->queued |= stream_bit;
+			}
+			sfd->refcount.apply = true;
+			sfd_list_append(&map->applying, &sfd->apply_link);
+			wake_workers(threads, 1);
+			return 0;
+		}
+	}
+
+	/* Updates to the same shadow must be applied in order; block copies
+	 * may also read from any other shadow */
+	if ((sfd && sfd->refcount.apply) || type == WMSG_BUFFER_COPY_BLOCK) {
+		int ret = fence_buffer_updates(map, threads);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	return apply_update(map, threads, render, type, remote_id, msg);
+}
+
+int fence_buffer_updates(
+		struct fd_translation_map *map, struct thread_pool *threads)
+{
+	bool waited = false;
+	while (atomic_load_explicit(&threads->apply_pending,
+			       memory_order_acquire) > 0) {
+		struct task_data task;
+		if (take_task(threads, 0, true, &task)) {
+			run_task(&task, &threads->threads[0]);
+			continue;
+		}
+		/* The remaining tasks are already running on workers */
+		struct pollfd pfd = {.fd = threads->completion_r,
+				.events = POLLIN};
+		if (poll(&pfd, 1, threads->completion_r == -1 ? 1 : -1) ==
+						-1 &&
+				errno != EINTR) {
+			wp_error("Failed to poll task completion counter: %s",
+					strerror(errno));
+		}
+		clear_event_counter(threads->completion_r);
+		waited = true;
+	}
+	if (waited) {
+		/* The counter is shared with the outgoing update tasks, whose
+		 * completions may have been cleared above */
+		signal_event_counter(threads->completion_w);
+	}
+
+	while (map->applying.l_next != &map->applying) {
+		struct shadow_fd_link *lcur = map->applying.l_next;
+		sfd_list_remove(lcur);
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, apply_link);
+		cur->refcount.apply = false;
+		if (cur->diff_history) {
+			cur->diff_history->queued = 0;
+		}
+		destroy_shadow_if_unreferenced(cur);
+	}
+
+	if (atomic_exchange(&threads->apply_failed, false)) {
+		return ERR_FATAL;
+	}
+	return 0;
+}
+
 bool shadow_decref_protocol(struct shadow_fd *sfd)
 {
 	sfd->refcount.protocol--;
@@ -2209,7 +4942,7 @@ bool shadow_decref_transfer(struct shadow_fd *sfd)
 		 * the original pipe was introduced */
 		if (sfd->pipe.fd != sfd->fd_local) {
 			checked_close(sfd->fd_local);
-			sfd->fd_local = sfd->pipe.fd;
+			set_local_fd(sfd, sfd->pipe.fd);
 		}
 	}
 	return destroy_shadow_if_unreferenced(sfd);
@@ -2245,36 +4978,67 @@ void decref_transferred_rids(
 	}
 }
 
+int setup_pipe_watch(struct fd_translation_map *map)
+{
+	if (map->pipe_watch_fd == -1) {
+		map->pipe_watch_fd = create_fd_watch_set();
+		if (map->pipe_watch_fd == -1) {
+			wp_debug("Pipes will be polled directly, no watch set: %s",
+					strerror(errno));
+			return -1;
+		}
+		for (struct shadow_fd_link *lcur = map->pipes.l_next;
+				lcur != &map->pipes; lcur = lcur->l_next) {
+			update_pipe_watch(SFD_FROM_LINK(lcur, pipe_link));
+		}
+	}
+	return map->pipe_watch_fd;
+}
+void set_pipe_read_interest(struct fd_translation_map *map, bool check_read)
+{
+	if (map->pipe_check_read == check_read) {
+		return;
+	}
+	map->pipe_check_read = check_read;
+	if (map->pipe_watch_fd == -1) {
+		return;
+	}
+	for (struct shadow_fd_link *lcur = map->pipes.l_next;
+			lcur != &map->pipes; lcur = lcur->l_next) {
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, pipe_link);
+		/* only pipes marked readable change their interest */
+		if (cur->pipe.readable) {
+			update_pipe_watch(cur);
+		}
+	}
+}
+
 int count_npipes(const struct fd_translation_map *map)
 {
+	if (map->pipe_watch_fd != -1) {
+		return map->npipes_unwatched;
+	}
 	int np = 0;
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		if (cur->type == FDC_PIPE) {
-			np++;
-		}
+	for (const struct shadow_fd_link *lcur = map->pipes.l_next;
+			lcur != &map->pipes; lcur = lcur->l_next) {
+		np++;
 	}
 	return np;
 }
 int fill_with_pipes(const struct fd_translation_map *map, struct pollfd *pfds,
 		bool check_read)
 {
+	if (map->pipe_watch_fd != -1 && map->npipes_unwatched == 0) {
+		return 0;
+	}
 	int np = 0;
-	for (struct shadow_fd_link *lcur = map->link.l_next,
+	for (struct shadow_fd_link *lcur = map->pipes.l_next,
 				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		if (cur->type == FDC_PIPE && cur->pipe.fd != -1) {
+			lcur != &map->pipes; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, pipe_link);
+		if (cur->pipe.fd != -1 && !cur->pipe.watched) {
 			pfds[np].fd = cur->pipe.fd;
-			pfds[np].events = 0;
-			if (check_read && cur->pipe.readable) {
-				pfds[np].events |= POLLIN;
-			}
-			if (cur->pipe.send.used > 0) {
-				pfds[np].events |= POLLOUT;
-			}
+			pfds[np].events = pipe_poll_events(cur, check_read);
 			np++;
 		}
 	}
@@ -2284,17 +5048,43 @@ int fill_with_pipes(const struct fd_translation_map *map, struct pollfd *pfds,
 static struct shadow_fd *get_shadow_for_pipe_fd(
 		struct fd_translation_map *map, int pipefd)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
+	/* pipe.fd usually equals fd_local, so try the index first */
+	struct shadow_fd *sfd = get_shadow_for_local_fd(map, pipefd);
+	if (sfd && sfd->type == FDC_PIPE && sfd->pipe.fd == pipefd) {
+		return sfd;
+	}
+	for (struct shadow_fd_link *lcur = map->pipes.l_next,
 				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		if (cur->type == FDC_PIPE && cur->pipe.fd == pipefd) {
+			lcur != &map->pipes; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, pipe_link);
+		if (cur->pipe.fd == pipefd) {
 			return cur;
 		}
 	}
 	return NULL;
 }
 
+static void mark_pipe_status(struct shadow_fd *sfd, short revents)
+{
+	if (revents & POLLIN || revents & POLLHUP) {
+		/* In */
+		sfd->pipe.readable = true;
+	}
+	if (revents & POLLOUT) {
+		sfd->pipe.writable = true;
+	}
+	if (revents & POLLERR) {
+		wp_debug("Pipe poll returned POLLERR for .pipe_fd=%d, closing",
+				sfd->pipe.fd);
+		if (sfd->pipe.can_read) {
+			pipe_close_read(sfd);
+		}
+		if (sfd->pipe.can_write) {
+			pipe_close_write(sfd);
+		}
+	}
+	update_pipe_watch(sfd);
+}
 void mark_pipe_object_statuses(
 		struct fd_translation_map *map, int nfds, struct pollfd *pfds)
 {
@@ -2306,33 +5096,34 @@ void mark_pipe_object_statuses(
 					lfd);
 			continue;
 		}
-		if (pfds[i].revents & POLLIN || pfds[i].revents & POLLHUP) {
-			/* In */
-			sfd->pipe.readable = true;
-		}
-		if (pfds[i].revents & POLLOUT) {
-			sfd->pipe.writable = true;
-		}
-		if (pfds[i].revents & POLLERR) {
-			wp_debug("Pipe poll returned POLLERR for .pipe_fd=%d, closing",
-					lfd);
-			if (sfd->pipe.can_read) {
-				pipe_close_read(sfd);
-			}
-			if (sfd->pipe.can_write) {
-				pipe_close_write(sfd);
-			}
-		}
+		mark_pipe_status(sfd, pfds[i].revents);
+	}
+}
+void collect_pipe_events(struct fd_translation_map *map)
+{
+	if (map->pipe_watch_fd == -1) {
+		return;
+	}
+	/* Events are level-triggered, so any that do not fit are reported
+	 * on the next call */
+	struct fd_watch_event events[64];
+	int n = wait_fd_watch_set(map->pipe_watch_fd, events, 64);
+	if (n == -1 && errno != EINTR) {
+		wp_error("Failed to check pipe watch set: %s", strerror(errno));
+	}
+	for (int i = 0; i < n; i++) {
+		mark_pipe_status((struct shadow_fd *)events[i].data,
+				events[i].revents);
 	}
 }
 
 void flush_writable_pipes(struct fd_translation_map *map)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
+	for (struct shadow_fd_link *lcur = map->pipes.l_next,
 				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *sfd = (struct shadow_fd *)lcur;
-		if (sfd->type != FDC_PIPE || !sfd->pipe.writable ||
+			lcur != &map->pipes; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *sfd = SFD_FROM_LINK(lcur, pipe_link);
+		if (!sfd->pipe.writable ||
 				sfd->pipe.send.used <= 0) {
 			continue;
 		}
@@ -2375,22 +5166,23 @@ void flush_writable_pipes(struct fd_translation_map *map)
 				sfd->pipe.pending_w_shutdown = false;
 			}
 		}
+		update_pipe_watch(sfd);
 	}
 	/* Destroy any new unreferenced objects */
-	for (struct shadow_fd_link *lcur = map->link.l_next,
+	for (struct shadow_fd_link *lcur = map->pipes.l_next,
 				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
+			lcur != &map->pipes; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, pipe_link);
 		destroy_shadow_if_unreferenced(cur);
 	}
 }
 void read_readable_pipes(struct fd_translation_map *map)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
+	for (struct shadow_fd_link *lcur = map->pipes.l_next,
 				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *sfd = (struct shadow_fd *)lcur;
-		if (sfd->type != FDC_PIPE || !sfd->pipe.readable) {
+			lcur != &map->pipes; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *sfd = SFD_FROM_LINK(lcur, pipe_link);
+		if (!sfd->pipe.readable) {
 			continue;
 		}
 
@@ -2401,6 +5193,7 @@ void read_readable_pipes(struct fd_translation_map *map)
 		}
 		if (sfd->pipe.recv.size > sfd->pipe.recv.used) {
 			sfd->pipe.readable = false;
+			update_pipe_watch(sfd);
 			ssize_t changed = read(sfd->pipe.fd,
 					sfd->pipe.recv.data +
 							sfd->pipe.recv.used,
@@ -2429,10 +5222,10 @@ void read_readable_pipes(struct fd_translation_map *map)
 	}
 
 	/* Destroy any new unreferenced objects */
-	for (struct shadow_fd_link *lcur = map->link.l_next,
+	for (struct shadow_fd_link *lcur = map->pipes.l_next,
 				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
+			lcur != &map->pipes; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, pipe_link);
 		destroy_shadow_if_unreferenced(cur);
 	}
 }
@@ -2460,7 +5253,7 @@ void extend_shm_shadow(struct thread_pool *threads, struct shadow_fd *sfd,
 	increase_buffer_sizes(sfd, threads, new_size);
 
 	// leave `sfd->remote_bufsize` unchanged, and mark dirty
-	sfd->is_dirty = true;
+	mark_shadow_dirty(sfd);
 }
 
 void run_task(struct task_data *task, struct thread_data *local)
@@ -2469,34 +5262,74 @@ void run_task(struct task_data *task, struct thread_data *local)
 		worker_run_compress_block(task, local);
 	} else if (task->type == TASK_COMPRESS_DIFF) {
 		worker_run_compress_diff(task, local);
+	} else if (task->type == TASK_COMPRESS_PIPE) {
+		compress_pipe_transfer(local->pool, &local->comp_ctx,
+				task->sfd, &task->pipe_msg);
+		transfer_async_add(task->msg_queue, task->msg_slot,
+				task->pipe_msg.data, task->pipe_msg.size);
+	} else if (task->type == TASK_TRAIN_DICT) {
+#ifdef HAS_ZSTD
+		train_dict_samples(task->trainer);
+#endif
+		/* Background tasks have no output, and are not counted in
+		 * tasks_pending */
+		return;
+	} else if (task->type == TASK_APPLY_UPDATE) {
+		worker_run_apply_update(task, local);
+		atomic_fetch_sub_explicit(&local->pool->apply_pending, 1,
+				memory_order_release);
+		signal_event_counter(local->pool->completion_w);
+		return;
 	} else {
 		wp_error("Unidentified task type");
 	}
+	transfer_async_end(task->msg_queue, task->msg_slot);
+
+	/* The task's output has been published to its msg_queue, so the
+	 * main thread may now treat it as complete */
+	struct thread_pool *pool = local->pool;
+	atomic_fetch_sub_explicit(&pool->tasks_pending, 1, memory_order_release);
+	signal_event_counter(pool->completion_w);
 }
 
 int start_parallel_work(struct thread_pool *pool,
 		struct thread_msg_recv_buf *recv_queue)
 {
-	pthread_mutex_lock(&pool->work_mutex);
 	if (recv_queue->zone_start != recv_queue->zone_end) {
 		wp_error("Some async messages not yet sent");
 	}
 	recv_queue->zone_start = 0;
 	recv_queue->zone_end = 0;
-	int num_mt_tasks = pool->stack_count;
-	if (buf_ensure_size(num_mt_tasks, sizeof(struct iovec),
+	int num_mt_tasks = pool->tasks_unpublished;
+	if (buf_ensure_size(num_mt_tasks, sizeof(struct thread_msg_slot),
 			    &recv_queue->size,
-			    (void **)&recv_queue->data) == -1) {
+			    (void **)&recv_queue->slots) == -1) {
 		wp_error("Failed to provide enough space for receive queue, skipping all work tasks");
-		num_mt_tasks = 0;
+		for (int i = 0; i < pool->nthreads; i++) {
+			struct task_deque *q = &pool->threads[i].queue;
+			q->pending_tail = atomic_load(&q->tail);
+		}
+		atomic_fetch_sub(&pool->tasks_pending, num_mt_tasks);
+		pool->tasks_unpublished = 0;
+		return 0;
+	}
+	pool->tasks_unpublished = 0;
+	if (num_mt_tasks == 0) {
+		return 0;
+	}
+	for (int i = 0; i < num_mt_tasks; i++) {
+		atomic_init(&recv_queue->slots[i].data, NULL);
+		recv_queue->slots[i].size = 0;
 	}
-	pool->do_work = num_mt_tasks > 0;
+	recv_queue->zone_end = num_mt_tasks;
 
-	/* Start the work tasks here */
-	if (num_mt_tasks > 0) {
-		pthread_cond_broadcast(&pool->work_cond);
+	/* Make the new tasks visible all at once */
+	for (int i = 0; i < pool->nthreads; i++) {
+		struct task_deque *q = &pool->threads[i].queue;
+		atomic_store(&q->tail, q->pending_tail);
 	}
-	pthread_mutex_unlock(&pool->work_mutex);
+	/* Wake only as many sleeping workers as there are tasks */
+	wake_workers(pool, num_mt_tasks);
 
 	return num_mt_tasks;
 }
@@ -2504,23 +5337,9 @@ int start_parallel_work(struct thread_pool *pool,
 bool request_work_task(
 		struct thread_pool *pool, struct task_data *task, bool *is_done)
 {
-	pthread_mutex_lock(&pool->work_mutex);
-	*is_done = pool->stack_count == 0 && pool->tasks_in_progress == 0;
-	bool has_task = false;
-	if (pool->stack_count > 0 && pool->do_work) {
-		int i = pool->stack_count - 1;
-		if (pool->stack[i].type != TASK_STOP) {
-			*task = pool->stack[i];
-			has_task = true;
-			pool->stack_count--;
-			pool->tasks_in_progress++;
-			if (pool->stack_count <= 0) {
-				pool->do_work = false;
-			}
-		}
-	}
-	pthread_mutex_unlock(&pool->work_mutex);
-	return has_task;
+	*is_done = atomic_load_explicit(&pool->tasks_pending,
+				   memory_order_acquire) == 0;
+	return take_task(pool, 0, false, task);
 }
 
 static void *worker_thread_main(void *arg)
@@ -2528,40 +5347,27 @@ static void *worker_thread_main(void *arg)
 	struct thread_data *data = arg;
 	struct thread_pool *pool = data->pool;
 
-	/* The loop is globally locked by default, and only unlocked in
-	 * pthread_cond_wait. Yes, there are fancier and faster schemes.
-	 */
-	pthread_mutex_lock(&pool->work_mutex);
-	while (1) {
-		while (!pool->do_work) {
-			pthread_cond_wait(&pool->work_cond, &pool->work_mutex);
-		}
-		if (pool->stack_count <= 0) {
-			pool->do_work = false;
+	while (!atomic_load(&pool->stop)) {
+		/* Prefer received updates, since the main thread will
+		 * eventually wait for them before writing protocol data, and
+		 * leave background tasks until the current frame is done */
+		struct task_data task;
+		if (take_task(pool, data->index, true, &task) ||
+				take_task(pool, data->index, false, &task) ||
+				task_deque_take(&pool->background_queue,
+						&task)) {
+			run_task(&task, data);
 			continue;
 		}
-		/* Copy task, since the queue may be resized */
-		int i = pool->stack_count - 1;
-		struct task_data task = pool->stack[i];
-		if (task.type == TASK_STOP) {
-			break;
-		}
-		pool->tasks_in_progress++;
-		pool->stack_count--;
-		if (pool->stack_count <= 0) {
-			pool->do_work = false;
-		}
-		pthread_mutex_unlock(&pool->work_mutex);
-		run_task(&task, data);
-		pthread_mutex_lock(&pool->work_mutex);
 
-		uint8_t triv = 0;
-		pool->tasks_in_progress--;
-		if (write(pool->selfpipe_w, &triv, 1) == -1) {
-			wp_error("Failed to write to self-pipe");
+		pthread_mutex_lock(&pool->sleep_mutex);
+		atomic_fetch_add(&pool->nsleeping, 1);
+		while (!atomic_load(&pool->stop) && !has_visible_task(pool)) {
+			pthread_cond_wait(&pool->sleep_cond, &pool->sleep_mutex);
 		}
+		atomic_fetch_sub(&pool->nsleeping, 1);
+		pthread_mutex_unlock(&pool->sleep_mutex);
 	}
-	pthread_mutex_unlock(&pool->work_mutex);
 
 	return NULL;
 }
@@ -26,6 +26,7 @@
 #define WAYPIPE_SHADOW_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -41,9 +42,16 @@ typedef VAGenericID VASurfaceID;
 typedef VAGenericID VABufferID;
 typedef struct ZSTD_CCtx_s ZSTD_CCtx;
 typedef struct ZSTD_DCtx_s ZSTD_DCtx;
+typedef struct ZSTD_CDict_s ZSTD_CDict;
+typedef struct ZSTD_DDict_s ZSTD_DDict;
 
 struct comp_ctx {
 	void *lz4_extstate;
+	/* Is lz4_extstate large enough for the LZ4 HC routines */
+	bool lz4_extstate_hc;
+	/* An LZ4_stream_t into which the pool's tx_dict has been loaded, if
+	 * there is one; it is copied into lz4_extstate for each message */
+	void *lz4_dict_state;
 	ZSTD_CCtx *zstd_ccontext;
 	ZSTD_DCtx *zstd_dcontext;
 };
@@ -58,11 +66,98 @@ struct shadow_fd_link {
 	struct shadow_fd_link *l_prev, *l_next; /* Doubly linked list */
 };
 
+/** Open addressing hash table mapping an integer key (a RID or a local fd)
+ * to the shadow structure which currently holds it. */
+struct shadow_index_entry {
+	int key;
+	struct shadow_fd *sfd; /* NULL iff the slot is empty */
+};
+struct shadow_index {
+	struct shadow_index_entry *slots;
+	int size; /* zero or a power of two */
+	int count;
+};
+
+/** Size of the blocks tracked by the deduplication index */
+#define DEDUP_BLOCK_SIZE 4096
+/** Number of entries in the (direct mapped) deduplication index */
+#define BLOCK_INDEX_SIZE (1 << 16)
+
+/** A block of DEDUP_BLOCK_SIZE bytes that the mirror of the file with RID
+ * `remote_id` was expected to hold at `offset`, once queued diffs are done.
+ * Entries are never updated when mirrors change, so the contents must be
+ * compared before use. remote_id is zero for empty entries. */
+struct block_index_entry {
+	uint64_t hash;
+	int32_t remote_id;
+	uint32_t offset;
+};
+
 struct fd_translation_map {
 	struct shadow_fd_link link; /* store in first position */
 
 	int max_local_id;
 	int local_sign;
+
+	/* Lookup tables for the shadow_fds in the list above; kept
+	 * in sync whenever a remote_id or fd_local is assigned */
+	struct shadow_index rid_index;
+	struct shadow_index fd_index;
+
+	/* Subsets of the above list, so that each main loop cycle only
+	 * visits the shadow_fds which might need work. Entries are linked
+	 * via shadow_fd::{dirty,pipe,maybe_unref,apply}_link */
+	/** Shadows to visit on the next collect_dirty_updates() call */
+	struct shadow_fd_link dirty;
+	/** All pipe shadows; these are polled and serviced every cycle */
+	struct shadow_fd_link pipes;
+	/** Shadows which were given thread tasks, and which may become
+	 * unreferenced once finish_dirty_updates() completes them */
+	struct shadow_fd_link maybe_unref;
+	/** Shadows with received updates still being applied by thread
+	 * tasks; released by fence_buffer_updates() */
+	struct shadow_fd_link applying;
+
+	/* If not -1, a watch set (epoll) in which pipes are registered once
+	 * and updated when their interest changes, see setup_pipe_watch() */
+	int pipe_watch_fd;
+	/** Pipes which could not be added to the watch set, and which
+	 * fill_with_pipes() must still provide to poll */
+	int npipes_unwatched;
+	/** Whether watched pipes should currently be checked for reading */
+	bool pipe_check_read;
+	/** Whether collect_update() may send WMSG_BUFFER_COPY_ROWS for image
+	 * contents that were scrolled, instead of diffing them */
+	bool scroll_copy;
+	/** If not NULL, a table of BLOCK_INDEX_SIZE entries, with which
+	 * collect_update() finds changed blocks whose contents are already
+	 * present in a mirror, and sends WMSG_BUFFER_COPY_BLOCK for them */
+	struct block_index_entry *block_index;
+	/** Whether diffs are sent as WMSG_BUFFER_DIFF_STREAM messages, whose
+	 * Zstd streams stay open from one update to the next */
+	bool diff_history;
+};
+
+/** Growable array of tasks for a struct task_deque. A ring that has been
+ * replaced may still be read by other threads, so it is kept (linked through
+ * `retired`) until the pool is cleaned up */
+struct task_ring {
+	struct task_ring *retired;
+	uint32_t mask;
+	struct task_data *tasks;
+};
+
+/** Per-thread task queue. Only the main thread adds tasks; the owning thread
+ * takes tasks from it first, and other threads steal from it when their own
+ * queue is empty. Tasks are taken by a compare-and-swap on `head`. */
+struct task_deque {
+	atomic_uint head;
+	/* End of the tasks visible to other threads */
+	atomic_uint tail;
+	/* Main thread only: end of all queued tasks, published to `tail` by
+	 * start_parallel_work */
+	unsigned int pending_tail;
+	_Atomic(struct task_ring *) ring;
 };
 
 /** Thread pool and associated global information */
@@ -74,28 +169,71 @@ struct thread_pool {
 	 * content and use the same settings */
 	enum compression_mode compression;
 	int compression_level;
+	/* If set, the compression level adapts each frame */
+	struct compression_tuner *comp_tuner;
+	/* If set, samples of small diffs are collected to train a dictionary
+	 * for tx_dict */
+	struct dict_trainer *dict_trainer;
+	/* If set, the dictionaries used for the compressed fills and diffs
+	 * that are sent and received; see WMSG_COMPRESSION_DICT */
+	struct compression_dict *tx_dict;
+	struct compression_dict *rx_dict;
+	/* If set, protocol blocks and pipe transfers are also compressed */
+	bool compress_streams;
+	/* If set, buffers of 4-byte pixels may be split into byte planes
+	 * before compression; see struct planes_tuner */
+	bool split_planes;
 
 	interval_diff_fn_t diff_func;
 	int diff_alignment_bits;
+	tile_accum_fn_t tile_accum_func;
+	planes_fn_t planes_split_func, planes_join_func;
+	/* If set, DMABUF contents are copied out with this before diffing */
+	readback_fn_t readback_func;
+	/* Diff window for new buffers; if diff_window_adapt is set, each
+	 * buffer then chooses its own window; see struct diff_tuner */
+	int diff_window;
+	bool diff_window_adapt;
+	/* If nonzero, the most output space a streamed diff may use; only
+	 * set by tests, to check the fallback for when it runs out */
+	size_t diff_stream_space_limit;
 
 	// Mutable state
-	pthread_mutex_t work_mutex;
-	pthread_cond_t work_cond;
-
-	bool do_work;
-	int stack_count, stack_size;
-	struct task_data *stack;
-	// TODO: distinct queues for wayland->channel and channel->wayland,
-	// to make multithreaded decompression possible
-	int tasks_in_progress;
-
-	// to wake the main loop
-	int selfpipe_r, selfpipe_w;
+	/* Number of tasks queued or running; the pool is idle iff zero */
+	atomic_int tasks_pending;
+	/* Main thread only: tasks queued since the last start_parallel_work,
+	 * and the queue to which the next task will be added */
+	int tasks_unpublished;
+	int next_queue;
+	/* Tasks applying updates received from the channel use a second set
+	 * of queues, so that they can be waited for separately. They are
+	 * published as soon as they are queued. */
+	atomic_int apply_pending;
+	int apply_next_queue;
+	atomic_bool apply_failed;
+	/* Tasks which may run for longer than a frame, like training a
+	 * dictionary. Only worker threads take them, and they are not counted
+	 * in `tasks_pending`, so frames do not wait for them. */
+	struct task_deque background_queue;
+
+	/* Idle workers sleep on this condition, announcing themselves in
+	 * `nsleeping` first so that wakeups need only be sent when useful */
+	pthread_mutex_t sleep_mutex;
+	pthread_cond_t sleep_cond;
+	atomic_int nsleeping;
+	atomic_bool stop;
+
+	/* Event counter, signalled after each completed task to wake the main
+	 * loop; an eventfd on Linux, so _r and _w may be equal */
+	int completion_r, completion_w;
 };
 
 struct thread_data {
 	pthread_t thread;
 	struct thread_pool *pool;
+	int index;
+	struct task_deque queue;
+	struct task_deque apply_queue;
 	/* Thread local data */
 	struct comp_ctx comp_ctx;
 
@@ -103,12 +241,29 @@ struct thread_data {
 	 * compression */
 	void *tmp_buf;
 	int tmp_size;
+	/* A second temporary buffer, for data split into byte planes */
+	void *planes_buf;
+	int planes_size;
+	/* Cacheable tile into which DMABUF contents are read back before
+	 * being diffed; allocated on first use */
+	char *stage_buf;
+	void *stage_handle;
 };
 
 enum task_type {
-	TASK_STOP,
 	TASK_COMPRESS_BLOCK,
 	TASK_COMPRESS_DIFF,
+	TASK_APPLY_UPDATE,
+	TASK_COMPRESS_PIPE,
+	TASK_TRAIN_DICT,
+};
+
+/** Whether a fill or diff task splits its data into byte planes */
+enum planes_mode {
+	PLANES_OFF,
+	PLANES_ON,
+	/* Compress both ways, send the smaller result, and vote for it */
+	PLANES_TRIAL,
 };
 
 /** Specification for a task to be run on another thread */
@@ -122,8 +277,23 @@ struct task_data {
 	struct interval *damage_intervals;
 	int damage_len;
 	bool damaged_end;
+	int diff_window;
+	/* Index of the diff history stream to use, or -1 for none */
+	int stream;
+	/* For fill and diff compression: whether to split byte planes */
+	enum planes_mode planes;
 
 	struct thread_msg_recv_buf *msg_queue;
+	/* Output slot in msg_queue, reserved when the task is queued */
+	int msg_slot;
+	/* For update application: the received fill or diff message, which
+	 * is kept unchanged until the task is done */
+	struct bytebuf update;
+	/* For pipe compression: the WMSG_PIPE_TRANSFER message to compress,
+	 * which the task takes ownership of */
+	struct bytebuf pipe_msg;
+	/* For dictionary training: the trainer whose samples to use */
+	struct dict_trainer *trainer;
 };
 
 /** Shadow object types, signifying file descriptor type and usage */
@@ -136,12 +306,142 @@ enum fdcat {
 	FDC_DMAVID_IW, /* DMABUF-based video, writing to program */
 };
 
+/** Size of the window of each stream in a struct diff_history, in bits */
+#define DIFF_HISTORY_WINDOW_LOG 20
+/** Size of the hash and chain tables of each compression stream in a struct
+ * diff_history, in bits. Left to the compression level, these reach several
+ * MiB per stream, even with a small window; with this limit, a stream needs
+ * about 2.5 MiB to compress and 1.5 MiB to decompress. */
+#define DIFF_HISTORY_TABLE_LOG 16
+
+/** Per-buffer Zstd streams for WMSG_BUFFER_DIFF_STREAM, which are kept open
+ * so that a diff can refer to the diffs sent before it. The n-th diff task
+ * of each update uses stream n, so no two tasks share one. */
+struct diff_history {
+	ZSTD_CCtx *cctx[DIFF_STREAM_COUNT];
+	ZSTD_DCtx *dctx[DIFF_STREAM_COUNT];
+	/* Sending side: whether the remote side has been told of the start
+	 * of each stream, and the compression level it was started with */
+	bool started[DIFF_STREAM_COUNT];
+	int level[DIFF_STREAM_COUNT];
+	/* Receiving side, main thread only: mask of the streams with an
+	 * update queued since the last fence_buffer_updates() */
+	uint32_t queued;
+};
+
+/** Number of window sizes compared by a struct diff_tuner */
+#define DIFF_WINDOW_CHOICES 6
+
+/** Per-buffer state for choosing the diff window which minimizes the cost,
+ * per damaged byte, of diffing and compressing a buffer and sending the
+ * result. Most diffs use the best window so far; some try a neighbor. */
+struct diff_tuner {
+	/* Index of the window used by the diff tasks now queued */
+	int choice;
+	int best;
+	uint32_t ndiffs;
+	/* Smoothed cost for each window, or negative if not yet measured */
+	float cost[DIFF_WINDOW_CHOICES];
+	/* Damaged bytes, output bytes, and nanoseconds of work of the diff
+	 * tasks now queued, accumulated by the worker threads */
+	atomic_uint_least64_t damage, output, time_ns;
+};
+
+/** Per-buffer state for deciding whether splitting 4-byte pixels into byte
+ * planes makes the buffer compress better. This depends on the content:
+ * photos and video gain, while flat UI and text often lose. The first
+ * update and every PLANES_TRIAL_INTERVAL-th after it are trials. */
+struct planes_tuner {
+	uint32_t nupdates;
+	bool split;
+	/* Whether the tasks now queued are trials */
+	bool trial;
+	/* Net votes of the trial tasks now queued for splitting */
+	atomic_int votes;
+};
+#define PLANES_TRIAL_INTERVAL 8
+
+/** Number of compression levels compared by a struct compression_tuner */
+#define COMPRESSION_CHOICES 8
+
+/** State for choosing, once per frame, the compression level for the next
+ * frame. The cost of a level, per input byte, is its measured compression
+ * time split over the worker threads, plus its output ratio divided by the
+ * rate at which the channel currently drains; a slow link thus favors
+ * stronger levels, and a fast one cheaper levels. */
+struct compression_tuner {
+	const int *levels;
+	int nlevels;
+	/* Index of the level used for the frame being compressed */
+	int choice;
+	uint32_t nframes;
+	/* Smoothed nanoseconds of compression per input byte, and ratio of
+	 * output to input bytes, or negative if not yet measured */
+	float ns_per_byte[COMPRESSION_CHOICES];
+	float ratio[COMPRESSION_CHOICES];
+	/* Input bytes, output bytes, and nanoseconds spent compressing the
+	 * current frame, accumulated by the worker threads */
+	atomic_uint_least64_t input, output, time_ns;
+};
+
+/** Maximum size of a trained compression dictionary */
+#define COMPRESSION_DICT_SIZE (1u << 14)
+/** Only diffs (or parts of diffs) this small are used to train it */
+#define COMPRESSION_DICT_SAMPLE_MAX 4096
+/** The dictionary is trained once this many samples, or this many bytes of
+ * samples, have been collected */
+#define COMPRESSION_DICT_SAMPLES 512
+#define COMPRESSION_DICT_TRAIN_BYTES (1u << 17)
+
+/** Protocol blocks and pipe transfers smaller than this are sent raw */
+#define STREAM_COMPRESS_MIN 512
+/** After a pipe transfer fails to compress to 7/8 of its size, this many
+ * of the pipe's next transfers are sent raw without trying */
+#define STREAM_COMPRESS_SKIP 16
+
+/** Samples of small diffs collected by the worker threads, from which a
+ * dictionary is trained by a TASK_TRAIN_DICT task */
+struct dict_trainer {
+	pthread_mutex_t lock;
+	char *samples;
+	size_t used;
+	size_t sizes[COMPRESSION_DICT_SAMPLES];
+	int count;
+	/* Set once training has been queued; no samples are added after */
+	bool training;
+	/* Set by the training task when `data` and `size` hold its result;
+	 * `data` is NULL if training failed */
+	atomic_bool trained;
+	char *data;
+	size_t size;
+};
+
+/** A dictionary with which compressed fills and diffs are made or read. It
+ * is only replaced while no thread tasks are running. */
+struct compression_dict {
+	char *data;
+	size_t size;
+	/* Prepared forms of the dictionary for Zstd; the compression level of
+	 * `cdict` is `cdict_level` */
+	ZSTD_CDict *cdict;
+	int cdict_level;
+	ZSTD_DDict *ddict;
+};
+
 struct pipe_buffer {
 	char *data;
 	int size;
 	int used;
 };
 
+/** Rows of an image inside a file */
+struct image_rows {
+	uint32_t start;
+	uint32_t stride;
+	uint32_t row_length; /* zero if there is no image */
+	uint32_t nrows;
+};
+
 /** Reference count for a struct shadow_fd; the object can be safely deleted
  * iff all counts are zero/false. */
 struct refcount {
@@ -152,6 +452,8 @@ struct refcount {
 	int transfer;
 	/** Do any thread tasks potentially refer to this */
 	bool compute;
+	/** Are received updates to this still being applied by thread tasks */
+	bool apply;
 };
 
 struct pipe_state {
@@ -173,6 +475,13 @@ struct pipe_state {
 	 * (POLLIN|POLLHUP -> readable ; POLLOUT -> writeable) */
 	bool readable, writable;
 	bool pending_w_shutdown;
+	/** How many more transfers to send raw, as recent ones were found to
+	 * be incompressible */
+	int compress_skip;
+	/** Is `fd` registered in the map's watch set, and for which events;
+	 * or has registering it failed, so that it must be polled */
+	bool watched, unwatchable;
+	short watch_events;
 };
 
 /**
@@ -183,6 +492,11 @@ struct pipe_state {
  */
 struct shadow_fd {
 	struct shadow_fd_link link; /* part of doubly linked list */
+	/* The map whose list and indices contain this structure */
+	struct fd_translation_map *map;
+	/* Links into the map's work lists; l_next is NULL when not linked */
+	struct shadow_fd_link dirty_link, pipe_link, maybe_unref_link;
+	struct shadow_fd_link apply_link;
 
 	enum fdcat type;
 	int remote_id; // + if created serverside; - if created clientside
@@ -208,10 +522,25 @@ struct shadow_fd {
 	/* exact mirror of the contents, with proper alignment */
 	char *mem_mirror;
 	void *mem_mirror_handle;
+	/* For files being diffed, hashes of each DIFF_TILE_SIZE tile of the
+	 * mirror, or zero if unknown; see construct_diff_tiled */
+	uint64_t *tile_hashes;
+	/* If not NULL, used to choose the window for the next diff */
+	struct diff_tuner *diff_tuner;
+	/* If not NULL, the Zstd streams used for this buffer's diffs */
+	struct diff_history *diff_history;
+	/* If not NULL, decides whether the buffer is split into byte planes */
+	struct planes_tuner *planes_tuner;
 
 	// File data
 	size_t remote_bufsize; // used to check for and send file extensions
 	bool file_readonly;
+	/* The image most recently committed from this file; searched for
+	 * scrolled rows on the next update, and then cleared */
+	struct image_rows scroll_image;
+	/* Bytes per pixel of that image's format, or 0 if unknown; byte
+	 * planes are only split for 4-byte pixels */
+	int pixel_bytes;
 
 	// Pipe data
 	struct pipe_state pipe;
@@ -222,7 +551,7 @@ struct shadow_fd {
 	void *dmabuf_map_handle; /* Nonnull when DMABUF is currently mapped */
 	uint32_t dmabuf_map_stride; /* stride at which mem_local is mapped */
 	/* temporary cache of stride-fixed mem_local. Same dimensions as
-	 * mem_mirror */
+	 * mem_mirror; only allocated if mem_local cannot be diffed directly */
 	char *dmabuf_warped;
 	void *dmabuf_warped_handle;
 
@@ -247,10 +576,54 @@ const char *compression_mode_to_str(enum compression_mode mode);
 
 void setup_translation_map(struct fd_translation_map *map, bool display_side);
 void cleanup_translation_map(struct fd_translation_map *map);
+/** Allocate map->block_index; returns -1 on failure */
+int enable_block_dedup(struct fd_translation_map *map);
 
 int setup_thread_pool(struct thread_pool *pool,
 		enum compression_mode compression, int compression_level,
 		int n_threads);
+/** Let the compression level adapt to the content and the channel, starting
+ * from the configured level. Returns -1 if the compression mode has no
+ * levels, or on allocation failure. */
+int enable_compression_tuner(struct thread_pool *pool);
+/** Once all updates of a frame are compressed, choose the level for the next
+ * frame. `drain_rate` is the rate in bytes/nsec at which the channel accepts
+ * data when backlogged, or zero if it has kept up. */
+void tune_compression(struct thread_pool *pool, double drain_rate);
+/** Collect samples of small diffs, to train a dictionary for compression.
+ * Returns -1 if dictionaries can not be trained for the compression mode,
+ * or on allocation failure. */
+int enable_dict_training(struct thread_pool *pool);
+/** Once enough samples have been collected, queue a task to train a
+ * dictionary; once it is trained, append a WMSG_COMPRESSION_DICT message
+ * with it to `transfers`, and compress later messages with it. Must be
+ * called once each frame, while no frame tasks run. */
+void update_compression_dict(
+		struct thread_pool *pool, struct transfer_queue *transfers);
+/** Also compress protocol blocks and pipe transfers, using the messages
+ * WMSG_PROTOCOL_COMPRESSED and WMSG_PIPE_TRANSFER_COMPRESSED. Returns -1 if
+ * the compression mode is COMP_NONE. */
+int enable_stream_compression(struct thread_pool *pool);
+/** Allow buffers of 4-byte pixels to be split into byte planes before they
+ * are compressed, where this helps; see WMSG_BUFFER_FILL_PLANES. Returns -1
+ * if the compression mode is COMP_NONE. */
+int enable_plane_split(struct thread_pool *pool);
+/** If stream compression is enabled and worthwhile, make a padded
+ * WMSG_PROTOCOL_COMPRESSED message from the protocol data, setting
+ * `*msg_size`; otherwise return NULL. Main thread only. */
+void *compress_protocol_block(struct thread_pool *pool, const char *data,
+		size_t size, size_t *msg_size);
+/** Decompress the WMSG_PROTOCOL_COMPRESSED message `msg` into `dst`, which
+ * is grown as needed, setting dst->zone_end to the protocol data length.
+ * Returns -1 on failure. Main thread only. */
+int uncompress_protocol_block(struct thread_pool *pool,
+		const struct bytebuf *msg, struct char_window *dst);
+/** Select the diff kernel: DIFF_FASTEST times the available kernels on a
+ * test buffer and picks the fastest, while other types force a kernel. If
+ * `window` is zero, each buffer adapts its own diff window. Returns -1 if
+ * the kernel is not available, leaving the pool unchanged. */
+int configure_diff_kernel(
+		struct thread_pool *pool, enum diff_type type, int window);
 void cleanup_thread_pool(struct thread_pool *pool);
 
 /** Given a file descriptor, return which type code would be applied to its
@@ -278,6 +651,17 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *cur,
  * related data. The caller should then invoke destroy_shadow_if_unreferenced.
  */
 void finish_update(struct shadow_fd *sfd);
+/** Set the is_dirty flag of a shadow structure, and queue it to be visited by
+ * the next collect_dirty_updates() call. */
+void mark_shadow_dirty(struct shadow_fd *sfd);
+/** Run collect_update on all shadows marked dirty since the last call, and on
+ * all pipes, destroying pipes which are no longer referenced. */
+void collect_dirty_updates(struct fd_translation_map *map,
+		struct thread_pool *threads, struct transfer_queue *transfers,
+		bool use_old_dmavid_req);
+/** Run finish_update on all shadows which were given thread tasks, and destroy
+ * any which are now unreferenced. */
+void finish_dirty_updates(struct fd_translation_map *map);
 /** Apply a data update message to an element in the translation map, creating
  * an entry when there is none.
  *
@@ -287,23 +671,52 @@ void finish_update(struct shadow_fd *sfd);
 int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		struct render_data *render, enum wmsg_type type, int remote_id,
 		const struct bytebuf *msg);
+/** Whether a message of this type is a fill or diff which is not fenced
+ * before it is handled, and which queue_buffer_update may apply from the
+ * message on a worker thread. */
+bool is_async_buffer_update(enum wmsg_type type);
+/** Like apply_update, for WMSG_BUFFER_FILL, WMSG_BUFFER_DIFF,
+ * WMSG_BUFFER_DIFF_STREAM, WMSG_BUFFER_COPY_ROWS and WMSG_BUFFER_COPY_BLOCK
+ * messages, but if
+ * worthwhile, decompress and apply it on the thread pool. The message must
+ * stay unchanged until the update is done, i.e., while
+ * `threads->apply_pending` is nonzero. fence_buffer_updates
+ * must be called before anything else which may read the shadow contents, or
+ * depends on the order of the updates. */
+int queue_buffer_update(struct fd_translation_map *map,
+		struct thread_pool *threads, struct render_data *render,
+		enum wmsg_type type, int remote_id, const struct bytebuf *msg);
+/** Wait for all updates queued by queue_buffer_update to be applied, helping
+ * from the main thread. Returns -1 if any of the updates were invalid. */
+int fence_buffer_updates(
+		struct fd_translation_map *map, struct thread_pool *threads);
 /** Get the shadow structure associated to a remote id, or NULL if it dne */
 struct shadow_fd *get_shadow_for_rid(struct fd_translation_map *map, int rid);
 /** Get shadow structure for a local file descriptor, or NULL if it dne */
 struct shadow_fd *get_shadow_for_local_fd(
 		struct fd_translation_map *map, int lfd);
 
-/** Count the number of pipe fds being maintained by the translation map */
+/** Register pipes in a watch set, kept up to date as they are created and
+ * change state, so that only pipes that are not in the set need to be
+ * polled directly. Returns the fd of the set, which polls readable when
+ * collect_pipe_events() should be called, or -1 if unsupported. */
+int setup_pipe_watch(struct fd_translation_map *map);
+/** Set whether pipes should be checked for reading */
+void set_pipe_read_interest(struct fd_translation_map *map, bool check_read);
+/** Count the number of pipe fds that must be passed to poll */
 int count_npipes(const struct fd_translation_map *map);
 /** Fill in pollfd entries, with POLLIN | POLLOUT, for applicable pipe objects.
  * Specifically, if check_read is true, indicate all readable pipes.
- * Also, indicate all writeable pipes for which we also something to write. */
+ * Also, indicate all writeable pipes for which we also something to write.
+ * Pipes in the watch set are skipped. */
 int fill_with_pipes(const struct fd_translation_map *map, struct pollfd *pfds,
 		bool check_read);
 
 /** mark pipe shadows as being ready to read or write */
 void mark_pipe_object_statuses(
 		struct fd_translation_map *map, int nfds, struct pollfd *pfds);
+/** mark pipe shadows in the watch set that are ready to read or write */
+void collect_pipe_events(struct fd_translation_map *map);
 /** For pipes marked writeable, flush as much buffered data as possible */
 void flush_writable_pipes(struct fd_translation_map *map);
 /** For pipes marked readable, read as much data as possible without blocking */
@@ -342,11 +755,12 @@ void extend_shm_shadow(struct thread_pool *threads, struct shadow_fd *sfd,
  * and return the total number of tasks */
 int start_parallel_work(struct thread_pool *pool,
 		struct thread_msg_recv_buf *recv_queue);
-/** Return true if there is a work task (not a stop task) remaining for the
- * main thread to work on; also set *is_done if all tasks have completed. */
+/** Return true if there is a work task remaining for the main thread to work
+ * on; also set *is_done if all tasks have completed. */
 bool request_work_task(struct thread_pool *pool, struct task_data *task,
 		bool *is_done);
-/** Run a work task */
+/** Run a work task, then mark it as completed and signal the pool's
+ * completion counter */
 void run_task(struct task_data *task, struct thread_data *local);
 
 // video.c
@@ -564,6 +564,14 @@ static const char *const wmsg_types[] = {
 		"WMSG_CLOSE",
 		"WMSG_OPEN_DMAVID_SRC_V2",
 		"WMSG_OPEN_DMAVID_DST_V2",
+		"WMSG_BUFFER_COPY_ROWS",
+		"WMSG_BUFFER_COPY_BLOCK",
+		"WMSG_BUFFER_DIFF_STREAM",
+		"WMSG_COMPRESSION_DICT",
+		"WMSG_PROTOCOL_COMPRESSED",
+		"WMSG_PIPE_TRANSFER_COMPRESSED",
+		"WMSG_BUFFER_FILL_PLANES",
+		"WMSG_BUFFER_DIFF_PLANES",
 };
 const char *wmsg_type_to_str(enum wmsg_type tp)
 {
@@ -611,37 +619,55 @@ int transfer_add(struct transfer_queue *w, size_t size, void *data)
 	return 0;
 }
 
-void transfer_async_add(struct thread_msg_recv_buf *q, void *data, size_t sz)
+/* Marks slots which are finished but hold no message */
+static char empty_slot_marker;
+
+void transfer_async_add(
+		struct thread_msg_recv_buf *q, int slot, void *data, size_t sz)
 {
-	struct iovec vec;
-	vec.iov_len = sz;
-	vec.iov_base = data;
-	pthread_mutex_lock(&q->lock);
-	q->data[q->zone_end++] = vec;
-	pthread_mutex_unlock(&q->lock);
+	q->slots[slot].size = sz;
+	atomic_store_explicit(&q->slots[slot].data,
+			data ? data : &empty_slot_marker, memory_order_release);
+}
+
+void transfer_async_end(struct thread_msg_recv_buf *q, int slot)
+{
+	/* Only the task owning the slot writes to it while it is empty */
+	if (!atomic_load_explicit(&q->slots[slot].data, memory_order_relaxed)) {
+		atomic_store_explicit(&q->slots[slot].data, &empty_slot_marker,
+				memory_order_release);
+	}
 }
 
 int transfer_load_async(struct transfer_queue *w)
 {
-	pthread_mutex_lock(&w->async_recv_queue.lock);
-	int zstart = w->async_recv_queue.zone_start;
-	int zend = w->async_recv_queue.zone_end;
-	w->async_recv_queue.zone_start = zend;
-	pthread_mutex_unlock(&w->async_recv_queue.lock);
-
-	for (int i = zstart; i < zend; i++) {
-		struct iovec v = w->async_recv_queue.data[i];
-		memset(&w->async_recv_queue.data[i], 0, sizeof(struct iovec));
-		if (v.iov_len == 0 || v.iov_base == NULL) {
-			wp_error("Unexpected empty message");
+	struct thread_msg_recv_buf *q = &w->async_recv_queue;
+	bool prefix_done = true;
+	for (int i = q->zone_start; i < q->zone_end; i++) {
+		struct thread_msg_slot *slot = &q->slots[i];
+		void *data = atomic_load_explicit(
+				&slot->data, memory_order_acquire);
+		if (!data) {
+			/* Task still running; later slots may be ready */
+			prefix_done = false;
 			continue;
 		}
-		/* Only fill/diff messages are received async, so msgno
-		 * is always incremented */
-		if (transfer_add(w, v.iov_len, v.iov_base) == -1) {
-			wp_error("Failed to add message to transfer queue");
-			pthread_mutex_unlock(&w->async_recv_queue.lock);
-			return -1;
+		if (data != &empty_slot_marker) {
+			/* Only buffer and pipe updates are received async,
+			 * so msgno is always incremented */
+			if (slot->size == 0) {
+				wp_error("Unexpected empty message");
+				free(data);
+			} else if (transfer_add(w, slot->size, data) == -1) {
+				/* Slot is kept and retried on the next call */
+				wp_error("Failed to add message to transfer queue");
+				return -1;
+			}
+			atomic_store_explicit(&slot->data, &empty_slot_marker,
+					memory_order_relaxed);
+		}
+		if (prefix_done) {
+			q->zone_start = i + 1;
 		}
 	}
 	return 0;
@@ -649,12 +675,14 @@ int transfer_load_async(struct transfer_queue *w)
 
 void cleanup_transfer_queue(struct transfer_queue *td)
 {
-	for (int i = td->async_recv_queue.zone_start;
-			i < td->async_recv_queue.zone_end; i++) {
-		free(td->async_recv_queue.data[i].iov_base);
+	struct thread_msg_recv_buf *q = &td->async_recv_queue;
+	for (int i = q->zone_start; i < q->zone_end; i++) {
+		void *data = atomic_load(&q->slots[i].data);
+		if (data != &empty_slot_marker) {
+			free(data);
+		}
 	}
-	pthread_mutex_destroy(&td->async_recv_queue.lock);
-	free(td->async_recv_queue.data);
+	free(q->slots);
 	for (int i = 0; i < td->end; i++) {
 		if (!td->meta[i].static_alloc) {
 			free(td->vecs[i].iov_base);
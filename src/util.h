@@ -27,6 +27,7 @@
 
 #include <assert.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -187,6 +188,10 @@ size_t print_wrapped_error(char *dest, size_t dest_space, const char *message);
  * depending on its flags and local capabilities. */
 #define CONN_NO_DMABUF_SUPPORT (0x1u << 2)
 
+/** The waypipe-server sets this to ask that both sides send diffs as
+ * WMSG_BUFFER_DIFF_STREAM messages, when using Zstd compression. */
+#define CONN_ZSTD_HISTORY (0x1u << 3)
+
 /** Indicate which compression format the waypipe-server can accept. For
  * backwards compatibility, if none of these flags is set, assume the server and
  * client match. */
@@ -353,6 +358,39 @@ enum wmsg_type {
 	 * to produce/consume video frames. Format: \ref wmsg_open_dmavid */
 	WMSG_OPEN_DMAVID_SRC_V2,
 	WMSG_OPEN_DMAVID_DST_V2,
+	/** Move rows of an image inside the file, as when its contents
+	 * scroll. Diffs that follow are relative to the moved contents.
+	 * Only sent if enabled by option. Format: \ref wmsg_buffer_copy_rows */
+	WMSG_BUFFER_COPY_ROWS,
+	/** Copy a range of the mirror of a (possibly different) file into
+	 * the file. Only sent if enabled by option.
+	 * Format: \ref wmsg_buffer_copy_block */
+	WMSG_BUFFER_COPY_BLOCK,
+	/** Apply a diff to the file, whose contents are the next part of one
+	 * of the file's Zstd streams; each stream is kept open between
+	 * messages, so that it can refer to earlier diffs. Only sent if
+	 * enabled by option. Format: \ref wmsg_buffer_diff_stream */
+	WMSG_BUFFER_DIFF_STREAM,
+	/** Provide a dictionary with which all later compressed fills and
+	 * diffs (except those on diff streams) are compressed. Only sent if
+	 * enabled by option. Format: \ref wmsg_basic, with a remote_id of
+	 * zero, followed by the dictionary */
+	WMSG_COMPRESSION_DICT,
+	/** Like WMSG_PROTOCOL, but with the protocol messages compressed
+	 * according to the global compression option. Only sent if enabled
+	 * by option. Format: \ref wmsg_protocol_compressed */
+	WMSG_PROTOCOL_COMPRESSED,
+	/** Like WMSG_PIPE_TRANSFER, but with the data compressed according to
+	 * the global compression option. Only sent if enabled by option.
+	 * Format: \ref wmsg_pipe_transfer_compressed */
+	WMSG_PIPE_TRANSFER_COMPRESSED,
+	/** Like WMSG_BUFFER_FILL, but the data was split into byte planes
+	 * (see planes_fn_t) before it was compressed. Only sent if enabled by
+	 * option. Format: \ref wmsg_buffer_fill */
+	WMSG_BUFFER_FILL_PLANES,
+	/** Like WMSG_BUFFER_DIFF, but the diff was split into byte planes
+	 * before it was compressed. Format: \ref wmsg_buffer_diff */
+	WMSG_BUFFER_DIFF_PLANES,
 };
 const char *wmsg_type_to_str(enum wmsg_type tp);
 bool wmsg_type_is_known(enum wmsg_type tp);
@@ -404,6 +442,63 @@ struct wmsg_buffer_diff {
 };
 static_assert(sizeof(struct wmsg_buffer_diff) == 16, "size check");
 
+/** Number of Zstd streams each file may use for WMSG_BUFFER_DIFF_STREAM */
+#define DIFF_STREAM_COUNT 16
+/** Flag in wmsg_buffer_diff_stream::stream; when set, the stream restarts
+ * with this message, and earlier messages on it may be forgotten. */
+#define DIFF_STREAM_RESTART (0x1u << 31)
+
+/** Format of WMSG_BUFFER_DIFF_STREAM; only the stream index is added to
+ * \ref wmsg_buffer_diff. Messages on a stream must be decompressed in the
+ * order they were sent; messages replayed after a reconnection are skipped
+ * as duplicates, so the streams on both sides stay in step. */
+struct wmsg_buffer_diff_stream {
+	uint32_t size_and_type;
+	int32_t remote_id;
+	uint32_t diff_size; /**< in bytes, when uncompressed */
+	uint32_t ntrailing; /**< number of 'trailing' bytes, copied to tail */
+	uint32_t stream; /**< stream index, and DIFF_STREAM_RESTART */
+	/* following this, the Zstd stream data, ending with a flush */
+};
+static_assert(sizeof(struct wmsg_buffer_diff_stream) == 20, "size check");
+
+struct wmsg_buffer_copy_rows {
+	uint32_t size_and_type;
+	int32_t remote_id;
+	uint32_t src; /**< start of the first row to read */
+	uint32_t dst; /**< start of the first row to write */
+	uint32_t row_length; /**< bytes per row */
+	uint32_t nrows;
+	uint32_t stride; /**< spacing between row starts */
+};
+static_assert(sizeof(struct wmsg_buffer_copy_rows) == 28, "size check");
+
+struct wmsg_buffer_copy_block {
+	uint32_t size_and_type;
+	int32_t remote_id;
+	int32_t src_remote_id; /**< file from whose mirror data is read */
+	uint32_t src_start;
+	uint32_t dst_start;
+	uint32_t length;
+};
+static_assert(sizeof(struct wmsg_buffer_copy_block) == 24, "size check");
+
+struct wmsg_protocol_compressed {
+	uint32_t size_and_type;
+	uint32_t raw_size; /**< in bytes, when uncompressed */
+	/* following this, the compressed protocol messages */
+};
+static_assert(sizeof(struct wmsg_protocol_compressed) == 8, "size check");
+
+struct wmsg_pipe_transfer_compressed {
+	uint32_t size_and_type;
+	int32_t remote_id;
+	uint32_t raw_size; /**< in bytes, when uncompressed */
+	/* following this, the compressed data */
+};
+static_assert(sizeof(struct wmsg_pipe_transfer_compressed) == 12,
+		"size check");
+
 struct wmsg_basic {
 	uint32_t size_and_type;
 	int32_t remote_id;
@@ -434,17 +529,21 @@ static inline enum wmsg_type transfer_type(uint32_t header)
 	return (enum wmsg_type)(header & ((1u << 5) - 1));
 }
 
+/** A message slot in a \ref thread_msg_recv_buf. The slot is empty while
+ * `data` is NULL; a worker fills it by setting `size` and then `data`. */
+struct thread_msg_slot {
+	_Atomic(void *) data;
+	size_t size;
+};
 /** Worker tasks write their resulting messages to this receive buffer,
  * and the main thread periodically checks the messages and appends the results
- * to the main thread. */
+ * to the main thread. Each task is assigned its own slot before it starts, so
+ * workers never contend with each other, and neither side takes a lock. */
 struct thread_msg_recv_buf {
-	// TODO: make this lock free, using the fact that valid iovecs have
-	// nonzero fields
-	struct iovec *data;
-	/** [zone_start, zone_end] contains the set of entries which might
-	 * contain data */
+	struct thread_msg_slot *slots;
+	/** [zone_start, zone_end) contains the set of slots which might
+	 * contain data; only the main thread changes these */
 	int zone_start, zone_end, size;
-	pthread_mutex_t lock;
 };
 static inline int msgno_gt(uint32_t a, uint32_t b)
 {
@@ -490,13 +589,78 @@ int transfer_add(struct transfer_queue *transfers, size_t size, void *data);
 void cleanup_transfer_queue(struct transfer_queue *transfers);
 /** Move any asynchronously loaded messages to the queue */
 int transfer_load_async(struct transfer_queue *w);
-/** Add a message to the async queue */
-void transfer_async_add(struct thread_msg_recv_buf *q, void *data, size_t sz);
+/** Add a message to the async queue, at the slot reserved for the task */
+void transfer_async_add(
+		struct thread_msg_recv_buf *q, int slot, void *data, size_t sz);
+/** Mark a task's slot as finished, if no message was added to it */
+void transfer_async_end(struct thread_msg_recv_buf *q, int slot);
 
 /* Functions that are unsually platform specific */
 int create_anon_file(void);
 int get_hardware_thread_count(void);
 int get_iov_max(void);
+/** Create a nonblocking counter which polls as readable once signalled; this
+ * is an eventfd where available (and then *read_fd == *write_fd), and
+ * otherwise a pipe. Returns -1 on failure. */
+int create_event_counter(int *read_fd, int *write_fd);
+void signal_event_counter(int write_fd);
+/** Reset the counter so that it no longer polls as readable */
+void clear_event_counter(int read_fd);
+/** A readiness event from a watch set; `revents` uses the POLL* flags */
+struct fd_watch_event {
+	void *data;
+	short revents;
+};
+/** Create a set of file descriptors whose interest list is kept by the
+ * kernel (epoll), and which polls as readable when any member is ready.
+ * Returns -1 if this is not supported, setting errno. */
+int create_fd_watch_set(void);
+/** Add, change, or remove `fd` in the set; `events` uses the POLL* flags,
+ * and `data` is reported back by wait_fd_watch_set. Return -1 on failure. */
+int add_to_fd_watch_set(int set, int fd, short events, void *data);
+int modify_fd_watch_set(int set, int fd, short events, void *data);
+void remove_from_fd_watch_set(int set, int fd);
+/** Without blocking, collect up to `max` ready file descriptors. Returns the
+ * number of events, or -1 on failure. */
+int wait_fd_watch_set(int set, struct fd_watch_event *events, int max);
+
+/** An io_uring instance, through which one read and one write can be kept
+ * in flight at a time. The fd of the ring polls as readable once an
+ * operation completes. */
+struct io_ring;
+enum io_ring_op { IO_RING_READ, IO_RING_WRITE };
+/** Returns NULL, setting errno, if io_uring is unsupported or disabled */
+struct io_ring *create_io_ring(void);
+/** Cancels any operations in flight and waits for them to stop */
+void destroy_io_ring(struct io_ring *ring);
+int get_io_ring_fd(const struct io_ring *ring);
+/** Register a buffer, replacing any earlier one, so that reads into it can
+ * skip page mapping. May only be called while no read is in flight. Returns
+ * -1 if registration fails; it is then not retried for the same buffer and
+ * size, for which later calls return 0 without registering anything. */
+int register_io_ring_buffer(struct io_ring *ring, void *buf, size_t size);
+/** Queue an operation; the iovecs are copied, but the memory they refer to
+ * must remain valid until its result has been taken. Operations are only
+ * started by submit_io_ring(). Returns -1 if the operation is busy. */
+int queue_io_ring_op(struct io_ring *ring, enum io_ring_op op, int fd,
+		const struct iovec *vecs, int nvecs);
+/** Start queued operations. Returns 1 if a result is ready to be taken,
+ * 0 if none is, and -1 on failure. */
+int submit_io_ring(struct io_ring *ring);
+/** Is the operation queued, in flight, or has its result not been taken? */
+bool is_io_ring_op_busy(const struct io_ring *ring, enum io_ring_op op);
+/** If the operation has completed, make it idle again, set `result` to the
+ * return value (or -errno) and return true */
+bool take_io_ring_result(
+		struct io_ring *ring, enum io_ring_op op, ssize_t *result);
+/** Cancel operations in flight, wait for them, and discard their results */
+void cancel_io_ring_ops(struct io_ring *ring);
+
+/** Create a buffer of `size` bytes, a multiple of the page size, which is
+ * mapped twice back to back, so that writes to `buf[i]` are also visible at
+ * `buf[i + size]`. Returns NULL on failure. */
+void *create_mirrored_buffer(size_t size);
+void destroy_mirrored_buffer(void *buf, size_t size);
 /** For large allocations only; functions providing aligned-and-zeroed
  * allocations. They return NULL on allocation failure.*/
 void *zeroed_aligned_alloc(size_t bytes, size_t alignment, void **handle);
@@ -72,9 +72,15 @@ static const char usage_string[] =
 		"                 socket path T to the control pipe C.\n"
 		"  bench B      Given a connection bandwidth B in MB/sec, estimate the best\n"
 		"                 compression level used to send data\n"
+		"  bench K      Run microbenchmark K instead, where K is one of:\n"
+		"                 lookup: time shadow lookups, for 10 to 100000 shadows\n"
+		"                 threads: time buffer updates using 1 to T threads\n"
+		"                 diff: measure diff kernel throughput in GB/s\n"
+		"                 readback: time diffs of buffers copied with streaming loads\n"
 		"\n"
 		"Options:\n"
 		"  -c, --compress C     choose compression method: lz4[=#], zstd=[=#], none\n"
+		"                         (with =auto, the level adapts to the connection)\n"
 		"  -d, --debug          print debug messages\n"
 		"  -h, --help           display this help and exit\n"
 		"  -n, --no-gpu         disable protocols which would use GPU resources\n"
@@ -85,16 +91,28 @@ static const char usage_string[] =
 		"                         ssh: sets the prefix for the socket path\n"
 		"      --version        print waypipe version and exit\n"
 		"      --allow-tiled    allow gpu buffers (DMABUFs) with format modifiers\n"
+		"      --block-dedup    send buffer blocks the remote already has as copies\n"
+		"      --compress-streams\n"
+		"                       also compress protocol and pipe (clipboard) data\n"
 		"      --control C      server,ssh: set control pipe to reconnect server\n"
+		"      --diff-kernel K  set the diff kernel: auto,avx512bw,avx512f,avx2,sse3,\n"
+		"                         neon,c. default: auto, the fastest at startup\n"
+		"      --diff-window W  merge changes up to W words apart, or adapt with auto\n"
 		"      --display D      server,ssh: the Wayland display name or path\n"
 		"      --drm-node R     set the local render node. default: /dev/dri/renderD128\n"
+		"      --frames K       max frames queued while the next is prepared, default=2\n"
+		"      --io-uring       use io_uring for channel reads and writes if possible\n"
 		"      --remote-node R  ssh: set the remote render node path\n"
 		"      --remote-bin R   ssh: set the remote waypipe binary. default: waypipe\n"
 		"      --login-shell    server: if server CMD is empty, run a login shell\n"
+		"      --scroll-copy    send scrolled buffer contents as row copies\n"
+		"      --split-planes   split pixels into byte planes when this compresses better\n"
 		"      --threads T      set thread pool size, default=hardware threads/2\n"
+		"      --train-dict     train a dictionary to compress small updates with\n"
 		"      --unlink-socket  server: unlink the socket that waypipe connects to\n"
 		"      --video[=V]      compress certain linear dmabufs only with a video codec\n"
 		"                         V is list of options: sw,hw,bpf=1.2e5,h264,vp9,av1\n"
+		"      --zstd-history   ssh,server: let Zstd diffs refer to earlier frames\n"
 		"\n";
 
 static int usage(int retcode)
@@ -217,11 +235,14 @@ static void fill_rand_token(char tok[static 8])
 	}
 }
 
-/* Scan a suffix which is either empty or has the form =N, returning true
- * if it matches */
-static bool parse_level_choice(const char *str, int *dest, int defval)
+/* Scan a suffix which is either empty or has the form =N or =auto, setting
+ * the compression level of `config` and returning true if it matches */
+static bool parse_level_choice(
+		const char *str, struct main_config *config, int defval)
 {
-	if (str[0] == '\0') {
+	int *dest = &config->compression_level;
+	config->compression_adapt = !strcmp(str, "=auto");
+	if (str[0] == '\0' || config->compression_adapt) {
 		*dest = defval;
 		return true;
 	}
@@ -353,6 +374,7 @@ static const char *feature_names[] = {
 		"dmabuf",
 		"video",
 		"vaapi",
+		"io_uring",
 };
 static const bool feature_flags[] = {
 #ifdef HAS_LZ4
@@ -380,6 +402,11 @@ static const bool feature_flags[] = {
 #else
 		false,
 #endif
+#ifdef HAS_IO_URING
+		true,
+#else
+		false,
+#endif
 };
 
 #define ARG_VERSION 1000
@@ -395,6 +422,16 @@ static const bool feature_flags[] = {
 #define ARG_CONTROL 1010
 #define ARG_WAYPIPE_BINARY 1011
 #define ARG_BENCH_TEST_SIZE 1012
+#define ARG_FRAMES 1013
+#define ARG_IO_URING 1014
+#define ARG_SCROLL_COPY 1015
+#define ARG_BLOCK_DEDUP 1016
+#define ARG_DIFF_KERNEL 1017
+#define ARG_DIFF_WINDOW 1018
+#define ARG_ZSTD_HISTORY 1019
+#define ARG_TRAIN_DICT 1020
+#define ARG_COMPRESS_STREAMS 1021
+#define ARG_SPLIT_PLANES 1022
 
 static const struct option options[] = {
 		{"compress", required_argument, NULL, 'c'},
@@ -416,6 +453,16 @@ static const struct option options[] = {
 		{"display", required_argument, NULL, ARG_DISPLAY},
 		{"control", required_argument, NULL, ARG_CONTROL},
 		{"test-size", required_argument, NULL, ARG_BENCH_TEST_SIZE},
+		{"frames", required_argument, NULL, ARG_FRAMES},
+		{"io-uring", no_argument, NULL, ARG_IO_URING},
+		{"scroll-copy", no_argument, NULL, ARG_SCROLL_COPY},
+		{"block-dedup", no_argument, NULL, ARG_BLOCK_DEDUP},
+		{"diff-kernel", required_argument, NULL, ARG_DIFF_KERNEL},
+		{"diff-window", required_argument, NULL, ARG_DIFF_WINDOW},
+		{"zstd-history", no_argument, NULL, ARG_ZSTD_HISTORY},
+		{"train-dict", no_argument, NULL, ARG_TRAIN_DICT},
+		{"compress-streams", no_argument, NULL, ARG_COMPRESS_STREAMS},
+		{"split-planes", no_argument, NULL, ARG_SPLIT_PLANES},
 		{0, 0, NULL, 0}};
 struct arg_permissions {
 	int val;
@@ -443,6 +490,16 @@ static const struct arg_permissions arg_permissions[] = {
 		{ARG_DISPLAY, MODE_SSH | MODE_SERVER},
 		{ARG_CONTROL, MODE_SSH | MODE_SERVER},
 		{ARG_BENCH_TEST_SIZE, MODE_BENCH},
+		{ARG_FRAMES, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_IO_URING, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_SCROLL_COPY, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_BLOCK_DEDUP, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_DIFF_KERNEL, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_DIFF_WINDOW, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_ZSTD_HISTORY, MODE_SSH | MODE_SERVER},
+		{ARG_TRAIN_DICT, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_COMPRESS_STREAMS, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_SPLIT_PLANES, MODE_SSH | MODE_CLIENT | MODE_SERVER},
 };
 
 /* envp is nonstandard, so use environ */
@@ -460,6 +517,8 @@ int main(int argc, char **argv)
 	char *remote_drm_node = NULL;
 	char *comp_string = NULL;
 	char *nthread_string = NULL;
+	char *frames_string = NULL;
+	char *window_string = NULL;
 	char *wayland_display = NULL;
 	char *waypipe_binary = "waypipe";
 	char *control_path = NULL;
@@ -467,9 +526,20 @@ int main(int argc, char **argv)
 	uint32_t bench_test_size = (1u << 22) + 13;
 
 	struct main_config config = {.n_worker_threads = 0,
+			.max_frames_in_flight = 2,
+			.chan_io_uring = false,
+			.scroll_copy = false,
+			.block_dedup = false,
+			.zstd_history = false,
+			.train_dict = false,
+			.compress_streams = false,
+			.split_planes = false,
+			.diff_kernel = DIFF_FASTEST,
+			.diff_window = DEFAULT_DIFF_WINDOW,
 			.drm_node = NULL,
 			.compression = COMP_NONE,
 			.compression_level = 0,
+			.compression_adapt = false,
 			.no_gpu = false,
 			.only_linear_dmabuf = true,
 			.video_if_possible = false,
@@ -536,9 +606,9 @@ int main(int argc, char **argv)
 			if (!strcmp(optarg, "none")) {
 				config.compression = COMP_NONE;
 				config.compression_level = 0;
+				config.compression_adapt = false;
 			} else if (!strncmp(optarg, "lz4", 3) &&
-					parse_level_choice(optarg + 3,
-							&config.compression_level,
+					parse_level_choice(optarg + 3, &config,
 							-1)) {
 #ifdef HAS_LZ4
 				config.compression = COMP_LZ4;
@@ -547,8 +617,7 @@ int main(int argc, char **argv)
 				return EXIT_FAILURE;
 #endif
 			} else if (!strncmp(optarg, "zstd", 4) &&
-					parse_level_choice(optarg + 4,
-							&config.compression_level,
+					parse_level_choice(optarg + 4, &config,
 							5)) {
 #ifdef HAS_ZSTD
 				config.compression = COMP_ZSTD;
@@ -600,6 +669,27 @@ int main(int argc, char **argv)
 		case ARG_ALLOW_TILED:
 			config.only_linear_dmabuf = false;
 			break;
+		case ARG_IO_URING:
+			config.chan_io_uring = true;
+			break;
+		case ARG_SCROLL_COPY:
+			config.scroll_copy = true;
+			break;
+		case ARG_BLOCK_DEDUP:
+			config.block_dedup = true;
+			break;
+		case ARG_ZSTD_HISTORY:
+			config.zstd_history = true;
+			break;
+		case ARG_TRAIN_DICT:
+			config.train_dict = true;
+			break;
+		case ARG_COMPRESS_STREAMS:
+			config.compress_streams = true;
+			break;
+		case ARG_SPLIT_PLANES:
+			config.split_planes = true;
+			break;
 #ifdef HAS_VIDEO
 		case ARG_VIDEO:
 			config.video_if_possible = true;
@@ -630,6 +720,44 @@ int main(int argc, char **argv)
 			config.n_worker_threads = (int)nthreads;
 			nthread_string = optarg;
 		} break;
+		case ARG_DIFF_KERNEL: {
+			bool found = false;
+			for (int t = DIFF_FASTEST; t <= DIFF_C; t++) {
+				enum diff_type type = (enum diff_type)t;
+				if (!strcmp(optarg, diff_type_to_str(type))) {
+					config.diff_kernel = type;
+					found = true;
+				}
+			}
+			if (!found) {
+				fprintf(stderr, "Unknown diff kernel '%s'\n",
+						optarg);
+				fail = true;
+			}
+		} break;
+		case ARG_DIFF_WINDOW: {
+			uint32_t window;
+			if (!strcmp(optarg, "auto")) {
+				config.diff_window = 0;
+			} else if (parse_uint32(optarg, &window) == -1 ||
+					window < MIN_DIFF_WINDOW ||
+					window > (1u << 16)) {
+				fail = true;
+			} else {
+				config.diff_window = (int)window;
+			}
+			window_string = optarg;
+		} break;
+		case ARG_FRAMES: {
+			uint32_t nframes;
+			if (parse_uint32(optarg, &nframes) == -1 ||
+					nframes < 1 ||
+					nframes > MAX_FRAMES_IN_FLIGHT) {
+				fail = true;
+			}
+			config.max_frames_in_flight = (int)nframes;
+			frames_string = optarg;
+		} break;
 		case ARG_WAYPIPE_BINARY:
 			waypipe_binary = optarg;
 			break;
@@ -741,6 +869,15 @@ int main(int argc, char **argv)
 	int ret;
 	if (mode == MODE_RECON) {
 		ret = run_recon(argv[0], argv[1]);
+	} else if (mode == MODE_BENCH && !strcmp(argv[0], "lookup")) {
+		ret = run_lookup_bench();
+	} else if (mode == MODE_BENCH && !strcmp(argv[0], "threads")) {
+		ret = run_thread_scaling_bench(
+				bench_test_size, config.n_worker_threads);
+	} else if (mode == MODE_BENCH && !strcmp(argv[0], "diff")) {
+		ret = run_diff_bench(bench_test_size);
+	} else if (mode == MODE_BENCH && !strcmp(argv[0], "readback")) {
+		ret = run_readback_bench(bench_test_size);
 	} else if (mode == MODE_BENCH) {
 		char *endptr = NULL;
 		float bw = strtof(argv[0], &endptr);
@@ -904,8 +1041,15 @@ int main(int argc, char **argv)
 				     2 * (control_path != NULL) +
 				     config.video_if_possible +
 				     !config.only_linear_dmabuf +
+				     config.chan_io_uring + config.scroll_copy +
+				     config.block_dedup + config.zstd_history +
+				     config.train_dict +
+				     config.compress_streams +
+				     config.split_planes +
 				     2 * needs_login_shell +
-				     2 * (config.n_worker_threads != 0);
+				     2 * (config.n_worker_threads != 0) +
+				     2 * (frames_string != NULL) +
+				     2 * (window_string != NULL);
 			char **arglist = calloc((size_t)(argc + nextra),
 					sizeof(char *));
 
@@ -991,6 +1135,32 @@ int main(int argc, char **argv)
 				arglist[dstidx + 1 + offset++] =
 						"--allow-tiled";
 			}
+			if (config.chan_io_uring) {
+				arglist[dstidx + 1 + offset++] = "--io-uring";
+			}
+			if (config.scroll_copy) {
+				arglist[dstidx + 1 + offset++] =
+						"--scroll-copy";
+			}
+			if (config.block_dedup) {
+				arglist[dstidx + 1 + offset++] =
+						"--block-dedup";
+			}
+			if (config.zstd_history) {
+				arglist[dstidx + 1 + offset++] =
+						"--zstd-history";
+			}
+			if (config.train_dict) {
+				arglist[dstidx + 1 + offset++] = "--train-dict";
+			}
+			if (config.compress_streams) {
+				arglist[dstidx + 1 + offset++] =
+						"--compress-streams";
+			}
+			if (config.split_planes) {
+				arglist[dstidx + 1 + offset++] =
+						"--split-planes";
+			}
 			if (remote_drm_node) {
 				arglist[dstidx + 1 + offset++] = "--drm-node";
 				arglist[dstidx + 1 + offset++] =
@@ -1000,6 +1170,15 @@ int main(int argc, char **argv)
 				arglist[dstidx + 1 + offset++] = "--threads";
 				arglist[dstidx + 1 + offset++] = nthread_string;
 			}
+			if (frames_string) {
+				arglist[dstidx + 1 + offset++] = "--frames";
+				arglist[dstidx + 1 + offset++] = frames_string;
+			}
+			if (window_string) {
+				arglist[dstidx + 1 + offset++] =
+						"--diff-window";
+				arglist[dstidx + 1 + offset++] = window_string;
+			}
 			if (control_path) {
 				arglist[dstidx + 1 + offset++] = "--control";
 				arglist[dstidx + 1 + offset++] = control_path;
@@ -125,15 +125,8 @@ void send_wayland_msg(struct test_state *src, const struct msg msg,
 		}
 	}
 
-	for (struct shadow_fd_link *lcur = src->glob.map.link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &src->glob.map.link;
-			lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		collect_update(&src->glob.threads, cur, transfers,
-				src->config.old_video_mode);
-		destroy_shadow_if_unreferenced(cur);
-	}
+	collect_dirty_updates(&src->glob.map, &src->glob.threads, transfers,
+			src->config.old_video_mode);
 
 	decref_transferred_rids(
 			&src->glob.map, fd_window.zone_start, fd_window.data);
@@ -145,20 +138,11 @@ void send_wayland_msg(struct test_state *src, const struct msg msg,
 		struct task_data task;
 		while (request_work_task(&src->glob.threads, &task, &is_done)) {
 			run_task(&task, &src->glob.threads.threads[0]);
-			src->glob.threads.tasks_in_progress--;
 		}
 		(void)transfer_load_async(transfers);
 	}
 
-	for (struct shadow_fd_link *lcur = src->glob.map.link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &src->glob.map.link;
-			lcur = lnxt, lnxt = lcur->l_next) {
-		/* Note: finish_update() may delete `cur` */
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		finish_update(cur);
-		destroy_shadow_if_unreferenced(cur);
-	}
+	finish_dirty_updates(&src->glob.map);
 
 	if (fd_window.zone_start > 0) {
 		size_t tsz = sizeof(uint32_t) *
@@ -317,7 +301,6 @@ void send_protocol_msg(struct test_state *src, struct test_state *dst,
 
 	struct transfer_queue transfers;
 	memset(&transfers, 0, sizeof(transfers));
-	pthread_mutex_init(&transfers.async_recv_queue.lock, NULL);
 
 	/* On destination side, a bit easier; process transfers, and
 	 * then deliver all messages */
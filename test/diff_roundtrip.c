@@ -80,14 +80,16 @@ static const struct subtest subtests[] = {
 		{1 << 24, -2, 0x71, 4},
 };
 
-static const enum diff_type diff_types[5] = {
+static const enum diff_type diff_types[6] = {
+		DIFF_AVX512BW,
 		DIFF_AVX512F,
 		DIFF_AVX2,
 		DIFF_SSE3,
 		DIFF_NEON,
 		DIFF_C,
 };
-static const char *diff_names[5] = {
+static const char *diff_names[6] = {
+		"avx5bw",
 		"avx512",
 		"avx2  ",
 		"sse3  ",
@@ -97,9 +99,19 @@ static const char *diff_names[5] = {
 
 static bool run_subtest(int i, const struct subtest test, char *diff,
 		char *source, char *mirror, char *target1, char *target2,
-		interval_diff_fn_t diff_fn, int alignment_bits,
-		const char *diff_name)
+		interval_diff_fn_t diff_fn, int alignment_bits, int window,
+		tile_accum_fn_t accum_fn, const char *diff_name)
 {
+	/* If accum_fn is set, diff with tile hashes */
+	uint64_t *tile_hashes = NULL;
+	if (accum_fn) {
+		tile_hashes = calloc(test.size / DIFF_TILE_SIZE + 1,
+				sizeof(uint64_t));
+		if (!tile_hashes) {
+			printf("Failed to allocate tile hashes\n");
+			return false;
+		}
+	}
 	uint64_t ns01 = 0, ns12 = 0;
 	int64_t nruns = 0;
 	size_t net_diffsize = 0;
@@ -130,10 +142,15 @@ static bool run_subtest(int i, const struct subtest test, char *diff,
 			struct timespec t0, t1, t2;
 			clock_gettime(CLOCK_MONOTONIC, &t0);
 			size_t diffsize = 0;
-			if (damage.start < damage.end) {
+			if (damage.start < damage.end && tile_hashes) {
+				diffsize = construct_diff_tiled(diff_fn,
+						alignment_bits, window, &damage,
+						1, mirror, source, diff,
+						accum_fn, tile_hashes);
+			} else if (damage.start < damage.end) {
 				diffsize = construct_diff_core(diff_fn,
-						alignment_bits, &damage, 1,
-						mirror, source, diff);
+						alignment_bits, window, &damage,
+						1, mirror, source, diff);
 			}
 			size_t ntrailing = 0;
 			if (s == test.shards - 1) {
@@ -177,9 +194,12 @@ static bool run_subtest(int i, const struct subtest test, char *diff,
 		}
 	}
 
+	free(tile_hashes);
+
 	double scale = 1.0 / ((double)repetitions * (double)test.size);
-	printf("%s #%2d, : %6.3f,%6.3f,%6.3f ns/byte create,apply,net (%d/%d@%d), %.1f bytes/run\n",
-			diff_name, i, (double)ns01 * scale,
+	printf("%s%s w%-2d #%2d, : %6.3f,%6.3f,%6.3f ns/byte create,apply,net (%d/%d@%d), %.1f bytes/run\n",
+			diff_name, accum_fn ? "+tiles" : "", window, i,
+			(double)ns01 * scale,
 			(double)ns12 * scale, (double)(ns01 + ns12) * scale,
 			(int)net_diffsize, (int)test.size, test.shards,
 			(double)repetitions * (double)test.size /
@@ -187,6 +207,60 @@ static bool run_subtest(int i, const struct subtest test, char *diff,
 	return all_success;
 }
 
+/** Diff an image from a mapping whose stride differs from that of the mirror,
+ * as is done for DMABUFs, and check the rows are reproduced */
+static bool run_strided_test(interval_diff_fn_t diff_fn, int alignment_bits,
+		size_t map_stride, const char *diff_name)
+{
+	const size_t height = 97, tx_stride = 320;
+	const size_t size = height * tx_stride;
+	const size_t row_length = min(tx_stride, map_stride);
+	char *mapped = aligned_alloc(64, alignz(height * map_stride, 64));
+	char *mirror = aligned_alloc(64, size);
+	char *target1 = aligned_alloc(64, size);
+	char *target2 = aligned_alloc(64, size);
+	char *diff = aligned_alloc(64, alignz(size + 8 * (height + 4), 64));
+	memset(mirror, 0, size);
+	memset(target1, 0, size);
+	memset(target2, 0, size);
+	srand(0x81);
+
+	bool success = true;
+	for (int x = 0; x < 10 && success; x++) {
+		rand_gap_fill(mapped, height * map_stride, 40 * x + 2);
+		/* Damage starting and ending partway through rows */
+		int align = 1 << alignment_bits;
+		int split = align * (rand() % (int)(size / (size_t)align));
+		struct interval damage[2] = {{0, split}, {split, (int)size}};
+		size_t diffsize = construct_diff_strided(diff_fn,
+				alignment_bits, MIN_DIFF_WINDOW, damage, 2,
+				mirror, mapped, tx_stride, map_stride,
+				row_length, diff);
+		apply_diff(size, target1, target2, diffsize, 0, diff);
+
+		for (size_t r = 0; r < height; r++) {
+			if (memcmp(target1 + r * tx_stride,
+					    mapped + r * map_stride,
+					    row_length) ||
+					memcmp(mirror + r * tx_stride,
+							target1 + r * tx_stride,
+							tx_stride)) {
+				printf("%s strided %d/%d: row %d differs\n",
+						diff_name, (int)map_stride,
+						(int)tx_stride, (int)r);
+				success = false;
+				break;
+			}
+		}
+	}
+	free(mapped);
+	free(mirror);
+	free(target1);
+	free(target2);
+	free(diff);
+	return success;
+}
+
 log_handler_func_t log_funcs[2] = {test_log_handler, test_log_handler};
 int main(int argc, char **argv)
 {
@@ -201,7 +275,10 @@ int main(int argc, char **argv)
 
 		/* Use maximum alignment */
 		const size_t bufsize = alignz(test.size + 8 + 64, 64);
-		char *diff = aligned_alloc(64, bufsize);
+		/* Diffs with tile hashes may split runs at tile boundaries */
+		size_t ntiles = test.size / DIFF_TILE_SIZE;
+		char *diff = aligned_alloc(
+				64, alignz(bufsize + 8 * (ntiles + 2), 64));
 		char *source = aligned_alloc(64, bufsize);
 		char *mirror = aligned_alloc(64, bufsize);
 		char *target1 = aligned_alloc(64, bufsize);
@@ -216,7 +293,19 @@ int main(int argc, char **argv)
 			}
 			all_success &= run_subtest(i, test, diff, source,
 					mirror, target1, target2, diff_fn,
-					alignment_bits, diff_names[a]);
+					alignment_bits, DEFAULT_DIFF_WINDOW,
+					NULL, diff_names[a]);
+			tile_accum_fn_t accum_fn =
+					get_tile_accum_function(diff_types[a]);
+			/* Also check the narrowest diff window, which splits
+			 * runs more often */
+			if (accum_fn) {
+				all_success &= run_subtest(i, test, diff,
+						source, mirror, target1,
+						target2, diff_fn,
+						alignment_bits, MIN_DIFF_WINDOW,
+						accum_fn, diff_names[a]);
+			}
 		}
 		free(diff);
 		free(source);
@@ -225,5 +314,103 @@ int main(int argc, char **argv)
 		free(target2);
 	}
 
+	for (int a = 0; a < (int)(sizeof(diff_types) / sizeof(diff_types[0]));
+			a++) {
+		int alignment_bits;
+		interval_diff_fn_t diff_fn = get_diff_function(
+				diff_types[a], &alignment_bits);
+		if (!diff_fn) {
+			continue;
+		}
+		/* Mappings with padded and with shorter rows */
+		all_success &= run_strided_test(diff_fn, alignment_bits, 384,
+				diff_names[a]);
+		all_success &= run_strided_test(diff_fn, alignment_bits, 256,
+				diff_names[a]);
+	}
+
+	/* Streaming load copies must match memcpy, at any alignment */
+	readback_fn_t readback = get_readback_function();
+	if (readback) {
+		char *src = aligned_alloc(64, 1024);
+		char *dst = aligned_alloc(64, 1024);
+		for (size_t k = 0; k < 1024; k++) {
+			src[k] = (char)rand();
+		}
+		static const size_t lengths[] = {0, 1, 15, 16, 63, 64, 65, 300,
+				900};
+		for (size_t off = 0; off < 80; off++) {
+			for (size_t k = 0; k < sizeof(lengths) / sizeof(size_t);
+					k++) {
+				memset(dst, 0, 1024);
+				(*readback)(dst + off % 7, src + off,
+						lengths[k]);
+				if (memcmp(dst + off % 7, src + off,
+						    lengths[k])) {
+					printf("Streaming load copy of %d bytes at offset %d failed\n",
+							(int)lengths[k],
+							(int)off);
+					all_success = false;
+				}
+			}
+		}
+		free(src);
+		free(dst);
+	}
+
+	/* Every tile accumulation function must produce the same hash */
+	char *tile = aligned_alloc(64, DIFF_TILE_SIZE);
+	for (size_t k = 0; k < DIFF_TILE_SIZE; k++) {
+		tile[k] = (char)rand();
+	}
+	uint64_t ref_hash = hash_tile(get_tile_accum_function(DIFF_C), tile);
+	for (int a = 0; a < (int)(sizeof(diff_types) / sizeof(diff_types[0]));
+			a++) {
+		tile_accum_fn_t accum_fn =
+				get_tile_accum_function(diff_types[a]);
+		if (accum_fn && hash_tile(accum_fn, tile) != ref_hash) {
+			printf("%s tile hash does not match the C version\n",
+					diff_names[a]);
+			all_success = false;
+		}
+	}
+	free(tile);
+
+	/* Byte plane splits must match the C version, and joins undo them */
+	char *pixels = malloc(1024);
+	char *planes = malloc(1024);
+	char *ref = malloc(1024);
+	char *joined = malloc(1024);
+	for (size_t k = 0; k < 1024; k++) {
+		pixels[k] = (char)rand();
+	}
+	planes_fn_t ref_split, ref_join;
+	get_planes_functions(DIFF_C, &ref_split, &ref_join);
+	static const size_t plane_lengths[] = {0, 3, 4, 31, 32, 33, 99, 128,
+			1021};
+	for (int a = 0; a < (int)(sizeof(diff_types) / sizeof(diff_types[0]));
+			a++) {
+		planes_fn_t split, join;
+		get_planes_functions(diff_types[a], &split, &join);
+		for (size_t k = 0; k < sizeof(plane_lengths) / sizeof(size_t);
+				k++) {
+			size_t len = plane_lengths[k];
+			const char *src = pixels + k % 3;
+			(*ref_split)(ref, src, len);
+			(*split)(planes, src, len);
+			(*join)(joined, planes, len);
+			if (memcmp(planes, ref, len) ||
+					memcmp(joined, src, len)) {
+				printf("%s byte plane split of %d bytes failed\n",
+						diff_names[a], (int)len);
+				all_success = false;
+			}
+		}
+	}
+	free(pixels);
+	free(planes);
+	free(ref);
+	free(joined);
+
 	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
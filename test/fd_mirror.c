@@ -40,15 +40,18 @@
 struct compression_settings {
 	enum compression_mode mode;
 	int level;
+	/* Send diffs on history streams, as with --zstd-history */
+	bool history;
 };
 
 static const struct compression_settings comp_modes[] = {
-		{COMP_NONE, 0},
+		{COMP_NONE, 0, false},
 #ifdef HAS_LZ4
-		{COMP_LZ4, 1},
+		{COMP_LZ4, 1, false},
 #endif
 #ifdef HAS_ZSTD
-		{COMP_ZSTD, 5},
+		{COMP_ZSTD, 5, false},
+		{COMP_ZSTD, 5, true},
 #endif
 };
 
@@ -212,8 +215,7 @@ static void wait_for_thread_pool(struct thread_pool *pool)
 {
 	bool done = false;
 	while (!done) {
-		uint8_t flush[64];
-		(void)read(pool->selfpipe_r, flush, sizeof(flush));
+		clear_event_counter(pool->completion_r);
 
 		/* Also run tasks on main thread, just like the real version */
 		// TODO: create a 'threadpool.c'
@@ -222,11 +224,6 @@ static void wait_for_thread_pool(struct thread_pool *pool)
 
 		if (has_task) {
 			run_task(&task, &pool->threads[0]);
-
-			pthread_mutex_lock(&pool->work_mutex);
-			pool->tasks_in_progress--;
-			pthread_mutex_unlock(&pool->work_mutex);
-			/* To skip the next poll */
 		} else {
 			/* Wait a short amount */
 			struct timespec waitspec;
@@ -237,6 +234,66 @@ static void wait_for_thread_pool(struct thread_pool *pool)
 	}
 }
 
+/* Much smaller than the main loop's, so that it is reused often */
+#define RECV_BUFFER_SIZE 16384
+
+/** Apply the messages in `res` after copying each into a receive buffer of
+ * `recv_size` bytes. Like the main loop, space is only kept for messages for
+ * which is_async_buffer_update is true, until the next fence; other space is
+ * overwritten right away, so that updates still being applied from it on the
+ * thread pool will fail. */
+static int receive_messages(struct fd_translation_map *dst_map,
+		struct thread_pool *dst_pool, struct render_data *render_data,
+		const struct bytebuf *res, size_t recv_size)
+{
+	for (size_t start = 0; start < res->size;) {
+		uint32_t hb = ((uint32_t *)&res->data[start])[0];
+		recv_size = max(recv_size, alignz(transfer_size(hb), 4));
+		start += alignz(transfer_size(hb), 4);
+	}
+	char *recv_buffer = malloc(recv_size);
+	if (!recv_buffer) {
+		return -1;
+	}
+	/* Updates queued since the last fence may read [0, retained) */
+	size_t retained = 0;
+	int ret = 0;
+	size_t start = 0;
+	while (start < res->size) {
+		uint32_t hb = ((uint32_t *)&res->data[start])[0];
+		int32_t xid = ((int32_t *)&res->data[start])[1];
+		size_t sz = transfer_size(hb);
+		enum wmsg_type type = transfer_type(hb);
+		if (!is_async_buffer_update(type) ||
+				retained + sz > recv_size) {
+			if (fence_buffer_updates(dst_map, dst_pool) == -1) {
+				ret = -1;
+			}
+			memset(recv_buffer, 0xa5, retained);
+			retained = 0;
+		}
+		struct bytebuf tmp;
+		tmp.data = &recv_buffer[retained];
+		tmp.size = sz;
+		memcpy(tmp.data, &res->data[start], sz);
+		/* This applies other messages inline, so any update it queues
+		 * but which is not retained will be overwritten below */
+		queue_buffer_update(dst_map, dst_pool, render_data, type, xid,
+				&tmp);
+		if (is_async_buffer_update(type)) {
+			retained += alignz(sz, 4);
+		} else {
+			memset(tmp.data, 0xa5, sz);
+		}
+		start += alignz(sz, 4);
+	}
+	if (fence_buffer_updates(dst_map, dst_pool) == -1) {
+		ret = -1;
+	}
+	free(recv_buffer);
+	return ret;
+}
+
 static bool test_transfer(struct fd_translation_map *src_map,
 		struct fd_translation_map *dst_map,
 		struct thread_pool *src_pool, struct thread_pool *dst_pool,
@@ -244,7 +301,6 @@ static bool test_transfer(struct fd_translation_map *src_map,
 {
 	struct transfer_queue transfer_data;
 	memset(&transfer_data, 0, sizeof(struct transfer_queue));
-	pthread_mutex_init(&transfer_data.async_recv_queue.lock, NULL);
 
 	struct shadow_fd *src_shadow = get_shadow_for_rid(src_map, rid);
 	collect_update(src_pool, src_shadow, &transfer_data, false);
@@ -276,18 +332,13 @@ static bool test_transfer(struct fd_translation_map *src_map,
 	struct bytebuf res = combine_transfer_blocks(&transfer_data);
 	cleanup_transfer_queue(&transfer_data);
 
-	size_t start = 0;
-	while (start < res.size) {
-		struct bytebuf tmp;
-		tmp.data = &res.data[start];
-		uint32_t hb = ((uint32_t *)tmp.data)[0];
-		int32_t xid = ((int32_t *)tmp.data)[1];
-		tmp.size = transfer_size(hb);
-		apply_update(dst_map, dst_pool, render_data, transfer_type(hb),
-				xid, &tmp);
-		start += alignz(tmp.size, 4);
-	}
+	int recv_ret = receive_messages(
+			dst_map, dst_pool, render_data, &res, RECV_BUFFER_SIZE);
 	free(res.data);
+	if (recv_ret == -1) {
+		wp_error("Failed to apply buffer updates");
+		return false;
+	}
 
 	/* first round, this only exists after the transfer */
 	struct shadow_fd *dst_shadow = get_shadow_for_rid(dst_map, rid);
@@ -306,6 +357,7 @@ static bool test_mirror(int new_file_fd, size_t sz,
 {
 	struct fd_translation_map src_map;
 	setup_translation_map(&src_map, false);
+	src_map.diff_history = comp_mode.history;
 
 	struct thread_pool src_pool;
 	setup_thread_pool(&src_pool, comp_mode.mode, comp_mode.level,
@@ -313,6 +365,7 @@ static bool test_mirror(int new_file_fd, size_t sz,
 
 	struct fd_translation_map dst_map;
 	setup_translation_map(&dst_map, true);
+	dst_map.diff_history = comp_mode.history;
 
 	struct thread_pool dst_pool;
 	setup_thread_pool(&dst_pool, comp_mode.mode, comp_mode.level,
@@ -384,6 +437,289 @@ static bool test_mirror(int new_file_fd, size_t sz,
 	return pass;
 }
 
+/** An anonymous file, translated on the source side, and the maps and
+ * thread pools of both sides, with which it is mirrored */
+struct file_mirror {
+	struct fd_translation_map src_map, dst_map;
+	struct thread_pool src_pool, dst_pool;
+	struct shadow_fd *src_shadow;
+	/* The file, to which tests write changes */
+	int fd;
+	struct render_data *rd;
+};
+
+/** Create a file of `size` zero bytes and a mirror for it; returns -1 on
+ * failure */
+static int setup_file_mirror(struct file_mirror *M,
+		struct compression_settings comp, size_t size, int src_threads,
+		int dst_threads, struct render_data *rd)
+{
+	M->fd = create_anon_file();
+	if (M->fd == -1 || ftruncate(M->fd, (off_t)size) == -1) {
+		wp_error("Failed to create test file");
+		if (M->fd != -1) {
+			checked_close(M->fd);
+		}
+		return -1;
+	}
+	setup_translation_map(&M->src_map, false);
+	setup_translation_map(&M->dst_map, true);
+	M->src_map.diff_history = comp.history;
+	M->dst_map.diff_history = comp.history;
+	setup_thread_pool(&M->src_pool, comp.mode, comp.level, src_threads);
+	setup_thread_pool(&M->dst_pool, comp.mode, comp.level, dst_threads);
+	M->src_shadow = translate_fd(&M->src_map, rd, NULL, M->fd, FDC_FILE,
+			size, NULL, false);
+	M->rd = rd;
+	return 0;
+}
+
+/** Damage the whole file, transfer the update, and check that the copy on
+ * the destination side matches */
+static bool transfer_file_mirror(struct file_mirror *M)
+{
+	M->src_shadow->is_dirty = true;
+	damage_everything(&M->src_shadow->damage);
+	return test_transfer(&M->src_map, &M->dst_map, &M->src_pool,
+			&M->dst_pool, M->src_shadow->remote_id, true, M->rd);
+}
+
+/** Destroy the mirror, closing the file */
+static void cleanup_file_mirror(struct file_mirror *M)
+{
+	cleanup_translation_map(&M->src_map);
+	cleanup_translation_map(&M->dst_map);
+	cleanup_thread_pool(&M->src_pool);
+	cleanup_thread_pool(&M->dst_pool);
+}
+
+/** Send diffs of noise with too little space for their compressed streams,
+ * and check that the updates are still applied correctly */
+static bool test_stream_overflow(
+		struct compression_settings comp, struct render_data *rd)
+{
+	const size_t sz = 1u << 18;
+	struct file_mirror M;
+	if (setup_file_mirror(&M, comp, sz, 2, 2, rd) == -1) {
+		return false;
+	}
+	M.src_pool.diff_stream_space_limit = 64;
+
+	bool pass = true;
+	uint32_t state = 1;
+	for (int round = 0; pass && round < 6; round++) {
+		uint32_t noise[1024];
+		for (size_t k = 0; k < sizeof(noise) / sizeof(noise[0]); k++) {
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			noise[k] = state;
+		}
+		off_t offset = (off_t)((size_t)round * (sz / 8) + 100);
+		if (pwrite(M.fd, noise, sizeof(noise), offset) !=
+				(ssize_t)sizeof(noise)) {
+			pass = false;
+			break;
+		}
+		pass &= transfer_file_mirror(&M);
+	}
+
+	cleanup_file_mirror(&M);
+	return pass;
+}
+
+/** Feed the compression tuner frames whose compression time doubles, and
+ * whose size shrinks, with each step up the list of levels, and check that
+ * it finds the cheapest level for a slow channel and then for a fast one */
+static bool test_compression_tuner(struct compression_settings comp)
+{
+	struct thread_pool pool;
+	setup_thread_pool(&pool, comp.mode, comp.level, 1);
+	bool pass = enable_compression_tuner(&pool) == 0;
+	/* With these drain rates, the 6th and 1st levels are cheapest */
+	const double drain_rates[2] = {0.01, 0.0};
+	const int expected[2] = {5, 0};
+	for (int phase = 0; pass && phase < 2; phase++) {
+		struct compression_tuner *tuner = pool.comp_tuner;
+		for (int frame = 0; frame < 401; frame++) {
+			int k = 0;
+			while (tuner->levels[k] != pool.compression_level) {
+				k++;
+			}
+			const uint64_t input = 1u << 20;
+			atomic_store(&tuner->input, input);
+			atomic_store(&tuner->output,
+					(uint64_t)(0.6 * (double)input /
+							(k + 1)));
+			atomic_store(&tuner->time_ns,
+					(uint64_t)(0.1 * (double)input *
+							(1 << k)));
+			tune_compression(&pool, drain_rates[phase]);
+		}
+		/* 401 is not a multiple of the trial interval, so the best
+		 * level is in use */
+		if (pool.compression_level != tuner->levels[expected[phase]]) {
+			wp_error("Compression tuner chose level %d, not %d",
+					pool.compression_level,
+					tuner->levels[expected[phase]]);
+			pass = false;
+		}
+	}
+	cleanup_thread_pool(&pool);
+	return pass;
+}
+
+#ifdef HAS_ZSTD
+/** Send many small diffs with dictionary training enabled, passing on the
+ * dictionary message when it is made, and check that the diffs made before
+ * and after it are applied correctly */
+static bool test_compression_dict(
+		struct compression_settings comp, struct render_data *rd)
+{
+	const size_t sz = 1u << 16;
+	struct file_mirror M;
+	if (setup_file_mirror(&M, comp, sz, 2, 2, rd) == -1) {
+		return false;
+	}
+	bool pass = enable_dict_training(&M.src_pool) == 0;
+
+	/* Draw short runs of a few colors, like small widgets do */
+	const uint32_t colors[4] = {
+			0xff202020, 0xffe0e0e0, 0xff3050c0, 0xffffffff};
+	int nrounds = 0;
+	for (int i = 0; pass && nrounds < 40; i++) {
+		uint32_t run[64];
+		size_t len = 8 + (size_t)(rand() % 56);
+		for (size_t k = 0; k < len; k++) {
+			run[k] = colors[(k / 8 + (size_t)i) % 4];
+		}
+		/* Ensure each round changes the buffer, as rounds continue
+		 * while the dictionary is trained in the background */
+		run[len - 1] = 0xff000000u | (uint32_t)i;
+		size_t offset = 4 * (size_t)(rand() % (int)(sz / 4 - len));
+		if (i > 0 && pwrite(M.fd, run, 4 * len, (off_t)offset) !=
+					      (ssize_t)(4 * len)) {
+			pass = false;
+			break;
+		}
+		pass &= transfer_file_mirror(&M);
+
+		struct transfer_queue transfers;
+		memset(&transfers, 0, sizeof(transfers));
+		update_compression_dict(&M.src_pool, &transfers);
+		for (int k = transfers.start; k < transfers.end; k++) {
+			char *data = transfers.vecs[k].iov_base;
+			uint32_t header = *(uint32_t *)data;
+			struct bytebuf msg = {.data = data,
+					.size = transfer_size(header)};
+			pass &= apply_update(&M.dst_map, &M.dst_pool, rd,
+						WMSG_COMPRESSION_DICT, 0,
+						&msg) == 0;
+		}
+		cleanup_transfer_queue(&transfers);
+		if (M.src_pool.tx_dict) {
+			/* Continue for a few rounds using the dictionary */
+			nrounds++;
+		} else if (!M.src_pool.dict_trainer) {
+			wp_error("Failed to train a compression dictionary");
+			pass = false;
+		}
+	}
+	pass &= M.dst_pool.rx_dict != NULL;
+
+	cleanup_file_mirror(&M);
+	return pass;
+}
+#endif
+
+/** Send several batches of small scattered diffs on history streams, each
+ * applied by multiple threads while the receive buffer is being reused,
+ * and check that the updates are applied correctly */
+static bool test_stream_batches(
+		struct compression_settings comp, struct render_data *rd)
+{
+	const size_t sz = 1u << 22;
+	struct file_mirror M;
+	if (setup_file_mirror(&M, comp, sz, 4, 3, rd) == -1) {
+		return false;
+	}
+	bool pass = true;
+	for (int round = 0; pass && round < 10; round++) {
+		/* A few runs in each part of the buffer, so that every
+		 * stream gets a diff */
+		char run[512];
+		memset(run, round + 1, sizeof(run));
+		for (size_t k = 0; round > 0 && k < 16; k++) {
+			off_t offset = (off_t)(k * (sz / 16) +
+					       (size_t)round * 4096);
+			if (pwrite(M.fd, run, sizeof(run), offset) !=
+					(ssize_t)sizeof(run)) {
+				pass = false;
+			}
+		}
+		pass &= transfer_file_mirror(&M);
+	}
+
+	cleanup_file_mirror(&M);
+	return pass;
+}
+
+/** Send a noisy photo-like image, for which splitting byte planes helps, and
+ * then some updates to it, and check that the planes are split and that
+ * the updates are applied correctly */
+static bool test_plane_split(
+		struct compression_settings comp, struct render_data *rd)
+{
+	const size_t width = 256, height = 256;
+	const size_t sz = 4 * width * height;
+	struct file_mirror M;
+	if (setup_file_mirror(&M, comp, sz, 2, 2, rd) == -1) {
+		return false;
+	}
+	bool pass = enable_plane_split(&M.src_pool) == 0;
+	M.src_shadow->pixel_bytes = 4;
+	uint32_t *image = malloc(sz);
+	/* Noise from a local generator, so that later tests see the same
+	 * sequence from rand() */
+	uint32_t state = 1;
+	for (int round = 0; pass && round < 12; round++) {
+		/* Redraw a band of rows each round */
+		size_t y0 = (size_t)round * 16 % height;
+		for (size_t y = 0; y < height; y++) {
+			for (size_t x = 0; x < width; x++) {
+				state ^= state << 13;
+				state ^= state >> 17;
+				state ^= state << 5;
+				size_t noise = state;
+				uint32_t r = (uint32_t)(x + noise % 4);
+				uint32_t g = (uint32_t)(y + noise / 4 % 4);
+				uint32_t b = (uint32_t)((x * y) >> 8);
+				image[y * width + x] = 0xff000000u |
+						       (r & 0xff) << 16 |
+						       (g & 0xff) << 8 |
+						       (b & 0xff);
+			}
+		}
+		size_t start = round ? 4 * width * y0 : 0;
+		size_t len = round ? 4 * width * 16 : sz;
+		if (pwrite(M.fd, (char *)image + start, len, (off_t)start) !=
+				(ssize_t)len) {
+			pass = false;
+			break;
+		}
+		pass &= transfer_file_mirror(&M);
+		if (!M.src_shadow->planes_tuner ||
+				!M.src_shadow->planes_tuner->split) {
+			wp_error("Byte planes were not split");
+			pass = false;
+		}
+	}
+	free(image);
+
+	cleanup_file_mirror(&M);
+	return pass;
+}
+
 log_handler_func_t log_funcs[2] = {NULL, test_atomic_log_handler};
 int main(int argc, char **argv)
 {
@@ -499,6 +835,50 @@ int main(int argc, char **argv)
 		}
 	}
 
+	for (size_t c = 0; c < sizeof(comp_modes) / sizeof(comp_modes[0]);
+			c++) {
+		/* Only Zstd diffs are streamed */
+		if (comp_modes[c].mode != COMP_ZSTD) {
+			continue;
+		}
+		bool pass = test_stream_overflow(comp_modes[c], rd);
+		printf("Stream overflow comp=%d, %s\n", (int)c,
+				pass ? "pass" : "FAIL");
+		all_success &= pass;
+	}
+
+	for (size_t c = 0; c < sizeof(comp_modes) / sizeof(comp_modes[0]);
+			c++) {
+		if (comp_modes[c].mode == COMP_NONE || comp_modes[c].history) {
+			continue;
+		}
+		bool pass = test_compression_tuner(comp_modes[c]);
+		printf("Compression tuner comp=%d, %s\n", (int)c,
+				pass ? "pass" : "FAIL");
+		all_success &= pass;
+#ifdef HAS_ZSTD
+		bool dpass = test_compression_dict(comp_modes[c], rd);
+		printf("Compression dictionary comp=%d, %s\n", (int)c,
+				dpass ? "pass" : "FAIL");
+		all_success &= dpass;
+#endif
+		bool ppass = test_plane_split(comp_modes[c], rd);
+		printf("Byte plane split comp=%d, %s\n", (int)c,
+				ppass ? "pass" : "FAIL");
+		all_success &= ppass;
+	}
+
+	for (size_t c = 0; c < sizeof(comp_modes) / sizeof(comp_modes[0]);
+			c++) {
+		if (!comp_modes[c].history) {
+			continue;
+		}
+		bool pass = test_stream_batches(comp_modes[c], rd);
+		printf("Diff stream batches comp=%d, %s\n", (int)c,
+				pass ? "pass" : "FAIL");
+		all_success &= pass;
+	}
+
 	cleanup_render_data(rd);
 	free(rd);
 	free(test_pattern);
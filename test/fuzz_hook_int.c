@@ -96,6 +96,7 @@ int main(int argc, char **argv)
 	struct main_config config = {
 			.drm_node = NULL,
 			.n_worker_threads = 1,
+			.diff_window = DEFAULT_DIFF_WINDOW,
 			.compression = COMP_NONE,
 			.compression_level = 0,
 			.no_gpu = true, /* until we can construct dmabufs here
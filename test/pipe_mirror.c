@@ -28,6 +28,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,7 +42,6 @@ static int shadow_sync(struct fd_translation_map *src_map,
 {
 	struct transfer_queue queue;
 	memset(&queue, 0, sizeof(queue));
-	pthread_mutex_init(&queue.async_recv_queue.lock, NULL);
 
 	read_readable_pipes(src_map);
 
@@ -144,16 +144,18 @@ static void print_pipe_state(const char *desc, struct pipe_state *p)
 }
 
 static bool test_pipe_mirror(bool close_src, bool can_read, bool can_write,
-		bool half_open_socket, bool interpret_as_force_iw)
+		bool half_open_socket, bool interpret_as_force_iw,
+		bool use_watch)
 {
 	if (can_read == can_write && half_open_socket) {
 		return true;
 	}
-	printf("\nTesting:%s%s%s%s%s\n", can_read ? " read" : "",
+	printf("\nTesting:%s%s%s%s%s%s\n", can_read ? " read" : "",
 			can_write ? " write" : "",
 			half_open_socket ? " socket" : "",
 			interpret_as_force_iw ? " force_iw" : "",
-			close_src ? " close_src" : " close_dst");
+			close_src ? " close_src" : " close_dst",
+			use_watch ? " watch" : "");
 	int spec_end, opp_end, anti_end = -1;
 	if (create_pseudo_pipe(can_read, can_write, half_open_socket, &spec_end,
 			    &opp_end) == -1) {
@@ -165,6 +167,10 @@ static bool test_pipe_mirror(bool close_src, bool can_read, bool can_write,
 
 	struct fd_translation_map dst_map;
 	setup_translation_map(&dst_map, true);
+	if (use_watch) {
+		(void)setup_pipe_watch(&src_map);
+		(void)setup_pipe_watch(&dst_map);
+	}
 
 	bool success = true;
 
@@ -319,6 +325,217 @@ cleanup:
 	return success;
 }
 
+/* Check that pipes in a watch set are reported without being polled, and
+ * that those which cannot be watched are polled instead */
+static bool test_pipe_watch(void)
+{
+	printf("\nTesting: watch set\n");
+	struct fd_translation_map map;
+	setup_translation_map(&map, false);
+	if (setup_pipe_watch(&map) == -1) {
+		printf("Watch sets not supported, skipping\n");
+		cleanup_translation_map(&map);
+		return true;
+	}
+	bool success = true;
+	int pipe_fds[2];
+	if (pipe(pipe_fds) == -1) {
+		cleanup_translation_map(&map);
+		return false;
+	}
+	struct shadow_fd *sfd = translate_fd(&map, NULL, NULL, pipe_fds[0],
+			FDC_PIPE, 0, NULL, false);
+	struct pollfd pfd;
+	if (count_npipes(&map) != 0 || fill_with_pipes(&map, &pfd, true)) {
+		printf("Watched pipe should not be polled\n");
+		success = false;
+	}
+
+	char buf[100];
+	memset(buf, 1, sizeof(buf));
+	if (write(pipe_fds[1], buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+		success = false;
+	}
+	checked_close(pipe_fds[1]);
+	set_pipe_read_interest(&map, true);
+	collect_pipe_events(&map);
+	if (!sfd->pipe.readable) {
+		printf("Hung up pipe was not marked readable\n");
+		success = false;
+	}
+	read_readable_pipes(&map);
+	if (sfd->pipe.recv.used != (int)sizeof(buf)) {
+		printf("Read %d bytes from pipe, expected %d\n",
+				sfd->pipe.recv.used, (int)sizeof(buf));
+		success = false;
+	}
+
+	/* Regular files cannot be watched by epoll */
+	int file = create_anon_file();
+	if (file != -1) {
+		(void)translate_fd(&map, NULL, NULL, file, FDC_PIPE, 0, NULL,
+				true);
+		if (count_npipes(&map) != 1 ||
+				fill_with_pipes(&map, &pfd, true) != 1 ||
+				pfd.fd != file) {
+			printf("Unwatchable pipe should be polled\n");
+			success = false;
+		}
+	}
+	cleanup_translation_map(&map);
+	printf("Test: %s\n", success ? "pass" : "FAIL");
+	return success;
+}
+
+#if defined(HAS_LZ4) || defined(HAS_ZSTD)
+/* Collect the pipe's update with the thread pool, and apply it; returns
+ * the number of WMSG_PIPE_TRANSFER_COMPRESSED messages, or -1 on failure */
+static int pool_sync(struct fd_translation_map *src_map,
+		struct fd_translation_map *dst_map, struct thread_pool *pool,
+		struct shadow_fd *sfd)
+{
+	struct transfer_queue queue;
+	memset(&queue, 0, sizeof(queue));
+
+	read_readable_pipes(src_map);
+	collect_update(pool, sfd, &queue, false);
+	start_parallel_work(pool, &queue.async_recv_queue);
+	bool done = false;
+	while (!done) {
+		struct task_data task;
+		if (request_work_task(pool, &task, &done)) {
+			run_task(&task, &pool->threads[0]);
+		}
+	}
+	finish_dirty_updates(src_map);
+	transfer_load_async(&queue);
+
+	int ncompressed = 0;
+	for (int i = 0; i < queue.end; i++) {
+		const uint32_t *header =
+				(const uint32_t *)queue.vecs[i].iov_base;
+		struct bytebuf msg;
+		msg.data = queue.vecs[i].iov_base;
+		msg.size = transfer_size(header[0]);
+		enum wmsg_type type = transfer_type(header[0]);
+		ncompressed += type == WMSG_PIPE_TRANSFER_COMPRESSED;
+		if (apply_update(dst_map, pool, NULL, type, (int32_t)header[1],
+				    &msg) < 0) {
+			wp_error("Update failed");
+			cleanup_transfer_queue(&queue);
+			return -1;
+		}
+	}
+	flush_writable_pipes(dst_map);
+	cleanup_transfer_queue(&queue);
+	return ncompressed;
+}
+
+/* Check that compressible pipe data and protocol blocks are sent compressed,
+ * and that pipe data which does not compress is sent raw */
+static bool test_stream_compression(enum compression_mode comp, int level)
+{
+	printf("\nTesting: stream compression with %s\n",
+			compression_mode_to_str(comp));
+	int pipe_fds[2];
+	if (pipe(pipe_fds) == -1) {
+		return false;
+	}
+	/* Both sides share a pool, as they must use the same settings */
+	struct thread_pool pool;
+	setup_thread_pool(&pool, comp, level, 1);
+	bool success = enable_stream_compression(&pool) == 0;
+
+	struct fd_translation_map src_map, dst_map;
+	setup_translation_map(&src_map, false);
+	setup_translation_map(&dst_map, true);
+	struct shadow_fd *src_shadow = translate_fd(&src_map, NULL, NULL,
+			pipe_fds[0], FDC_PIPE, 0, NULL, false);
+	shadow_decref_transfer(src_shadow);
+
+	char text[8192];
+	char out[8192];
+	for (size_t i = 0; i < sizeof(text); i++) {
+		text[i] = "text/plain;charset=utf-8\n"[i % 25];
+	}
+	int anti_end = -1;
+	for (int round = 0; round < 2 && success; round++) {
+		/* The second round is incompressible */
+		if (round == 1) {
+			for (size_t i = 0; i < sizeof(text); i++) {
+				text[i] = (char)rand();
+			}
+		}
+		if (write(pipe_fds[1], text, sizeof(text)) !=
+				(ssize_t)sizeof(text)) {
+			success = false;
+			break;
+		}
+		src_shadow->pipe.readable = true;
+		int ncompressed = pool_sync(&src_map, &dst_map, &pool,
+				src_shadow);
+		if (round == 0) {
+			struct shadow_fd *dst_shadow = get_shadow_for_rid(
+					&dst_map, src_shadow->remote_id);
+			if (!dst_shadow) {
+				success = false;
+				break;
+			}
+			anti_end = dup(dst_shadow->fd_local);
+			shadow_decref_transfer(dst_shadow);
+		}
+		ssize_t rr = anti_end == -1 ? -1
+					    : read(anti_end, out, sizeof(out));
+		bool match = rr == (ssize_t)sizeof(text) &&
+			     !memcmp(out, text, sizeof(text));
+		bool compressed = ncompressed == 1;
+		printf("Round %d: %d compressed transfers, data %s\n", round,
+				ncompressed, match ? "matches" : "differs");
+		success = success && match && compressed == (round == 0);
+	}
+	if (success && src_shadow->pipe.compress_skip != STREAM_COMPRESS_SKIP) {
+		printf("Incompressible data did not pause compression\n");
+		success = false;
+	}
+
+	struct bytebuf msg;
+	msg.data = compress_protocol_block(&pool, text, sizeof(text) / 2,
+			&msg.size);
+	if (success && msg.data) {
+		printf("Incompressible protocol block was compressed\n");
+		success = false;
+	}
+	free(msg.data);
+	memset(text, 7, sizeof(text));
+	msg.data = compress_protocol_block(&pool, text, sizeof(text),
+			&msg.size);
+	struct char_window proto = {0};
+	if (msg.data) {
+		/* Received messages exclude the padding */
+		msg.size = transfer_size(*(uint32_t *)msg.data);
+	}
+	if (!msg.data || uncompress_protocol_block(&pool, &msg, &proto) ==
+					       -1 ||
+			proto.zone_end != (int)sizeof(text) ||
+			memcmp(proto.data, text, sizeof(text))) {
+		printf("Protocol block roundtrip failed\n");
+		success = false;
+	}
+	free(msg.data);
+	free(proto.data);
+
+	if (anti_end != -1) {
+		checked_close(anti_end);
+	}
+	checked_close(pipe_fds[1]);
+	cleanup_translation_map(&src_map);
+	cleanup_translation_map(&dst_map);
+	cleanup_thread_pool(&pool);
+	printf("Test: %s\n", success ? "pass" : "FAIL");
+	return success;
+}
+#endif
+
 log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
 int main(int argc, char **argv)
 {
@@ -336,11 +553,18 @@ int main(int argc, char **argv)
 
 	srand(0);
 	bool all_success = true;
-	for (uint32_t bits = 0; bits < 32; bits++) {
+	for (uint32_t bits = 0; bits < 64; bits++) {
 		bool pass = test_pipe_mirror(bits & 1, bits & 2, bits & 4,
-				bits & 8, bits & 16);
+				bits & 8, bits & 16, bits & 32);
 		all_success = all_success && pass;
 	}
+	all_success = all_success && test_pipe_watch();
+#ifdef HAS_LZ4
+	all_success = all_success && test_stream_compression(COMP_LZ4, 1);
+#endif
+#ifdef HAS_ZSTD
+	all_success = all_success && test_stream_compression(COMP_ZSTD, 5);
+#endif
 	printf("\nSuccess: %c\n", all_success ? 'Y' : 'n');
 	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
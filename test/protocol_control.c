@@ -236,6 +236,366 @@ end:
 	return pass;
 }
 
+/** What the frame drawn by a struct shm_surface_case commits */
+struct shm_frame {
+	int buffer;
+	int32_t damage_x, damage_y, damage_w, damage_h;
+};
+/** A surface with `nbuffers` buffers of `width` x `height` XRGB8888 pixels,
+ * with rows `stride` bytes apart, placed one after another in one shm pool;
+ * see run_shm_surface_frames */
+struct shm_surface_case {
+	int nbuffers, width, height, stride;
+	int nframes;
+	/* If set, draws the initial contents of the pool; else it is zero */
+	void (*init)(char *mem, const struct shm_surface_case *c);
+	/* Changes the pool contents `mem` for frame `k`, and chooses the
+	 * buffer to commit and its damage */
+	void (*draw)(char *mem, const struct shm_surface_case *c, int k,
+			struct shm_frame *frame);
+};
+
+/** Create the pool and surface of `c` through `T`, then for each frame let
+ * the case draw into the pool, commit the chosen buffer, and check that the
+ * display side copy of each buffer committed so far matches */
+static bool run_shm_surface_frames(
+		struct transfer_states *T, const struct shm_surface_case *c)
+{
+	const size_t buf_size = (size_t)c->height * (size_t)c->stride;
+	const size_t size = (size_t)c->nbuffers * buf_size;
+	char *contents = calloc(size, 1);
+	if (c->init) {
+		c->init(contents, c);
+	}
+	int fd = make_filled_file(size, contents);
+	free(contents);
+	char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			0);
+	bool *committed = calloc((size_t)c->nbuffers, sizeof(bool));
+	bool pass = true;
+
+	struct wp_objid display = {0x1}, registry = {0x2}, shm = {0x3},
+			compositor = {0x4}, pool = {0x5}, surface = {0x6};
+
+	send_wl_display_req_get_registry(T, display, registry);
+	send_wl_registry_evt_global(T, registry, 1, "wl_shm", 1);
+	send_wl_registry_evt_global(T, registry, 2, "wl_compositor", 1);
+	send_wl_registry_req_bind(T, registry, 1, "wl_shm", 1, shm);
+	send_wl_registry_req_bind(
+			T, registry, 2, "wl_compositor", 1, compositor);
+	send_wl_shm_req_create_pool(T, shm, pool, fd, (int32_t)size);
+	int ret_fd = get_only_fd_from_msg(T->comp);
+	if (ret_fd == -1 || mem == MAP_FAILED) {
+		wp_error("Fd not passed through");
+		pass = false;
+		goto end;
+	}
+	for (int i = 0; i < c->nbuffers; i++) {
+		struct wp_objid buffer = {0x7 + (uint32_t)i};
+		send_wl_shm_pool_req_create_buffer(T, pool, buffer,
+				(int32_t)((size_t)i * buf_size), c->width,
+				c->height, c->stride, 0x30334258);
+	}
+	send_wl_compositor_req_create_surface(T, compositor, surface);
+
+	for (int k = 0; k < c->nframes; k++) {
+		struct shm_frame frame = {.buffer = 0,
+				.damage_x = 0,
+				.damage_y = 0,
+				.damage_w = c->width,
+				.damage_h = c->height};
+		c->draw(mem, c, k, &frame);
+
+		struct wp_objid buffer = {0x7 + (uint32_t)frame.buffer};
+		send_wl_surface_req_attach(T, surface, buffer, 0, 0);
+		send_wl_surface_req_damage(T, surface, frame.damage_x,
+				frame.damage_y, frame.damage_w, frame.damage_h);
+		send_wl_surface_req_commit(T, surface);
+		committed[frame.buffer] = true;
+
+		char *ret_mem = mmap(NULL, size, PROT_READ, MAP_SHARED, ret_fd,
+				0);
+		if (ret_mem == MAP_FAILED) {
+			wp_error("Failed to map file");
+			pass = false;
+			break;
+		}
+		for (int i = 0; i < c->nbuffers; i++) {
+			size_t offset = (size_t)i * buf_size;
+			if (committed[i] && memcmp(ret_mem + offset,
+							    mem + offset,
+							    buf_size)) {
+				wp_error("Buffer %d mismatch after frame %d",
+						i, k);
+				pass = false;
+			}
+		}
+		munmap(ret_mem, size);
+		if (!pass) {
+			break;
+		}
+	}
+
+end:
+	if (mem != MAP_FAILED) {
+		munmap(mem, size);
+	}
+	free(committed);
+	checked_close(fd);
+	return pass;
+}
+
+static void fill_age_damage_pool(char *mem, const struct shm_surface_case *c)
+{
+	const size_t buf_size = (size_t)c->height * (size_t)c->stride;
+	char *image = make_filled_pattern(buf_size, 0x11223344);
+	for (int i = 0; i < c->nbuffers; i++) {
+		memcpy(mem + (size_t)i * buf_size, image, buf_size);
+	}
+	free(image);
+}
+static void draw_age_damage_frame(char *mem, const struct shm_surface_case *c,
+		int k, struct shm_frame *frame)
+{
+	const size_t buf_size = (size_t)c->height * (size_t)c->stride;
+	int b = (k * 3) % c->nbuffers;
+	/* The client brings the buffer up to date from the one it last
+	 * committed, so regions damaged since the buffer itself was last
+	 * committed change too; then it changes a small rectangle */
+	int prev = k > 0 ? ((k - 1) * 3) % c->nbuffers : b;
+	char *buf = mem + (size_t)b * buf_size;
+	memcpy(buf, mem + (size_t)prev * buf_size, buf_size);
+	int x = (k * 7) % (c->width - 8), y = (k * 13) % (c->height - 4);
+	for (int r = y; r < y + 4; r++) {
+		for (int col = x; col < x + 8; col++) {
+			uint32_t v = (uint32_t)(k * 0x01010101 + col);
+			memcpy(buf + r * c->stride + 4 * col, &v, 4);
+		}
+	}
+	frame->buffer = b;
+	frame->damage_x = x;
+	frame->damage_y = y;
+	frame->damage_w = 8;
+	frame->damage_h = 4;
+}
+/** Cycle through more buffers than a client would typically use, updating
+ * only the damaged parts of each, and check that the display side copy of
+ * each buffer matches the surface contents after every commit */
+static bool test_shm_buffer_age_damage(void)
+{
+	fprintf(stdout, "\n  shm buffer age damage test\n");
+
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	const struct shm_surface_case c = {.nbuffers = 10,
+			.width = 64,
+			.height = 64,
+			.stride = 256,
+			.nframes = 30,
+			.init = fill_age_damage_pool,
+			.draw = draw_age_damage_frame};
+	bool pass = run_shm_surface_frames(&T, &c);
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+
+static void fill_scroll_rows(char *dst, int stride, int width, int nrows,
+		int first_line)
+{
+	for (int r = 0; r < nrows; r++) {
+		uint32_t *row = (uint32_t *)(dst + r * stride);
+		for (int c = 0; c < width; c++) {
+			row[c] = (uint32_t)(first_line + r) * 0x9e3779b1u +
+				 (uint32_t)c;
+		}
+	}
+}
+static void fill_scroll_start(char *mem, const struct shm_surface_case *c)
+{
+	fill_scroll_rows(mem, c->stride, c->width, c->height, 0);
+}
+/* The first line shown after each commit */
+static const int scroll_tops[] = {0, 0, 5, 17, 17, 9, 40, 0};
+static void draw_scroll_frame(char *mem, const struct shm_surface_case *c,
+		int k, struct shm_frame *frame)
+{
+	fill_scroll_rows(mem, c->stride, c->width, c->height, scroll_tops[k]);
+	(void)frame;
+}
+/** Scroll the contents of a padded buffer up and down, and check that the
+ * display side copy matches after each commit */
+static bool test_shm_scroll_copy(void)
+{
+	fprintf(stdout, "\n  shm scroll copy test\n");
+
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	T.app->glob.map.scroll_copy = true;
+	const struct shm_surface_case c = {.nbuffers = 1,
+			.width = 64,
+			.height = 128,
+			.stride = 64 * 4 + 32,
+			.nframes = (int)(sizeof(scroll_tops) /
+					 sizeof(scroll_tops[0])),
+			.init = fill_scroll_start,
+			.draw = draw_scroll_frame};
+	bool pass = run_shm_surface_frames(&T, &c);
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+
+static void draw_partial_tile_frame(char *mem,
+		const struct shm_surface_case *c, int k, struct shm_frame *frame)
+{
+	/* Unchanged twice, so that the contents are known to be static; then
+	 * a few pixels are changed with matching damage, and reverted with
+	 * full damage */
+	fill_scroll_rows(mem, c->stride, c->width, c->height, 0);
+	if (k == 2) {
+		memset(mem + 2 * c->stride + 16, 0x55, 32);
+		frame->damage_x = 4;
+		frame->damage_y = 2;
+		frame->damage_w = 8;
+		frame->damage_h = 1;
+	}
+}
+/** Change part of a tile with partial damage, then revert it with full
+ * damage, and check that the display side copy matches after each commit */
+static bool test_shm_partial_tile_revert(void)
+{
+	fprintf(stdout, "\n  shm partial tile revert test\n");
+
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	const struct shm_surface_case c = {.nbuffers = 1,
+			.width = 64,
+			.height = 64,
+			.stride = 256,
+			.nframes = 4,
+			.init = fill_scroll_start,
+			.draw = draw_partial_tile_frame};
+	bool pass = run_shm_surface_frames(&T, &c);
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+static void draw_scattered_frame(char *mem, const struct shm_surface_case *c,
+		int k, struct shm_frame *frame)
+{
+	/* Changed words are separated by gaps of varying length */
+	const size_t size = (size_t)c->height * (size_t)c->stride;
+	for (size_t i = (size_t)(rand() % 64) * 4; i < size;
+			i += 4 * (size_t)(1 + rand() % 64)) {
+		mem[i] = (char)(mem[i] + 1);
+	}
+	(void)k;
+	(void)frame;
+}
+/** Make scattered changes to a buffer over many frames while the diff window
+ * adapts, and check that the display side copy stays in sync */
+static bool test_shm_adaptive_diff_window(void)
+{
+	fprintf(stdout, "\n  shm adaptive diff window test\n");
+
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	bool pass = true;
+	if (configure_diff_kernel(&T.app->glob.threads, DIFF_FASTEST, 0) ==
+			-1) {
+		wp_error("Failed to configure diff kernel");
+		pass = false;
+	}
+
+	/* Enough frames for the windows on both sides of the initial one to
+	 * be tried */
+	const struct shm_surface_case c = {.nbuffers = 1,
+			.width = 64,
+			.height = 64,
+			.stride = 256,
+			.nframes = 24,
+			.draw = draw_scattered_frame};
+	srand(7);
+	pass &= run_shm_surface_frames(&T, &c);
+
+	/* The pool is the only shadow_fd on the application side */
+	struct shadow_fd_link *head = &T.app->glob.map.link;
+	struct shadow_fd *sfd = NULL;
+	if (head->l_next != head) {
+		sfd = (struct shadow_fd *)head->l_next;
+	}
+	int nmeasured = 0;
+	for (int i = 0; sfd && sfd->diff_tuner && i < DIFF_WINDOW_CHOICES;
+			i++) {
+		nmeasured += sfd->diff_tuner->cost[i] >= 0.f;
+	}
+	if (nmeasured < 2) {
+		wp_error("Only %d diff windows were tried", nmeasured);
+		pass = false;
+	}
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+/* The first line drawn in each frame; offsets of 16 rows move whole blocks,
+ * both between and within the two buffers */
+static const int dedup_tops[] = {0, 0, 16, 16, 0, 48, 32, 5, 5};
+static void draw_dedup_frame(char *mem, const struct shm_surface_case *c,
+		int k, struct shm_frame *frame)
+{
+	frame->buffer = k % 2;
+	fill_scroll_rows(mem + (size_t)frame->buffer * (size_t)c->height *
+					       (size_t)c->stride,
+			c->stride, c->width, c->height, dedup_tops[k]);
+}
+/** Alternately draw into two buffers from the same pool, reusing content
+ * already drawn into either of them, and check that the display side copy
+ * matches after each commit */
+static bool test_shm_block_dedup(void)
+{
+	fprintf(stdout, "\n  shm block dedup test\n");
+
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	bool pass = enable_block_dedup(&T.app->glob.map) == 0;
+	if (!pass) {
+		wp_error("Failed to enable block deduplication");
+	} else {
+		const struct shm_surface_case c = {.nbuffers = 2,
+				.width = 64,
+				.height = 64,
+				.stride = 256,
+				.nframes = (int)(sizeof(dedup_tops) /
+						 sizeof(dedup_tops[0])),
+				.draw = draw_dedup_frame};
+		pass = run_shm_surface_frames(&T, &c);
+	}
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+
 static bool test_fixed_shm_screencopy_copy(void)
 {
 	fprintf(stdout, "\n screencopy test\n");
@@ -935,9 +1295,14 @@ int main(int argc, char **argv)
 
 	set_initial_fds();
 
-	int ntest = 21;
+	int ntest = 26;
 	int nsuccess = 0;
 	nsuccess += test_fixed_shm_buffer_copy();
+	nsuccess += test_shm_buffer_age_damage();
+	nsuccess += test_shm_scroll_copy();
+	nsuccess += test_shm_block_dedup();
+	nsuccess += test_shm_partial_tile_revert();
+	nsuccess += test_shm_adaptive_diff_window();
 	nsuccess += test_fixed_shm_screencopy_copy();
 	nsuccess += test_fixed_keymap_copy();
 	nsuccess += test_fixed_dmabuf_copy(COPY_LINUX_DMABUF);